@@ -57,10 +57,16 @@ android {
     composeOptions {
         kotlinCompilerExtensionVersion = "1.5.4"
     }
+    androidResources {
+        noCompress += "tar" // Archives are mapped directly from the APK by the native extractor, which requires them to be stored uncompressed.
+    }
     packaging {
         resources {
             excludes += "/META-INF/{AL2.0,LGPL2.1}"
         }
+        jniLibs {
+            useLegacyPackaging = true // The launcher is executed from the native library directory, so native libraries must be extracted from the APK.
+        }
     }
     externalNativeBuild {
         cmake {
@@ -142,7 +148,6 @@ dependencies {
     implementation("androidx.compose.material3:material3")
     implementation("androidx.core:core-splashscreen:1.0.1")
     implementation("org.jetbrains.kotlinx:kotlinx-serialization-json:1.6.0")
-    implementation("org.apache.commons:commons-compress:1.21")
     testImplementation("junit:junit:4.13.2")
     androidTestImplementation("androidx.test.ext:junit:1.1.5")
     androidTestImplementation("androidx.test.espresso:espresso-core:3.5.1")
@@ -0,0 +1,102 @@
+// Copyright © 2023 Cassia Developers, all rights reserved.
+
+#include "benchmark.h"
+#include "cassia/util/error.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <thread>
+#include <fmt/format.h>
+
+namespace cassia {
+BenchmarkReport::BenchmarkReport(FILE *output) : output{output} {}
+
+void BenchmarkReport::Add(std::string name, double value, std::string unit, bool higherIsBetter) {
+    fmt::println(output, "{:<48} {:>14.2f} {}", name, value, unit);
+    std::fflush(output);
+    results.push_back(BenchmarkResult{std::move(name), value, std::move(unit), higherIsBetter});
+}
+
+std::string BenchmarkReport::ToJson(std::string_view label) const {
+    // Names, units and labels are written without escaping, they're expected to be plain identifiers.
+    std::string json;
+    auto out{std::back_inserter(json)};
+    fmt::format_to(out, "{{\"version\":1,\"label\":\"{}\",\"cpus\":{},\"results\":[", label, std::thread::hardware_concurrency());
+    for (size_t i{}; i < results.size(); i++) {
+        const auto &result{results[i]};
+        fmt::format_to(out, "{}\n{{\"name\":\"{}\",\"value\":{},\"unit\":\"{}\",\"higherIsBetter\":{}}}", i ? "," : "", result.name, result.value, result.unit, result.higherIsBetter);
+    }
+    json += "\n]}\n";
+    return json;
+}
+
+/**
+ * @return The string value of a key following the supplied offset, or an empty string if there is none.
+ */
+static std::string_view FindJsonString(std::string_view json, size_t offset, std::string_view key, size_t end) {
+    auto keyOffset{json.find(fmt::format("\"{}\":\"", key), offset)};
+    if (keyOffset == std::string_view::npos || keyOffset >= end)
+        return {};
+    auto valueOffset{keyOffset + key.size() + 4};
+    auto valueEnd{json.find('"', valueOffset)};
+    if (valueEnd == std::string_view::npos)
+        throw Exception{"Unterminated string for '{}'", key};
+    return json.substr(valueOffset, valueEnd - valueOffset);
+}
+
+std::vector<BenchmarkResult> BenchmarkReport::ParseJson(std::string_view json) {
+    constexpr std::string_view NameKey{"{\"name\":"};
+    std::vector<BenchmarkResult> parsed;
+    size_t offset{};
+    while ((offset = json.find(NameKey, offset)) != std::string_view::npos) {
+        auto end{json.find('}', offset)};
+        if (end == std::string_view::npos)
+            throw Exception{"Unterminated result at offset {}", offset};
+
+        BenchmarkResult result{
+            .name = std::string{FindJsonString(json, offset, "name", end)},
+            .unit = std::string{FindJsonString(json, offset, "unit", end)},
+        };
+        auto valueOffset{json.find("\"value\":", offset)};
+        if (valueOffset == std::string_view::npos || valueOffset >= end)
+            throw Exception{"Result '{}' has no value", result.name};
+        std::string value{json.substr(valueOffset + 8, end - valueOffset - 8)};
+        result.value = std::strtod(value.c_str(), nullptr);
+        auto higherIsBetterOffset{json.find("\"higherIsBetter\":true", offset)};
+        result.higherIsBetter = higherIsBetterOffset != std::string_view::npos && higherIsBetterOffset < end;
+
+        parsed.push_back(std::move(result));
+        offset = end;
+    }
+    return parsed;
+}
+
+double MeasureNanosecondsPerOperation(const BenchmarkOptions &options, const std::function<void(size_t iterations)> &function) {
+    using namespace std::chrono_literals;
+    auto minimumBatchDuration{options.quick ? 5ms : 100ms};
+    size_t batches{options.quick ? 3U : 7U};
+
+    auto runBatch{[&](size_t iterations) {
+        auto start{std::chrono::steady_clock::now()};
+        function(iterations);
+        return std::chrono::steady_clock::now() - start;
+    }};
+
+    size_t iterations{1};
+    while (runBatch(iterations) < minimumBatchDuration)
+        iterations *= 2;
+
+    std::vector<double> samples;
+    for (size_t i{}; i < batches; i++)
+        samples.push_back(static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(runBatch(iterations)).count()) / static_cast<double>(iterations));
+    return GetPercentile(samples, 0.5);
+}
+
+double GetPercentile(std::vector<double> &samples, double percentile) {
+    if (samples.empty())
+        return 0;
+    std::sort(samples.begin(), samples.end());
+    auto index{static_cast<size_t>(percentile * static_cast<double>(samples.size() - 1) + 0.5)};
+    return samples[std::min(index, samples.size() - 1)];
+}
+}
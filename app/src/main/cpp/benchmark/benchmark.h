@@ -0,0 +1,142 @@
+// Copyright © 2023 Cassia Developers, all rights reserved.
+#pragma once
+
+#include <cstdio>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace cassia {
+/**
+ * @brief Options shared by all benchmarks.
+ */
+struct BenchmarkOptions {
+    bool quick{}; //!< Runs fewer iterations, this is for checking that the benchmarks work rather than for measuring.
+    std::string filter; //!< Only benchmarks whose name contains this are run, all benchmarks are run if this is empty.
+    int stderrFd{-1}; //!< The original stderr of the process, the Logger has taken over STDERR_FILENO by the time any benchmark runs.
+
+    /**
+     * @return If the benchmark with the supplied name should be run.
+     */
+    bool ShouldRun(std::string_view name) const {
+        return filter.empty() || name.find(filter) != std::string_view::npos;
+    }
+};
+
+/**
+ * @brief A single measurement, results with the same name are compared between runs.
+ */
+struct BenchmarkResult {
+    std::string name;
+    double value;
+    std::string unit;
+    bool higherIsBetter;
+};
+
+/**
+ * @brief A collection of the results of a run, which are printed as they're added and can be serialized to JSON.
+ */
+class BenchmarkReport {
+  private:
+    FILE *output;
+    std::vector<BenchmarkResult> results;
+
+  public:
+    explicit BenchmarkReport(FILE *output);
+
+    void Add(std::string name, double value, std::string unit, bool higherIsBetter);
+
+    const std::vector<BenchmarkResult> &GetResults() const {
+        return results;
+    }
+
+    std::string ToJson(std::string_view label) const;
+
+    /**
+     * @return The results from JSON written by ToJson.
+     * @note This isn't a general JSON parser, it only handles the format that's written by ToJson.
+     */
+    static std::vector<BenchmarkResult> ParseJson(std::string_view json);
+};
+
+/**
+ * @brief Prevents the compiler from optimizing away the computation of a value.
+ */
+template<typename T>
+inline void DoNotOptimize(const T &value) {
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+/**
+ * @brief Measures the time taken by a function that runs an operation for the supplied amount of iterations.
+ * @details The amount of iterations is doubled until a batch runs for long enough to be measured accurately, the median of several batches is taken to reduce noise.
+ * @return The time per operation in nanoseconds.
+ */
+double MeasureNanosecondsPerOperation(const BenchmarkOptions &options, const std::function<void(size_t iterations)> &function);
+
+/**
+ * @return The value at the supplied percentile (between 0 and 1) of the samples, this sorts the samples.
+ */
+double GetPercentile(std::vector<double> &samples, double percentile);
+
+/**
+ * @brief Measures the throughput of the Logger from pipes to the sink, across different amounts of log threads, producers and line lengths, and dispatching lines across different amounts of channels.
+ */
+void RunLoggerBenchmarks(BenchmarkReport &report, const BenchmarkOptions &options);
+
+/**
+ * @brief Measures the latency of spawning processes directly, with fork (also with a large resident heap) and through the launcher, and the request latency of a server process under load with different launch options.
+ */
+void RunProcessBenchmarks(BenchmarkReport &report, const BenchmarkOptions &options);
+
+/**
+ * @brief Measures the overhead of the UniqueFd and SharedFd wrappers over raw file descriptors.
+ */
+void RunFdBenchmarks(BenchmarkReport &report, const BenchmarkOptions &options);
+
+/**
+ * @brief Measures pixel conversion with every supported kernel, and presenting full and partially damaged frames through the compositor.
+ */
+void RunCompositorBenchmarks(BenchmarkReport &report, const BenchmarkOptions &options);
+
+/**
+ * @brief Measures the latency and throughput of injecting input into a stand-in X server.
+ */
+void RunInputBenchmarks(BenchmarkReport &report, const BenchmarkOptions &options);
+
+/**
+ * @brief Measures the round trip of two threads handing an event back and forth with the primitives behind each Wine sync mode.
+ */
+void RunSyncBenchmarks(BenchmarkReport &report, const BenchmarkOptions &options);
+
+/**
+ * @brief Measures merging synthetic DXVK state caches and the shader cache sessions of applications, the results of both are checked so these also verify them.
+ */
+void RunShaderCacheBenchmarks(BenchmarkReport &report, const BenchmarkOptions &options);
+
+/**
+ * @brief Measures listing a large directory by path like the DocumentsProvider did and through the DirectoryIndex, both uncached and from its cache.
+ */
+void RunDirectoryBenchmarks(BenchmarkReport &report, const BenchmarkOptions &options);
+
+/**
+ * @brief Measures extracting a generated archive uncompressed and compressed with gzip and zstd, and checks that archives can't escape the destination of an extraction.
+ */
+void RunTarBenchmarks(BenchmarkReport &report, const BenchmarkOptions &options);
+
+/**
+ * @brief Measures the time of a sampling cycle of the ResourceSampler over a process tree with more than 50 threads.
+ */
+void RunResourceSamplerBenchmarks(BenchmarkReport &report, const BenchmarkOptions &options);
+
+/**
+ * @brief Measures cloning a generated template prefix with 10k files into a new prefix.
+ */
+void RunPrefixBenchmarks(BenchmarkReport &report, const BenchmarkOptions &options);
+
+/**
+ * @brief Measures parsing a realistic mix of Wine debug output, and the whole stage of parsing, counting and collapsing repeats that the Logger runs for Wine channels.
+ */
+void RunWineDebugBenchmarks(BenchmarkReport &report, const BenchmarkOptions &options);
+}
@@ -0,0 +1,98 @@
+// Copyright © 2023 Cassia Developers, all rights reserved.
+
+#include "benchmark.h"
+#include "cassia/compositor.h"
+#include "cassia/util/error.h"
+#include <chrono>
+#include <cstring>
+#include <span>
+#include <fmt/format.h>
+
+namespace cassia {
+constexpr uint32_t FrameWidth{1920};
+constexpr uint32_t FrameHeight{1080};
+constexpr double FramePixels{static_cast<double>(FrameWidth) * FrameHeight};
+
+/**
+ * @brief The rectangles damaged in every frame of the partial damage benchmark, this resembles a cursor and a few text fields being redrawn.
+ */
+constexpr PixelRect PartialDamage[]{
+    {100, 100, 64, 64},
+    {400, 300, 600, 40},
+    {400, 360, 600, 40},
+    {1500, 900, 300, 120},
+};
+
+static std::vector<uint8_t> CreateFrame() {
+    std::vector<uint8_t> pixels(static_cast<size_t>(FrameWidth) * FrameHeight * 4);
+    for (size_t i{}; i < pixels.size(); i++)
+        pixels[i] = static_cast<uint8_t>(i * 7 + (i >> 12));
+    return pixels;
+}
+
+/**
+ * @brief Converts a 1080p BGRX frame into an RGBX buffer with a wider stride, as window buffers are usually padded.
+ * @return The time per frame in nanoseconds.
+ */
+static double MeasureConvert(const BenchmarkOptions &options, PixelKernel kernel) {
+    auto src{CreateFrame()};
+    size_t dstStride{(FrameWidth + 64) * 4};
+    std::vector<uint8_t> dst(dstStride * FrameHeight);
+    return MeasureNanosecondsPerOperation(options, [&](size_t iterations) {
+        for (size_t i{}; i < iterations; i++) {
+            ConvertPixels(src.data(), FrameWidth * 4, PixelFormat::Bgrx8888, dst.data(), dstStride, PixelFormat::Rgbx8888, FrameWidth, FrameHeight, kernel);
+            DoNotOptimize(dst.data());
+        }
+    });
+}
+
+/**
+ * @brief Publishes frames to a compositor presenting to a memory window, waiting for every frame to be presented before publishing the next one.
+ * @return The time per frame in nanoseconds, this includes the handoff between threads.
+ */
+static double MeasurePresent(const BenchmarkOptions &options, std::span<const PixelRect> damagePerFrame) {
+    auto pixels{CreateFrame()};
+    auto source{std::make_unique<BufferFrameSource>()};
+    auto &frameSource{*source};
+    Compositor compositor{std::move(source)};
+    auto memoryWindow{std::make_unique<MemoryWindow>()};
+    auto &window{*memoryWindow};
+    compositor.SetWindow(std::move(memoryWindow));
+
+    DamageRegion fullDamage, damage;
+    fullDamage.Add(PixelRect{0, 0, static_cast<int32_t>(FrameWidth), static_cast<int32_t>(FrameHeight)});
+    for (const auto &rect: damagePerFrame)
+        damage.Add(rect);
+
+    uint64_t presents{1};
+    frameSource.Publish(pixels.data(), FrameWidth * 4, FrameWidth, FrameHeight, PixelFormat::Bgrx8888, fullDamage);
+    if (!window.WaitForPresents(presents, std::chrono::seconds{5}))
+        throw Exception{"The initial frame wasn't presented"};
+    const auto &presented{window.GetPixels()};
+    if (presented[0] != pixels[2] || presented[1] != pixels[1] || presented[2] != pixels[0])
+        throw Exception{"The presented frame doesn't match the published frame"};
+
+    return MeasureNanosecondsPerOperation(options, [&](size_t iterations) {
+        for (size_t i{}; i < iterations; i++) {
+            pixels[i % pixels.size()]++; // The content doesn't matter to the compositor, but this keeps the frames distinct.
+            frameSource.Publish(pixels.data(), FrameWidth * 4, FrameWidth, FrameHeight, PixelFormat::Bgrx8888, damagePerFrame.empty() ? fullDamage : damage);
+            if (!window.WaitForPresents(++presents, std::chrono::seconds{5}))
+                throw Exception{"Frame {} wasn't presented", presents};
+        }
+    });
+}
+
+void RunCompositorBenchmarks(BenchmarkReport &report, const BenchmarkOptions &options) {
+    for (auto kernel: {PixelKernel::Scalar, PixelKernel::Ssse3, PixelKernel::Avx2, PixelKernel::Neon}) {
+        std::string name{fmt::format("compositor.convert.{}", GetPixelKernelName(kernel))};
+        if (IsPixelKernelSupported(kernel) && options.ShouldRun(name))
+            report.Add(name, FramePixels / MeasureConvert(options, kernel) * 1000, "MP/s", true);
+    }
+
+    // Throughput is measured in pixels of the entire frame, so partial damage shows the benefit of only copying the damaged regions.
+    if (options.ShouldRun("compositor.present.full"))
+        report.Add("compositor.present.full", FramePixels / MeasurePresent(options, {}) * 1000, "MP/s", true);
+    if (options.ShouldRun("compositor.present.partial"))
+        report.Add("compositor.present.partial", FramePixels / MeasurePresent(options, PartialDamage) * 1000, "MP/s", true);
+}
+}
@@ -0,0 +1,138 @@
+// Copyright © 2023 Cassia Developers, all rights reserved.
+
+#include "benchmark.h"
+#include "cassia/directory_index.h"
+#include "cassia/util/dir.h"
+#include "cassia/util/error.h"
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+namespace cassia {
+/**
+ * @brief Lists a directory the way the DocumentsProvider did from Kotlin, File.listFiles() followed by File.exists(), isDirectory(), canWrite(), length() and lastModified() on the full path of every entry.
+ * @return The amount of entries, the metadata is only read to be discarded.
+ */
+static size_t ListDirectoryByPath(const std::filesystem::path &path) {
+    UniqueDir directory{opendir(path.c_str())};
+    if (!directory)
+        throw Exception{"Failed to open '{}': {}", path.string(), strerror(errno)};
+
+    std::vector<std::string> names;
+    while (auto entry{readdir(directory.get())})
+        if (std::strcmp(entry->d_name, ".") != 0 && std::strcmp(entry->d_name, "..") != 0)
+            names.emplace_back(entry->d_name);
+
+    size_t count{};
+    for (const auto &name: names) {
+        auto entryPath{(path / name).string()};
+        struct stat info{};
+        if (stat(entryPath.c_str(), &info) == -1)
+            continue;
+        stat(entryPath.c_str(), &info);
+        DoNotOptimize(access(entryPath.c_str(), W_OK));
+        stat(entryPath.c_str(), &info);
+        stat(entryPath.c_str(), &info);
+        DoNotOptimize(info.st_size + info.st_mtim.tv_sec);
+        count++;
+    }
+    return count;
+}
+
+static void Expect(bool condition, std::string_view description) {
+    if (!condition)
+        throw Exception{"Directory benchmark check failed: {}", description};
+}
+
+/**
+ * @return The amount of entries in a packed listing, along with checking that the names are in the expected order.
+ */
+static uint32_t CheckListing(const std::vector<uint8_t> &listing, bool sortedByName) {
+    uint32_t count;
+    std::memcpy(&count, listing.data(), sizeof(count));
+    size_t offset{sizeof(count)};
+    std::string previous;
+    for (uint32_t index{}; index < count; index++) {
+        offset += sizeof(int64_t) * 2 + sizeof(uint8_t) * 2;
+        uint16_t nameLength;
+        std::memcpy(&nameLength, listing.data() + offset, sizeof(nameLength));
+        offset += sizeof(nameLength);
+        std::string name{reinterpret_cast<const char *>(listing.data() + offset), nameLength};
+        offset += nameLength;
+        Expect(!sortedByName || previous.empty() || strcasecmp(previous.c_str(), name.c_str()) <= 0, "the listing is sorted by name");
+        previous = std::move(name);
+    }
+    Expect(offset == listing.size(), "the listing has no trailing bytes");
+    return count;
+}
+
+/**
+ * @brief Measures listing a synthetic directory like system32 by path, uncached through the index and from its cache, which also checks that changes invalidate the cache.
+ */
+static void MeasureListing(BenchmarkReport &report, const BenchmarkOptions &options, const std::filesystem::path &directory) {
+    size_t entryCount{options.quick ? 2000U : 20000U};
+    for (size_t index{}; index < entryCount; index++) {
+        // A few subdirectories are mixed in with the files, like in a real prefix.
+        auto path{directory / fmt::format("File{:05}.dll", (index * 7919) % entryCount)};
+        if (index % 100 == 0)
+            std::filesystem::create_directory(path);
+        else
+            UniqueFd{open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644), "directory_benchmark"};
+    }
+    auto toMs{[](double ns) { return ns / 1'000'000; }};
+
+    if (options.ShouldRun("directory.list.by_path"))
+        report.Add("directory.list.by_path", toMs(MeasureNanosecondsPerOperation(options, [&](size_t iterations) {
+            for (size_t i{}; i < iterations; i++)
+                Expect(ListDirectoryByPath(directory) == entryCount, "every entry is listed by path");
+        })), "ms", false);
+
+    if (options.ShouldRun("directory.list.uncached"))
+        report.Add("directory.list.uncached", toMs(MeasureNanosecondsPerOperation(options, [&](size_t iterations) {
+            for (size_t i{}; i < iterations; i++) {
+                auto listing{DirectoryIndex::Pack(DirectoryIndex::ReadDirectory(directory))};
+                Expect(CheckListing(listing, false) == entryCount, "every entry is listed by the index");
+            }
+        })), "ms", false);
+
+    if (options.ShouldRun("directory.list.cached")) {
+        DirectoryIndex index;
+        auto order{static_cast<DirectorySortOrder>(static_cast<uint32_t>(DirectorySortOrder::Name))};
+        Expect(CheckListing(*index.List(directory, order), true) == entryCount, "every entry is listed in order");
+        report.Add("directory.list.cached", MeasureNanosecondsPerOperation(options, [&](size_t iterations) {
+            for (size_t i{}; i < iterations; i++)
+                DoNotOptimize(index.List(directory, order)->size());
+        }), "ns", false);
+
+        // Another order of a cached directory is sorted from the cached entries, without reading the directory again.
+        auto descending{static_cast<DirectorySortOrder>(static_cast<uint32_t>(DirectorySortOrder::LastModified) | static_cast<uint32_t>(DirectorySortOrder::Descending))};
+        Expect(CheckListing(*index.List(directory, descending), false) == entryCount, "every entry is listed in another order");
+        auto stats{index.GetStats()};
+        Expect(stats.misses == 1 && stats.hits > 0, "repeated listings are served from the cache");
+
+        UniqueFd{open((directory / "New.dll").c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644), "directory_benchmark"};
+        Expect(CheckListing(*index.List(directory, order), true) == entryCount + 1, "a new entry invalidates the cache");
+        Expect(index.GetStats().invalidations == 1, "the change is counted as an invalidation");
+        std::filesystem::remove(directory / "New.dll");
+    }
+}
+
+void RunDirectoryBenchmarks(BenchmarkReport &report, const BenchmarkOptions &options) {
+    if (!options.ShouldRun("directory.list.by_path") && !options.ShouldRun("directory.list.uncached") && !options.ShouldRun("directory.list.cached"))
+        return;
+    std::string pattern{(std::filesystem::temp_directory_path() / "cassia-directory-XXXXXX").string()};
+    if (!mkdtemp(pattern.data()))
+        throw Exception{"mkdtemp failed: {}", strerror(errno)};
+    std::filesystem::path directory{pattern};
+    try {
+        MeasureListing(report, options, directory);
+    } catch (...) {
+        std::filesystem::remove_all(directory);
+        throw;
+    }
+    std::filesystem::remove_all(directory);
+}
+}
@@ -0,0 +1,104 @@
+// Copyright © 2023 Cassia Developers, all rights reserved.
+
+#include "benchmark.h"
+#include "cassia/util/error.h"
+#include "cassia/util/fd.h"
+#include <chrono>
+#include <latch>
+#include <thread>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace cassia {
+/**
+ * @brief The amount of threads that copy the same SharedFd concurrently in the contended benchmark.
+ */
+constexpr size_t ContendedThreadCount{4};
+
+static UniqueFd OpenDevNull() {
+    int fd{open("/dev/null", O_RDONLY | O_CLOEXEC)};
+    if (fd == -1)
+        throw Exception{"open(/dev/null) failed: {}", strerror(errno)};
+    return UniqueFd{fd};
+}
+
+/**
+ * @return The time per copy of a SharedFd while all threads are copying the same one, this measures contention on the reference count.
+ */
+static double MeasureContendedSharedFdCopy(const BenchmarkOptions &options) {
+    size_t iterations{options.quick ? 100'000U : 5'000'000U};
+    SharedFd shared{OpenDevNull()};
+    std::latch ready{static_cast<std::ptrdiff_t>(ContendedThreadCount + 1)};
+    std::vector<std::jthread> threads;
+    for (size_t i{}; i < ContendedThreadCount; i++) {
+        threads.emplace_back([&] {
+            ready.arrive_and_wait();
+            for (size_t iteration{}; iteration < iterations; iteration++) {
+                SharedFd copy{shared};
+                DoNotOptimize(copy);
+            }
+        });
+    }
+
+    ready.arrive_and_wait();
+    auto start{std::chrono::steady_clock::now()};
+    threads.clear();
+    return static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count()) / static_cast<double>(iterations);
+}
+
+void RunFdBenchmarks(BenchmarkReport &report, const BenchmarkOptions &options) {
+    if (options.ShouldRun("fd.unique_fd.move")) {
+        UniqueFd first{OpenDevNull()}, second{-1};
+        report.Add("fd.unique_fd.move", MeasureNanosecondsPerOperation(options, [&](size_t iterations) {
+            for (size_t i{}; i < iterations; i++) {
+                second = std::move(first);
+                first = std::move(second);
+                DoNotOptimize(first);
+            }
+        }) / 2, "ns/op", false);
+    }
+
+    if (options.ShouldRun("fd.unique_fd.duplicate")) {
+        UniqueFd fd{OpenDevNull()};
+        report.Add("fd.unique_fd.duplicate", MeasureNanosecondsPerOperation(options, [&](size_t iterations) {
+            for (size_t i{}; i < iterations; i++) {
+                UniqueFd duplicate{fd.Duplicate()};
+                DoNotOptimize(duplicate);
+            }
+        }), "ns/op", false);
+    }
+
+    // The baseline for the UniqueFd::Duplicate, the difference between these is the overhead of the wrapper.
+    if (options.ShouldRun("fd.raw.duplicate")) {
+        UniqueFd fd{OpenDevNull()};
+        report.Add("fd.raw.duplicate", MeasureNanosecondsPerOperation(options, [&](size_t iterations) {
+            for (size_t i{}; i < iterations; i++) {
+                int duplicate{dup(fd.Get())};
+                DoNotOptimize(duplicate);
+                close(duplicate);
+            }
+        }), "ns/op", false);
+    }
+
+    if (options.ShouldRun("fd.shared_fd.copy")) {
+        SharedFd shared{OpenDevNull()};
+        report.Add("fd.shared_fd.copy", MeasureNanosecondsPerOperation(options, [&](size_t iterations) {
+            for (size_t i{}; i < iterations; i++) {
+                SharedFd copy{shared};
+                DoNotOptimize(copy);
+            }
+        }), "ns/op", false);
+    }
+
+    if (options.ShouldRun("fd.shared_fd.get")) {
+        SharedFd shared{OpenDevNull()};
+        report.Add("fd.shared_fd.get", MeasureNanosecondsPerOperation(options, [&](size_t iterations) {
+            for (size_t i{}; i < iterations; i++)
+                DoNotOptimize(shared.Get());
+        }), "ns/op", false);
+    }
+
+    if (options.ShouldRun("fd.shared_fd.copy_contended"))
+        report.Add("fd.shared_fd.copy_contended", MeasureContendedSharedFdCopy(options), "ns/op", false);
+}
+}
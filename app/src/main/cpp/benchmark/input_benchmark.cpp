@@ -0,0 +1,210 @@
+// Copyright © 2023 Cassia Developers, all rights reserved.
+
+#include "benchmark.h"
+#include "cassia/input_injector.h"
+#include "cassia/util/error.h"
+#include <array>
+#include <condition_variable>
+#include <cstring>
+#include <filesystem>
+#include <mutex>
+#include <thread>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace cassia {
+/**
+ * @brief A stand-in for an X server such as Xvfb, which only implements what's needed to accept XTEST requests and records when they're received.
+ */
+class FakeXServer {
+  private:
+    static constexpr uint8_t XTestOpcode{140};
+
+    std::filesystem::path directory;
+    std::string socketPath;
+    UniqueFd listenFd;
+    std::thread serverThread;
+
+    std::mutex mutex;
+    std::condition_variable condition;
+    uint64_t requests{}, keyPresses{};
+    std::vector<std::chrono::steady_clock::time_point> keyPressTimes; //!< The time at which every key press was received, in order.
+
+    static bool ReadAll(int fd, std::span<uint8_t> data) {
+        while (!data.empty()) {
+            ssize_t count{read(fd, data.data(), data.size())};
+            if (count <= 0)
+                return false;
+            data = data.subspan(static_cast<size_t>(count));
+        }
+        return true;
+    }
+
+    void Serve() {
+        UniqueFd client{accept4(listenFd.Get(), nullptr, nullptr, SOCK_CLOEXEC), "benchmark"};
+        if (!client.Valid())
+            return;
+
+        std::array<uint8_t, 12> setupRequest;
+        if (!ReadAll(client.Get(), setupRequest))
+            return;
+        // A successful setup reply with an empty vendor string, no pixmap formats and a single screen with root window 1, keycodes are 8-255.
+        std::array<uint8_t, 8 + 32 + 40> setupReply{1, 0, 11, 0, 0, 0, (32 + 40) / 4, 0};
+        setupReply[8 + 26] = 8;
+        setupReply[8 + 27] = 255;
+        setupReply[8 + 20] = 1;
+        setupReply[8 + 32] = 1;
+        if (write(client.Get(), setupReply.data(), setupReply.size()) != static_cast<ssize_t>(setupReply.size()))
+            return;
+
+        std::array<uint8_t, 16> queryExtension;
+        if (!ReadAll(client.Get(), queryExtension))
+            return;
+        std::array<uint8_t, 32> queryReply{1, 0, 1, 0};
+        queryReply[8] = 1;
+        queryReply[9] = XTestOpcode;
+        if (write(client.Get(), queryReply.data(), queryReply.size()) != static_cast<ssize_t>(queryReply.size()))
+            return;
+
+        std::vector<uint8_t> buffer(64 * 1024);
+        size_t filled{};
+        while (true) {
+            ssize_t count{read(client.Get(), buffer.data() + filled, buffer.size() - filled)};
+            if (count <= 0)
+                return;
+            auto now{std::chrono::steady_clock::now()};
+            filled += static_cast<size_t>(count);
+
+            size_t offset{};
+            uint64_t newRequests{}, newKeyPresses{};
+            std::scoped_lock lock{mutex};
+            for (; offset + X11Connection::FakeInputRequestSize <= filled; offset += X11Connection::FakeInputRequestSize) {
+                if (buffer[offset] != XTestOpcode)
+                    return; // Any waits time out, which reports the failure.
+                newRequests++;
+                if (buffer[offset + 4] == static_cast<uint8_t>(X11EventType::KeyPress)) {
+                    newKeyPresses++;
+                    keyPressTimes.push_back(now);
+                }
+            }
+            std::memmove(buffer.data(), buffer.data() + offset, filled - offset);
+            filled -= offset;
+            requests += newRequests;
+            keyPresses += newKeyPresses;
+            condition.notify_all();
+        }
+    }
+
+  public:
+    FakeXServer() : listenFd{socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0), "benchmark"} {
+        std::string pattern{(std::filesystem::temp_directory_path() / "cassia-x11-XXXXXX").string()};
+        if (!mkdtemp(pattern.data()))
+            throw Exception{"mkdtemp failed: {}", strerror(errno)};
+        directory = pattern;
+        socketPath = (directory / "X0").string();
+
+        sockaddr_un address{.sun_family = AF_UNIX};
+        std::memcpy(address.sun_path, socketPath.c_str(), socketPath.size() + 1);
+        if (bind(listenFd.Get(), reinterpret_cast<sockaddr *>(&address), sizeof(address)) == -1 || listen(listenFd.Get(), 1) == -1)
+            throw Exception{"Failed to listen on '{}': {}", socketPath, strerror(errno)};
+        keyPressTimes.reserve(1 << 20);
+        serverThread = std::thread{&FakeXServer::Serve, this};
+    }
+
+    ~FakeXServer() {
+        shutdown(listenFd.Get(), SHUT_RDWR); // This unblocks accept if the injector never connected.
+        serverThread.join();
+        std::filesystem::remove_all(directory);
+    }
+
+    const std::string &GetDisplay() const {
+        return socketPath;
+    }
+
+    /**
+     * @brief Waits until the supplied amount of key presses have been received in total.
+     * @return The time at which the last of them was received.
+     */
+    std::chrono::steady_clock::time_point WaitForKeyPresses(uint64_t count) {
+        std::unique_lock lock{mutex};
+        if (!condition.wait_for(lock, std::chrono::seconds{5}, [&] { return keyPresses >= count; }))
+            throw Exception{"Only received {} out of {} key presses", keyPresses, count};
+        return keyPressTimes[count - 1];
+    }
+
+    uint64_t GetRequests() {
+        std::scoped_lock lock{mutex};
+        return requests;
+    }
+};
+
+static InputEvent MakeEvent(InputEventType type, uint32_t code = 0, float x = 0, float y = 0) {
+    return InputEvent{.type = type, .code = code, .x = x, .y = y};
+}
+
+/**
+ * @brief Measures the time from pushing a single key press to the X server receiving it.
+ * @return The latencies in nanoseconds.
+ */
+static std::vector<double> MeasureKeyLatency(const BenchmarkOptions &options) {
+    FakeXServer server;
+    InputInjector injector{server.GetDisplay()};
+    size_t iterations{options.quick ? 200U : 5000U};
+    std::vector<double> latencies;
+    latencies.reserve(iterations);
+    for (size_t i{}; i < iterations; i++) {
+        std::array events{MakeEvent(InputEventType::KeyDown, 30), MakeEvent(InputEventType::KeyUp, 30)};
+        auto start{std::chrono::steady_clock::now()};
+        injector.Push(events);
+        auto received{server.WaitForKeyPresses(i + 1)};
+        latencies.push_back(static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(received - start).count()));
+    }
+    return latencies;
+}
+
+/**
+ * @brief Pushes batches of mouse motion with a click in every batch, as a high polling rate mouse would produce them.
+ * @return The amount of events pushed per second, and the amount of requests injected per event.
+ */
+static std::pair<double, double> MeasureThroughput(const BenchmarkOptions &options) {
+    constexpr size_t MotionPerBatch{30};
+    FakeXServer server;
+    InputInjector injector{server.GetDisplay()};
+    size_t batchCount{options.quick ? 2'000U : 100'000U};
+
+    std::vector<InputEvent> batch;
+    for (size_t i{}; i < MotionPerBatch; i++)
+        batch.push_back(MakeEvent(InputEventType::RelativeMotion, 0, 1.5f, -0.5f));
+    batch.push_back(MakeEvent(InputEventType::KeyDown, 30));
+    batch.push_back(MakeEvent(InputEventType::KeyUp, 30));
+
+    auto start{std::chrono::steady_clock::now()};
+    for (size_t i{}; i < batchCount; i++) {
+        std::span<const InputEvent> remaining{batch};
+        while (!remaining.empty()) {
+            remaining = remaining.subspan(injector.Push(remaining));
+            if (!remaining.empty())
+                std::this_thread::yield(); // The ring is full, this only happens when the injection thread falls behind.
+        }
+    }
+    auto end{server.WaitForKeyPresses(batchCount)};
+    double events{static_cast<double>(batchCount * batch.size())};
+    double seconds{std::chrono::duration<double>(end - start).count()};
+    return {events / seconds, static_cast<double>(server.GetRequests()) / events};
+}
+
+void RunInputBenchmarks(BenchmarkReport &report, const BenchmarkOptions &options) {
+    if (options.ShouldRun("input.key_latency")) {
+        auto latencies{MeasureKeyLatency(options)};
+        report.Add("input.key_latency.p50", GetPercentile(latencies, 0.5) / 1000, "us", false);
+        report.Add("input.key_latency.p99", GetPercentile(latencies, 0.99) / 1000, "us", false);
+    }
+
+    if (options.ShouldRun("input.throughput")) {
+        auto [eventsPerSecond, requestsPerEvent]{MeasureThroughput(options)};
+        report.Add("input.throughput", eventsPerSecond, "events/s", true);
+        report.Add("input.throughput.requests_per_event", requestsPerEvent, "ratio", false);
+    }
+}
+}
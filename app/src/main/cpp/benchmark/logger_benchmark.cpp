@@ -0,0 +1,456 @@
+// Copyright © 2023 Cassia Developers, all rights reserved.
+
+#include "benchmark.h"
+#include "cassia/logger.h"
+#include "cassia/util/error.h"
+#include "cassia/util/line_framer.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <latch>
+#include <memory>
+#include <random>
+#include <span>
+#include <thread>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+
+namespace cassia {
+/**
+ * @brief The tag of the channels used by the benchmarks, this is the name passed to Logger::GetPipe with the logger's prefix.
+ */
+constexpr std::string_view BenchmarkLogTag{"cassia.app.bench"};
+constexpr std::string_view BenchmarkLogName{"bench"};
+
+/**
+ * @brief The size of the buffer that producers write to their pipe at once, it's made up of complete lines.
+ */
+constexpr size_t ProducerChunkSize{64 * 1024};
+
+/**
+ * @brief The maximum time to wait for the sink to receive all lines of a scenario, the logger is assumed to be stuck beyond this.
+ */
+constexpr std::chrono::seconds SinkDrainTimeout{60};
+
+/**
+ * @brief A distribution of line lengths written by producers, lengths exclude the newline.
+ */
+struct LineMix {
+    std::string_view name;
+    std::function<size_t(std::mt19937 &)> nextLength;
+};
+
+static const std::array<LineMix, 4> LineMixes{{
+    {"short", [](std::mt19937 &) -> size_t { return 32; }},
+    {"medium", [](std::mt19937 &) -> size_t { return 128; }},
+    {"long", [](std::mt19937 &) -> size_t { return 1024; }},
+    {"mixed", [](std::mt19937 &random) -> size_t {
+        // Roughly the shape of Wine output: mostly short trace lines with the occasional long dump.
+        auto bucket{std::uniform_int_distribution<int>{0, 99}(random)};
+        if (bucket < 70)
+            return std::uniform_int_distribution<size_t>{16, 64}(random);
+        if (bucket < 95)
+            return std::uniform_int_distribution<size_t>{64, 256}(random);
+        return std::uniform_int_distribution<size_t>{256, 2048}(random);
+    }},
+}};
+
+/**
+ * @brief Counters that are updated by the sink, these are shared with the benchmark as the sink is owned by the logger.
+ */
+struct BenchmarkSinkCounters {
+    std::atomic<uint64_t> lines;
+    std::atomic<uint64_t> bytes;
+};
+
+/**
+ * @brief A sink which counts the records from the benchmark channels without writing them anywhere, records from any other channel are forwarded.
+ */
+struct CountingLogSink : LogSink {
+  private:
+    std::shared_ptr<BenchmarkSinkCounters> counters;
+    FdLogSink forward;
+
+  public:
+    CountingLogSink(std::shared_ptr<BenchmarkSinkCounters> counters, UniqueFd forwardFd) : counters{std::move(counters)}, forward{std::move(forwardFd)} {}
+
+    void Write(const LogRecord &record) override {
+        if (record.tag == BenchmarkLogTag) {
+            counters->lines.fetch_add(1, std::memory_order_relaxed);
+            counters->bytes.fetch_add(record.messageLength, std::memory_order_relaxed);
+        } else {
+            forward.Write(record);
+        }
+    }
+};
+
+static UniqueFd DuplicateFd(int fd) {
+    int duplicate{fcntl(fd, F_DUPFD_CLOEXEC, 0)};
+    if (duplicate == -1)
+        throw Exception{"fcntl({}, F_DUPFD_CLOEXEC) failed: {}", fd, strerror(errno)};
+    return UniqueFd{duplicate};
+}
+
+/**
+ * @return A buffer of complete lines with lengths from the mix, and the amount of lines in it.
+ */
+static std::pair<std::string, size_t> GenerateChunk(const LineMix &mix, uint32_t seed) {
+    std::mt19937 random{seed};
+    std::string chunk;
+    size_t lines{};
+    while (true) {
+        auto length{mix.nextLength(random)};
+        if (chunk.size() + length + 1 > ProducerChunkSize)
+            break;
+        chunk.append(length, static_cast<char>('a' + lines % 26));
+        chunk += '\n';
+        lines++;
+    }
+    return {std::move(chunk), lines};
+}
+
+static void WriteAll(int fd, std::string_view data) {
+    while (!data.empty()) {
+        ssize_t written{write(fd, data.data(), data.size())};
+        if (written == -1) {
+            if (errno == EINTR)
+                continue;
+            throw Exception{"write({}) failed: {}", fd, strerror(errno)};
+        }
+        data.remove_prefix(static_cast<size_t>(written));
+    }
+}
+
+/**
+ * @brief Writes the supplied amount of chunks from every producer concurrently, and waits for the sink to receive all of their lines.
+ * @return The time from the producers starting to the last line reaching the sink.
+ */
+static std::chrono::nanoseconds RunScenario(BenchmarkSinkCounters &counters, const LineMix &mix, size_t producerCount, size_t chunksPerProducer, uint64_t &totalLines) {
+    std::vector<std::pair<std::string, size_t>> chunks;
+    std::vector<LogPipe> pipes;
+    totalLines = 0;
+    for (size_t i{}; i < producerCount; i++) {
+        chunks.push_back(GenerateChunk(mix, static_cast<uint32_t>(i)));
+        totalLines += chunks.back().second * chunksPerProducer;
+        pipes.push_back(Logger::GetPipe(std::string{BenchmarkLogName}));
+    }
+    counters.lines.store(0, std::memory_order_relaxed);
+    counters.bytes.store(0, std::memory_order_relaxed);
+
+    std::latch ready{static_cast<std::ptrdiff_t>(producerCount + 1)};
+    std::vector<std::jthread> producers;
+    for (size_t i{}; i < producerCount; i++) {
+        producers.emplace_back([&, i] {
+            ready.arrive_and_wait();
+            for (size_t chunk{}; chunk < chunksPerProducer; chunk++)
+                WriteAll(pipes[i].out.Get(), chunks[i].first);
+            pipes[i].out.Reset();
+            pipes[i].err.Reset();
+        });
+    }
+
+    ready.arrive_and_wait();
+    auto start{std::chrono::steady_clock::now()};
+    producers.clear();
+    while (counters.lines.load(std::memory_order_relaxed) < totalLines) {
+        if (std::chrono::steady_clock::now() - start > SinkDrainTimeout)
+            throw Exception{"The sink only received {}/{} lines within {}s", counters.lines.load(std::memory_order_relaxed), totalLines, SinkDrainTimeout.count()};
+        std::this_thread::sleep_for(std::chrono::microseconds{100});
+    }
+    return std::chrono::steady_clock::now() - start;
+}
+
+/**
+ * @brief Waits for the sink to have received the supplied total amount of lines.
+ */
+static void WaitForLines(BenchmarkSinkCounters &counters, uint64_t lines) {
+    auto start{std::chrono::steady_clock::now()};
+    while (counters.lines.load(std::memory_order_relaxed) < lines) {
+        if (std::chrono::steady_clock::now() - start > SinkDrainTimeout)
+            throw Exception{"The sink only received {}/{} lines within {}s", counters.lines.load(std::memory_order_relaxed), lines, SinkDrainTimeout.count()};
+        std::this_thread::yield();
+    }
+}
+
+/**
+ * @brief Measures dispatching single lines round-robin over an increasing amount of open channels, like the channels of every process of a running prefix.
+ * @details The latency is from writing a line to it reaching the sink, the throughput is of writing lines back to back, neither should grow with the amount of channels.
+ */
+static void MeasureChannelDispatch(BenchmarkReport &report, const BenchmarkOptions &options, BenchmarkSinkCounters &counters) {
+    constexpr std::array<size_t, 4> ChannelCounts{1, 10, 100, 500};
+    constexpr std::string_view Line{"dispatch\n"};
+    size_t roundTrips{options.quick ? 200U : 5000U};
+    size_t throughputLines{options.quick ? 10000U : 500000U};
+    for (size_t channelCount: ChannelCounts) {
+        auto name{fmt::format("logger.dispatch.c{}", channelCount)};
+        if (!options.ShouldRun(name))
+            continue;
+
+        std::vector<LogPipe> pipes;
+        for (size_t i{}; i < channelCount; i++)
+            pipes.push_back(Logger::GetPipe(std::string{BenchmarkLogName}));
+
+        std::vector<double> latencies;
+        for (size_t i{}; i < roundTrips; i++) {
+            auto lines{counters.lines.load(std::memory_order_relaxed) + 1};
+            auto start{std::chrono::steady_clock::now()};
+            WriteAll(pipes[i % channelCount].out.Get(), Line);
+            WaitForLines(counters, lines);
+            latencies.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count());
+        }
+        report.Add(name + ".latency.p50", GetPercentile(latencies, 0.5), "us", false);
+        report.Add(name + ".latency.p99", GetPercentile(latencies, 0.99), "us", false);
+
+        auto lines{counters.lines.load(std::memory_order_relaxed) + throughputLines};
+        auto start{std::chrono::steady_clock::now()};
+        for (size_t i{}; i < throughputLines; i++)
+            WriteAll(pipes[i % channelCount].out.Get(), Line);
+        WaitForLines(counters, lines);
+        double seconds{std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count()};
+        report.Add(name + ".lines_per_second", static_cast<double>(throughputLines) / seconds, "lines/s", true);
+    }
+}
+
+static void Expect(bool condition, std::string_view description) {
+    if (!condition)
+        throw Exception{"Logger benchmark check failed: {}", description};
+}
+
+/**
+ * @brief Checks that the lines of every channel are only written to the persistent ring of that channel, like the rings of contexts running side by side.
+ */
+static void CheckRingRouting(const BenchmarkOptions &options) {
+    if (!options.ShouldRun("logger.ring_routing"))
+        return;
+    std::string pattern{(std::filesystem::temp_directory_path() / "cassia-log-ring-XXXXXX").string()};
+    if (!mkdtemp(pattern.data()))
+        throw Exception{"mkdtemp failed: {}", strerror(errno)};
+    std::filesystem::path directory{pattern};
+    try {
+        std::array<std::filesystem::path, 2> ringPaths{directory / "first.logring", directory / "second.logring"};
+        {
+            std::array<LogPipe, 2> pipes{
+                Logger::GetPipe(std::string{BenchmarkLogName}, {}, std::make_shared<LogRing>(ringPaths[0], 64 * 1024)),
+                Logger::GetPipe(std::string{BenchmarkLogName}, {}, std::make_shared<LogRing>(ringPaths[1], 64 * 1024)),
+            };
+            WriteAll(pipes[0].out.Get(), "first\n");
+            WriteAll(pipes[1].err.Get(), "second\n");
+        } // The rings are released by the logger once it has drained the closed pipes.
+
+        auto start{std::chrono::steady_clock::now()};
+        std::array<std::vector<LogRingEntry>, 2> entries;
+        while ((entries[0] = ReadLogRing(ringPaths[0])).empty() || (entries[1] = ReadLogRing(ringPaths[1])).empty()) {
+            if (std::chrono::steady_clock::now() - start > SinkDrainTimeout)
+                throw Exception{"The rings didn't receive their lines within {}s", SinkDrainTimeout.count()};
+            std::this_thread::sleep_for(std::chrono::milliseconds{1});
+        }
+        Expect(entries[0].size() == 1 && entries[0][0].message == "first" && entries[0][0].stream == LogRingStream::Out, "the first ring only has the line of its channel");
+        Expect(entries[1].size() == 1 && entries[1][0].message == "second" && entries[1][0].stream == LogRingStream::Err, "the second ring only has the line of its channel");
+    } catch (...) {
+        std::filesystem::remove_all(directory);
+        throw;
+    }
+    std::filesystem::remove_all(directory);
+}
+
+/**
+ * @brief The lines a framer emitted for a stream, along with the amount of reads it took to consume the stream.
+ */
+struct FramedStream {
+    std::vector<std::string> lines;
+    size_t reads{};
+};
+
+/**
+ * @brief Writes a stream to a pipe in slices and frames it, every slice is read in full before the next one is written.
+ * @param sliceSizes The sizes of consecutive slices, these are repeated until the entire stream has been written.
+ * @param flush If the framer is flushed at the end of the stream, any trailing partial line is only emitted by this.
+ */
+static FramedStream FrameStream(LineFramer &framer, std::string_view stream, std::span<const size_t> sliceSizes, bool flush) {
+    std::array<int, 2> fds;
+    if (pipe2(fds.data(), O_CLOEXEC) == -1)
+        throw Exception{"pipe2() failed: {}", strerror(errno)};
+    UniqueFd readFd{fds[0], "benchmark"}, writeFd{fds[1], "benchmark"};
+
+    FramedStream framed;
+    auto collect{[&](const char *line, size_t length) {
+        Expect(std::strlen(line) == length, "lines are null-terminated at their length");
+        framed.lines.emplace_back(line, length);
+    }};
+    for (size_t index{}; !stream.empty(); index++) {
+        auto slice{stream.substr(0, sliceSizes[index % sliceSizes.size()])};
+        WriteAll(writeFd.Get(), slice);
+        stream.remove_prefix(slice.size());
+        for (size_t pending{slice.size()}; pending != 0;) {
+            ssize_t length{framer.Read(readFd.Get())};
+            if (length <= 0)
+                throw Exception{"read({}) failed: {}", readFd.Get(), length == 0 ? "EOF" : strerror(errno)};
+            pending -= static_cast<size_t>(length);
+            framed.reads++;
+            framer.ForEachLine(collect);
+        }
+    }
+    if (flush)
+        framer.Flush(collect);
+    return framed;
+}
+
+static FramedStream FrameStream(LineFramer &framer, std::string_view stream, size_t sliceSize, bool flush) {
+    return FrameStream(framer, stream, std::span{&sliceSize, 1}, flush);
+}
+
+/**
+ * @brief Splits a stream into lines the way a framer is specified to, as a reference for it.
+ * @details Every line is split into chunks of the maximum length with the remainder as the last chunk, an empty line is emitted as is unless it's the end of the stream.
+ */
+static std::vector<std::string> SplitLines(std::string_view stream, size_t maxLineLength) {
+    std::vector<std::string> lines;
+    while (!stream.empty()) {
+        size_t newline{stream.find('\n')};
+        auto line{stream.substr(0, newline)};
+        stream.remove_prefix(newline == std::string_view::npos ? stream.size() : newline + 1);
+        if (line.empty())
+            lines.emplace_back();
+        for (; !line.empty(); line.remove_prefix(std::min(line.size(), maxLineLength)))
+            lines.emplace_back(line.substr(0, maxLineLength));
+    }
+    return lines;
+}
+
+/**
+ * @brief Checks the edge cases of framing lines in the ring the logger reads pipes into, with a ring of a single page.
+ */
+static void CheckLineFramer(const BenchmarkOptions &options) {
+    if (!options.ShouldRun("logger.line_framer"))
+        return;
+    constexpr size_t MaxLineLength{256};
+    size_t capacity{static_cast<size_t>(sysconf(_SC_PAGESIZE))};
+
+    {
+        // Slices that don't line up with the lines leave a partial line at the head, so the ring wraps around many times.
+        LineFramer framer{capacity, MaxLineLength};
+        std::vector<std::string> expected;
+        std::string stream;
+        for (size_t index{}; stream.size() < capacity * 8; index++) {
+            expected.emplace_back(fmt::format("{}:{}", index, std::string(index % 200, static_cast<char>('a' + index % 26))));
+            stream += expected.back() + '\n';
+        }
+        Expect(FrameStream(framer, stream, 1000, false).lines == expected, "lines wrapping around the end of the ring are emitted intact and in order");
+    }
+
+    {
+        // A line longer than the whole ring is split into chunks of the maximum length, the remainder is a line of its own.
+        LineFramer framer{capacity, MaxLineLength};
+        size_t longLength{capacity * 3 + 100};
+        std::string stream(longLength, 'x');
+        stream += '\n' + std::string(MaxLineLength, 'y') + '\n' + "after\n";
+        auto lines{FrameStream(framer, stream, capacity / 2, false).lines};
+        size_t chunks{longLength / MaxLineLength};
+        Expect(lines.size() == chunks + 3, "a line longer than the ring is split into chunks of the maximum length");
+        Expect(std::all_of(lines.begin(), lines.begin() + static_cast<ptrdiff_t>(chunks), [](const std::string &line) { return line == std::string(MaxLineLength, 'x'); }), "the chunks of a long line have the maximum length");
+        Expect(lines[chunks] == std::string(longLength % MaxLineLength, 'x'), "the remainder of a long line is emitted once its newline arrives");
+        Expect(lines[chunks + 1] == std::string(MaxLineLength, 'y') && lines[chunks + 2] == "after", "a newline directly after a line of the maximum length belongs to it");
+    }
+
+    {
+        // A partial final line is held back until the stream is flushed, and flushing leaves nothing behind.
+        LineFramer framer{capacity, MaxLineLength};
+        Expect(FrameStream(framer, "first\nsecond\npartial", capacity, false).lines == std::vector<std::string>{"first", "second"}, "a partial final line isn't emitted before a flush");
+        std::vector<std::string> flushed;
+        framer.Flush([&](const char *line, size_t length) { flushed.emplace_back(line, length); });
+        Expect(flushed == std::vector<std::string>{"partial"}, "a flush emits the partial final line");
+        Expect(FrameStream(framer, "next", capacity, true).lines == std::vector<std::string>{"next"}, "a flushed framer starts with an empty ring");
+    }
+
+    {
+        // A burst of many short lines which fits into the ring is consumed by a single read.
+        LineFramer framer{capacity, MaxLineLength};
+        std::vector<std::string> expected;
+        std::string stream;
+        for (size_t index{}; stream.size() + 4 < capacity; index++) {
+            expected.emplace_back(fmt::format("{:03}", index % 1000));
+            stream += expected.back() + '\n';
+        }
+        auto framed{FrameStream(framer, stream, stream.size(), true)};
+        Expect(framed.reads == 1, "a burst that fits into the ring is consumed by a single read");
+        Expect(framed.lines == expected, "every line of a burst is emitted in order");
+    }
+
+    // Random streams are split at random boundaries and compared against the reference, the seeds are fixed so any failure can be reproduced.
+    size_t seedCount{options.quick ? 20U : 500U};
+    for (uint32_t seed{}; seed < seedCount; seed++) {
+        std::mt19937 random{seed};
+        // Half of the seeds use a maximum line length just below the capacity of the ring, which is the largest one it accepts.
+        constexpr std::array<size_t, 4> MaxLineLengths{1, 17, 256, 1000};
+        size_t maxLineLength{seed % 2 ? MaxLineLengths[seed / 2 % MaxLineLengths.size()] : capacity - 2 - seed / 2 % 4 * 16};
+        LineFramer framer{capacity, maxLineLength};
+
+        std::string stream;
+        std::uniform_int_distribution<int> bucket{0, 99};
+        std::uniform_int_distribution<int> character{'!', '~'};
+        while (stream.size() < capacity * 4) {
+            // Mostly short lines, with lines around the maximum length and far longer than the ring mixed in.
+            int kind{bucket(random)};
+            size_t length{kind < 50 ? std::uniform_int_distribution<size_t>{0, 32}(random)
+                        : kind < 75 ? maxLineLength - 1 + std::uniform_int_distribution<size_t>{0, 2}(random)
+                        : kind < 95 ? std::uniform_int_distribution<size_t>{0, maxLineLength * 3}(random)
+                        : std::uniform_int_distribution<size_t>{capacity, capacity * 3}(random)};
+            for (size_t i{}; i < length; i++)
+                stream += static_cast<char>(character(random));
+            stream += '\n';
+        }
+        if (bucket(random) < 50)
+            stream.resize(stream.size() - std::uniform_int_distribution<size_t>{1, std::min<size_t>(stream.size(), 64)}(random)); // The stream ends in a partial line.
+
+        std::vector<size_t> sliceSizes(64);
+        for (auto &size: sliceSizes)
+            size = bucket(random) < 50 ? std::uniform_int_distribution<size_t>{1, 16}(random) : std::uniform_int_distribution<size_t>{1, capacity * 2}(random);
+        Expect(FrameStream(framer, stream, sliceSizes, true).lines == SplitLines(stream, maxLineLength), fmt::format("lines of a random stream split at random boundaries match the reference (seed {})", seed));
+    }
+}
+
+void RunLoggerBenchmarks(BenchmarkReport &report, const BenchmarkOptions &options) {
+    constexpr std::array<size_t, 3> ProducerCounts{1, 4, 16};
+    constexpr std::array<size_t, 2> ShardCounts{1, 4}; // The default of a single log thread compared to one per core of a typical big cluster.
+    size_t bytesPerScenario{options.quick ? 4 * ProducerChunkSize : 256 * ProducerChunkSize}; // Spread over the producers, so every scenario moves the same amount of data.
+
+    auto counters{std::make_shared<BenchmarkSinkCounters>()};
+    Logger::SetSink(std::make_unique<CountingLogSink>(counters, DuplicateFd(options.stderrFd)));
+    try {
+        CheckLineFramer(options);
+        CheckRingRouting(options);
+        for (size_t shardCount: ShardCounts) {
+            // Channels are assigned to a shard when they're created, so every scenario creates its channels after the count is set.
+            Logger::SetShardCount(shardCount);
+            for (size_t producerCount: ProducerCounts) {
+                if (shardCount > producerCount)
+                    continue; // The shards past the amount of channels would be idle.
+                for (const auto &mix: LineMixes) {
+                    auto name{fmt::format("logger.throughput.s{}.p{}.{}", shardCount, producerCount, mix.name)};
+                    if (!options.ShouldRun(name))
+                        continue;
+
+                    uint64_t totalLines{};
+                    auto chunksPerProducer{std::max<size_t>(bytesPerScenario / ProducerChunkSize / producerCount, 1)};
+                    auto duration{RunScenario(*counters, mix, producerCount, chunksPerProducer, totalLines)};
+                    double seconds{std::chrono::duration<double>(duration).count()};
+                    report.Add(name + ".lines_per_second", static_cast<double>(totalLines) / seconds, "lines/s", true);
+                    report.Add(name + ".megabytes_per_second", static_cast<double>(counters->bytes.load(std::memory_order_relaxed)) / seconds / (1024 * 1024), "MiB/s", true);
+                }
+            }
+        }
+        MeasureChannelDispatch(report, options, *counters);
+    } catch (...) {
+        Logger::SetShardCount(1);
+        Logger::SetSink(std::make_unique<FdLogSink>(DuplicateFd(options.stderrFd)));
+        throw;
+    }
+    Logger::SetShardCount(1);
+    Logger::SetSink(std::make_unique<FdLogSink>(DuplicateFd(options.stderrFd)));
+}
+}
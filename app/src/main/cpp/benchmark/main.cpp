@@ -0,0 +1,134 @@
+// Copyright © 2023 Cassia Developers, all rights reserved.
+
+/* Benchmarks of the native core on a Linux host, these measure the Logger, process spawning and the fd wrappers.
+ * Usage: cassia_benchmark [--quick] [--filter <substring>] [--label <label>] [--output <results.json>] [--compare <baseline.json>] [--threshold <percent>]
+ * Results are written as JSON with --output, a later run can be compared against them with --compare to find regressions between commits.
+ */
+
+#include "benchmark.h"
+#include "cassia/util/error.h"
+#include <cmath>
+#include <fstream>
+#include <sstream>
+#include <unordered_map>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace cassia {
+/**
+ * @brief The original stdout and stderr of the process, the Logger takes both over while it's statically initialized.
+ * @note These are duplicated in a prioritized constructor, which runs before any C++ static initializers.
+ */
+static int originalStdout{-1}, originalStderr{-1};
+
+__attribute__((constructor(101))) static void SaveOriginalStdio() {
+    originalStdout = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 0);
+    originalStderr = fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, 0);
+}
+
+static std::string ReadFile(const std::string &path) {
+    std::ifstream file{path};
+    if (!file)
+        throw Exception{"Cannot open '{}'", path};
+    std::stringstream contents;
+    contents << file.rdbuf();
+    return contents.str();
+}
+
+/**
+ * @brief Prints the change of every result relative to the baseline.
+ * @return The amount of results that regressed by more than the threshold.
+ */
+static size_t CompareResults(FILE *output, const std::vector<BenchmarkResult> &baseline, const std::vector<BenchmarkResult> &results, double thresholdPercent) {
+    std::unordered_map<std::string_view, const BenchmarkResult *> baselineResults;
+    for (const auto &result: baseline)
+        baselineResults.emplace(result.name, &result);
+
+    size_t regressions{};
+    fmt::println(output, "\n{:<48} {:>14} {:>14} {:>9}", "name", "baseline", "current", "change");
+    for (const auto &result: results) {
+        auto it{baselineResults.find(result.name)};
+        if (it == baselineResults.end() || it->second->value == 0) {
+            fmt::println(output, "{:<48} {:>14} {:>14.2f}", result.name, "-", result.value);
+            continue;
+        }
+
+        double change{(result.value - it->second->value) / it->second->value * 100};
+        double regression{result.higherIsBetter ? -change : change};
+        bool regressed{regression > thresholdPercent};
+        regressions += regressed;
+        fmt::println(output, "{:<48} {:>14.2f} {:>14.2f} {:>+8.1f}%{}", result.name, it->second->value, result.value, change, regressed ? " REGRESSED" : "");
+    }
+    return regressions;
+}
+
+static int Main(int argc, char **argv) {
+    FILE *output{originalStdout != -1 ? fdopen(originalStdout, "w") : stdout};
+    BenchmarkOptions options{.stderrFd = originalStderr};
+    std::string label, outputPath, comparePath;
+    double thresholdPercent{10};
+
+    for (int i{1}; i < argc; i++) {
+        std::string_view arg{argv[i]};
+        auto nextArg{[&]() -> std::string {
+            if (i + 1 >= argc)
+                throw Exception{"'{}' requires a value", arg};
+            return argv[++i];
+        }};
+
+        if (arg == "--quick")
+            options.quick = true;
+        else if (arg == "--filter")
+            options.filter = nextArg();
+        else if (arg == "--label")
+            label = nextArg();
+        else if (arg == "--output")
+            outputPath = nextArg();
+        else if (arg == "--compare")
+            comparePath = nextArg();
+        else if (arg == "--threshold")
+            thresholdPercent = std::stod(nextArg());
+        else
+            throw Exception{"Unknown argument '{}'", arg};
+    }
+
+    BenchmarkReport report{output};
+    RunFdBenchmarks(report, options);
+    RunProcessBenchmarks(report, options);
+    RunLoggerBenchmarks(report, options);
+    RunCompositorBenchmarks(report, options);
+    RunInputBenchmarks(report, options);
+    RunSyncBenchmarks(report, options);
+    RunShaderCacheBenchmarks(report, options);
+    RunDirectoryBenchmarks(report, options);
+    RunTarBenchmarks(report, options);
+    RunResourceSamplerBenchmarks(report, options);
+    RunPrefixBenchmarks(report, options);
+    RunWineDebugBenchmarks(report, options);
+
+    if (!outputPath.empty()) {
+        std::ofstream file{outputPath};
+        file << report.ToJson(label);
+        if (!file)
+            throw Exception{"Cannot write '{}'", outputPath};
+    }
+
+    if (!comparePath.empty()) {
+        auto regressions{CompareResults(output, BenchmarkReport::ParseJson(ReadFile(comparePath)), report.GetResults(), thresholdPercent)};
+        if (regressions) {
+            fmt::println(output, "{} results regressed by more than {}%", regressions, thresholdPercent);
+            return 2;
+        }
+    }
+    return 0;
+}
+}
+
+int main(int argc, char **argv) {
+    try {
+        return cassia::Main(argc, argv);
+    } catch (const std::exception &e) {
+        dprintf(cassia::originalStderr != -1 ? cassia::originalStderr : STDERR_FILENO, "%s\n", e.what());
+        return 1;
+    }
+}
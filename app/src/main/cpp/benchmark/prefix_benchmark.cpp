@@ -0,0 +1,104 @@
+// Copyright © 2023 Cassia Developers, all rights reserved.
+
+#include "benchmark.h"
+#include "cassia/prefix_cloner.h"
+#include "cassia/prefix_fingerprint.h"
+#include "cassia/util/error.h"
+#include "cassia/util/fd.h"
+#include <array>
+#include <cstring>
+#include <filesystem>
+#include <random>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+
+namespace cassia {
+/**
+ * @brief The amount of files in the generated template, this is around the amount in a prefix initialized by wineboot.
+ */
+constexpr size_t TemplateFileCount{10000};
+
+static void Expect(bool condition, std::string_view description) {
+    if (!condition)
+        throw Exception{"Prefix benchmark check failed: {}", description};
+}
+
+static void WriteFile(const std::filesystem::path &path, std::string_view contents) {
+    UniqueFd fd{open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644), "benchmark"};
+    if (!fd.Valid())
+        throw Exception{"Failed to create '{}': {}", path.string(), strerror(errno)};
+    if (write(fd.Get(), contents.data(), contents.size()) != static_cast<ssize_t>(contents.size()))
+        throw Exception{"Failed to write '{}': {}", path.string(), strerror(errno)};
+}
+
+/**
+ * @brief Generates a template that resembles an initialized prefix, mostly small binaries in the Windows directory along with the registry, a home directory and the symlinks of a prefix.
+ */
+static void GenerateTemplate(const std::filesystem::path &templatePath) {
+    std::mt19937 random{TemplateFileCount};
+    std::uniform_int_distribution<size_t> sizeDistribution{512, 8 * 1024};
+    std::string contents(8 * 1024, '\0');
+    for (auto &c: contents)
+        c = static_cast<char>(random());
+
+    auto driveC{templatePath / "pfx" / "drive_c"};
+    std::array<std::filesystem::path, 4> directories{driveC / "windows" / "system32", driveC / "windows" / "syswow64", driveC / "windows" / "Fonts", driveC / "users" / "cassia" / "AppData"};
+    for (const auto &directory: directories)
+        std::filesystem::create_directories(directory);
+    std::filesystem::create_directories(templatePath / "pfx" / "dosdevices");
+    std::filesystem::create_directories(templatePath / "home" / ".cache");
+
+    for (size_t index{}; index < TemplateFileCount - 4; index++) {
+        // Subdirectories are spread over the Windows directory like the driver and manifest stores.
+        auto directory{directories[index % directories.size()] / fmt::format("{:03}", index % 250)};
+        if (index < 250 * directories.size())
+            std::filesystem::create_directory(directory);
+        WriteFile(directory / fmt::format("file{:05}.dll", index), std::string_view{contents}.substr(0, sizeDistribution(random)));
+    }
+    for (auto hive: {"system.reg", "user.reg", "userdef.reg"})
+        WriteFile(templatePath / "pfx" / hive, contents);
+    std::filesystem::create_directory_symlink("../drive_c", templatePath / "pfx" / "dosdevices" / "c:");
+    std::filesystem::create_directory_symlink(driveC, templatePath / "pfx" / "dosdevices" / "z:"); // Absolute symlinks into the template are rebased.
+    WriteFile(templatePath / PrefixFingerprintFileName, "fingerprint");
+}
+
+/**
+ * @brief Measures cloning a generated template with 10k files into a new prefix, each clone is checked and removed afterwards.
+ */
+static void MeasureClone(BenchmarkReport &report, const BenchmarkOptions &options, const std::filesystem::path &directory) {
+    auto templatePath{directory / "template"}, prefixPath{directory / "prefix"};
+    GenerateTemplate(templatePath);
+
+    size_t cloneCount{options.quick ? 2U : 7U};
+    std::vector<double> durations;
+    for (size_t index{}; index < cloneCount; index++) {
+        std::filesystem::create_directory(prefixPath);
+        auto stats{ClonePrefix(templatePath, prefixPath)};
+        Expect(stats.reflinkedFiles + stats.copiedFiles == TemplateFileCount, "every file of the template is cloned");
+        Expect(stats.symlinks == 2, "every symlink of the template is cloned");
+        Expect(std::filesystem::read_symlink(prefixPath / "pfx" / "dosdevices" / "z:") == prefixPath / "pfx" / "drive_c", "absolute symlinks into the template are rebased");
+        Expect(std::filesystem::exists(prefixPath / PrefixFingerprintFileName), "the fingerprint is cloned");
+        Expect(access((prefixPath / "pfx" / "drive_c" / "windows" / "system32" / "000" / "file00000.dll").c_str(), W_OK) == 0, "cloned binaries are writable");
+        durations.push_back(std::chrono::duration<double, std::milli>{stats.duration}.count());
+        std::filesystem::remove_all(prefixPath);
+    }
+    report.Add("prefix.clone", GetPercentile(durations, 0.5), "ms", false);
+}
+
+void RunPrefixBenchmarks(BenchmarkReport &report, const BenchmarkOptions &options) {
+    if (!options.ShouldRun("prefix.clone"))
+        return;
+    std::string pattern{(std::filesystem::temp_directory_path() / "cassia-prefix-XXXXXX").string()};
+    if (!mkdtemp(pattern.data()))
+        throw Exception{"mkdtemp failed: {}", strerror(errno)};
+    std::filesystem::path directory{pattern};
+    try {
+        MeasureClone(report, options, directory);
+    } catch (...) {
+        std::filesystem::remove_all(directory);
+        throw;
+    }
+    std::filesystem::remove_all(directory);
+}
+}
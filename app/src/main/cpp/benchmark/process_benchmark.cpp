@@ -0,0 +1,283 @@
+// Copyright © 2023 Cassia Developers, all rights reserved.
+
+#include "benchmark.h"
+#include "cassia/launcher.h"
+#include "cassia/process_monitor.h"
+#include "cassia/wine_ctx.h"
+#include "cassia/util/error.h"
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <thread>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+namespace cassia {
+/**
+ * @brief The executable that's spawned, it exits immediately so the measurements are dominated by the spawn itself.
+ */
+constexpr const char *SpawnBenchmarkExecutable{"/bin/true"};
+
+/**
+ * @brief Spawns are measured after this many unmeasured ones, so the page cache and allocators are warm.
+ */
+constexpr size_t SpawnWarmupIterations{5};
+
+/**
+ * @brief Measures the time to spawn a process and the time until its exit has been observed, and adds the percentiles of both to the report.
+ */
+static void MeasureSpawns(BenchmarkReport &report, const BenchmarkOptions &options, const std::string &name, const std::function<Process()> &spawn) {
+    size_t iterations{options.quick ? 20U : 500U};
+    std::vector<double> spawnSamples, exitSamples;
+    for (size_t i{}; i < SpawnWarmupIterations + iterations; i++) {
+        auto start{std::chrono::steady_clock::now()};
+        auto process{spawn()};
+        auto spawned{std::chrono::steady_clock::now()};
+        if (int exitCode{process.WaitForExit()}; exitCode != 0)
+            throw Exception{"'{}' exited with {}", SpawnBenchmarkExecutable, exitCode};
+        auto exited{std::chrono::steady_clock::now()};
+
+        if (i >= SpawnWarmupIterations) {
+            spawnSamples.push_back(std::chrono::duration<double, std::micro>(spawned - start).count());
+            exitSamples.push_back(std::chrono::duration<double, std::micro>(exited - start).count());
+        }
+    }
+
+    report.Add(name + ".spawn.p50", GetPercentile(spawnSamples, 0.5), "us", false);
+    report.Add(name + ".spawn.p99", GetPercentile(spawnSamples, 0.99), "us", false);
+    report.Add(name + ".exit.p50", GetPercentile(exitSamples, 0.5), "us", false);
+    report.Add(name + ".exit.p99", GetPercentile(exitSamples, 0.99), "us", false);
+}
+
+/**
+ * @brief Spawns a process with fork and exec, as a baseline for the vfork semantics of Process which don't copy the page tables of the parent.
+ */
+static Process ForkProcess(const char *executable) {
+    pid_t pid{fork()};
+    if (pid == -1)
+        throw Exception{"fork() failed: {}", strerror(errno)};
+    if (pid == 0) {
+        execl(executable, executable, nullptr);
+        _exit(127);
+    }
+    Process process;
+    process.pid = pid;
+    process.exitCode = ProcessMonitor::Watch(pid);
+    return process;
+}
+
+/**
+ * @brief Makes the supplied amount of memory resident in this process, like the heap of a game that's running when Wine spawns a process.
+ */
+static std::unique_ptr<char[]> AllocateResidentHeap(size_t size) {
+    std::unique_ptr<char[]> heap{new char[size]};
+    size_t pageSize{static_cast<size_t>(sysconf(_SC_PAGESIZE))};
+    for (size_t offset{}; offset < size; offset += pageSize)
+        heap[offset] = static_cast<char>(offset);
+    DoNotOptimize(heap.get());
+    return heap;
+}
+
+/**
+ * @brief The executable that stands in for wineserver, it echoes every request on its input back to its output as soon as it's woken up for it.
+ */
+constexpr const char *EchoServerExecutable{"/bin/cat"};
+
+/**
+ * @brief The time between requests to the server, this lets it go to sleep between them like wineserver does between bursts of requests.
+ */
+constexpr std::chrono::microseconds EchoRequestInterval{200};
+
+/**
+ * @brief Measures the round trip of requests to a server process spawned with the supplied options, while every core is oversubscribed with threads of our own.
+ * @details This models a Wine process waiting on a wineserver request while the game's threads keep all cores busy, the latency is dominated by how quickly the server is scheduled once woken up.
+ * @return The round trip times in microseconds.
+ */
+static std::vector<double> MeasureServerLatency(const BenchmarkOptions &options, const LaunchOptions &launchOptions) {
+    std::array<int, 2> requestFds, replyFds;
+    if (pipe2(requestFds.data(), O_CLOEXEC) == -1 || pipe2(replyFds.data(), O_CLOEXEC) == -1)
+        throw Exception{"pipe2() failed: {}", strerror(errno)};
+    UniqueFd requestRead{requestFds[0], "benchmark"}, replyRead{replyFds[0], "benchmark"};
+    UniqueFd requestWrite{requestFds[1], "benchmark"};
+    SharedFd replyWrite{replyFds[1], "benchmark"};
+    if (!requestRead.SetCloseOnExec(false))
+        throw Exception{"fcntl({}, 0) failed: {}", requestRead.Get(), strerror(errno)};
+
+    // The server reads requests from the inherited pipe and writes replies to its stdout.
+    Process server{EchoServerExecutable, {fmt::format("/dev/fd/{}", requestRead.Get())}, {}, LogPipe{replyWrite, replyWrite}, launchOptions};
+    requestRead.Reset();
+    replyWrite.Reset();
+
+    std::atomic<bool> stopping{};
+    std::vector<std::thread> loadThreads;
+    for (unsigned i{}; i < 2 * std::max(std::thread::hardware_concurrency(), 1U); i++)
+        loadThreads.emplace_back([&stopping] {
+            uint64_t counter{};
+            while (!stopping.load(std::memory_order_relaxed))
+                DoNotOptimize(++counter);
+        });
+
+    size_t iterations{options.quick ? 200U : 5000U};
+    std::vector<double> latencies;
+    latencies.reserve(iterations);
+    for (size_t i{}; i < SpawnWarmupIterations + iterations; i++) {
+        std::this_thread::sleep_for(EchoRequestInterval);
+        char request{'r'}, reply{};
+        auto start{std::chrono::steady_clock::now()};
+        if (write(requestWrite.Get(), &request, 1) != 1 || read(replyRead.Get(), &reply, 1) != 1)
+            throw Exception{"Lost the connection to '{}': {}", EchoServerExecutable, strerror(errno)};
+        if (i >= SpawnWarmupIterations)
+            latencies.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count());
+    }
+
+    stopping = true;
+    for (auto &thread: loadThreads)
+        thread.join();
+    requestWrite.Reset(); // The server exits once its input is closed.
+    server.WaitForExit();
+    return latencies;
+}
+
+/**
+ * @brief The maximum time to wait for a process to exit when it's expected to, the monitor is assumed to be stuck beyond this.
+ */
+constexpr std::chrono::seconds ExitTimeout{10};
+
+static void Expect(bool condition, std::string_view description) {
+    if (!condition)
+        throw Exception{"Process benchmark check failed: {}", description};
+}
+
+/**
+ * @return If the supplied pid has been reaped, so it isn't left behind as a zombie.
+ */
+static bool IsReaped(pid_t pid) {
+    return waitpid(pid, nullptr, WNOHANG) == -1 && errno == ECHILD;
+}
+
+/**
+ * @brief Checks that the process monitor reaps children that exited before being watched, escalates termination from SIGTERM to SIGKILL and leaves no zombies behind.
+ */
+static void CheckProcessMonitor(const BenchmarkOptions &options) {
+    if (!options.ShouldRun("process.monitor"))
+        return;
+
+    {
+        // The child is only watched once it's a zombie, this must still be noticed as the pidfd is readable immediately.
+        pid_t pid{fork()};
+        if (pid == -1)
+            throw Exception{"fork() failed: {}", strerror(errno)};
+        if (pid == 0)
+            _exit(7);
+        siginfo_t info{};
+        if (waitid(P_PID, static_cast<id_t>(pid), &info, WEXITED | WNOWAIT) == -1)
+            throw Exception{"waitid({}) failed: {}", pid, strerror(errno)};
+        auto exitCode{ProcessMonitor::Watch(pid)};
+        Expect(exitCode.wait_for(ExitTimeout) == std::future_status::ready, "a process that exited before being watched is noticed");
+        Expect(exitCode.get() == 7, "the exit code of a process that exited before being watched is kept");
+        Expect(IsReaped(pid), "a process that exited before being watched is reaped");
+    }
+
+    {
+        Process process{SpawnBenchmarkExecutable};
+        pid_t pid{process.pid};
+        Expect(process.WaitForExit() == 0, "a process exits with its exit code");
+        Expect(IsReaped(pid), "a process is reaped by the time WaitForExit returns");
+    }
+
+    {
+        // A process which exits on SIGTERM is never sent SIGKILL, regardless of the grace period.
+        Process process{"/bin/sleep", {"60"}};
+        bool timedOut{!process.WaitForExit(std::chrono::milliseconds{10})};
+        process.Terminate(ExitTimeout * 2);
+        auto exitCode{process.WaitForExit(ExitTimeout)};
+        if (!exitCode) {
+            kill(process.pid, SIGKILL);
+            process.WaitForExit();
+        }
+        Expect(timedOut, "waiting on a running process times out");
+        Expect(exitCode == 128 + SIGTERM, "a process that exits on SIGTERM isn't killed");
+    }
+
+    {
+        // The shell ignores SIGTERM and signals it's done so through the pipe, so it can only be stopped by SIGKILL.
+        std::array<int, 2> readyFds;
+        if (pipe2(readyFds.data(), O_CLOEXEC) == -1)
+            throw Exception{"pipe2() failed: {}", strerror(errno)};
+        UniqueFd readyRead{readyFds[0], "benchmark"}, readyWrite{readyFds[1], "benchmark"};
+        std::array<InheritedFd, 1> inheritedFds{InheritedFd{readyWrite.Get(), 3}};
+        Process process{"/bin/sh", {"-c", "trap '' TERM; echo >&3; exec 3>&-; while :; do sleep 0.01; done"}, {}, std::nullopt, {}, inheritedFds};
+        readyWrite.Reset();
+        char ready;
+        if (read(readyRead.Get(), &ready, sizeof(ready)) != 1) {
+            kill(process.pid, SIGKILL);
+            process.WaitForExit();
+            throw Exception{"The shell exited before ignoring SIGTERM"};
+        }
+
+        constexpr std::chrono::milliseconds GracePeriod{100};
+        auto start{std::chrono::steady_clock::now()};
+        process.Terminate(GracePeriod);
+        auto exitCode{process.WaitForExit(ExitTimeout)};
+        auto elapsed{std::chrono::steady_clock::now() - start};
+        if (!exitCode) {
+            kill(process.pid, SIGKILL);
+            process.WaitForExit();
+        }
+        Expect(exitCode == 128 + SIGKILL, "a process that ignores SIGTERM is killed with SIGKILL");
+        Expect(elapsed >= GracePeriod, "SIGKILL is only sent once the grace period has expired");
+    }
+}
+
+void RunProcessBenchmarks(BenchmarkReport &report, const BenchmarkOptions &options) {
+    CheckProcessMonitor(options);
+
+    auto spawnDirect{[] { return Process{SpawnBenchmarkExecutable}; }};
+    auto spawnFork{[] { return ForkProcess(SpawnBenchmarkExecutable); }};
+    if (options.ShouldRun("process.direct"))
+        MeasureSpawns(report, options, "process.direct", spawnDirect);
+    if (options.ShouldRun("process.fork"))
+        MeasureSpawns(report, options, "process.fork", spawnFork);
+
+    // Forking has to copy the page tables of the parent, so it slows down with the size of the heap while spawning with vfork semantics doesn't.
+    if (options.ShouldRun("process.direct.large_heap") || options.ShouldRun("process.fork.large_heap")) {
+        auto heap{AllocateResidentHeap(options.quick ? 256 * 1024 * 1024 : 2048ULL * 1024 * 1024)};
+        if (options.ShouldRun("process.direct.large_heap"))
+            MeasureSpawns(report, options, "process.direct.large_heap", spawnDirect);
+        if (options.ShouldRun("process.fork.large_heap"))
+            MeasureSpawns(report, options, "process.fork.large_heap", spawnFork);
+    }
+
+    // This compares the launch options of wineserver with inheriting ours, the difference is what the options buy wineserver under load.
+    std::array<std::pair<const char *, LaunchOptions>, 2> policies{
+        std::pair{"inherit", LaunchOptions{}},
+        std::pair{"wineserver", GetWineserverLaunchOptions()},
+    };
+    for (const auto &[policy, launchOptions]: policies) {
+        auto name{fmt::format("process.server_latency.{}", policy)};
+        if (!options.ShouldRun(name))
+            continue;
+        auto latencies{MeasureServerLatency(options, launchOptions)};
+        report.Add(name + ".p50", GetPercentile(latencies, 0.5), "us", false);
+        report.Add(name + ".p99", GetPercentile(latencies, 0.99), "us", false);
+    }
+
+    if (options.ShouldRun("process.launcher")) {
+        auto launcherPath{Launcher::GetBundledPath()};
+        if (!std::filesystem::exists(launcherPath)) {
+            fmt::println(stderr, "Skipping launcher benchmarks as '{}' doesn't exist", launcherPath.string());
+            return;
+        }
+
+        Launcher launcher{launcherPath, {}, {}};
+        MeasureSpawns(report, options, "process.launcher", [&] {
+            return Process{launcher, SpawnBenchmarkExecutable};
+        });
+    }
+}
+}
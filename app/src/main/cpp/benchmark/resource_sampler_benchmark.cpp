@@ -0,0 +1,111 @@
+// Copyright © 2023 Cassia Developers, all rights reserved.
+
+#include "benchmark.h"
+#include "cassia/process.h"
+#include "cassia/resource_sampler.h"
+#include "cassia/util/error.h"
+#include <chrono>
+#include <latch>
+#include <thread>
+#include <unistd.h>
+
+namespace cassia {
+/**
+ * @brief The amount of idle threads added to the benchmark process, along with its own threads this makes it look like a Wine process of a game.
+ */
+constexpr size_t SampledThreadCount{56};
+
+/**
+ * @brief The amount of child processes in the sampled tree, like the helper processes Wine spawns next to a game.
+ */
+constexpr size_t SampledChildCount{4};
+
+/**
+ * @brief The interval of the sampler, this is shorter than the one used by the app so the benchmark doesn't take long.
+ */
+constexpr std::chrono::milliseconds SamplerInterval{5};
+
+/**
+ * @brief The maximum time to wait for the sampler to complete all cycles, the sampler is assumed to be stuck beyond this.
+ */
+constexpr std::chrono::seconds CycleTimeout{30};
+
+static void Expect(bool condition, std::string_view description) {
+    if (!condition)
+        throw Exception{"Resource sampler benchmark check failed: {}", description};
+}
+
+/**
+ * @brief Measures the time of sampling cycles over a process tree with more than 50 threads, the benchmark process with idle threads and a few child processes.
+ * @return The cycle times in microseconds, excluding the first cycle which opens every file.
+ */
+static std::vector<double> MeasureCycles(const BenchmarkOptions &options) {
+    size_t cycleCount{options.quick ? 20U : 200U};
+    ResourceSampler sampler{SamplerInterval, 4096};
+    sampler.AddRoot(getpid());
+
+    std::vector<double> cycleTimes;
+    int64_t lastTimestamp{-1};
+    uint32_t maxThreads{};
+    size_t maxProcesses{};
+    auto start{std::chrono::steady_clock::now()};
+    while (cycleTimes.size() < cycleCount + 1) {
+        if (std::chrono::steady_clock::now() - start > CycleTimeout)
+            throw Exception{"The sampler didn't complete {} cycles within {}s", cycleCount, CycleTimeout.count()};
+        std::this_thread::sleep_for(SamplerInterval / 5);
+
+        auto samples{sampler.Drain()};
+        if (samples.empty() || samples.back().timestampNs == lastTimestamp)
+            continue;
+        lastTimestamp = samples.back().timestampNs;
+        uint32_t threads{};
+        size_t processes{};
+        for (const auto &sample: samples) {
+            if (sample.timestampNs == lastTimestamp) {
+                threads += sample.threads;
+                processes++;
+            }
+        }
+        maxThreads = std::max(maxThreads, threads);
+        maxProcesses = std::max(maxProcesses, processes);
+        cycleTimes.push_back(std::chrono::duration<double, std::micro>{sampler.GetStats().lastCycleTime}.count());
+    }
+    Expect(maxThreads >= 50, "the sampled tree has at least 50 threads");
+    Expect(maxProcesses >= SampledChildCount + 1, "every process of the tree is sampled");
+    cycleTimes.erase(cycleTimes.begin());
+    return cycleTimes;
+}
+
+void RunResourceSamplerBenchmarks(BenchmarkReport &report, const BenchmarkOptions &options) {
+    if (!options.ShouldRun("resource_sampler.cycle"))
+        return;
+
+    std::latch stopping{1};
+    std::vector<std::thread> threads;
+    std::vector<Process> children;
+    std::vector<double> cycleTimes;
+    auto stop{[&] {
+        stopping.count_down();
+        for (auto &thread: threads)
+            thread.join();
+        for (auto &child: children) {
+            child.Terminate(std::chrono::seconds{1});
+            child.WaitForExit();
+        }
+    }};
+    try {
+        for (size_t index{}; index < SampledThreadCount; index++)
+            threads.emplace_back([&] { stopping.wait(); });
+        for (size_t index{}; index < SampledChildCount; index++)
+            children.emplace_back("/bin/sleep", std::vector<std::string>{"60"});
+        cycleTimes = MeasureCycles(options);
+    } catch (...) {
+        stop();
+        throw;
+    }
+    stop();
+
+    report.Add("resource_sampler.cycle.p50", GetPercentile(cycleTimes, 0.5), "us", false);
+    report.Add("resource_sampler.cycle.p99", GetPercentile(cycleTimes, 0.99), "us", false);
+}
+}
@@ -0,0 +1,186 @@
+// Copyright © 2023 Cassia Developers, all rights reserved.
+
+#include "benchmark.h"
+#include "cassia/shader_cache.h"
+#include "cassia/util/error.h"
+#include <array>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <limits>
+#include <random>
+#include <thread>
+#include <stdlib.h>
+
+namespace cassia {
+/**
+ * @brief The version that synthetic caches are written with, this is the version of recent DXVK releases.
+ */
+constexpr uint32_t SyntheticCacheVersion{17};
+
+/**
+ * @brief Writes a synthetic state cache with an entry for every id in [firstId, firstId + count), entries with the same id are identical across caches.
+ * @param truncate If the cache should end partway through an extra entry, like a cache that DXVK was killed while writing.
+ */
+static void WriteSyntheticCache(const std::filesystem::path &path, uint32_t version, uint64_t firstId, size_t count, bool truncate = false) {
+    std::ofstream file{path, std::ios::binary};
+    std::array<char, 12> header{'D', 'X', 'V', 'K'};
+    std::memcpy(header.data() + 4, &version, sizeof(version));
+    file.write(header.data(), header.size());
+
+    std::vector<char> entry;
+    for (uint64_t id{firstId}; id < firstId + count + (truncate ? 1 : 0); id++) {
+        // The size and contents are derived from the id, real entries are a few hundred bytes of pipeline state.
+        std::mt19937_64 random{id};
+        uint32_t dataSize{static_cast<uint32_t>(200 + random() % 800)};
+        entry.resize(4 + 20 + dataSize);
+        uint32_t entryHeader{(dataSize << 8) | 0x1F};
+        std::memcpy(entry.data(), &entryHeader, sizeof(entryHeader));
+        for (size_t offset{4}; offset < entry.size(); offset += 8) {
+            uint64_t value{random()};
+            std::memcpy(entry.data() + offset, &value, std::min<size_t>(8, entry.size() - offset));
+        }
+        file.write(entry.data(), static_cast<std::streamsize>(id < firstId + count ? entry.size() : entry.size() / 2));
+    }
+    if (!file)
+        throw Exception{"Failed to write '{}'", path.string()};
+}
+
+static void Expect(bool condition, std::string_view description) {
+    if (!condition)
+        throw Exception{"Shader cache benchmark check failed: {}", description};
+}
+
+/**
+ * @brief Measures merging overlapping caches with different amounts of threads, the results are checked against what was written so this doubles as a test of the merge.
+ */
+static void MeasureMerge(BenchmarkReport &report, const BenchmarkOptions &options, const std::filesystem::path &directory) {
+    if (!options.ShouldRun("shader_cache.merge.threads_1") && !options.ShouldRun("shader_cache.merge.threads_4"))
+        return;
+    size_t cacheCount{8}, entriesPerCache{options.quick ? 2000U : 20000U};
+    std::vector<std::filesystem::path> inputs;
+    for (size_t index{}; index < cacheCount; index++) {
+        // Every cache shares half of its entries with the next one, like sessions of the same game that visited some of the same areas.
+        inputs.push_back(directory / fmt::format("session{}.dxvk-cache", index));
+        WriteSyntheticCache(inputs.back(), SyntheticCacheVersion, index * entriesPerCache / 2, entriesPerCache);
+    }
+    inputs.push_back(directory / "truncated.dxvk-cache");
+    WriteSyntheticCache(inputs.back(), SyntheticCacheVersion, 1'000'000'000, entriesPerCache / 10, true);
+    inputs.push_back(directory / "old.dxvk-cache");
+    WriteSyntheticCache(inputs.back(), SyntheticCacheVersion - 1, 2'000'000'000, entriesPerCache / 10);
+
+    size_t uniqueEntries{(cacheCount - 1) * entriesPerCache / 2 + entriesPerCache + entriesPerCache / 10};
+    for (size_t threadCount: {1U, 4U}) {
+        auto name{fmt::format("shader_cache.merge.threads_{}", threadCount)};
+        if (!options.ShouldRun(name))
+            continue;
+
+        auto output{directory / "merged.dxvk-cache"};
+        std::vector<double> samples;
+        ShaderCacheMergeStats stats{};
+        for (size_t iteration{}; iteration < (options.quick ? 1U : 5U); iteration++) {
+            std::filesystem::remove(output);
+            stats = MergeDxvkCaches(inputs, output, threadCount);
+            samples.push_back(static_cast<double>(stats.inputBytes) / (1024 * 1024) / std::chrono::duration<double>{stats.duration}.count());
+        }
+        Expect(stats.version == SyntheticCacheVersion, "the output has the newest version");
+        Expect(stats.entries == uniqueEntries, "every unique entry is kept");
+        Expect(stats.duplicateEntries == cacheCount * entriesPerCache + entriesPerCache / 10 - uniqueEntries, "every duplicate entry is dropped");
+        Expect(stats.droppedFiles == 1 && stats.truncatedFiles == 1, "the old cache is dropped and the truncated cache is detected");
+        Expect(std::filesystem::file_size(output) == stats.outputBytes, "the output has the reported size");
+
+        // Merging the output into itself must not change it, which is what happens when a session adds nothing new.
+        auto remerged{MergeDxvkCaches(std::span{&output, 1}, output, threadCount)};
+        Expect(remerged.entries == uniqueEntries && remerged.duplicateEntries == 0 && remerged.outputBytes == stats.outputBytes, "merging a merged cache is idempotent");
+        report.Add(name + ".throughput", GetPercentile(samples, 0.5), "MB/s", true);
+    }
+}
+
+/**
+ * @brief Measures beginning and ending sessions of two applications under a quota that only fits one of them, which checks that sessions are merged back and the least recently used application is evicted.
+ */
+static void MeasureSessions(BenchmarkReport &report, const BenchmarkOptions &options, const std::filesystem::path &directory) {
+    if (!options.ShouldRun("shader_cache.session"))
+        return;
+    size_t entries{options.quick ? 2000U : 20000U};
+    auto gamePath{directory / "games/Game.exe"}, otherPath{directory / "games/Other.exe"};
+    std::filesystem::create_directories(gamePath.parent_path());
+    // This is a legacy cache next to the executable, which is imported by the first session.
+    WriteSyntheticCache(directory / "games/Game.dxvk-cache", SyntheticCacheVersion, 0, entries);
+
+    auto cacheSize{std::filesystem::file_size(directory / "games/Game.dxvk-cache")};
+    ShaderCacheManager manager{directory / "caches", cacheSize * 2};
+    auto toMs{[](std::chrono::steady_clock::duration duration) { return std::chrono::duration<double, std::milli>{duration}.count(); }};
+
+    auto start{std::chrono::steady_clock::now()};
+    auto session{manager.BeginSession("runtime", gamePath.string())};
+    auto beginDuration{std::chrono::steady_clock::now() - start};
+    Expect(std::filesystem::file_size(session.path / "Game.dxvk-cache") == cacheSize, "the session is pre-warmed with the legacy cache");
+
+    // The game adds new entries to its copy of the cache, like DXVK does while it runs.
+    WriteSyntheticCache(session.path / "Game.dxvk-cache", SyntheticCacheVersion, entries / 2, entries);
+    auto stats{manager.EndSession(std::move(session))};
+    Expect(stats.caches == 1 && stats.entries == entries + entries / 2, "the session is merged into the caches of the application");
+    Expect(stats.evictedBytes == 0, "nothing is evicted within the quota");
+
+    std::this_thread::sleep_for(std::chrono::milliseconds{10}); // The other application has to be used later for eviction to be deterministic.
+    auto otherSession{manager.BeginSession("runtime", otherPath.string())};
+    WriteSyntheticCache(otherSession.path / "Other.dxvk-cache", SyntheticCacheVersion, 0, entries);
+    auto otherStats{manager.EndSession(std::move(otherSession))};
+    Expect(otherStats.evictedBytes > 0 && !std::filesystem::exists(directory / "caches/runtime/game/Game.dxvk-cache"), "the least recently used application is evicted");
+    Expect(std::filesystem::exists(directory / "caches/runtime/other/Other.dxvk-cache"), "the most recently used application is kept");
+
+    report.Add("shader_cache.session.begin", toMs(beginDuration), "ms", false);
+    report.Add("shader_cache.session.end", toMs(stats.duration), "ms", false);
+}
+
+/**
+ * @brief Measures beginning and ending a runtime-wide session, which checks that it's pre-warmed with the caches of every application and that its caches are merged back into the application they're named after.
+ */
+static void MeasureRuntimeSession(BenchmarkReport &report, const BenchmarkOptions &options, const std::filesystem::path &directory) {
+    if (!options.ShouldRun("shader_cache.runtime_session"))
+        return;
+    size_t entries{options.quick ? 2000U : 20000U};
+    ShaderCacheManager manager{directory / "runtime_caches", std::numeric_limits<uint64_t>::max()};
+    auto gameSession{manager.BeginSession("runtime", "C:\\Games\\Game.exe")};
+    WriteSyntheticCache(gameSession.path / "Game.dxvk-cache", SyntheticCacheVersion, 0, entries);
+    manager.EndSession(std::move(gameSession));
+    auto toMs{[](std::chrono::steady_clock::duration duration) { return std::chrono::duration<double, std::milli>{duration}.count(); }};
+
+    auto start{std::chrono::steady_clock::now()};
+    auto session{manager.BeginRuntimeSession("runtime")};
+    auto beginDuration{std::chrono::steady_clock::now() - start};
+    Expect(std::filesystem::exists(session.path / "Game.dxvk-cache"), "the runtime session is pre-warmed with the caches of every application");
+
+    // Both a known and a new application write to the runtime session, like games started from the desktop do.
+    WriteSyntheticCache(session.path / "Game.dxvk-cache", SyntheticCacheVersion, entries / 2, entries);
+    WriteSyntheticCache(session.path / "Other.dxvk-cache", SyntheticCacheVersion, 0, entries);
+    auto mergeStats{manager.MergeSession(session)};
+    Expect(mergeStats.caches == 2 && mergeStats.entries == entries * 2 + entries / 2, "the runtime session is merged into the application each cache is named after");
+    Expect(std::filesystem::exists(session.path / "Other.dxvk-cache"), "merging keeps the runtime session in use");
+
+    auto stats{manager.EndSession(std::move(session))};
+    Expect(stats.entries == mergeStats.entries && std::filesystem::exists(directory / "runtime_caches/runtime/other/Other.dxvk-cache"), "merging again doesn't add any entries");
+    Expect(std::filesystem::is_empty(directory / "runtime_caches/runtime" / SharedApplicationName / "sessions"), "the runtime session is removed once it ends");
+
+    report.Add("shader_cache.runtime_session.begin", toMs(beginDuration), "ms", false);
+    report.Add("shader_cache.runtime_session.merge", toMs(mergeStats.duration), "ms", false);
+}
+
+void RunShaderCacheBenchmarks(BenchmarkReport &report, const BenchmarkOptions &options) {
+    std::string pattern{(std::filesystem::temp_directory_path() / "cassia-shader-cache-XXXXXX").string()};
+    if (!mkdtemp(pattern.data()))
+        throw Exception{"mkdtemp failed: {}", strerror(errno)};
+    std::filesystem::path directory{pattern};
+    try {
+        MeasureMerge(report, options, directory);
+        MeasureSessions(report, options, directory);
+        MeasureRuntimeSession(report, options, directory);
+    } catch (...) {
+        std::filesystem::remove_all(directory);
+        throw;
+    }
+    std::filesystem::remove_all(directory);
+}
+}
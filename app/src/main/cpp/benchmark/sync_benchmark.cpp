@@ -0,0 +1,232 @@
+// Copyright © 2023 Cassia Developers, all rights reserved.
+
+#include "benchmark.h"
+#include "cassia/wine_sync.h"
+#include "cassia/util/error.h"
+#include "cassia/util/fd.h"
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <linux/futex.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+namespace cassia {
+/**
+ * @brief The argument of futex_waitv, older kernel headers don't define it.
+ */
+struct FutexWaitv {
+    uint64_t value;
+    uint64_t address;
+    uint32_t flags;
+    uint32_t reserved;
+};
+
+constexpr long FutexWaitvSyscall{449};
+constexpr uint32_t FutexWaitvSize32{2}; //!< FUTEX2_SIZE_U32
+
+/**
+ * @brief A pair of auto-reset events implemented the way Wine does in one of the sync modes, one thread sets the first and waits on the second while the other does the opposite.
+ */
+class SyncPingPong {
+  public:
+    virtual ~SyncPingPong() = default;
+
+    virtual void Signal(size_t event) = 0;
+
+    virtual void Wait(size_t event) = 0;
+};
+
+/**
+ * @brief Every signal and wait is a request to a server thread over a socket, like wineserver requests are.
+ */
+class ServerPingPong : public SyncPingPong {
+  private:
+    std::array<UniqueFd, 2> clientFds{-1, -1}; //!< The socket of each side, a request is a single byte naming the event.
+    std::array<UniqueFd, 2> serverFds{-1, -1};
+    std::thread serverThread;
+
+    void Serve() {
+        std::array<bool, 2> signalled{};
+        std::array<bool, 2> waiting{}; //!< If a side is blocked on a wait request, which is replied to once the event is signalled.
+        std::array<pollfd, 2> pollFds{pollfd{.fd = serverFds[0].Get(), .events = POLLIN}, pollfd{.fd = serverFds[1].Get(), .events = POLLIN}};
+        while (poll(pollFds.data(), pollFds.size(), -1) > 0) {
+            for (size_t side{}; side < 2; side++) {
+                if (!pollFds[side].revents)
+                    continue;
+                uint8_t request{};
+                if (read(serverFds[side].Get(), &request, 1) != 1)
+                    return;
+                bool wait{(request & 0x80) != 0};
+                size_t event{request & 1U};
+                if (wait)
+                    waiting[side] = true;
+                else
+                    signalled[event] = true;
+                if (!wait && write(serverFds[side].Get(), &request, 1) != 1) // Signalling is a round trip as well.
+                    return;
+            }
+            // Side N waits on event N, so it's woken up once that event has been signalled.
+            for (size_t side{}; side < 2; side++) {
+                if (waiting[side] && signalled[side]) {
+                    waiting[side] = signalled[side] = false;
+                    uint8_t reply{0x80};
+                    if (write(serverFds[side].Get(), &reply, 1) != 1)
+                        return;
+                }
+            }
+        }
+    }
+
+    void Request(size_t side, uint8_t request) {
+        uint8_t reply{};
+        if (write(clientFds[side].Get(), &request, 1) != 1 || read(clientFds[side].Get(), &reply, 1) != 1)
+            throw Exception{"Lost the connection to the server thread: {}", strerror(errno)};
+    }
+
+  public:
+    ServerPingPong() {
+        for (size_t side{}; side < 2; side++) {
+            std::array<int, 2> fds;
+            if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds.data()) == -1)
+                throw Exception{"socketpair() failed: {}", strerror(errno)};
+            clientFds[side] = UniqueFd{fds[0], "benchmark"};
+            serverFds[side] = UniqueFd{fds[1], "benchmark"};
+        }
+        serverThread = std::thread{&ServerPingPong::Serve, this};
+    }
+
+    ~ServerPingPong() override {
+        for (auto &fd: clientFds)
+            fd.Reset(); // The server thread exits once the connections are closed.
+        serverThread.join();
+    }
+
+    void Signal(size_t event) override {
+        // The side that signals an event is the one that doesn't wait on it.
+        Request(event ^ 1, static_cast<uint8_t>(event));
+    }
+
+    void Wait(size_t event) override {
+        Request(event, static_cast<uint8_t>(0x80 | event));
+    }
+};
+
+/**
+ * @brief Every event is a semaphore eventfd that's waited on with poll, like esync does.
+ */
+class EsyncPingPong : public SyncPingPong {
+  private:
+    std::array<UniqueFd, 2> eventFds{-1, -1};
+
+  public:
+    EsyncPingPong() {
+        for (auto &fd: eventFds) {
+            fd = UniqueFd{eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK | EFD_SEMAPHORE), "benchmark"};
+            if (!fd.Valid())
+                throw Exception{"eventfd() failed: {}", strerror(errno)};
+        }
+    }
+
+    void Signal(size_t event) override {
+        uint64_t value{1};
+        if (write(eventFds[event].Get(), &value, sizeof(value)) != sizeof(value))
+            throw Exception{"Failed to signal an eventfd: {}", strerror(errno)};
+    }
+
+    void Wait(size_t event) override {
+        pollfd pollFd{.fd = eventFds[event].Get(), .events = POLLIN};
+        uint64_t value{};
+        // Like esync, the wait is retried if another waiter consumed the event between poll and read.
+        while (read(eventFds[event].Get(), &value, sizeof(value)) != sizeof(value)) {
+            if (errno != EAGAIN)
+                throw Exception{"Failed to wait on an eventfd: {}", strerror(errno)};
+            poll(&pollFd, 1, -1);
+        }
+    }
+};
+
+/**
+ * @brief Every event is a futex that's waited on with futex_waitv like fsync does, or FUTEX_WAIT if that isn't supported.
+ */
+class FsyncPingPong : public SyncPingPong {
+  private:
+    std::array<std::atomic<uint32_t>, 2> futexes{};
+    bool futexWaitv;
+
+  public:
+    explicit FsyncPingPong(bool futexWaitv) : futexWaitv{futexWaitv} {}
+
+    void Signal(size_t event) override {
+        futexes[event].store(1, std::memory_order_release);
+        syscall(SYS_futex, &futexes[event], FUTEX_WAKE, 1, nullptr, nullptr, 0);
+    }
+
+    void Wait(size_t event) override {
+        uint32_t expected{1};
+        while (!futexes[event].compare_exchange_weak(expected, 0, std::memory_order_acquire)) {
+            if (futexWaitv) {
+                FutexWaitv waiter{.value = 0, .address = reinterpret_cast<uint64_t>(&futexes[event]), .flags = FutexWaitvSize32};
+                syscall(FutexWaitvSyscall, &waiter, 1, 0, nullptr, 0);
+            } else {
+                syscall(SYS_futex, &futexes[event], FUTEX_WAIT, 0, nullptr, nullptr, 0);
+            }
+            expected = 1;
+        }
+    }
+};
+
+/**
+ * @brief Measures the round trip of setting an event that another thread waits on and waiting for it to set an event in response, which is how Win32 threads hand work to each other.
+ * @return The round trip times in microseconds.
+ */
+static std::vector<double> MeasureRoundTrips(const BenchmarkOptions &options, SyncPingPong &pingPong) {
+    size_t iterations{options.quick ? 200U : 20000U}, warmupIterations{iterations / 10};
+    std::thread peer{[&] {
+        for (size_t i{}; i < warmupIterations + iterations; i++) {
+            pingPong.Wait(0);
+            pingPong.Signal(1);
+        }
+    }};
+
+    std::vector<double> latencies;
+    latencies.reserve(iterations);
+    for (size_t i{}; i < warmupIterations + iterations; i++) {
+        auto start{std::chrono::steady_clock::now()};
+        pingPong.Signal(0);
+        pingPong.Wait(1);
+        if (i >= warmupIterations)
+            latencies.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count());
+    }
+    peer.join();
+    return latencies;
+}
+
+void RunSyncBenchmarks(BenchmarkReport &report, const BenchmarkOptions &options) {
+    const auto &support{GetWineSyncSupport()};
+    for (auto mode: {WineSyncMode::Server, WineSyncMode::Esync, WineSyncMode::Fsync}) {
+        auto name{fmt::format("wine_sync.{}.round_trip", GetWineSyncModeName(mode))};
+        if (!options.ShouldRun(name))
+            continue;
+
+        std::unique_ptr<SyncPingPong> pingPong;
+        if (mode == WineSyncMode::Server)
+            pingPong = std::make_unique<ServerPingPong>();
+        else if (mode == WineSyncMode::Esync)
+            pingPong = std::make_unique<EsyncPingPong>();
+        else
+            pingPong = std::make_unique<FsyncPingPong>(support.futexWaitv);
+        if (mode == WineSyncMode::Fsync && !support.futexWaitv)
+            fmt::println(stderr, "futex_waitv isn't supported, measuring fsync with FUTEX_WAIT instead");
+
+        auto latencies{MeasureRoundTrips(options, *pingPong)};
+        report.Add(name + ".p50", GetPercentile(latencies, 0.5), "us", false);
+        report.Add(name + ".p99", GetPercentile(latencies, 0.99), "us", false);
+    }
+}
+}
@@ -0,0 +1,265 @@
+// Copyright © 2023 Cassia Developers, all rights reserved.
+
+#include "benchmark.h"
+#include "cassia/tar_extractor.h"
+#include "cassia/util/error.h"
+#include "cassia/util/fd.h"
+#include <array>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <zlib.h>
+#include <zstd.h>
+
+namespace cassia {
+constexpr size_t TarBlockSize{512};
+
+static void Expect(bool condition, std::string_view description) {
+    if (!condition)
+        throw Exception{"Tar benchmark check failed: {}", description};
+}
+
+/**
+ * @brief Appends a ustar entry to an archive, the contents are padded to the block size.
+ */
+static void AppendEntry(std::string &archive, std::string_view name, char type, std::string_view contents = {}, std::string_view linkName = {}) {
+    std::array<char, TarBlockSize> header{};
+    auto setField{[&](size_t offset, size_t size, std::string_view value) {
+        if (value.size() > size)
+            throw Exception{"'{}' doesn't fit into a header field of {} bytes", value, size};
+        std::memcpy(header.data() + offset, value.data(), value.size());
+    }};
+    setField(0, 100, name);
+    setField(100, 8, fmt::format("{:07o}", type == '5' ? 0755 : 0644));
+    setField(108, 8, "0000000");
+    setField(116, 8, "0000000");
+    setField(124, 12, fmt::format("{:011o}", contents.size()));
+    setField(136, 12, fmt::format("{:011o}", 0));
+    header[156] = type;
+    setField(157, 100, linkName);
+    setField(257, 8, std::string_view{"ustar\0" "00", 8});
+
+    // The checksum is calculated with the checksum field itself filled with spaces.
+    std::memset(header.data() + 148, ' ', 8);
+    unsigned checksum{};
+    for (char c: header)
+        checksum += static_cast<uint8_t>(c);
+    setField(148, 8, fmt::format("{:06o}", checksum) + std::string{"\0 ", 2});
+
+    archive.append(header.data(), header.size());
+    archive.append(contents);
+    archive.append((TarBlockSize - contents.size() % TarBlockSize) % TarBlockSize, '\0');
+}
+
+/**
+ * @brief Terminates an archive with the two zeroed blocks that mark its end.
+ */
+static void FinishArchive(std::string &archive) {
+    archive.append(TarBlockSize * 2, '\0');
+}
+
+static std::string ReadContents(const std::filesystem::path &path) {
+    std::ifstream file{path, std::ios::binary};
+    std::stringstream contents;
+    contents << file.rdbuf();
+    return contents.str();
+}
+
+static void WriteArchive(std::string_view archive, const std::filesystem::path &archivePath) {
+    std::ofstream file{archivePath, std::ios::binary | std::ios::trunc};
+    file.write(archive.data(), static_cast<std::streamsize>(archive.size()));
+    if (!file)
+        throw Exception{"Failed to write '{}'", archivePath.string()};
+}
+
+/**
+ * @brief Extracts an archive from a file, like an archive in the APK or the downloads directory.
+ */
+static TarExtractStats ExtractArchive(const std::filesystem::path &archivePath, const std::filesystem::path &destination) {
+    UniqueFd fd{open(archivePath.c_str(), O_RDONLY | O_CLOEXEC), "benchmark"};
+    if (!fd.Valid())
+        throw Exception{"Failed to open '{}': {}", archivePath.string(), strerror(errno)};
+    return ExtractTar(fd.Get(), 0, std::filesystem::file_size(archivePath), destination);
+}
+
+/**
+ * @brief Compresses an archive with gzip, like a tarball made with "tar -z".
+ */
+static std::string CompressGzip(std::string_view archive) {
+    z_stream stream{};
+    // A window size of 15 with 16 added writes the gzip format, rather than zlib's own.
+    if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        throw Exception{"deflateInit2() failed"};
+    std::string compressed(deflateBound(&stream, static_cast<uLong>(archive.size())), '\0');
+    stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(archive.data()));
+    stream.avail_in = static_cast<uInt>(archive.size());
+    stream.next_out = reinterpret_cast<Bytef *>(compressed.data());
+    stream.avail_out = static_cast<uInt>(compressed.size());
+    int result{deflate(&stream, Z_FINISH)};
+    compressed.resize(stream.total_out);
+    deflateEnd(&stream);
+    if (result != Z_STREAM_END)
+        throw Exception{"Failed to compress the archive: {}", zError(result)};
+    return compressed;
+}
+
+static std::string CompressZstd(std::string_view archive) {
+    std::string compressed(ZSTD_compressBound(archive.size()), '\0');
+    size_t result{ZSTD_compress(compressed.data(), compressed.size(), archive.data(), archive.size(), ZSTD_CLEVEL_DEFAULT)};
+    if (ZSTD_isError(result))
+        throw Exception{"Failed to compress the archive: {}", ZSTD_getErrorName(result)};
+    compressed.resize(result);
+    return compressed;
+}
+
+/**
+ * @brief Generates an archive that resembles a runtime, mostly small files with a few large ones spread over a hundred directories.
+ * @details The contents are drawn from a small alphabet, so they compress at a ratio similar to binaries.
+ */
+static std::string GenerateArchive(size_t fileCount, uint64_t &fileBytes) {
+    std::mt19937 random{static_cast<uint32_t>(fileCount)};
+    std::uniform_int_distribution<int> mixDistribution{0, 99};
+    std::uniform_int_distribution<int> byteDistribution{0, 63};
+    std::string archive, contents;
+    fileBytes = 0;
+    for (size_t directory{}; directory < 100; directory++)
+        AppendEntry(archive, fmt::format("directory{:02}/", directory), '5');
+    for (size_t index{}; index < fileCount; index++) {
+        int mix{mixDistribution(random)};
+        size_t size{mix < 80 ? std::uniform_int_distribution<size_t>{1024, 16 * 1024}(random) : mix < 98 ? std::uniform_int_distribution<size_t>{16 * 1024, 128 * 1024}(random) : std::uniform_int_distribution<size_t>{256 * 1024, 1024 * 1024}(random)};
+        contents.resize(size);
+        for (auto &c: contents)
+            c = static_cast<char>(byteDistribution(random));
+        AppendEntry(archive, fmt::format("directory{:02}/file{:05}.dll", index % 100, index), '0', contents);
+        fileBytes += size;
+    }
+    FinishArchive(archive);
+    return archive;
+}
+
+/**
+ * @brief Measures extracting a generated archive uncompressed and compressed with gzip and zstd, in terms of the extracted data and files.
+ */
+static void MeasureExtraction(BenchmarkReport &report, const BenchmarkOptions &options, const std::filesystem::path &directory) {
+    std::array<std::pair<const char *, std::string (*)(std::string_view)>, 3> formats{{
+        {"plain", nullptr},
+        {"gzip", &CompressGzip},
+        {"zstd", &CompressZstd},
+    }};
+    size_t fileCount{options.quick ? 300U : 3000U};
+    uint64_t fileBytes{};
+    std::string archive;
+    auto archivePath{directory / "archive"}, destination{directory / "extracted"};
+    for (const auto &[format, compress]: formats) {
+        auto name{fmt::format("tar.extract.{}", format)};
+        if (!options.ShouldRun(name))
+            continue;
+        if (archive.empty())
+            archive = GenerateArchive(fileCount, fileBytes);
+        WriteArchive(compress ? compress(archive) : archive, archivePath);
+
+        double nanoseconds{MeasureNanosecondsPerOperation(options, [&](size_t iterations) {
+            for (size_t i{}; i < iterations; i++) {
+                auto stats{ExtractArchive(archivePath, destination)};
+                Expect(stats.files == fileCount && stats.fileBytes == fileBytes, "every file of the generated archive is extracted");
+            }
+        })};
+        double seconds{nanoseconds / 1'000'000'000};
+        report.Add(name + ".megabytes_per_second", static_cast<double>(fileBytes) / seconds / (1024 * 1024), "MiB/s", true);
+        report.Add(name + ".files_per_second", static_cast<double>(fileCount) / seconds, "files/s", true);
+    }
+}
+
+/**
+ * @brief Checks that archives can't write outside of the destination through symlinks of their own, while symlinks that are only stored are still extracted.
+ */
+static void CheckAdversarialArchives(const BenchmarkOptions &options, const std::filesystem::path &directory) {
+    if (!options.ShouldRun("tar.adversarial"))
+        return;
+    auto outside{directory / "outside"}, destination{directory / "destination"}, archivePath{directory / "archive.tar"};
+    std::filesystem::create_directory(outside);
+    std::ofstream{outside / "secret"} << "secret";
+
+    struct AdversarialArchive {
+        std::string_view description;
+        std::string archive;
+        std::filesystem::path victim; //!< A path outside of the destination which must not be created by the archive.
+    };
+    std::array<AdversarialArchive, 6> archives{{
+        {"a file is written through an absolute symlink", {}, outside / "file"},
+        {"a file is written through a relative symlink", {}, outside / "file"},
+        {"a directory is created through a symlink", {}, outside / "directory"},
+        {"a hardlink is created to a file through a symlink", {}, {}},
+        {"a file is written below another file", {}, {}},
+        {"a pax header has a malformed size", {}, {}},
+    }};
+    AppendEntry(archives[0].archive, "d", '2', {}, outside.string());
+    AppendEntry(archives[0].archive, "d/file", '0', "escaped");
+    AppendEntry(archives[1].archive, "d", '2', {}, "../outside"); // The staging directory is next to the destination, so this resolves to the same directory.
+    AppendEntry(archives[1].archive, "d/file", '0', "escaped");
+    AppendEntry(archives[2].archive, "d", '2', {}, outside.string());
+    AppendEntry(archives[2].archive, "d/directory/", '5');
+    AppendEntry(archives[3].archive, "d", '2', {}, outside.string());
+    AppendEntry(archives[3].archive, "link", '1', {}, "d/secret");
+    AppendEntry(archives[4].archive, "f", '0', "file");
+    AppendEntry(archives[4].archive, "f/file", '0', "file");
+    AppendEntry(archives[5].archive, "pax", 'x', "14 size=12abc\n");
+    AppendEntry(archives[5].archive, "file", '0', "file");
+
+    for (auto &[description, archive, victim]: archives) {
+        FinishArchive(archive);
+        bool rejected{};
+        try {
+            WriteArchive(archive, archivePath);
+            ExtractArchive(archivePath, destination);
+        } catch (const std::exception &) {
+            rejected = true;
+        }
+        Expect(rejected, fmt::format("an archive where {} is rejected", description));
+        Expect(!std::filesystem::exists(destination), fmt::format("an archive where {} doesn't create the destination", description));
+        Expect(victim.empty() || !std::filesystem::exists(victim), fmt::format("an archive where {} doesn't write outside of the destination", description));
+    }
+    Expect(std::filesystem::hard_link_count(outside / "secret") == 1, "no hardlinks are created to files outside of the destination");
+
+    // Symlinks are still extracted verbatim as long as nothing is written through them, and later entries replace rather than follow them.
+    std::string archive;
+    AppendEntry(archive, "target/", '5');
+    AppendEntry(archive, "target/file", '0', "contents");
+    AppendEntry(archive, "link", '2', {}, "target");
+    AppendEntry(archive, "absolute", '2', {}, outside.string());
+    AppendEntry(archive, "hardlink", '1', {}, "target/file");
+    AppendEntry(archive, "replaced", '2', {}, (outside / "replaced").string());
+    AppendEntry(archive, "replaced", '0', "replaced");
+    FinishArchive(archive);
+    WriteArchive(archive, archivePath);
+    auto stats{ExtractArchive(archivePath, destination)};
+    Expect(stats.files == 2 && stats.directories == 1 && stats.symlinks == 3 && stats.hardlinks == 1, "every entry of a benign archive is counted");
+    Expect(ReadContents(destination / "link" / "file") == "contents", "a symlink within the destination is extracted");
+    Expect(std::filesystem::read_symlink(destination / "absolute") == outside, "a symlink outside of the destination is stored verbatim");
+    Expect(std::filesystem::hard_link_count(destination / "target" / "file") == 2, "a hardlink within the destination is extracted");
+    Expect(!std::filesystem::is_symlink(destination / "replaced") && ReadContents(destination / "replaced") == "replaced", "a file replaces an earlier symlink at its path");
+    Expect(!std::filesystem::exists(outside / "replaced"), "a file doesn't follow an earlier symlink at its path");
+}
+
+void RunTarBenchmarks(BenchmarkReport &report, const BenchmarkOptions &options) {
+    if (!options.ShouldRun("tar.adversarial") && !options.ShouldRun("tar.extract.plain") && !options.ShouldRun("tar.extract.gzip") && !options.ShouldRun("tar.extract.zstd"))
+        return;
+    std::string pattern{(std::filesystem::temp_directory_path() / "cassia-tar-XXXXXX").string()};
+    if (!mkdtemp(pattern.data()))
+        throw Exception{"mkdtemp failed: {}", strerror(errno)};
+    std::filesystem::path directory{pattern};
+    try {
+        CheckAdversarialArchives(options, directory);
+        MeasureExtraction(report, options, directory);
+    } catch (...) {
+        std::filesystem::remove_all(directory);
+        throw;
+    }
+    std::filesystem::remove_all(directory);
+}
+}
@@ -0,0 +1,128 @@
+// Copyright © 2023 Cassia Developers, all rights reserved.
+
+#include "benchmark.h"
+#include "cassia/wine_debug.h"
+#include "cassia/util/error.h"
+#include <array>
+#include <chrono>
+#include <random>
+
+namespace cassia {
+static void Expect(bool condition, std::string_view description) {
+    if (!condition)
+        throw Exception{"Wine debug benchmark check failed: {}", description};
+}
+
+/**
+ * @brief A kind of line in the generated output, lines are generated with the supplied share of the output.
+ */
+struct WineDebugLineKind {
+    int percentage;
+    bool parsed; //!< If lines of this kind have a Wine debug prefix.
+    std::function<std::string(std::mt19937 &, size_t index)> generate;
+};
+
+/**
+ * @brief The mix of lines in the output of a game, mostly the same few fixmes repeated every frame along with other debug messages and output without a prefix.
+ * @note Some lines have fields that look like a thread prefix followed by something that looks like a class, these must not be parsed.
+ */
+static const std::array<WineDebugLineKind, 7> WineDebugLineKinds{{
+    {45, true, [](std::mt19937 &, size_t) -> std::string {
+        return "0134:fixme:d3d:wined3d_context_gl_apply_draw_state Unsupported blend op 0x3.";
+    }},
+    {20, true, [](std::mt19937 &random, size_t index) -> std::string {
+        constexpr std::array<std::string_view, 3> Classes{"fixme", "warn", "err"};
+        constexpr std::array<std::string_view, 4> Channels{"ntdll", "seh", "dsound", "wininet"};
+        return fmt::format("{:04x}:{}:{}:Function{} Message {} with some details", 0x100 + index % 8, Classes[random() % Classes.size()], Channels[random() % Channels.size()], random() % 64, index);
+    }},
+    {10, true, [](std::mt19937 &, size_t index) -> std::string {
+        return fmt::format("{}.{:03}:0024:{:04x}:trace:seh:dispatch_exception code=c0000005 flags=0 addr=00007FFF12345678", 1000 + index / 1000, index % 1000, 0x30 + index % 4);
+    }},
+    {15, false, [](std::mt19937 &, size_t index) -> std::string {
+        constexpr std::array<std::string_view, 4> Lines{"info:  Game: Game.exe", "DXVK: v2.3", "wine: Unhandled page fault on read access", "err:   DxvkMemoryAllocator: Memory allocation failed"};
+        return std::string{Lines[index % Lines.size()]};
+    }},
+    {4, false, [](std::mt19937 &, size_t index) -> std::string {
+        return fmt::format("00c8:0134:{:08x}:d3d:looks like a prefix", 0xdeadbeef + index); // A hex field in place of the class.
+    }},
+    {3, false, [](std::mt19937 &, size_t) -> std::string {
+        return "cafe:babe:face:fee:decade"; // Only hex fields, none of which is a class.
+    }},
+    {3, false, [](std::mt19937 &, size_t) -> std::string {
+        return "0134:fixed:d3d:function a class that only starts like one";
+    }},
+}};
+
+/**
+ * @return The generated lines and the amount of them that have a Wine debug prefix.
+ */
+static std::pair<std::vector<std::string>, size_t> GenerateWineDebugLines(size_t count) {
+    std::mt19937 random{static_cast<uint32_t>(count)};
+    std::discrete_distribution<size_t> kinds{WineDebugLineKinds.size(), 0, static_cast<double>(WineDebugLineKinds.size()), [](double index) {
+        return static_cast<double>(WineDebugLineKinds[static_cast<size_t>(index)].percentage);
+    }};
+    std::vector<std::string> lines;
+    size_t parsedCount{};
+    for (size_t index{}; index < count; index++) {
+        const auto &kind{WineDebugLineKinds[kinds(random)]};
+        lines.push_back(kind.generate(random, index));
+        parsedCount += kind.parsed;
+    }
+    return {std::move(lines), parsedCount};
+}
+
+void RunWineDebugBenchmarks(BenchmarkReport &report, const BenchmarkOptions &options) {
+    if (!options.ShouldRun("wine_debug.parse") && !options.ShouldRun("wine_debug.collapse"))
+        return;
+    auto [lines, parsedCount]{GenerateWineDebugLines(options.quick ? 10000U : 100000U)};
+    size_t bytes{};
+    for (const auto &line: lines)
+        bytes += line.size() + 1;
+    auto addThroughput{[&](const std::string &name, double nanoseconds) {
+        double seconds{nanoseconds / 1'000'000'000};
+        report.Add(name + ".megabytes_per_second", static_cast<double>(bytes) / seconds / (1024 * 1024), "MiB/s", true);
+        report.Add(name + ".lines_per_second", static_cast<double>(lines.size()) / seconds, "lines/s", true);
+    }};
+
+    if (options.ShouldRun("wine_debug.parse")) {
+        size_t parsed{};
+        for (const auto &line: lines)
+            parsed += ParseWineDebugLine(line).has_value();
+        Expect(parsed == parsedCount, "only lines with a Wine debug prefix are parsed");
+
+        addThroughput("wine_debug.parse", MeasureNanosecondsPerOperation(options, [&](size_t iterations) {
+            for (size_t i{}; i < iterations; i++)
+                for (const auto &line: lines)
+                    DoNotOptimize(ParseWineDebugLine(line));
+        }));
+    }
+
+    if (options.ShouldRun("wine_debug.collapse")) {
+        // This is the whole stage the Logger runs for every line of a Wine channel, the lines are spread over a few seconds so some windows expire.
+        WineDebugCounters counters;
+        size_t emitted{};
+        auto emit{[&](int, std::string_view text) {
+            DoNotOptimize(text.data());
+            emitted++;
+        }};
+        addThroughput("wine_debug.collapse", MeasureNanosecondsPerOperation(options, [&](size_t iterations) {
+            for (size_t i{}; i < iterations; i++) {
+                WineDebugCollapser collapser{std::chrono::seconds{1}};
+                std::chrono::steady_clock::time_point now{};
+                for (const auto &line: lines) {
+                    now += std::chrono::microseconds{50};
+                    if (auto parsed{ParseWineDebugLine(line)}) {
+                        counters.Increment(*parsed);
+                        collapser.Process(line, *parsed, now, emit);
+                    } else {
+                        collapser.Reset(emit);
+                        emit(0, line);
+                    }
+                }
+                collapser.Reset(emit);
+            }
+        }));
+        Expect(emitted != 0 && !counters.Snapshot().empty(), "the collapsed lines are emitted and counted");
+    }
+}
+}
@@ -0,0 +1,117 @@
+// Copyright © 2023 Cassia Developers, all rights reserved.
+
+#include "compositor.h"
+#include "util/percentile.h"
+#include "util/trace.h"
+#include <algorithm>
+#include <vector>
+
+namespace cassia {
+Compositor::Compositor(std::unique_ptr<FrameSource> source, PixelKernel kernel) : source{std::move(source)}, kernel{kernel}, presentThread{&Compositor::PresentThread, this} {}
+
+Compositor::~Compositor() {
+    stopping = true;
+    source->Interrupt();
+    presentThread.join();
+}
+
+void Compositor::SetWindow(std::unique_ptr<CompositorWindow> newWindow) {
+    {
+        std::scoped_lock lock{windowMutex};
+        window = std::move(newWindow);
+        windowWidth = windowHeight = 0;
+    }
+    {
+        std::scoped_lock lock{statsMutex};
+        lastPresent = {}; // The time without a window shouldn't count as a frame interval.
+    }
+    source->InvalidateAll();
+}
+
+int64_t Compositor::Present(const Frame &frame) {
+    TraceScope trace{"compositor.present"};
+    bool geometryChanged{frame.width != windowWidth || frame.height != windowHeight || frame.format != windowFormat};
+    if (geometryChanged) {
+        window->SetGeometry(frame.width, frame.height, frame.format);
+        windowWidth = frame.width;
+        windowHeight = frame.height;
+        windowFormat = frame.format;
+    }
+
+    PixelRect frameRect{0, 0, static_cast<int32_t>(frame.width), static_cast<int32_t>(frame.height)};
+    PixelRect bounds{geometryChanged ? frameRect : frame.damage.GetBounds().Intersect(frameRect)};
+    PixelRect dirty{bounds};
+    WindowBuffer buffer;
+    if (!window->Lock(buffer, dirty)) {
+        windowWidth = windowHeight = 0; // The geometry is set again on the next attempt, in case the window lost it.
+        return -1;
+    }
+
+    // The buffer may not have the size of the frame if the window couldn't be resized, anything outside of either is skipped.
+    PixelRect clip{frameRect.Intersect(PixelRect{0, 0, static_cast<int32_t>(buffer.width), static_cast<int32_t>(buffer.height)})};
+    int64_t pixels{};
+    auto convert{[&](PixelRect rect) {
+        rect = rect.Intersect(clip);
+        if (rect.Empty())
+            return;
+        ConvertPixels(frame.pixels + rect.y * frame.stride + static_cast<size_t>(rect.x) * 4, frame.stride, frame.format,
+                      buffer.bits + rect.y * buffer.stride + static_cast<size_t>(rect.x) * 4, buffer.stride, buffer.format,
+                      static_cast<uint32_t>(rect.width), static_cast<uint32_t>(rect.height), kernel);
+        pixels += rect.Area();
+    }};
+
+    if (geometryChanged || dirty != bounds) {
+        convert(dirty); // The window couldn't preserve the contents outside of the dirty region it returned, so all of it needs to be drawn.
+    } else {
+        for (const auto &rect: frame.damage.GetRects())
+            convert(rect);
+    }
+
+    window->UnlockAndPost();
+    return pixels;
+}
+
+void Compositor::PresentThread() {
+    while (!stopping) {
+        Frame frame;
+        if (!source->AcquireFrame(frame, AcquireTimeout))
+            continue;
+
+        int64_t pixels{-1};
+        auto start{std::chrono::steady_clock::now()};
+        {
+            std::scoped_lock lock{windowMutex};
+            if (window)
+                pixels = Present(frame);
+        }
+        auto end{std::chrono::steady_clock::now()};
+        source->ReleaseFrame();
+
+        std::scoped_lock lock{statsMutex};
+        if (pixels < 0) {
+            skippedFrames++;
+            continue;
+        }
+        presentedFrames++;
+        presentedPixels += static_cast<uint64_t>(pixels);
+        presentTimes[presentTimeCount++ % SampleCount] = end - start;
+        if (lastPresent != std::chrono::steady_clock::time_point{})
+            frameIntervals[frameIntervalCount++ % SampleCount] = end - lastPresent;
+        lastPresent = end;
+    }
+}
+
+CompositorStats Compositor::GetStats() {
+    std::scoped_lock lock{statsMutex};
+    return CompositorStats{
+        .presentedFrames = presentedFrames,
+        .skippedFrames = skippedFrames,
+        .presentedPixels = presentedPixels,
+        .presentTimeP50 = GetPercentile(presentTimes, presentTimeCount, 0.5),
+        .presentTimeP99 = GetPercentile(presentTimes, presentTimeCount, 0.99),
+        .frameIntervalP50 = GetPercentile(frameIntervals, frameIntervalCount, 0.5),
+        .frameIntervalP99 = GetPercentile(frameIntervals, frameIntervalCount, 0.99),
+        .kernel = GetPixelKernelName(kernel),
+    };
+}
+}
@@ -0,0 +1,84 @@
+// Copyright © 2023 Cassia Developers, all rights reserved.
+#pragma once
+
+#include "compositor_window.h"
+#include "frame_source.h"
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+namespace cassia {
+/**
+ * @brief Statistics about the frames presented by the Compositor.
+ * @note The percentiles are over the most recent presents, they're 0 if there haven't been any.
+ */
+struct CompositorStats {
+    uint64_t presentedFrames;
+    uint64_t skippedFrames; //!< Frames that were acquired but couldn't be presented, as there was no window or it couldn't be locked.
+    uint64_t presentedPixels; //!< The total amount of pixels that were converted into window buffers.
+    std::chrono::nanoseconds presentTimeP50, presentTimeP99; //!< The time from locking the window to posting the buffer.
+    std::chrono::nanoseconds frameIntervalP50, frameIntervalP99; //!< The time between consecutive presents.
+    const char *kernel; //!< The name of the pixel conversion kernel in use.
+};
+
+/**
+ * @brief A software compositor, which presents frames from a frame source to a window on its own thread.
+ * @details Only the damaged regions of every frame are converted into the window's buffer, the rest of the buffer is preserved by the window.
+ */
+class Compositor {
+  private:
+    static constexpr size_t SampleCount{256}; //!< The amount of recent presents that timing percentiles are computed over.
+    static constexpr std::chrono::milliseconds AcquireTimeout{100}; //!< The interval at which the present thread checks if it's stopping.
+
+    std::unique_ptr<FrameSource> source;
+    PixelKernel kernel;
+
+    std::mutex windowMutex; //!< Held while presenting, so a window is never destroyed while it's locked.
+    std::unique_ptr<CompositorWindow> window;
+    uint32_t windowWidth{}, windowHeight{}; //!< The geometry that was last set on the window, this is reset with the window.
+    PixelFormat windowFormat{};
+
+    std::mutex statsMutex;
+    uint64_t presentedFrames{}, skippedFrames{}, presentedPixels{};
+    std::array<std::chrono::nanoseconds, SampleCount> presentTimes{}, frameIntervals{};
+    uint64_t presentTimeCount{}, frameIntervalCount{}; //!< The total amount of samples written into the rings.
+    std::chrono::steady_clock::time_point lastPresent;
+
+    std::atomic<bool> stopping{};
+    std::thread presentThread;
+
+    /**
+     * @return The amount of pixels that were converted, or -1 if the frame couldn't be presented.
+     */
+    int64_t Present(const Frame &frame);
+
+    void PresentThread();
+
+  public:
+    /**
+     * @param kernel The pixel conversion kernel to use, this should only be overridden for benchmarking.
+     */
+    explicit Compositor(std::unique_ptr<FrameSource> source, PixelKernel kernel = GetBestPixelKernel());
+
+    Compositor(const Compositor &) = delete;
+
+    Compositor &operator=(const Compositor &) = delete;
+
+    ~Compositor();
+
+    FrameSource &GetSource() {
+        return *source;
+    }
+
+    /**
+     * @brief Replaces the window that frames are presented to, the latest frame is presented to a new window in full.
+     * @param window The new window, or null to stop presenting. The previous window is destroyed once it's no longer in use.
+     */
+    void SetWindow(std::unique_ptr<CompositorWindow> window);
+
+    CompositorStats GetStats();
+};
+}
@@ -0,0 +1,85 @@
+// Copyright © 2023 Cassia Developers, all rights reserved.
+
+#include "compositor_window.h"
+#ifdef __ANDROID__
+#include <android/native_window.h>
+#endif
+
+namespace cassia {
+#ifdef __ANDROID__
+NativeWindow::NativeWindow(ANativeWindow *window) : window{window} {}
+
+NativeWindow::~NativeWindow() {
+    ANativeWindow_release(window);
+}
+
+void NativeWindow::SetGeometry(uint32_t width, uint32_t height, PixelFormat format) {
+    // Only RGB formats are supported by ANativeWindow_lock, BGR frames are swizzled during the copy instead.
+    ANativeWindow_setBuffersGeometry(window, static_cast<int32_t>(width), static_cast<int32_t>(height), HasAlpha(format) ? WINDOW_FORMAT_RGBA_8888 : WINDOW_FORMAT_RGBX_8888);
+}
+
+bool NativeWindow::Lock(WindowBuffer &buffer, PixelRect &dirty) {
+    ARect bounds{dirty.x, dirty.y, dirty.x + dirty.width, dirty.y + dirty.height};
+    ANativeWindow_Buffer nativeBuffer;
+    if (ANativeWindow_lock(window, &nativeBuffer, &bounds) != 0)
+        return false;
+
+    PixelFormat format;
+    if (nativeBuffer.format == WINDOW_FORMAT_RGBA_8888) {
+        format = PixelFormat::Rgba8888;
+    } else if (nativeBuffer.format == WINDOW_FORMAT_RGBX_8888) {
+        format = PixelFormat::Rgbx8888;
+    } else {
+        ANativeWindow_unlockAndPost(window); // The buffer is posted unmodified, as there's no way to unlock without posting.
+        return false;
+    }
+
+    buffer = WindowBuffer{
+        .bits = static_cast<uint8_t *>(nativeBuffer.bits),
+        .width = static_cast<uint32_t>(nativeBuffer.width),
+        .height = static_cast<uint32_t>(nativeBuffer.height),
+        .stride = static_cast<size_t>(nativeBuffer.stride) * 4, // The stride of ANativeWindow_Buffer is in pixels.
+        .format = format,
+    };
+    dirty = PixelRect{bounds.left, bounds.top, bounds.right - bounds.left, bounds.bottom - bounds.top};
+    return true;
+}
+
+void NativeWindow::UnlockAndPost() {
+    ANativeWindow_unlockAndPost(window);
+}
+#endif
+
+void MemoryWindow::SetGeometry(uint32_t newWidth, uint32_t newHeight, PixelFormat newFormat) {
+    pixels.resize(static_cast<size_t>(newWidth) * newHeight * 4);
+    width = newWidth;
+    height = newHeight;
+    format = HasAlpha(newFormat) ? PixelFormat::Rgba8888 : PixelFormat::Rgbx8888; // This matches the formats NativeWindow uses, so conversion costs the same as on a device.
+}
+
+bool MemoryWindow::Lock(WindowBuffer &buffer, PixelRect &dirty) {
+    if (pixels.empty())
+        return false;
+    buffer = WindowBuffer{
+        .bits = pixels.data(),
+        .width = width,
+        .height = height,
+        .stride = static_cast<size_t>(width) * 4,
+        .format = format,
+    };
+    return true;
+}
+
+void MemoryWindow::UnlockAndPost() {
+    {
+        std::scoped_lock lock{mutex};
+        presents++;
+    }
+    condition.notify_all();
+}
+
+bool MemoryWindow::WaitForPresents(uint64_t count, std::chrono::milliseconds timeout) {
+    std::unique_lock lock{mutex};
+    return condition.wait_for(lock, timeout, [&] { return presents >= count; });
+}
+}
@@ -0,0 +1,111 @@
+// Copyright © 2023 Cassia Developers, all rights reserved.
+#pragma once
+
+#include "pixel_convert.h"
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+
+#ifdef __ANDROID__
+struct ANativeWindow;
+#endif
+
+namespace cassia {
+/**
+ * @brief A locked buffer of a window, which the compositor draws into directly.
+ */
+struct WindowBuffer {
+    uint8_t *bits;
+    uint32_t width, height;
+    size_t stride; //!< The size of a row in bytes.
+    PixelFormat format;
+};
+
+/**
+ * @brief An interface for the windows that the Compositor presents frames to.
+ * @note Windows are only used from the Compositor's present thread once they've been handed to it, so implementations don't need to be thread-safe.
+ */
+struct CompositorWindow {
+    virtual ~CompositorWindow() = default;
+
+    /**
+     * @brief Sets the size and format of the window's buffers, these are scaled to the size of the window.
+     */
+    virtual void SetGeometry(uint32_t width, uint32_t height, PixelFormat format) = 0;
+
+    /**
+     * @brief Locks the next buffer of the window for drawing.
+     * @param dirty The region that will be drawn, this may be expanded by the window if it can't preserve the contents of the buffer outside of it.
+     * @return If the buffer was locked, this fails if the window has been abandoned.
+     */
+    virtual bool Lock(WindowBuffer &buffer, PixelRect &dirty) = 0;
+
+    /**
+     * @brief Unlocks the buffer and queues it for display.
+     */
+    virtual void UnlockAndPost() = 0;
+};
+
+#ifdef __ANDROID__
+/**
+ * @brief A window backed by an ANativeWindow, such as the one of a Surface.
+ */
+class NativeWindow : public CompositorWindow {
+  private:
+    ANativeWindow *window;
+
+  public:
+    /**
+     * @note This takes over the reference to the window, it's released on destruction.
+     */
+    explicit NativeWindow(ANativeWindow *window);
+
+    NativeWindow(const NativeWindow &) = delete;
+
+    NativeWindow &operator=(const NativeWindow &) = delete;
+
+    ~NativeWindow() override;
+
+    void SetGeometry(uint32_t width, uint32_t height, PixelFormat format) override;
+
+    bool Lock(WindowBuffer &buffer, PixelRect &dirty) override;
+
+    void UnlockAndPost() override;
+};
+#endif
+
+/**
+ * @brief A window backed by a single buffer in memory, this is used to measure the compositor on hosts without a display.
+ * @note As there's only a single buffer, the contents outside of the dirty region are always preserved.
+ */
+class MemoryWindow : public CompositorWindow {
+  private:
+    std::vector<uint8_t> pixels;
+    uint32_t width{}, height{};
+    PixelFormat format{};
+    std::mutex mutex; //!< Guards presents, this is only used for WaitForPresents.
+    std::condition_variable condition;
+    uint64_t presents{};
+
+  public:
+    void SetGeometry(uint32_t width, uint32_t height, PixelFormat format) override;
+
+    bool Lock(WindowBuffer &buffer, PixelRect &dirty) override;
+
+    void UnlockAndPost() override;
+
+    /**
+     * @brief Waits until the supplied amount of buffers have been posted in total.
+     * @return If the buffers were posted before the timeout elapsed.
+     */
+    bool WaitForPresents(uint64_t count, std::chrono::milliseconds timeout);
+
+    /**
+     * @note The pixels may only be read while the compositor isn't presenting, such as after WaitForPresents.
+     */
+    const std::vector<uint8_t> &GetPixels() const {
+        return pixels;
+    }
+};
+}
@@ -0,0 +1,466 @@
+// Copyright © 2023 Cassia Developers, all rights reserved.
+
+#include "content_store.h"
+#include "util/error.h"
+#include "util/fd.h"
+#include "util/parallel.h"
+#include <array>
+#include <atomic>
+#include <climits>
+#include <cstring>
+#include <memory>
+#include <optional>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <xxhash.h>
+
+namespace cassia {
+constexpr std::string_view BlobsDirectory{"blobs"};
+constexpr std::string_view ManifestsDirectory{"manifests"};
+constexpr std::string_view TemporaryDirectory{"tmp"};
+constexpr std::string_view LockFileName{"lock"}; //!< A file which is locked for the duration of any operation on the store, so garbage collection never sees a partially installed tree.
+constexpr std::string_view ManifestHeader{"# destination="}; //!< The first line of every manifest, this is followed by the path of the tree it describes.
+constexpr std::string_view TemporarySuffix{".cassia-tmp"}; //!< The suffix of entries in a destination that are about to replace an existing entry.
+constexpr std::string_view ExecutableBlobSuffix{"x"}; //!< The suffix of blobs that are executable, the mode is a property of the inode so these are separate from identical non-executable contents.
+
+enum class EntryType : char {
+    Directory = 'd',
+    File = 'f',
+    Symlink = 'l',
+};
+
+/**
+ * @brief A single entry of a tree, the manifest of a tree is all of its entries with parents preceding their children.
+ */
+struct ManifestEntry {
+    EntryType type;
+    mode_t mode; //!< The permission bits of files and directories.
+    uint64_t size;
+    std::string value; //!< The hash of the contents for files or the target for symlinks.
+    std::string path; //!< The path of the entry relative to the root of the tree.
+};
+
+/**
+ * @return A path inside the temporary directory of the store that's unique within this process.
+ */
+static std::filesystem::path GetTemporaryPath(const std::filesystem::path &root) {
+    static std::atomic<uint64_t> counter{};
+    return root / TemporaryDirectory / fmt::format("{}-{}", getpid(), counter.fetch_add(1, std::memory_order_relaxed));
+}
+
+static std::filesystem::path GetBlobPath(const std::filesystem::path &root, const ManifestEntry &entry) {
+    auto name{entry.value.substr(2)};
+    if (entry.mode & 0111)
+        name += ExecutableBlobSuffix;
+    return root / BlobsDirectory / entry.value.substr(0, 2) / name;
+}
+
+/**
+ * @brief Hashes the contents of a file with XXH3-128, which is vectorized with NEON on ARM64 and is limited by memory bandwidth rather than the hash.
+ */
+static std::string HashFile(const std::filesystem::path &path) {
+    UniqueFd fd{open(path.c_str(), O_RDONLY | O_CLOEXEC | O_NOFOLLOW), "content_store"};
+    if (fd.Get() == -1)
+        throw Exception{"Failed to open '{}': {}", path.string(), strerror(errno)};
+    struct stat info{};
+    if (fstat(fd.Get(), &info) == -1)
+        throw Exception{"fstat() failed for '{}': {}", path.string(), strerror(errno)};
+
+    XXH128_hash_t hash;
+    auto size{static_cast<size_t>(info.st_size)};
+    if (size == 0) {
+        hash = XXH3_128bits(nullptr, 0);
+    } else {
+        void *data{mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd.Get(), 0)};
+        if (data == MAP_FAILED)
+            throw Exception{"Failed to map '{}': {}", path.string(), strerror(errno)};
+        madvise(data, size, MADV_SEQUENTIAL);
+        hash = XXH3_128bits(data, size);
+        munmap(data, size);
+    }
+    return fmt::format("{:016x}{:016x}", hash.high64, hash.low64);
+}
+
+/**
+ * @return All entries of the tree in pre-order, the contents of files aren't hashed yet.
+ */
+static std::vector<ManifestEntry> ScanTree(const std::filesystem::path &source) {
+    std::vector<ManifestEntry> entries;
+    for (auto it{std::filesystem::recursive_directory_iterator{source}}; it != std::filesystem::recursive_directory_iterator{}; ++it) {
+        auto path{it->path().lexically_relative(source).string()};
+        if (path.find_first_of("\t\n") != std::string::npos)
+            throw Exception{"Unsupported character in the path '{}'", path};
+
+        struct stat info{};
+        if (lstat(it->path().c_str(), &info) == -1)
+            throw Exception{"lstat() failed for '{}': {}", path, strerror(errno)};
+
+        if (S_ISDIR(info.st_mode)) {
+            entries.push_back(ManifestEntry{EntryType::Directory, static_cast<mode_t>(info.st_mode & 07777), 0, "-", std::move(path)});
+        } else if (S_ISREG(info.st_mode)) {
+            entries.push_back(ManifestEntry{EntryType::File, static_cast<mode_t>(info.st_mode & 0777), static_cast<uint64_t>(info.st_size), {}, std::move(path)});
+        } else if (S_ISLNK(info.st_mode)) {
+            auto target{std::filesystem::read_symlink(it->path()).string()};
+            if (target.find_first_of("\t\n") != std::string::npos)
+                throw Exception{"Unsupported character in the target of '{}'", path};
+            entries.push_back(ManifestEntry{EntryType::Symlink, 0777, 0, std::move(target), std::move(path)});
+        } // Any other types of files can't be stored and aren't part of a tree.
+    }
+    return entries;
+}
+
+/**
+ * @return The entries of a manifest, or std::nullopt if it doesn't exist.
+ */
+static std::optional<std::vector<ManifestEntry>> ReadManifest(const std::filesystem::path &path) {
+    std::unique_ptr<FILE, decltype(&fclose)> file{fopen(path.c_str(), "re"), &fclose};
+    if (!file) {
+        if (errno == ENOENT)
+            return std::nullopt;
+        throw Exception{"fopen({}) failed: {}", path.string(), strerror(errno)};
+    }
+
+    std::string contents;
+    std::array<char, 4096> buffer;
+    size_t size;
+    while ((size = fread(buffer.data(), 1, buffer.size(), file.get())) > 0)
+        contents.append(buffer.data(), size);
+    if (ferror(file.get()))
+        throw Exception{"Failed to read {}", path.string()};
+
+    std::vector<ManifestEntry> entries;
+    std::string_view remaining{contents};
+    while (!remaining.empty()) {
+        auto end{remaining.find('\n')};
+        auto view{remaining.substr(0, end)};
+        remaining.remove_prefix(end == std::string_view::npos ? remaining.size() : end + 1);
+        if (view.empty() || view.starts_with('#'))
+            continue;
+
+        // Every line is "<type>\t<mode>\t<size>\t<value>\t<path>", the path is last as it's the only field that may contain any other characters.
+        std::array<std::string_view, 4> fields;
+        for (auto &field: fields) {
+            auto separator{view.find('\t')};
+            if (separator == std::string_view::npos)
+                throw Exception{"Malformed manifest '{}'", path.string()};
+            field = view.substr(0, separator);
+            view.remove_prefix(separator + 1);
+        }
+        if (fields[0].size() != 1)
+            throw Exception{"Malformed manifest '{}'", path.string()};
+        entries.push_back(ManifestEntry{
+            static_cast<EntryType>(fields[0][0]),
+            static_cast<mode_t>(std::stoul(std::string{fields[1]}, nullptr, 8)),
+            std::stoull(std::string{fields[2]}),
+            std::string{fields[3]},
+            std::string{view},
+        });
+    }
+    return entries;
+}
+
+static void WriteManifest(const std::filesystem::path &root, const std::filesystem::path &path, const std::filesystem::path &destination, const std::vector<ManifestEntry> &entries) {
+    std::string contents{fmt::format("{}{}\n", ManifestHeader, destination.string())};
+    auto out{std::back_inserter(contents)};
+    for (const auto &entry: entries)
+        fmt::format_to(out, "{}\t{:o}\t{}\t{}\t{}\n", static_cast<char>(entry.type), entry.mode, entry.size, entry.value, entry.path);
+
+    auto temporaryPath{GetTemporaryPath(root)};
+    {
+        std::unique_ptr<FILE, decltype(&fclose)> file{fopen(temporaryPath.c_str(), "we"), &fclose};
+        if (!file)
+            throw Exception{"fopen({}) failed: {}", temporaryPath.string(), strerror(errno)};
+        if (fwrite(contents.data(), 1, contents.size(), file.get()) != contents.size() || fflush(file.get()) != 0)
+            throw Exception{"Failed to write {}: {}", temporaryPath.string(), strerror(errno)};
+    }
+    std::filesystem::rename(temporaryPath, path);
+}
+
+/**
+ * @return If the error denotes that a file can't be hardlinked to the supplied path, in which case it's copied instead.
+ */
+static bool IsLinkUnsupportedError(int error) {
+    return error == EXDEV || error == EMLINK || error == EPERM || error == EACCES;
+}
+
+/**
+ * @brief Adds the contents of a file to the store if they aren't in it already.
+ * @return If a new blob was added.
+ */
+static bool ImportBlob(const std::filesystem::path &root, const std::filesystem::path &source, const ManifestEntry &entry) {
+    auto blobPath{GetBlobPath(root, entry)};
+    struct stat info{};
+    if (lstat(blobPath.c_str(), &info) == 0)
+        return false;
+
+    std::error_code error;
+    std::filesystem::create_directory(blobPath.parent_path(), error);
+    if (error)
+        throw Exception{"Failed to create '{}': {}", blobPath.parent_path().string(), error.message()};
+
+    // The source is linked rather than copied, so importing a tree that's already on the same filesystem doesn't write any data.
+    auto temporaryPath{GetTemporaryPath(root)};
+    if (link(source.c_str(), temporaryPath.c_str()) == -1) {
+        if (!IsLinkUnsupportedError(errno))
+            throw Exception{"Failed to link '{}' into the store: {}", source.string(), strerror(errno)};
+        std::filesystem::copy_file(source, temporaryPath);
+    }
+    if (chmod(temporaryPath.c_str(), (entry.mode & 0111) ? 0555 : 0444) == -1)
+        throw Exception{"chmod() failed for '{}': {}", temporaryPath.string(), strerror(errno)};
+    if (rename(temporaryPath.c_str(), blobPath.c_str()) == -1)
+        throw Exception{"Failed to add the blob '{}': {}", blobPath.string(), strerror(errno)};
+    return true;
+}
+
+/**
+ * @brief Replaces an entry in the destination with a new one, which is created at the supplied temporary path.
+ */
+static void ReplaceEntry(const std::filesystem::path &temporaryPath, const std::filesystem::path &path, const struct stat *existing) {
+    if (existing && S_ISDIR(existing->st_mode))
+        std::filesystem::remove_all(path);
+    if (rename(temporaryPath.c_str(), path.c_str()) == -1) {
+        int error{errno};
+        unlink(temporaryPath.c_str());
+        throw Exception{"Failed to replace '{}': {}", path.string(), strerror(error)};
+    }
+}
+
+/**
+ * @return If the entry in the destination was changed, it's left untouched if it's already a link to the blob.
+ */
+static bool MaterializeFile(const std::filesystem::path &blobPath, const std::filesystem::path &path) {
+    struct stat blobInfo{};
+    if (stat(blobPath.c_str(), &blobInfo) == -1)
+        throw Exception{"stat() failed for the blob '{}': {}", blobPath.string(), strerror(errno)};
+    struct stat info{};
+    bool exists{lstat(path.c_str(), &info) == 0};
+    if (exists && info.st_dev == blobInfo.st_dev && info.st_ino == blobInfo.st_ino)
+        return false;
+
+    auto temporaryPath{std::filesystem::path{path}.concat(TemporarySuffix)};
+    unlink(temporaryPath.c_str());
+    if (link(blobPath.c_str(), temporaryPath.c_str()) == -1) {
+        if (!IsLinkUnsupportedError(errno))
+            throw Exception{"Failed to link '{}': {}", path.string(), strerror(errno)};
+        // The blob has reached the link limit of the filesystem or links aren't permitted, so this entry gets a private copy instead.
+        std::filesystem::copy_file(blobPath, temporaryPath);
+        chmod(temporaryPath.c_str(), blobInfo.st_mode & 07777);
+    }
+    ReplaceEntry(temporaryPath, path, exists ? &info : nullptr);
+    return true;
+}
+
+/**
+ * @return If the symlink in the destination was changed.
+ */
+static bool MaterializeSymlink(const std::string &target, const std::filesystem::path &path) {
+    struct stat info{};
+    bool exists{lstat(path.c_str(), &info) == 0};
+    if (exists && S_ISLNK(info.st_mode)) {
+        std::error_code error;
+        if (std::filesystem::read_symlink(path, error).string() == target && !error)
+            return false;
+    }
+
+    auto temporaryPath{std::filesystem::path{path}.concat(TemporarySuffix)};
+    unlink(temporaryPath.c_str());
+    if (symlink(target.c_str(), temporaryPath.c_str()) == -1)
+        throw Exception{"Failed to create the symlink '{}': {}", path.string(), strerror(errno)};
+    ReplaceEntry(temporaryPath, path, exists ? &info : nullptr);
+    return true;
+}
+
+/**
+ * @return If the directory in the destination was changed.
+ */
+static bool MaterializeDirectory(mode_t mode, const std::filesystem::path &path) {
+    // The owner always needs to be able to write to directories, so entries inside them can be updated.
+    mode |= S_IRWXU;
+    struct stat info{};
+    if (lstat(path.c_str(), &info) == 0) {
+        if (S_ISDIR(info.st_mode)) {
+            if ((info.st_mode & 07777) == mode)
+                return false;
+            if (chmod(path.c_str(), mode) == -1)
+                throw Exception{"chmod() failed for '{}': {}", path.string(), strerror(errno)};
+            return true;
+        }
+        if (unlink(path.c_str()) == -1)
+            throw Exception{"Failed to remove '{}': {}", path.string(), strerror(errno)};
+    }
+    if (mkdir(path.c_str(), mode) == -1)
+        throw Exception{"Failed to create the directory '{}': {}", path.string(), strerror(errno)};
+    return true;
+}
+
+/**
+ * @brief Locks the store for the lifetime of the returned file descriptor.
+ */
+static UniqueFd LockStore(const std::filesystem::path &root) {
+    auto path{root / LockFileName};
+    UniqueFd fd{open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600), "content_store"};
+    if (fd.Get() == -1)
+        throw Exception{"Failed to open '{}': {}", path.string(), strerror(errno)};
+    while (flock(fd.Get(), LOCK_EX) == -1)
+        if (errno != EINTR)
+            throw Exception{"Failed to lock '{}': {}", path.string(), strerror(errno)};
+    return fd;
+}
+
+ContentStore::ContentStore(std::filesystem::path pRoot) : root{std::move(pRoot)} {
+    for (auto directory: {BlobsDirectory, ManifestsDirectory, TemporaryDirectory})
+        std::filesystem::create_directories(root / directory);
+}
+
+std::filesystem::path ContentStore::GetManifestPath(const std::string &name) const {
+    if (name.empty() || name.starts_with('.') || name.find('/') != std::string::npos)
+        throw Exception{"Invalid tree name '{}'", name};
+    return root / ManifestsDirectory / name;
+}
+
+bool ContentStore::IsInstalled(const std::string &name) const {
+    return std::filesystem::exists(GetManifestPath(name));
+}
+
+ContentInstallStats ContentStore::Install(const std::filesystem::path &source, const std::filesystem::path &destination, const std::string &name, size_t threadCount) {
+    auto start{std::chrono::steady_clock::now()};
+    auto manifestPath{GetManifestPath(name)};
+    auto lock{LockStore(root)};
+
+    auto entries{ScanTree(source)};
+    std::vector<size_t> files;
+    for (size_t index{}; index < entries.size(); index++)
+        if (entries[index].type == EntryType::File)
+            files.push_back(index);
+    ParallelFor(files.size(), threadCount, [&](size_t index) {
+        auto &entry{entries[files[index]]};
+        entry.value = HashFile(source / entry.path);
+    });
+
+    // Identical files within the tree are only imported once, the first of them is the source of the blob.
+    std::unordered_map<std::string, size_t> uniqueBlobs;
+    std::vector<size_t> imports;
+    for (auto index: files) {
+        const auto &entry{entries[index]};
+        if (uniqueBlobs.try_emplace(GetBlobPath(root, entry).string(), index).second)
+            imports.push_back(index);
+    }
+    std::vector<char> added(imports.size());
+    ParallelFor(imports.size(), threadCount, [&](size_t index) {
+        added[index] = ImportBlob(root, source / entries[imports[index]].path, entries[imports[index]]);
+    });
+
+    ContentInstallStats stats{.files = files.size()};
+    for (size_t index{}; index < imports.size(); index++) {
+        if (added[index]) {
+            stats.addedBlobs++;
+            stats.addedBytes += entries[imports[index]].size;
+        }
+    }
+    stats.reusedBlobs = files.size() - stats.addedBlobs;
+    for (auto index: files)
+        stats.reusedBytes += entries[index].size;
+    stats.reusedBytes -= stats.addedBytes;
+
+    // Entries that were installed previously but aren't part of the tree anymore are removed, anything else in the destination is left alone.
+    auto previousEntries{ReadManifest(manifestPath)};
+    if (previousEntries) {
+        std::unordered_map<std::string_view, EntryType> types;
+        for (const auto &entry: entries)
+            types.emplace(entry.path, entry.type);
+        for (auto it{previousEntries->rbegin()}; it != previousEntries->rend(); ++it) {
+            auto type{types.find(it->path)};
+            if (type != types.end() && type->second == it->type)
+                continue;
+            auto path{destination / it->path};
+            std::error_code error;
+            if (type != types.end())
+                std::filesystem::remove_all(path, error); // The type of the entry changed, so it's replaced entirely.
+            else
+                std::filesystem::remove(path, error); // Directories are kept if anything that isn't part of the tree was added to them.
+            if (!error && type == types.end())
+                stats.removedEntries++;
+        }
+    } else if (source != destination) {
+        // Nothing is known about the contents of an existing destination without a manifest, so it's replaced entirely.
+        std::filesystem::remove_all(destination);
+    }
+
+    std::filesystem::create_directories(destination);
+    std::atomic<size_t> unchangedEntries{}, updatedEntries{};
+    for (const auto &entry: entries) {
+        if (entry.type == EntryType::Directory)
+            (MaterializeDirectory(entry.mode, destination / entry.path) ? updatedEntries : unchangedEntries)++;
+    }
+    ParallelFor(entries.size(), threadCount, [&](size_t index) {
+        const auto &entry{entries[index]};
+        bool updated;
+        if (entry.type == EntryType::File)
+            updated = MaterializeFile(GetBlobPath(root, entry), destination / entry.path);
+        else if (entry.type == EntryType::Symlink)
+            updated = MaterializeSymlink(entry.value, destination / entry.path);
+        else
+            return;
+        (updated ? updatedEntries : unchangedEntries)++;
+    });
+    stats.unchangedEntries = unchangedEntries;
+    stats.updatedEntries = updatedEntries;
+
+    // The manifest is only written once the destination is complete, an interrupted install is repeated in full as every unchanged entry is skipped.
+    WriteManifest(root, manifestPath, std::filesystem::absolute(destination), entries);
+    stats.duration = std::chrono::steady_clock::now() - start;
+    return stats;
+}
+
+ContentCollectStats ContentStore::CollectGarbage() {
+    auto lock{LockStore(root)};
+    ContentCollectStats stats{};
+
+    for (const auto &entry: std::filesystem::directory_iterator{root / ManifestsDirectory}) {
+        std::unique_ptr<FILE, decltype(&fclose)> file{fopen(entry.path().c_str(), "re"), &fclose};
+        if (!file)
+            continue;
+        std::array<char, PATH_MAX + ManifestHeader.size() + 1> buffer{};
+        if (!fgets(buffer.data(), buffer.size(), file.get()))
+            continue;
+        std::string_view header{buffer.data()};
+        if (header.ends_with('\n'))
+            header.remove_suffix(1);
+        if (!header.starts_with(ManifestHeader) || std::filesystem::exists(header.substr(ManifestHeader.size())))
+            continue;
+        file.reset();
+        if (std::filesystem::remove(entry.path()))
+            stats.removedManifests++;
+    }
+
+    // Every blob has one link from the store itself, any further links are from trees which still use it.
+    for (const auto &directory: std::filesystem::directory_iterator{root / BlobsDirectory}) {
+        if (!directory.is_directory())
+            continue;
+        for (const auto &blob: std::filesystem::directory_iterator{directory.path()}) {
+            struct stat info{};
+            if (lstat(blob.path().c_str(), &info) == -1)
+                continue;
+            if (info.st_nlink <= 1 && unlink(blob.path().c_str()) == 0) {
+                stats.removedBlobs++;
+                stats.removedBytes += static_cast<uint64_t>(info.st_size);
+            } else {
+                stats.remainingBlobs++;
+                stats.remainingBytes += static_cast<uint64_t>(info.st_size);
+            }
+        }
+        rmdir(directory.path().c_str()); // This only succeeds if the directory is empty now.
+    }
+
+    // Nothing can be using temporary files while the store is locked, these are left behind by interrupted operations.
+    for (const auto &entry: std::filesystem::directory_iterator{root / TemporaryDirectory})
+        std::filesystem::remove_all(entry.path());
+    return stats;
+}
+}
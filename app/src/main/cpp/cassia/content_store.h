@@ -0,0 +1,72 @@
+// Copyright © 2023 Cassia Developers, all rights reserved.
+#pragma once
+
+#include <chrono>
+#include <filesystem>
+#include <string>
+
+namespace cassia {
+/**
+ * @brief Statistics about installing a single tree into a ContentStore.
+ */
+struct ContentInstallStats {
+    size_t files;
+    size_t unchangedEntries; //!< Entries that were already present in the destination, these aren't touched.
+    size_t updatedEntries; //!< Entries that were created or replaced in the destination.
+    size_t removedEntries; //!< Entries in the previous manifest that aren't in the tree anymore.
+    size_t addedBlobs;
+    size_t reusedBlobs; //!< Files whose contents were already in the store, from this tree or any other.
+    uint64_t addedBytes;
+    uint64_t reusedBytes;
+    std::chrono::nanoseconds duration;
+};
+
+/**
+ * @brief Statistics about a garbage collection pass of a ContentStore.
+ */
+struct ContentCollectStats {
+    size_t removedBlobs;
+    uint64_t removedBytes;
+    size_t removedManifests;
+    size_t remainingBlobs;
+    uint64_t remainingBytes;
+};
+
+/**
+ * @brief A content-addressed store of files which are shared between directory trees (such as runtimes) as hardlinks, so identical files are only stored once.
+ * @details Files are stored as read-only blobs named after the XXH3-128 hash of their contents (and whether they're executable, as the mode is shared by all links).
+ * Every installed tree has a manifest of its entries in the store, which is used to only update the entries that changed when the tree is installed again.
+ * @note Blobs are only referenced through hardlinks, so a blob with a link count of one isn't part of any tree and is removed by garbage collection.
+ */
+class ContentStore {
+  private:
+    std::filesystem::path root;
+
+    std::filesystem::path GetManifestPath(const std::string &name) const;
+
+  public:
+    /**
+     * @param root The directory of the store, this must be on the same filesystem as any trees installed from it.
+     */
+    explicit ContentStore(std::filesystem::path root);
+
+    /**
+     * @brief Installs a directory tree into the destination, with all files being hardlinks to blobs in the store.
+     * @details Files are hashed in parallel, any contents that aren't in the store yet are hardlinked (or copied, across filesystems) into it from the source.
+     * The source can be the destination itself, which converts an existing tree in-place.
+     * @param name A unique name for the destination, this is used to identify its manifest.
+     * @note The source tree is left intact, but its files may become read-only as they're shared with the store.
+     */
+    ContentInstallStats Install(const std::filesystem::path &source, const std::filesystem::path &destination, const std::string &name, size_t threadCount = 4);
+
+    /**
+     * @return If a tree has been installed under the supplied name.
+     */
+    bool IsInstalled(const std::string &name) const;
+
+    /**
+     * @brief Removes all blobs that aren't part of any tree, and the manifests of trees that don't exist anymore.
+     */
+    ContentCollectStats CollectGarbage();
+};
+}
@@ -0,0 +1,194 @@
+// Copyright © 2023 Cassia Developers, all rights reserved.
+
+#include "context_registry.h"
+#include "util/trace.h"
+
+namespace cassia {
+const char *GetContextStateName(ContextState state) {
+    switch (state) {
+        case ContextState::Starting:
+            return "starting";
+        case ContextState::Running:
+            return "running";
+        case ContextState::Stopping:
+            return "stopping";
+        case ContextState::Suspended:
+            return "suspended";
+    }
+    return "unknown";
+}
+
+ContextRegistry::ContextRegistry() : reaperThread{&ContextRegistry::ReaperThread, this} {}
+
+ContextRegistry::~ContextRegistry() {
+    {
+        std::scoped_lock lock{mutex};
+        stopping = true;
+    }
+    condition.notify_all();
+    reaperThread.join();
+
+    std::unique_lock lock{mutex};
+    while (!entries.empty())
+        DestroyEntry(lock, entries.begin());
+}
+
+ContextRegistry::EntryIterator ContextRegistry::WaitForEntry(std::unique_lock<std::mutex> &lock, const std::filesystem::path &prefixPath) {
+    while (true) {
+        auto it{entries.find(prefixPath)};
+        if (it == entries.end() || (it->second.state != ContextState::Starting && it->second.state != ContextState::Stopping))
+            return it;
+        condition.wait(lock);
+    }
+}
+
+void ContextRegistry::DestroyEntry(std::unique_lock<std::mutex> &lock, EntryIterator it) {
+    it->second.state = ContextState::Stopping;
+    auto context{std::move(it->second.context)};
+    lock.unlock();
+    context.reset(); // This waits for the processes of the context to exit, unless the context is still in use elsewhere.
+    lock.lock();
+    entries.erase(it);
+    condition.notify_all();
+}
+
+void ContextRegistry::Start(const std::filesystem::path &runtimePath, const std::filesystem::path &pPrefixPath, const std::filesystem::path &cassiaExtPath, bool forceInit) {
+    TraceScope trace{"contexts.start"};
+    auto prefixPath{pPrefixPath.lexically_normal()};
+    std::unique_lock lock{mutex};
+    auto it{WaitForEntry(lock, prefixPath)};
+    if (it != entries.end()) {
+        auto &entry{it->second};
+        if (entry.state == ContextState::Running)
+            throw Exception{"Prefix '{}' is already running", prefixPath.string()};
+
+        if (!forceInit && entry.context->CanResume(runtimePath, prefixPath, cassiaExtPath)) {
+            entry.state = ContextState::Starting;
+            auto context{entry.context};
+            lock.unlock();
+            bool resumed{};
+            try {
+                context->Resume();
+                resumed = true;
+            } catch (const std::exception &e) {
+                fmt::println(stderr, "Failed to resume the suspended prefix '{}', starting it from scratch: {}", prefixPath.string(), e.what());
+            }
+            lock.lock();
+            if (resumed) {
+                entry.state = ContextState::Running;
+                condition.notify_all(); // The reaper may be waiting for the idle deadline of this context.
+                return;
+            }
+        }
+        DestroyEntry(lock, it); // The previous context of the prefix must be shut down before a new wineserver is started for it.
+    }
+
+    it = entries.emplace(prefixPath, Entry{.state = ContextState::Starting}).first;
+    lock.unlock();
+    std::shared_ptr<WineContext> context;
+    try {
+        context = std::make_shared<WineContext>(runtimePath, prefixPath, cassiaExtPath, forceInit);
+    } catch (...) {
+        // A context that fails to start has already stopped wineserver and the launcher, so only its entry has to be removed.
+        lock.lock();
+        entries.erase(it);
+        condition.notify_all();
+        throw;
+    }
+    lock.lock();
+    it->second.context = std::move(context);
+    it->second.state = ContextState::Running;
+    condition.notify_all();
+}
+
+void ContextRegistry::Stop(const std::filesystem::path &pPrefixPath, std::chrono::milliseconds idleTimeout) {
+    TraceScope trace{"contexts.stop"};
+    auto prefixPath{pPrefixPath.lexically_normal()};
+    std::unique_lock lock{mutex};
+    auto it{WaitForEntry(lock, prefixPath)};
+    if (it == entries.end())
+        return;
+    auto &entry{it->second};
+    if (idleTimeout <= std::chrono::milliseconds{}) {
+        DestroyEntry(lock, it);
+        return;
+    }
+
+    if (entry.state == ContextState::Running) {
+        entry.state = ContextState::Stopping;
+        auto context{entry.context};
+        lock.unlock();
+        bool suspended{};
+        try {
+            context->Suspend();
+            suspended = true;
+        } catch (const std::exception &e) {
+            fmt::println(stderr, "Failed to suspend prefix '{}', shutting it down: {}", prefixPath.string(), e.what());
+        }
+        lock.lock();
+        if (!suspended) {
+            DestroyEntry(lock, it);
+            return;
+        }
+    }
+    entry.state = ContextState::Suspended;
+    entry.idleDeadline = std::chrono::steady_clock::now() + idleTimeout;
+    condition.notify_all();
+}
+
+std::shared_ptr<WineContext> ContextRegistry::Get(const std::filesystem::path &prefixPath) {
+    std::scoped_lock lock{mutex};
+    auto it{entries.find(prefixPath.lexically_normal())};
+    if (it == entries.end() || it->second.state != ContextState::Running)
+        return nullptr;
+    return it->second.context;
+}
+
+std::vector<std::shared_ptr<WineContext>> ContextRegistry::GetAll() {
+    std::scoped_lock lock{mutex};
+    std::vector<std::shared_ptr<WineContext>> contexts;
+    for (const auto &[prefixPath, entry]: entries)
+        if (entry.state == ContextState::Running || entry.state == ContextState::Suspended)
+            contexts.push_back(entry.context);
+    return contexts;
+}
+
+std::vector<ContextInfo> ContextRegistry::GetInfo() {
+    std::scoped_lock lock{mutex};
+    std::vector<ContextInfo> info;
+    for (const auto &[prefixPath, entry]: entries)
+        info.push_back(ContextInfo{
+            .prefixPath = prefixPath,
+            .state = entry.state,
+            .syncMode = entry.context ? std::optional{entry.context->GetSyncMode()} : std::nullopt,
+        });
+    return info;
+}
+
+void ContextRegistry::ReaperThread() {
+    std::unique_lock lock{mutex};
+    while (!stopping) {
+        auto now{std::chrono::steady_clock::now()};
+        auto nextDeadline{std::chrono::steady_clock::time_point::max()};
+        bool destroyed{};
+        for (auto it{entries.begin()}; it != entries.end(); it++) {
+            if (it->second.state != ContextState::Suspended)
+                continue;
+            if (it->second.idleDeadline <= now) {
+                fmt::println(stderr, "Suspended prefix '{}' was idle for too long, shutting it down", it->first.string());
+                DestroyEntry(lock, it);
+                destroyed = true; // The lock was released, so the entries need to be scanned again.
+                break;
+            }
+            nextDeadline = std::min(nextDeadline, it->second.idleDeadline);
+        }
+        if (destroyed)
+            continue;
+
+        if (nextDeadline == std::chrono::steady_clock::time_point::max())
+            condition.wait(lock);
+        else
+            condition.wait_until(lock, nextDeadline);
+    }
+}
+}
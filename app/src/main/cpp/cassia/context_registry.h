@@ -0,0 +1,106 @@
+// Copyright © 2023 Cassia Developers, all rights reserved.
+#pragma once
+
+#include "wine_ctx.h"
+#include <chrono>
+#include <condition_variable>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+namespace cassia {
+/**
+ * @brief The state of a context in the ContextRegistry, Starting and Stopping are transitional states that are owned by the thread performing the transition.
+ */
+enum class ContextState : uint8_t {
+    Starting, //!< The context is being created or resumed.
+    Running,
+    Stopping, //!< The context is being suspended or destroyed.
+    Suspended, //!< The session has ended, wineserver is kept alive until the idle deadline for a warm start.
+};
+
+const char *GetContextStateName(ContextState state);
+
+struct ContextInfo {
+    std::filesystem::path prefixPath;
+    ContextState state;
+    std::optional<WineSyncMode> syncMode; //!< This is only known once the context has been created.
+};
+
+/**
+ * @brief A registry of WineContexts keyed by prefix, every prefix has its own wineserver so multiple of them can run side by side.
+ * @details The registry lock is only held to inspect or change the state of a context, never across process waits. Creating, resuming, suspending and destroying a context is done without it by the thread that moved the context into a transitional state, other threads transitioning the same context wait for that to finish while those for other prefixes proceed.
+ * Contexts are handed out as shared pointers, so they can be used without any lock held, a context that's stopped while in use is destroyed once the last user releases it.
+ */
+class ContextRegistry {
+  private:
+    struct Entry {
+        ContextState state;
+        std::shared_ptr<WineContext> context; //!< This is null while the context is first being created.
+        std::chrono::steady_clock::time_point idleDeadline; //!< The time at which a suspended context is destroyed.
+    };
+
+    using EntryIterator = std::map<std::filesystem::path, Entry>::iterator;
+
+    std::mutex mutex;
+    std::condition_variable condition; //!< Signalled whenever a context leaves a transitional state or the idle deadlines change.
+    std::map<std::filesystem::path, Entry> entries; //!< Entries are never erased while in a transitional state, so their owner can hold onto them across unlocking.
+    bool stopping{};
+    std::thread reaperThread; //!< Destroys suspended contexts once their idle deadline has passed.
+
+    /**
+     * @return The entry of the prefix once it isn't in a transitional state, or the end iterator if there is none.
+     */
+    EntryIterator WaitForEntry(std::unique_lock<std::mutex> &lock, const std::filesystem::path &prefixPath);
+
+    /**
+     * @brief Destroys the context of an entry without holding the lock and erases the entry, the entry must not be in a transitional state owned by another thread.
+     */
+    void DestroyEntry(std::unique_lock<std::mutex> &lock, EntryIterator it);
+
+    void ReaperThread();
+
+  public:
+    ContextRegistry();
+
+    ContextRegistry(const ContextRegistry &) = delete;
+
+    ContextRegistry &operator=(const ContextRegistry &) = delete;
+
+    /**
+     * @brief Destroys all contexts, this must not be called while other threads are using the registry.
+     */
+    ~ContextRegistry();
+
+    /**
+     * @brief Starts the context of a prefix, a suspended context with the same configuration is resumed rather than started from scratch.
+     * @note An exception is thrown if the prefix is already running or its context fails to start.
+     */
+    void Start(const std::filesystem::path &runtimePath, const std::filesystem::path &prefixPath, const std::filesystem::path &cassiaExtPath, bool forceInit);
+
+    /**
+     * @brief Stops the context of a prefix, this does nothing if the prefix isn't running.
+     * @param idleTimeout The time the context is kept suspended for a warm start before being destroyed, it's destroyed immediately if this isn't positive.
+     */
+    void Stop(const std::filesystem::path &prefixPath, std::chrono::milliseconds idleTimeout);
+
+    /**
+     * @return The context of the prefix if it's running, or null otherwise.
+     */
+    std::shared_ptr<WineContext> Get(const std::filesystem::path &prefixPath);
+
+    /**
+     * @return All contexts that are running or suspended.
+     */
+    std::vector<std::shared_ptr<WineContext>> GetAll();
+
+    /**
+     * @return The state of every prefix that has a context.
+     */
+    std::vector<ContextInfo> GetInfo();
+};
+}
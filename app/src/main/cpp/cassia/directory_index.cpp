@@ -0,0 +1,306 @@
+// Copyright © 2023 Cassia Developers, all rights reserved.
+
+#include "directory_index.h"
+#include "util/error.h"
+#include "util/parallel.h"
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#ifdef __ANDROID__
+#include <android/api-level.h>
+#endif
+
+namespace cassia {
+constexpr size_t DirentBufferSize{64 * 1024}; //!< The buffer for getdents64, which fits a few thousand entries per call.
+constexpr size_t ParallelStatThreshold{2048}; //!< Directories with at least this many entries are stated on several threads.
+constexpr size_t StatChunkSize{512};
+constexpr size_t StatThreadCount{4};
+constexpr uint32_t WatchMask{IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR};
+
+/**
+ * @return If statx can be used, it's only allowed by the seccomp policy of apps from Android 11 onwards even though older kernels implement it.
+ */
+static bool IsStatxAvailable() {
+#ifdef __ANDROID__
+    static const bool available{android_get_device_api_level() >= 30};
+    return available;
+#else
+    return true;
+#endif
+}
+
+/**
+ * @brief The fields of statx or stat that are needed for an entry.
+ */
+struct EntryStat {
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+    uint64_t size;
+    int64_t lastModifiedMs;
+};
+
+static bool StatEntry(int directoryFd, const char *name, int flags, EntryStat &stat) {
+    if (IsStatxAvailable()) {
+        struct statx info{};
+        if (syscall(__NR_statx, directoryFd, name, flags | AT_STATX_SYNC_AS_STAT, STATX_TYPE | STATX_MODE | STATX_UID | STATX_GID | STATX_SIZE | STATX_MTIME, &info) == -1)
+            return false;
+        stat = EntryStat{info.stx_mode, info.stx_uid, info.stx_gid, info.stx_size, info.stx_mtime.tv_sec * 1000 + info.stx_mtime.tv_nsec / 1'000'000};
+        return true;
+    }
+
+    struct stat info{};
+    if (fstatat(directoryFd, name, &info, flags) == -1)
+        return false;
+    stat = EntryStat{info.st_mode, info.st_uid, info.st_gid, static_cast<uint64_t>(info.st_size), info.st_mtim.tv_sec * 1000 + info.st_mtim.tv_nsec / 1'000'000};
+    return true;
+}
+
+/**
+ * @brief Fills in the metadata of an entry, following symlinks like java.io.File does.
+ * @return If the entry still exists.
+ */
+static bool FillEntry(int directoryFd, DirectoryEntry &entry) {
+    static const uid_t uid{geteuid()};
+    static const gid_t gid{getegid()};
+
+    EntryStat stat{};
+    bool resolved{StatEntry(directoryFd, entry.name.c_str(), 0, stat)};
+    if (!resolved && !StatEntry(directoryFd, entry.name.c_str(), AT_SYMLINK_NOFOLLOW, stat))
+        return false; // The entry was removed after it was listed.
+
+    entry.size = stat.size;
+    entry.lastModifiedMs = stat.lastModifiedMs;
+    entry.type = !resolved ? DirectoryEntryType::Other : S_ISDIR(stat.mode) ? DirectoryEntryType::Directory : S_ISREG(stat.mode) ? DirectoryEntryType::File : DirectoryEntryType::Other;
+    if (stat.uid == uid)
+        entry.writable = stat.mode & S_IWUSR;
+    else if (stat.gid == gid)
+        entry.writable = stat.mode & S_IWGRP;
+    else
+        entry.writable = stat.mode & S_IWOTH;
+    return true;
+}
+
+DirectoryIndex::DirectoryIndex(size_t maxDirectories) : inotifyFd{inotify_init1(IN_NONBLOCK | IN_CLOEXEC), "directory_index"}, maxDirectories{maxDirectories} {
+    if (!inotifyFd.Valid())
+        fmt::println(stderr, "inotify_init1() failed, directories won't be cached: {}", strerror(errno));
+}
+
+std::vector<DirectoryEntry> DirectoryIndex::ReadDirectory(const std::filesystem::path &path) {
+    UniqueFd fd{open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC), "directory_index"};
+    if (!fd.Valid())
+        throw Exception{"Failed to open '{}': {}", path.string(), strerror(errno)};
+
+    std::vector<DirectoryEntry> entries;
+    auto buffer{std::make_unique<uint64_t[]>(DirentBufferSize / sizeof(uint64_t))}; // This is 8-byte aligned, as every record is.
+    while (true) {
+        long count{syscall(SYS_getdents64, fd.Get(), buffer.get(), DirentBufferSize)};
+        if (count == -1)
+            throw Exception{"getdents64() failed for '{}': {}", path.string(), strerror(errno)};
+        if (count == 0)
+            break;
+        for (long offset{}; offset < count;) {
+            auto record{reinterpret_cast<const dirent64 *>(reinterpret_cast<const uint8_t *>(buffer.get()) + offset)};
+            offset += record->d_reclen;
+            std::string_view name{record->d_name};
+            if (name != "." && name != "..")
+                entries.push_back(DirectoryEntry{.name = std::string{name}});
+        }
+    }
+
+    // Every entry is stated relative to the directory fd, so the path of the directory isn't resolved again for each of them.
+    std::vector<uint8_t> exists(entries.size());
+    auto fillRange{[&](size_t begin, size_t end) {
+        for (size_t index{begin}; index < end; index++)
+            exists[index] = FillEntry(fd.Get(), entries[index]);
+    }};
+    if (entries.size() >= ParallelStatThreshold)
+        ParallelFor((entries.size() + StatChunkSize - 1) / StatChunkSize, StatThreadCount, [&](size_t chunk) {
+            fillRange(chunk * StatChunkSize, std::min((chunk + 1) * StatChunkSize, entries.size()));
+        });
+    else
+        fillRange(0, entries.size());
+
+    size_t index{};
+    std::erase_if(entries, [&](const DirectoryEntry &) { return !exists[index++]; });
+    return entries;
+}
+
+std::vector<uint8_t> DirectoryIndex::Pack(const std::vector<DirectoryEntry> &entries) {
+    size_t size{sizeof(uint32_t)};
+    for (const auto &entry: entries)
+        size += sizeof(int64_t) * 2 + sizeof(uint8_t) * 2 + sizeof(uint16_t) + entry.name.size();
+
+    std::vector<uint8_t> buffer(size);
+    auto output{buffer.data()};
+    auto write{[&output](const auto &value) {
+        std::memcpy(output, &value, sizeof(value));
+        output += sizeof(value);
+    }};
+    write(static_cast<uint32_t>(entries.size()));
+    for (const auto &entry: entries) {
+        write(static_cast<int64_t>(entry.size));
+        write(entry.lastModifiedMs);
+        write(static_cast<uint8_t>(entry.type));
+        write(static_cast<uint8_t>(entry.writable));
+        write(static_cast<uint16_t>(entry.name.size())); // Names are at most 255 bytes on every filesystem we can be on.
+        std::memcpy(output, entry.name.data(), entry.name.size());
+        output += entry.name.size();
+    }
+    return buffer;
+}
+
+void DirectoryIndex::Sort(std::vector<DirectoryEntry> &entries, DirectorySortOrder order) {
+    auto field{static_cast<DirectorySortOrder>(static_cast<uint32_t>(order) & static_cast<uint32_t>(DirectorySortOrder::FieldMask))};
+    if (field == DirectorySortOrder::None)
+        return;
+    bool descending{(static_cast<uint32_t>(order) & static_cast<uint32_t>(DirectorySortOrder::Descending)) != 0};
+
+    auto compareNames{[](const DirectoryEntry &a, const DirectoryEntry &b) {
+        // Names are compared case-insensitively like the file picker does, with the exact name as a tie-breaker so the order is stable.
+        int result{strcasecmp(a.name.c_str(), b.name.c_str())};
+        return result != 0 ? result < 0 : a.name < b.name;
+    }};
+    auto less{[&](const DirectoryEntry &a, const DirectoryEntry &b) {
+        if (field == DirectorySortOrder::LastModified && a.lastModifiedMs != b.lastModifiedMs)
+            return a.lastModifiedMs < b.lastModifiedMs;
+        if (field == DirectorySortOrder::Size && a.size != b.size)
+            return a.size < b.size;
+        return compareNames(a, b);
+    }};
+    if (descending)
+        std::sort(entries.begin(), entries.end(), [&](const DirectoryEntry &a, const DirectoryEntry &b) { return less(b, a); });
+    else
+        std::sort(entries.begin(), entries.end(), less);
+}
+
+void DirectoryIndex::DrainEvents() {
+    if (!inotifyFd.Valid())
+        return;
+    alignas(inotify_event) std::array<uint8_t, 4096> buffer;
+    while (true) {
+        ssize_t count{read(inotifyFd.Get(), buffer.data(), buffer.size())};
+        if (count <= 0)
+            break; // EAGAIN, there are no more events.
+        for (ssize_t offset{}; offset < count;) {
+            auto event{reinterpret_cast<const inotify_event *>(buffer.data() + offset)};
+            offset += static_cast<ssize_t>(sizeof(inotify_event) + event->len);
+
+            auto invalidate{[this](CachedDirectory &directory) {
+                stats.invalidations += directory.valid;
+                directory.valid = false;
+                directory.generation = ++generationCounter;
+                directory.entries.clear();
+                directory.packed.clear();
+            }};
+            if (event->mask & IN_Q_OVERFLOW) {
+                // Events were lost, so any directory could have changed.
+                for (auto &[path, directory]: directories)
+                    invalidate(directory);
+                continue;
+            }
+            auto it{watches.find(event->wd)};
+            if (it == watches.end())
+                continue;
+            if (event->mask & IN_IGNORED) {
+                // The directory was removed so its watch is gone, it's forgotten and watched again if it's recreated.
+                for (const auto &path: it->second) {
+                    auto directory{directories.find(path)};
+                    lru.erase(directory->second.lruPosition);
+                    directories.erase(directory);
+                }
+                watches.erase(it);
+                continue;
+            }
+            for (const auto &path: it->second)
+                invalidate(directories.at(path));
+        }
+    }
+}
+
+DirectoryIndex::CachedDirectory &DirectoryIndex::GetDirectory(const std::string &path) {
+    auto it{directories.find(path)};
+    if (it != directories.end()) {
+        lru.splice(lru.begin(), lru, it->second.lruPosition);
+        return it->second;
+    }
+
+    if (directories.size() >= maxDirectories) {
+        auto evicted{directories.find(lru.back())};
+        auto watch{watches.find(evicted->second.watch)};
+        if (watch != watches.end()) {
+            std::erase(watch->second, lru.back());
+            if (watch->second.empty()) {
+                inotify_rm_watch(inotifyFd.Get(), watch->first);
+                watches.erase(watch);
+            }
+        }
+        directories.erase(evicted);
+        lru.pop_back();
+    }
+
+    // The watch is added before the directory is read, so a change while it's being read invalidates the listing. Paths that alias the same directory share a watch.
+    int watch{inotifyFd.Valid() ? inotify_add_watch(inotifyFd.Get(), path.c_str(), WatchMask) : -1};
+    if (watch != -1)
+        watches[watch].push_back(path);
+    lru.push_front(path);
+    auto &directory{directories[path]};
+    directory.watch = watch;
+    directory.generation = ++generationCounter;
+    directory.lruPosition = lru.begin();
+    return directory;
+}
+
+std::shared_ptr<const std::vector<uint8_t>> DirectoryIndex::List(const std::string &pPath, DirectorySortOrder order) {
+    auto path{std::filesystem::path{pPath}.lexically_normal().string()};
+    auto orderKey{static_cast<uint32_t>(order)};
+    uint64_t generation;
+    {
+        std::scoped_lock lock{mutex};
+        DrainEvents();
+        auto &directory{GetDirectory(path)};
+        if (directory.valid) {
+            stats.hits++;
+            auto &packed{directory.packed[orderKey]};
+            if (!packed) {
+                auto entries{directory.entries};
+                Sort(entries, order);
+                packed = std::make_shared<const std::vector<uint8_t>>(Pack(entries));
+            }
+            return packed;
+        }
+        stats.misses++;
+        generation = directory.generation;
+    }
+
+    auto entries{ReadDirectory(path)};
+    auto sorted{entries};
+    Sort(sorted, order);
+    auto packed{std::make_shared<const std::vector<uint8_t>>(Pack(sorted))};
+
+    std::scoped_lock lock{mutex};
+    DrainEvents();
+    auto it{directories.find(path)};
+    if (it != directories.end() && it->second.watch != -1 && it->second.generation == generation) {
+        auto &directory{it->second};
+        directory.valid = true;
+        directory.entries = std::move(entries);
+        directory.packed.clear();
+        directory.packed[orderKey] = packed;
+    }
+    return packed;
+}
+
+DirectoryIndexStats DirectoryIndex::GetStats() {
+    std::scoped_lock lock{mutex};
+    auto result{stats};
+    result.cachedDirectories = directories.size();
+    return result;
+}
+}
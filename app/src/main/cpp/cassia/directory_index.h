@@ -0,0 +1,115 @@
+// Copyright © 2023 Cassia Developers, all rights reserved.
+#pragma once
+
+#include "util/fd.h"
+#include <filesystem>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace cassia {
+enum class DirectoryEntryType : uint8_t {
+    File,
+    Directory,
+    Other, //!< Anything else, including symlinks that don't resolve.
+};
+
+/**
+ * @brief The metadata of a single entry of a directory, symlinks are resolved like java.io.File does.
+ */
+struct DirectoryEntry {
+    std::string name;
+    uint64_t size;
+    int64_t lastModifiedMs;
+    DirectoryEntryType type;
+    bool writable; //!< If the permission bits allow us to write to the entry, this doesn't account for SELinux or read-only mounts.
+};
+
+/**
+ * @brief The order of a listing, the descending bit can be combined with any field.
+ */
+enum class DirectorySortOrder : uint32_t {
+    None = 0, //!< The order of the entries in the directory, which is the cheapest as nothing needs to be sorted.
+    Name = 1,
+    LastModified = 2,
+    Size = 3,
+    FieldMask = 0b11,
+    Descending = 0b100,
+};
+
+/**
+ * @brief Statistics about the lifetime of a DirectoryIndex.
+ */
+struct DirectoryIndexStats {
+    uint64_t hits; //!< Listings that were served from the cache.
+    uint64_t misses; //!< Listings that required reading the directory.
+    uint64_t invalidations; //!< Cached directories that were invalidated by a change.
+    size_t cachedDirectories;
+};
+
+/**
+ * @brief An index of the metadata of directories, which is used to serve the queries of the DocumentsProvider without listing and stating entries one by one from the JVM.
+ * @details Directories are read with getdents64 and their entries are stated with statx relative to the directory fd, large directories are stated on several threads.
+ * Listings are cached in the packed form that's returned to Kotlin, along with every sorted order that was requested. Cached directories are watched with inotify and invalidated on any change to them, events are drained before every query so no thread is needed to watch them.
+ * @note This is safe to use from any amount of threads concurrently, directories are read without the lock held so a slow directory doesn't block queries for others.
+ */
+class DirectoryIndex {
+  private:
+    struct CachedDirectory {
+        int watch{-1}; //!< The inotify watch descriptor of the directory.
+        uint64_t generation{}; //!< This is unique across all directories and changes on every invalidation, so a listing that raced with a change isn't cached.
+        bool valid{};
+        std::vector<DirectoryEntry> entries;
+        std::unordered_map<uint32_t, std::shared_ptr<const std::vector<uint8_t>>> packed; //!< The packed listing of every sort order that was requested, keyed by the order.
+        std::list<std::string>::iterator lruPosition;
+    };
+
+    std::mutex mutex;
+    UniqueFd inotifyFd;
+    size_t maxDirectories;
+    std::unordered_map<std::string, CachedDirectory> directories;
+    std::unordered_map<int, std::vector<std::string>> watches; //!< The cached paths of every watch descriptor, paths that alias the same directory share its watch.
+    uint64_t generationCounter{};
+    std::list<std::string> lru; //!< Cached directories from most to least recently used.
+    DirectoryIndexStats stats{};
+
+    /**
+     * @brief Invalidates every directory with a pending inotify event.
+     */
+    void DrainEvents();
+
+    /**
+     * @return The cache of a directory, this starts watching it if it isn't cached yet and evicts the least recently used directory if the cache is full.
+     */
+    CachedDirectory &GetDirectory(const std::string &path);
+
+  public:
+    /**
+     * @param maxDirectories The amount of directories that are cached, every cached directory uses an inotify watch.
+     */
+    explicit DirectoryIndex(size_t maxDirectories = 64);
+
+    /**
+     * @brief Reads and stats all entries of a directory, this is uncached.
+     */
+    static std::vector<DirectoryEntry> ReadDirectory(const std::filesystem::path &path);
+
+    /**
+     * @brief Serializes a listing into the format that's parsed by the DocumentsProvider.
+     * @details The listing is a little-endian uint32 count followed by every entry as an int64 size, int64 modification time in milliseconds, uint8 type, uint8 writable flag, uint16 name length and the name in UTF-8.
+     */
+    static std::vector<uint8_t> Pack(const std::vector<DirectoryEntry> &entries);
+
+    static void Sort(std::vector<DirectoryEntry> &entries, DirectorySortOrder order);
+
+    /**
+     * @return The packed listing of a directory in the supplied order, this is served from the cache unless the directory changed since it was last listed.
+     */
+    std::shared_ptr<const std::vector<uint8_t>> List(const std::string &path, DirectorySortOrder order);
+
+    DirectoryIndexStats GetStats();
+};
+}
@@ -0,0 +1,120 @@
+// Copyright © 2023 Cassia Developers, all rights reserved.
+
+#include "frame_source.h"
+#include <cstring>
+
+namespace cassia {
+/**
+ * @brief Copies a rectangle between two buffers of the same format.
+ */
+static void CopyRect(const uint8_t *src, size_t srcStride, uint8_t *dst, size_t dstStride, const PixelRect &rect) {
+    size_t offset{static_cast<size_t>(rect.x) * 4}, rowSize{static_cast<size_t>(rect.width) * 4};
+    for (int32_t row{rect.y}; row < rect.y + rect.height; row++)
+        std::memcpy(dst + row * dstStride + offset, src + row * srcStride + offset, rowSize);
+}
+
+void BufferFrameSource::Publish(const uint8_t *pixels, size_t stride, uint32_t width, uint32_t height, PixelFormat format, const DamageRegion &damage) {
+    PixelRect frameRect{0, 0, static_cast<int32_t>(width), static_cast<int32_t>(height)};
+    size_t index;
+    DamageRegion copyRegion;
+    {
+        std::scoped_lock lock{mutex};
+        for (index = 0; index < SlotCount; index++)
+            if (index != latestSlot && index != acquiredSlot)
+                break;
+
+        auto &slot{slots[index]};
+        if (slot.width != width || slot.height != height || slot.format != format) {
+            slot.pixels.resize(static_cast<size_t>(width) * height * 4);
+            slot.width = width;
+            slot.height = height;
+            slot.format = format;
+            copyRegion.Add(frameRect);
+        } else {
+            copyRegion.Add(slot.stale);
+            copyRegion.Add(damage);
+        }
+        slot.stale.Clear();
+    }
+
+    // The slot can't be acquired until it's the latest slot, so it can be written without holding the lock.
+    auto &slot{slots[index]};
+    for (const auto &rect: copyRegion.GetRects())
+        CopyRect(pixels, stride, slot.pixels.data(), static_cast<size_t>(width) * 4, rect.Intersect(frameRect));
+
+    {
+        std::scoped_lock lock{mutex};
+        bool resized{latestSlot == NoSlot || slots[latestSlot].width != width || slots[latestSlot].height != height || slots[latestSlot].format != format};
+        for (size_t other{}; other < SlotCount; other++) {
+            if (other == index)
+                continue;
+            auto &otherSlot{slots[other]};
+            if (resized)
+                otherSlot.stale.Add(PixelRect{0, 0, static_cast<int32_t>(otherSlot.width), static_cast<int32_t>(otherSlot.height)}); // The slot may be reused if the size changes back, it can't be patched up from damage across a resize.
+            else
+                otherSlot.stale.Add(damage);
+        }
+
+        if (resized) {
+            pendingDamage.Clear();
+            pendingDamage.Add(frameRect);
+        } else {
+            for (const auto &rect: damage.GetRects())
+                pendingDamage.Add(rect.Intersect(frameRect));
+        }
+
+        slot.sequence = ++sequence;
+        slot.timestamp = std::chrono::steady_clock::now();
+        latestSlot = index;
+    }
+    condition.notify_one();
+}
+
+bool BufferFrameSource::AcquireFrame(Frame &frame, std::chrono::nanoseconds timeout) {
+    std::unique_lock lock{mutex};
+    condition.wait_for(lock, timeout, [this] { return interrupted || (latestSlot != NoSlot && !pendingDamage.Empty()); });
+    if (interrupted) {
+        interrupted = false;
+        return false;
+    }
+    if (latestSlot == NoSlot || pendingDamage.Empty())
+        return false;
+
+    const auto &slot{slots[latestSlot]};
+    acquiredSlot = latestSlot;
+    frame.pixels = slot.pixels.data();
+    frame.width = slot.width;
+    frame.height = slot.height;
+    frame.stride = static_cast<size_t>(slot.width) * 4;
+    frame.format = slot.format;
+    frame.damage = pendingDamage;
+    frame.sequence = slot.sequence;
+    frame.timestamp = slot.timestamp;
+    pendingDamage.Clear();
+    return true;
+}
+
+void BufferFrameSource::ReleaseFrame() {
+    std::scoped_lock lock{mutex};
+    acquiredSlot = NoSlot;
+}
+
+void BufferFrameSource::InvalidateAll() {
+    {
+        std::scoped_lock lock{mutex};
+        if (latestSlot == NoSlot)
+            return;
+        pendingDamage.Clear();
+        pendingDamage.Add(PixelRect{0, 0, static_cast<int32_t>(slots[latestSlot].width), static_cast<int32_t>(slots[latestSlot].height)});
+    }
+    condition.notify_one();
+}
+
+void BufferFrameSource::Interrupt() {
+    {
+        std::scoped_lock lock{mutex};
+        interrupted = true;
+    }
+    condition.notify_one();
+}
+}
@@ -0,0 +1,95 @@
+// Copyright © 2023 Cassia Developers, all rights reserved.
+#pragma once
+
+#include "pixel_convert.h"
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+
+namespace cassia {
+/**
+ * @brief A complete image from a frame source along with the regions which changed since the previously acquired frame.
+ */
+struct Frame {
+    const uint8_t *pixels;
+    uint32_t width, height;
+    size_t stride; //!< The size of a row in bytes.
+    PixelFormat format;
+    DamageRegion damage; //!< The regions that need to be presented, this is the entire frame after a resize or an invalidation.
+    uint64_t sequence; //!< The sequence number of the frame, frames which were superseded before being acquired are skipped.
+    std::chrono::steady_clock::time_point timestamp; //!< The time at which the frame was published.
+};
+
+/**
+ * @brief An interface for producers of frames that are presented by the Compositor.
+ * @note Frames are only ever acquired from the Compositor's present thread, while the other functions may be called from any thread.
+ */
+struct FrameSource {
+    virtual ~FrameSource() = default;
+
+    /**
+     * @brief Waits for a frame with damage that hasn't been acquired yet.
+     * @return If a frame was acquired, this is false if the timeout elapsed or the wait was interrupted.
+     * @note The frame's pixels are only valid until ReleaseFrame is called, and there can only be a single acquired frame at a time.
+     */
+    virtual bool AcquireFrame(Frame &frame, std::chrono::nanoseconds timeout) = 0;
+
+    virtual void ReleaseFrame() = 0;
+
+    /**
+     * @brief Marks the entirety of the latest frame as damaged, so it's presented again in full (such as on a new window).
+     */
+    virtual void InvalidateAll() = 0;
+
+    /**
+     * @brief Wakes up a pending or the next call to AcquireFrame without a frame.
+     */
+    virtual void Interrupt() = 0;
+};
+
+/**
+ * @brief A frame source that frames are published into from memory, these are triple-buffered so neither side ever waits for the other.
+ * @details Every slot tracks the damage that was published since it was last written, so publishing only copies the damaged regions rather than the entire frame.
+ */
+class BufferFrameSource : public FrameSource {
+  private:
+    static constexpr size_t SlotCount{3};
+    static constexpr size_t NoSlot{SlotCount};
+
+    struct Slot {
+        std::vector<uint8_t> pixels;
+        uint32_t width{}, height{};
+        PixelFormat format{};
+        DamageRegion stale; //!< The regions that were published into other slots since this slot was last written.
+        uint64_t sequence{};
+        std::chrono::steady_clock::time_point timestamp;
+    };
+
+    std::mutex mutex;
+    std::condition_variable condition; //!< Signalled when a frame is published, the frame is invalidated or on an interrupt.
+    std::array<Slot, SlotCount> slots;
+    size_t latestSlot{NoSlot}; //!< The slot holding the most recently published frame.
+    size_t acquiredSlot{NoSlot}; //!< The slot holding the frame that's currently acquired by the consumer.
+    DamageRegion pendingDamage; //!< The damage accumulated since the consumer last acquired a frame.
+    uint64_t sequence{};
+    bool interrupted{};
+
+  public:
+    /**
+     * @brief Publishes a new frame, only the damaged regions (and any regions the target slot is missing) are copied.
+     * @param pixels The entire image, not only the damaged regions.
+     * @note This may only be called from a single thread at a time.
+     */
+    void Publish(const uint8_t *pixels, size_t stride, uint32_t width, uint32_t height, PixelFormat format, const DamageRegion &damage);
+
+    bool AcquireFrame(Frame &frame, std::chrono::nanoseconds timeout) override;
+
+    void ReleaseFrame() override;
+
+    void InvalidateAll() override;
+
+    void Interrupt() override;
+};
+}
@@ -0,0 +1,259 @@
+// Copyright © 2023 Cassia Developers, all rights reserved.
+
+#include "input_injector.h"
+#include "util/percentile.h"
+#include "util/trace.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <vector>
+#include <poll.h>
+#include <sys/eventfd.h>
+
+namespace cassia {
+/**
+ * @brief The offset between Linux scancodes and X keycodes, which is used by the evdev rules of XKB.
+ */
+constexpr uint32_t X11KeycodeOffset{8};
+
+/**
+ * @return The X button of a Linux BTN_* code, or 0 if there isn't one.
+ */
+static uint8_t GetX11Button(uint32_t code) {
+    switch (code) {
+        case 0x110: // BTN_LEFT
+            return 1;
+        case 0x111: // BTN_RIGHT
+            return 3;
+        case 0x112: // BTN_MIDDLE
+            return 2;
+        case 0x113: // BTN_SIDE
+            return 8;
+        case 0x114: // BTN_EXTRA
+            return 9;
+        default:
+            return 0;
+    }
+}
+
+static int16_t ClampToInt16(float value) {
+    return static_cast<int16_t>(std::clamp(value, -32768.0f, 32767.0f));
+}
+
+InputInjector::InputInjector(std::string display) : display{std::move(display)}, wakeEventFd{eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK), "input_injector"} {
+    if (!wakeEventFd.Valid())
+        throw Exception{"eventfd failed: {}", strerror(errno)};
+    injectorThread = std::thread{&InputInjector::InjectorThread, this};
+}
+
+InputInjector::~InputInjector() {
+    stopping = true;
+    eventfd_write(wakeEventFd.Get(), 1);
+    injectorThread.join();
+}
+
+size_t InputInjector::Push(std::span<const InputEvent> events) {
+    auto now{std::chrono::steady_clock::now()};
+    size_t pushed{};
+    for (auto event: events) {
+        event.timestamp = now;
+        if (!ring.TryPush(event))
+            break;
+        pushed++;
+    }
+    pushedEvents.fetch_add(pushed, std::memory_order_relaxed);
+    if (pushed != events.size())
+        droppedEvents.fetch_add(events.size() - pushed, std::memory_order_relaxed);
+    if (pushed) {
+        int result{eventfd_write(wakeEventFd.Get(), 1)};
+        TerminateIf(result == -1 && errno != EAGAIN, "eventfd_write({}) failed: {}", wakeEventFd.Get(), strerror(errno));
+    }
+    return pushed;
+}
+
+bool InputInjector::EnsureConnected() {
+    if (connection)
+        return true;
+    auto now{std::chrono::steady_clock::now()};
+    if (lastConnectAttempt != std::chrono::steady_clock::time_point{} && now - lastConnectAttempt < ReconnectInterval)
+        return false;
+    lastConnectAttempt = now;
+
+    try {
+        connection.emplace(display);
+    } catch (const std::exception &e) {
+        if (!connectFailureLogged)
+            fmt::println(stderr, "Failed to connect to X display for input injection: {}", e.what());
+        connectFailureLogged = true;
+        return false;
+    }
+    connectFailureLogged = false;
+    std::scoped_lock lock{statsMutex};
+    connected = true;
+    return true;
+}
+
+void InputInjector::Disconnect(const std::exception &error) {
+    fmt::println(stderr, "Lost X display for input injection: {}", error.what());
+    connection.reset();
+    hasRelativeMotion = hasAbsoluteMotion = false;
+    motionX = motionY = residualX = residualY = scrollX = scrollY = 0;
+    std::scoped_lock lock{statsMutex};
+    connected = false;
+}
+
+void InputInjector::FlushMotion() {
+    if (hasRelativeMotion) {
+        float x{motionX + residualX}, y{motionY + residualY};
+        auto deltaX{ClampToInt16(std::trunc(x))}, deltaY{ClampToInt16(std::trunc(y))};
+        residualX = x - deltaX;
+        residualY = y - deltaY;
+        if (deltaX || deltaY)
+            connection->FakeInput(X11EventType::MotionNotify, 1, deltaX, deltaY);
+        hasRelativeMotion = false;
+        motionX = motionY = 0;
+    }
+    if (hasAbsoluteMotion) {
+        connection->FakeInput(X11EventType::MotionNotify, 0, ClampToInt16(absoluteX), ClampToInt16(absoluteY));
+        hasAbsoluteMotion = false;
+    }
+
+    // Scrolling is injected as clicks of the scroll buttons: 4 and 5 scroll up and down, 6 and 7 scroll left and right.
+    auto injectClicks{[this](float &delta, uint8_t positiveButton, uint8_t negativeButton) {
+        auto clicks{static_cast<int>(std::trunc(delta))};
+        delta -= static_cast<float>(clicks);
+        uint8_t button{clicks > 0 ? positiveButton : negativeButton};
+        for (int click{}; click < std::min(std::abs(clicks), MaxScrollClicks); click++) {
+            connection->FakeInput(X11EventType::ButtonPress, button);
+            connection->FakeInput(X11EventType::ButtonRelease, button);
+        }
+    }};
+    injectClicks(scrollY, 4, 5);
+    injectClicks(scrollX, 7, 6);
+}
+
+void InputInjector::ProcessEvents() {
+    if (!EnsureConnected()) {
+        InputEvent event;
+        uint64_t dropped{};
+        while (ring.TryPop(event))
+            dropped++;
+        droppedEvents.fetch_add(dropped, std::memory_order_relaxed);
+        return;
+    }
+
+    InputEvent event;
+    std::optional<std::chrono::steady_clock::time_point> oldestTimestamp;
+    uint64_t coalesced{};
+    bool hasScroll{};
+    while (ring.TryPop(event)) {
+        if (!oldestTimestamp)
+            oldestTimestamp = event.timestamp;
+        switch (event.type) {
+            case InputEventType::RelativeMotion:
+                if (hasAbsoluteMotion)
+                    FlushMotion(); // Relative and absolute motion can't be merged, but their order needs to be retained.
+                coalesced += hasRelativeMotion;
+                motionX += event.x;
+                motionY += event.y;
+                hasRelativeMotion = true;
+                break;
+
+            case InputEventType::AbsoluteMotion:
+                if (hasRelativeMotion)
+                    FlushMotion();
+                coalesced += hasAbsoluteMotion;
+                absoluteX = event.x;
+                absoluteY = event.y;
+                hasAbsoluteMotion = true;
+                break;
+
+            case InputEventType::Scroll:
+                coalesced += hasScroll;
+                hasScroll = true;
+                scrollX += event.x;
+                scrollY += event.y;
+                break;
+
+            case InputEventType::ButtonDown:
+            case InputEventType::ButtonUp:
+                FlushMotion();
+                if (auto button{GetX11Button(event.code)})
+                    connection->FakeInput(event.type == InputEventType::ButtonDown ? X11EventType::ButtonPress : X11EventType::ButtonRelease, button);
+                break;
+
+            case InputEventType::KeyDown:
+            case InputEventType::KeyUp:
+                FlushMotion();
+                if (connection->IsValidKeycode(event.code + X11KeycodeOffset))
+                    connection->FakeInput(event.type == InputEventType::KeyDown ? X11EventType::KeyPress : X11EventType::KeyRelease, static_cast<uint8_t>(event.code + X11KeycodeOffset));
+                break;
+        }
+    }
+    if (!oldestTimestamp)
+        return;
+    FlushMotion();
+
+    TraceScope trace{"input.inject", "bytes", static_cast<int64_t>(connection->GetQueuedSize())};
+    size_t requests{connection->GetQueuedSize() / X11Connection::FakeInputRequestSize};
+    try {
+        if (requests)
+            connection->Flush();
+    } catch (const std::exception &e) {
+        Disconnect(e);
+        return;
+    }
+
+    auto latency{std::chrono::steady_clock::now() - *oldestTimestamp};
+    std::scoped_lock lock{statsMutex};
+    coalescedEvents += coalesced;
+    injectedRequests += requests;
+    if (requests) {
+        batches++;
+        latencies[latencyCount++ % SampleCount] = latency;
+    }
+}
+
+void InputInjector::InjectorThread() {
+    while (!stopping) {
+        // A negative fd is ignored by poll, so the connection is only polled while there is one.
+        std::array<pollfd, 2> fds{pollfd{.fd = wakeEventFd.Get(), .events = POLLIN}, pollfd{.fd = connection ? connection->GetFd() : -1, .events = POLLIN}};
+        // There's no timeout as connecting is only retried once there are events to inject.
+        int result{poll(fds.data(), fds.size(), -1)};
+        TerminateIf(result == -1 && errno != EINTR, "poll failed: {}", strerror(errno));
+
+        if (fds[0].revents & POLLIN) {
+            eventfd_t value;
+            eventfd_read(wakeEventFd.Get(), &value);
+        }
+
+        if (connection && fds[1].revents) {
+            try {
+                if (auto errors{connection->ProcessIncoming()}) {
+                    std::scoped_lock lock{statsMutex};
+                    serverErrors += errors;
+                }
+            } catch (const std::exception &e) {
+                Disconnect(e);
+            }
+        }
+
+        ProcessEvents();
+    }
+}
+
+InputStats InputInjector::GetStats() {
+    std::scoped_lock lock{statsMutex};
+    return InputStats{
+        .pushedEvents = pushedEvents.load(std::memory_order_relaxed),
+        .droppedEvents = droppedEvents.load(std::memory_order_relaxed),
+        .coalescedEvents = coalescedEvents,
+        .injectedRequests = injectedRequests,
+        .batches = batches,
+        .serverErrors = serverErrors,
+        .connected = connected,
+        .latencyP50 = GetPercentile(latencies, latencyCount, 0.5),
+        .latencyP99 = GetPercentile(latencies, latencyCount, 0.99),
+    };
+}
+}
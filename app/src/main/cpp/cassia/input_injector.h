@@ -0,0 +1,123 @@
+// Copyright © 2023 Cassia Developers, all rights reserved.
+#pragma once
+
+#include "x11_connection.h"
+#include "util/spsc_ring.h"
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <thread>
+
+namespace cassia {
+enum class InputEventType : uint8_t {
+    RelativeMotion, //!< The X and Y values are a delta in pixels.
+    AbsoluteMotion, //!< The X and Y values are a position in pixels.
+    Scroll, //!< The X and Y values are a delta in detents, positive values scroll right and up like Android's scroll axes.
+    ButtonDown, //!< The code is a Linux BTN_* code.
+    ButtonUp,
+    KeyDown, //!< The code is a Linux KEY_* scancode.
+    KeyUp,
+};
+
+struct InputEvent {
+    InputEventType type;
+    uint32_t code;
+    float x, y;
+    std::chrono::steady_clock::time_point timestamp; //!< The time at which the event was pushed, this is filled in by InputInjector::Push.
+};
+
+/**
+ * @brief Statistics about the input injected by an InputInjector.
+ */
+struct InputStats {
+    uint64_t pushedEvents;
+    uint64_t droppedEvents; //!< Events that were dropped as the ring was full or there was no connection to the X server.
+    uint64_t coalescedEvents; //!< Motion and scroll events that were merged into a previous event rather than being injected separately.
+    uint64_t injectedRequests;
+    uint64_t batches; //!< The amount of writes to the X server, each containing all requests since the previous one.
+    uint64_t serverErrors; //!< Errors returned by the X server, such as for keycodes that it doesn't know.
+    bool connected;
+    std::chrono::nanoseconds latencyP50, latencyP99; //!< The time from pushing the oldest event of a batch to writing it, over the most recent batches.
+};
+
+/**
+ * @brief Injects input events into an X server with XTEST from a dedicated thread.
+ * @details Events are pushed in batches through a lock-free ring, so the pushing thread (usually the UI thread) never blocks on the X server.
+ * All events that are in the ring when the injection thread wakes up form a batch: consecutive motion and scroll events in it are merged while the order of buttons and keys relative to them is kept.
+ * The connection is established lazily and re-established after it's lost, as the X server may start after the injector or be restarted.
+ */
+class InputInjector {
+  private:
+    static constexpr size_t RingCapacity{4096};
+    static constexpr size_t SampleCount{256}; //!< The amount of recent batches that latency percentiles are computed over.
+    static constexpr std::chrono::seconds ReconnectInterval{1};
+    static constexpr int MaxScrollClicks{16}; //!< The maximum amount of scroll button clicks injected per batch in each direction, excess scrolling is discarded.
+
+    std::string display;
+    SpscRing<InputEvent> ring{RingCapacity};
+    UniqueFd wakeEventFd;
+    std::atomic<bool> stopping{};
+    std::atomic<uint64_t> pushedEvents{}, droppedEvents{};
+
+    // These are only accessed by the injection thread.
+    std::optional<X11Connection> connection;
+    std::chrono::steady_clock::time_point lastConnectAttempt;
+    bool connectFailureLogged{}; //!< If a failure to connect was logged since the last successful connection, so retries don't spam the log.
+    bool hasRelativeMotion{}, hasAbsoluteMotion{};
+    float motionX{}, motionY{}; //!< The relative motion accumulated in the current batch.
+    float residualX{}, residualY{}; //!< The fractional part of relative motion that hasn't been injected yet.
+    float absoluteX{}, absoluteY{}; //!< The latest absolute position in the current batch.
+    float scrollX{}, scrollY{}; //!< The scroll delta that hasn't been injected yet, this is carried over between batches until it adds up to a click.
+
+    std::mutex statsMutex;
+    uint64_t coalescedEvents{}, injectedRequests{}, batches{}, serverErrors{};
+    bool connected{};
+    std::array<std::chrono::nanoseconds, SampleCount> latencies{};
+    uint64_t latencyCount{};
+
+    std::thread injectorThread;
+
+    /**
+     * @return If there's a connection to the X server, this tries to connect if there isn't one and enough time has passed since the last attempt.
+     */
+    bool EnsureConnected();
+
+    void Disconnect(const std::exception &error);
+
+    /**
+     * @brief Queues requests for any pending motion and scroll, this must be done before any button or key to retain their order.
+     */
+    void FlushMotion();
+
+    /**
+     * @brief Drains the ring and injects all events in it as a single batch.
+     */
+    void ProcessEvents();
+
+    void InjectorThread();
+
+  public:
+    /**
+     * @param display The X display to inject input into, in the format of DISPLAY.
+     */
+    explicit InputInjector(std::string display);
+
+    InputInjector(const InputInjector &) = delete;
+
+    InputInjector &operator=(const InputInjector &) = delete;
+
+    ~InputInjector();
+
+    /**
+     * @brief Queues events for injection and wakes up the injection thread.
+     * @return The amount of events that were queued, the rest were dropped as the ring is full.
+     * @note This may only be called from a single thread at a time.
+     */
+    size_t Push(std::span<const InputEvent> events);
+
+    InputStats GetStats();
+};
+}
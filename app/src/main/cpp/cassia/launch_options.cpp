@@ -0,0 +1,167 @@
+// Copyright © 2023 Cassia Developers, all rights reserved.
+
+#include "launch_options.h"
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <charconv>
+#include <fstream>
+#include <limits>
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+namespace cassia {
+/**
+ * @brief The argument of sched_setattr, neither bionic nor glibc expose it.
+ */
+struct SchedAttr {
+    uint32_t size;
+    uint32_t schedPolicy;
+    uint64_t schedFlags;
+    int32_t schedNice;
+    uint32_t schedPriority;
+    uint64_t schedRuntime;
+    uint64_t schedDeadline;
+    uint64_t schedPeriod;
+    uint32_t schedUtilMin;
+    uint32_t schedUtilMax;
+};
+
+constexpr uint64_t SchedFlagKeepAll{0x08 | 0x10}; //!< SCHED_FLAG_KEEP_POLICY | SCHED_FLAG_KEEP_PARAMS, so only the clamps are changed.
+constexpr uint64_t SchedFlagUtilClampMin{0x20};
+constexpr uint64_t SchedFlagUtilClampMax{0x40};
+
+static bool ApplyRlimit(int resource, uint64_t value) {
+    rlimit limit{};
+    if (getrlimit(resource, &limit) == -1)
+        return false;
+    limit.rlim_cur = limit.rlim_max == RLIM_INFINITY ? static_cast<rlim_t>(value) : std::min(static_cast<rlim_t>(value), limit.rlim_max);
+    return setrlimit(resource, &limit) == 0;
+}
+
+static bool ApplyOomScoreAdj(int32_t value) {
+    // This is formatted into a stack buffer as allocating isn't safe in the child.
+    std::array<char, 16> buffer;
+    auto result{std::to_chars(buffer.data(), buffer.data() + buffer.size(), value)};
+    int fd{open("/proc/self/oom_score_adj", O_WRONLY | O_CLOEXEC)};
+    if (fd == -1)
+        return false;
+    bool written{write(fd, buffer.data(), static_cast<size_t>(result.ptr - buffer.data())) != -1};
+    int error{errno};
+    close(fd);
+    errno = error;
+    return written;
+}
+
+LaunchOptionsResult ApplyLaunchOptions(const LaunchOptions &options) {
+    LaunchOptionsResult result{};
+    auto check{[&](bool success, LaunchOption option) {
+        if (!success) {
+            result.failedOptions |= 1U << static_cast<uint32_t>(option);
+            result.error = errno;
+        }
+    }};
+
+    if (options.affinity) {
+        cpu_set_t cpuSet;
+        CPU_ZERO(&cpuSet);
+        for (int cpu{}; cpu < 64; cpu++)
+            if (options.affinity & (uint64_t{1} << cpu))
+                CPU_SET(cpu, &cpuSet);
+        check(sched_setaffinity(0, sizeof(cpuSet), &cpuSet) == 0, LaunchOption::Affinity);
+    }
+
+    // The nice value is applied to the thread rather than the process, the child only has a single thread at this point so it's the same.
+    if (options.nice)
+        check(setpriority(PRIO_PROCESS, 0, *options.nice) == 0, LaunchOption::Nice);
+
+    if (options.uclampMin || options.uclampMax) {
+        SchedAttr attr{
+            .size = sizeof(SchedAttr),
+            .schedFlags = SchedFlagKeepAll | (options.uclampMin ? SchedFlagUtilClampMin : 0) | (options.uclampMax ? SchedFlagUtilClampMax : 0),
+            .schedUtilMin = options.uclampMin.value_or(0),
+            .schedUtilMax = options.uclampMax.value_or(1024),
+        };
+        check(syscall(__NR_sched_setattr, 0, &attr, 0) == 0, LaunchOption::Uclamp);
+    }
+
+    if (options.maxOpenFiles)
+        check(ApplyRlimit(RLIMIT_NOFILE, *options.maxOpenFiles), LaunchOption::MaxOpenFiles);
+    if (options.stackSize)
+        check(ApplyRlimit(RLIMIT_STACK, *options.stackSize), LaunchOption::StackSize);
+    if (options.oomScoreAdj)
+        check(ApplyOomScoreAdj(*options.oomScoreAdj), LaunchOption::OomScoreAdj);
+
+    if (options.group == ProcessGroupPlacement::NewGroup)
+        check(setpgid(0, 0) == 0, LaunchOption::Group);
+    else if (options.group == ProcessGroupPlacement::NewSession)
+        check(setsid() != -1, LaunchOption::Group);
+
+    return result;
+}
+
+std::string DescribeFailedLaunchOptions(uint32_t failedOptions) {
+    constexpr std::array<const char *, 7> Names{"affinity", "nice", "uclamp", "RLIMIT_NOFILE", "RLIMIT_STACK", "oom_score_adj", "process group"};
+    std::string description;
+    for (size_t index{}; index < Names.size(); index++) {
+        if (!(failedOptions & (1U << index)))
+            continue;
+        if (!description.empty())
+            description += ", ";
+        description += Names[index];
+    }
+    return description;
+}
+
+CpuTopology ReadCpuTopology(const std::filesystem::path &cpuDirectory) {
+    std::array<uint64_t, 64> capacities{};
+    uint64_t allCores{};
+    std::error_code error;
+    for (const auto &entry: std::filesystem::directory_iterator{cpuDirectory, error}) {
+        auto name{entry.path().filename().string()};
+        unsigned cpu{};
+        if (!name.starts_with("cpu"))
+            continue;
+        auto parsed{std::from_chars(name.data() + 3, name.data() + name.size(), cpu)};
+        if (parsed.ec != std::errc{} || parsed.ptr != name.data() + name.size() || cpu >= capacities.size())
+            continue;
+
+        allCores |= uint64_t{1} << cpu;
+        std::ifstream capacityFile{entry.path() / "cpu_capacity"};
+        if (!(capacityFile >> capacities[cpu]))
+            capacities[cpu] = std::numeric_limits<uint64_t>::max(); // Cores without a capacity are all treated as equal.
+    }
+    if (!allCores) {
+        // sysfs isn't available, so every core we can see is assumed to be equal.
+        auto count{std::clamp<long>(sysconf(_SC_NPROCESSORS_CONF), 1, 64)};
+        allCores = count == 64 ? ~uint64_t{} : (uint64_t{1} << count) - 1;
+        return CpuTopology{.allCores = allCores, .bigCores = allCores, .littleCores = allCores};
+    }
+
+    auto minCapacity{std::numeric_limits<uint64_t>::max()};
+    for (unsigned cpu{}; cpu < capacities.size(); cpu++)
+        if (allCores & (uint64_t{1} << cpu))
+            minCapacity = std::min(minCapacity, capacities[cpu]);
+
+    CpuTopology topology{.allCores = allCores};
+    for (unsigned cpu{}; cpu < capacities.size(); cpu++) {
+        if (!(allCores & (uint64_t{1} << cpu)))
+            continue;
+        if (capacities[cpu] == minCapacity)
+            topology.littleCores |= uint64_t{1} << cpu;
+        else
+            topology.bigCores |= uint64_t{1} << cpu;
+    }
+    if (!topology.bigCores)
+        topology.bigCores = allCores; // All cores have the same capacity.
+    return topology;
+}
+
+const CpuTopology &GetCpuTopology() {
+    static const CpuTopology topology{ReadCpuTopology()};
+    return topology;
+}
+}
@@ -0,0 +1,90 @@
+// Copyright © 2023 Cassia Developers, all rights reserved.
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <type_traits>
+
+namespace cassia {
+/**
+ * @brief The process group or session that a child is placed in.
+ */
+enum class ProcessGroupPlacement : uint8_t {
+    Inherit, //!< The child stays in our process group.
+    NewGroup, //!< The child leads a new process group, so it and its descendants can be signalled together.
+    NewSession, //!< The child leads a new session, which also detaches it from any controlling terminal.
+};
+
+/**
+ * @brief Scheduling and resource limits that are applied to a child between it being spawned and executing its executable, so it never runs its own code without them.
+ * @details Every option is optional, unset options are inherited from the spawning process (which is the launcher for processes spawned through one).
+ * All options are applied on a best-effort basis, a failure to apply one (such as lacking the privileges to lower nice) is logged without failing the spawn.
+ * @note Latency-nice isn't supported as it never made it into mainline Linux, utilization clamping is what Android uses to express the same intent.
+ */
+struct LaunchOptions {
+    uint64_t affinity{}; //!< A mask of the CPUs the child may run on, this is inherited if 0.
+    std::optional<int32_t> nice;
+    std::optional<uint32_t> uclampMin, uclampMax; //!< The utilization clamps of the child between 0 and 1024, these steer DVFS and big.LITTLE task placement on kernels with uclamp.
+    std::optional<uint64_t> maxOpenFiles; //!< The soft RLIMIT_NOFILE, this is limited to the hard limit so RLIM_INFINITY raises it as far as possible.
+    std::optional<uint64_t> stackSize; //!< The soft RLIMIT_STACK in bytes, this is limited to the hard limit.
+    std::optional<int32_t> oomScoreAdj; //!< The OOM score adjustment, this can only be lowered below our own with CAP_SYS_RESOURCE.
+    ProcessGroupPlacement group{ProcessGroupPlacement::Inherit};
+};
+
+static_assert(std::is_trivially_copyable_v<LaunchOptions>, "LaunchOptions are sent to the launcher as-is");
+
+/**
+ * @brief The individual options of LaunchOptions, these are used as bits to report which options failed to apply.
+ */
+enum class LaunchOption : uint32_t {
+    Affinity,
+    Nice,
+    Uclamp,
+    MaxOpenFiles,
+    StackSize,
+    OomScoreAdj,
+    Group,
+};
+
+/**
+ * @brief The outcome of applying LaunchOptions in a child.
+ */
+struct LaunchOptionsResult {
+    uint32_t failedOptions; //!< A mask of the options that failed to apply, with a bit for every LaunchOption.
+    int error; //!< The errno of the last option that failed to apply.
+};
+
+/**
+ * @brief Applies options to the calling process, this must be called in a child before it executes anything.
+ * @note This is async-signal-safe and doesn't allocate, so it's safe to call in a vforked child sharing its parent's memory.
+ */
+LaunchOptionsResult ApplyLaunchOptions(const LaunchOptions &options);
+
+/**
+ * @return The names of all options that failed to apply, separated by commas.
+ */
+std::string DescribeFailedLaunchOptions(uint32_t failedOptions);
+
+/**
+ * @brief The CPUs of the device grouped by their capacity, as is required for placing processes on big.LITTLE systems.
+ */
+struct CpuTopology {
+    uint64_t allCores;
+    uint64_t bigCores; //!< All cores with more than the minimum capacity, on symmetric systems this is all cores.
+    uint64_t littleCores; //!< All cores with the minimum capacity, on symmetric systems this is all cores.
+};
+
+/**
+ * @brief Reads the topology from the CPU directories in sysfs, the capacity of every core is in cpuN/cpu_capacity.
+ * @param cpuDirectory The directory with the CPU directories, this is only overridden for testing.
+ * @note Cores without a capacity are considered to be of equal capacity, which is the case for x86 hosts. Only the first 64 cores are considered.
+ */
+CpuTopology ReadCpuTopology(const std::filesystem::path &cpuDirectory = "/sys/devices/system/cpu");
+
+/**
+ * @return The topology of the device, this is read once and cached as CPU capacities never change.
+ */
+const CpuTopology &GetCpuTopology();
+}
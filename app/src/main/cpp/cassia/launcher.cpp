@@ -0,0 +1,147 @@
+// Copyright © 2023 Cassia Developers, all rights reserved.
+
+#include "launcher.h"
+#include "process_monitor.h"
+#include "util/error.h"
+#include "util/trace.h"
+#include <array>
+#include <cstring>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+namespace cassia {
+/**
+ * @brief The number of the launcher's end of the socket in the launcher, it's passed to it as an argument.
+ */
+constexpr int LauncherSocketFd{3};
+
+Launcher::Launcher(const std::filesystem::path &path, const std::vector<std::string> &envVars, const std::vector<std::filesystem::path> &preloadDirectories, const LaunchOptions &options) : socket{-1} {
+    // SOCK_SEQPACKET preserves message boundaries, so every request and reply is received whole.
+    std::array<int, 2> sockets;
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sockets.data()) == -1)
+        throw Exception{"socketpair() failed: {}", strerror(errno)};
+    socket = UniqueFd{sockets[0], "launcher"};
+    UniqueFd launcherSocket{sockets[1], "launcher"};
+
+    // The launcher's end stays FD_CLOEXEC here and is only duplicated into the launcher, a copy leaked into another child would keep the socket open after the launcher exits. The launcher sets FD_CLOEXEC on it again as soon as it starts.
+    std::vector<std::string> args{std::to_string(LauncherSocketFd)};
+    for (const auto &directory: preloadDirectories)
+        args.push_back(directory.string());
+    std::array<InheritedFd, 1> inheritedFds{InheritedFd{launcherSocket.Get(), LauncherSocketFd}};
+    process = Process{path, args, envVars, Logger::GetPipe("launcher"), options, inheritedFds};
+
+    replyThread = std::thread{&Launcher::ReplyThread, this};
+}
+
+Launcher::~Launcher() {
+    shutdown(socket.Get(), SHUT_RDWR);
+    if (replyThread.joinable())
+        replyThread.join();
+    process.WaitForExit();
+}
+
+std::filesystem::path Launcher::GetBundledPath() {
+    Dl_info info{};
+    if (!dladdr(reinterpret_cast<void *>(&Launcher::GetBundledPath), &info) || !info.dli_fname)
+        throw Exception{"dladdr() failed to locate the native library"};
+    return std::filesystem::path{info.dli_fname}.parent_path() / LauncherFileName;
+}
+
+void Launcher::ReplyThread() {
+    while (true) {
+        LauncherReply reply;
+        ssize_t size{recv(socket.Get(), &reply, sizeof(reply), 0)};
+        if (size == -1 && errno == EINTR)
+            continue;
+        if (size != sizeof(reply)) {
+            if (size == -1)
+                fmt::println(stderr, "recv({}) failed: {}", socket.Get(), strerror(errno));
+            break;
+        }
+
+        std::scoped_lock lock{mutex};
+        if (reply.type == LauncherMessageType::Spawned) {
+            // The promise is created here rather than by the spawning thread as the child's Exited reply may be received before that thread wakes up.
+            SpawnResult result{.reply = reply};
+            if (reply.pid != -1)
+                result.exitCode = exitCodes[reply.pid].get_future().share();
+            spawnResults[reply.id] = std::move(result);
+            condition.notify_all();
+        } else if (reply.type == LauncherMessageType::Exited) {
+            TraceInstant("process.exit", "pid", reply.pid);
+            auto it{exitCodes.find(reply.pid)};
+            if (it != exitCodes.end()) {
+                it->second.set_value(GetExitCode(reply.value));
+                exitCodes.erase(it);
+            }
+        }
+    }
+
+    std::scoped_lock lock{mutex};
+    disconnected = true;
+    for (auto &[pid, exitCode]: exitCodes)
+        exitCode.set_value(-1); // The exit code of these children can't be determined anymore.
+    exitCodes.clear();
+    condition.notify_all();
+}
+
+std::pair<pid_t, std::shared_future<int>> Launcher::Spawn(const std::filesystem::path &exe, const std::vector<std::string> &args, const std::vector<std::string> &envVars, std::optional<LogPipe> logPipe, const LaunchOptions &options) {
+    fmt::println(stderr, "Launching '{} {}' through the launcher", exe.string(), fmt::join(args, " "));
+
+    LauncherSpawnRequest header{
+        .argCount = static_cast<uint32_t>(args.size()),
+        .envCount = static_cast<uint32_t>(envVars.size()),
+        .hasLogFds = logPipe.has_value(),
+        .options = options,
+    };
+    {
+        std::scoped_lock lock{mutex};
+        header.id = nextRequestId++;
+    }
+
+    std::string message{reinterpret_cast<const char *>(&header), sizeof(header)};
+    auto appendString{[&](std::string_view string) {
+        message.append(string);
+        message.push_back('\0');
+    }};
+    appendString(exe.string());
+    for (const auto &arg: args)
+        appendString(arg);
+    for (const auto &var: envVars)
+        appendString(var);
+    if (message.size() > LauncherMaxMessageSize)
+        throw Exception{"Spawn request for '{}' is {} bytes, which is larger than the maximum of {}", exe.string(), message.size(), LauncherMaxMessageSize};
+
+    iovec iov{.iov_base = message.data(), .iov_len = message.size()};
+    msghdr messageHeader{.msg_iov = &iov, .msg_iovlen = 1};
+    alignas(cmsghdr) std::array<char, CMSG_SPACE(sizeof(int) * 2)> control{};
+    if (logPipe) {
+        messageHeader.msg_control = control.data();
+        messageHeader.msg_controllen = control.size();
+        cmsghdr *cmsg{CMSG_FIRSTHDR(&messageHeader)};
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * 2);
+        std::array<int, 2> fds{logPipe->out.Get(), logPipe->err.Get()};
+        std::memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(fds));
+    }
+
+    while (sendmsg(socket.Get(), &messageHeader, MSG_NOSIGNAL) == -1)
+        if (errno != EINTR)
+            throw Exception{"sendmsg({}) failed: {}", socket.Get(), strerror(errno)};
+
+    std::unique_lock lock{mutex};
+    condition.wait(lock, [&] { return spawnResults.contains(header.id) || disconnected; });
+    auto it{spawnResults.find(header.id)};
+    if (it == spawnResults.end())
+        throw Exception{"The launcher exited before spawning '{}'", exe.string()};
+
+    SpawnResult result{std::move(it->second)};
+    spawnResults.erase(it);
+    if (result.reply.pid == -1)
+        throw Exception{"Failed to launch '{}': {}", exe.string(), strerror(result.reply.value)};
+    return {result.reply.pid, std::move(result.exitCode)};
+}
+}
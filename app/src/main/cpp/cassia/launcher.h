@@ -0,0 +1,74 @@
+// Copyright © 2023 Cassia Developers, all rights reserved.
+#pragma once
+
+#include "process.h"
+#include "launcher_protocol.h"
+#include <condition_variable>
+#include <unordered_map>
+
+namespace cassia {
+/**
+ * @brief A client for a launcher process, which spawns executables on our behalf so the app process never has to be forked for them.
+ * @details The launcher is started once with a fixed environment, every spawn only passes the arguments and any additional environment variables.
+ * Children of the launcher aren't our children, so their exit statuses are forwarded by the launcher rather than being reaped by the ProcessMonitor.
+ */
+class Launcher {
+  private:
+    UniqueFd socket;
+    Process process;
+    std::thread replyThread;
+
+    std::mutex mutex;
+    std::condition_variable condition; //!< Signalled when a reply has been received or the launcher has disconnected.
+    uint32_t nextRequestId{};
+
+    /**
+     * @brief The result of a spawn request, the exit code future is only valid if the spawn succeeded.
+     */
+    struct SpawnResult {
+        LauncherReply reply;
+        std::shared_future<int> exitCode;
+    };
+
+    std::unordered_map<uint32_t, SpawnResult> spawnResults; //!< Results of spawn requests which haven't been claimed by the requesting thread yet.
+    std::unordered_map<pid_t, std::promise<int>> exitCodes; //!< The exit codes of all children that haven't exited yet, these are fulfilled with -1 if the launcher exits first.
+    bool disconnected{}; //!< If the launcher has exited, no further replies will be received after this is set.
+
+    void ReplyThread();
+
+  public:
+    /**
+     * @param path The path to the launcher executable, see GetBundledPath().
+     * @param envVars The environment of the launcher, this is inherited by every process it spawns.
+     * @param preloadDirectories Directories with files (such as shared libraries) that the launcher reads into the page cache in the background, so spawns don't have to load them from storage.
+     * @param options The options of the launcher process, these are inherited by everything it spawns unless a spawn overrides them.
+     */
+    Launcher(const std::filesystem::path &path, const std::vector<std::string> &envVars, const std::vector<std::filesystem::path> &preloadDirectories, const LaunchOptions &options = {});
+
+    Launcher(const Launcher &) = delete;
+
+    Launcher &operator=(const Launcher &) = delete;
+
+    /**
+     * @note This disconnects from the launcher which causes it to exit, any children it spawned keep running.
+     */
+    ~Launcher();
+
+    /**
+     * @return The path of the launcher executable that is packaged alongside this library.
+     */
+    static std::filesystem::path GetBundledPath();
+
+    pid_t GetPid() const {
+        return process.pid;
+    }
+
+    /**
+     * @brief Spawns an executable through the launcher, this blocks until the launcher has replied.
+     * @param envVars Environment variables in addition to the launcher's own environment, these take precedence over any variables with the same name.
+     * @param options Options in addition to the launcher's own, options that fail to apply are logged by the launcher.
+     * @return The pid of the spawned process and a future for its exit code.
+     */
+    std::pair<pid_t, std::shared_future<int>> Spawn(const std::filesystem::path &exe, const std::vector<std::string> &args, const std::vector<std::string> &envVars, std::optional<LogPipe> logPipe, const LaunchOptions &options = {});
+};
+}
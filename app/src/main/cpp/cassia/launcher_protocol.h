@@ -0,0 +1,47 @@
+// Copyright © 2023 Cassia Developers, all rights reserved.
+#pragma once
+
+#include "launch_options.h"
+#include <cstddef>
+#include <cstdint>
+
+namespace cassia {
+/**
+ * @brief The file name of the launcher executable, it's named like a library so it's packaged and extracted alongside libcassia.so.
+ */
+constexpr const char *LauncherFileName{"libcassia_launcher.so"};
+
+/**
+ * @brief The maximum size of a single message on the launcher socket, this bounds the size of the arguments and environment of a spawn request.
+ */
+constexpr size_t LauncherMaxMessageSize{64 * 1024};
+
+enum class LauncherMessageType : uint32_t {
+    Spawn, //!< Client -> Launcher: A LauncherSpawnRequest.
+    Spawned, //!< Launcher -> Client: A LauncherReply for a spawn request with the pid or an errno.
+    Exited, //!< Launcher -> Client: A LauncherReply with the wait status of a child that exited.
+};
+
+/**
+ * @brief The header of a spawn request, this is followed by the null-terminated executable path, arguments and environment variables in that order.
+ * @note If hasLogFds is set, the stdout and stderr fds for the child are passed alongside the message with SCM_RIGHTS.
+ */
+struct LauncherSpawnRequest {
+    LauncherMessageType type{LauncherMessageType::Spawn};
+    uint32_t id; //!< An ID chosen by the client to match the reply with the request.
+    uint32_t argCount;
+    uint32_t envCount; //!< The amount of environment variables, these override any of the launcher's own variables with the same name.
+    uint32_t hasLogFds;
+    LaunchOptions options; //!< Applied in the child on top of the launcher's own options.
+};
+
+/**
+ * @brief A reply from the launcher, these are sent in the order the events happened so a child's Spawned reply always precedes its Exited reply.
+ */
+struct LauncherReply {
+    LauncherMessageType type;
+    uint32_t id; //!< The ID of the spawn request, this is only valid for Spawned replies.
+    int32_t pid; //!< The pid of the child, this is -1 if spawning failed.
+    int32_t value; //!< The errno of a failed spawn for Spawned replies, or the wait status of the child for Exited replies.
+};
+}
@@ -0,0 +1,230 @@
+// Copyright © 2023 Cassia Developers, all rights reserved.
+
+#include "log_ring.h"
+#include "util/error.h"
+#include "util/fd.h"
+#include <algorithm>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <limits>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fmt/chrono.h>
+
+namespace cassia {
+constexpr uint64_t LogRingMagic{0x474E49524C415343}; //!< "CSALRING" in little-endian.
+constexpr uint32_t LogRingVersion{1};
+constexpr uint64_t InvalidOffset{~0ULL}; //!< The commit offset of a record which is being written.
+
+constexpr uint8_t RecordTypeLog{1};
+constexpr uint8_t RecordTypePadding{2}; //!< Fills the space at the end of the ring which was too small for the next record.
+
+/**
+ * @note This occupies the first page of the file, the record area starts right after it.
+ */
+struct LogRing::Header {
+    std::atomic<uint64_t> magic; //!< This is written last when creating the file, so a file without it was never fully initialized.
+    uint32_t version;
+    uint32_t headerSize;
+    uint64_t capacity;
+    int64_t monotonicBaseNs; //!< CLOCK_MONOTONIC at the time the ring was created, this is used with realtimeBaseNs to convert timestamps into wall-clock time.
+    int64_t realtimeBaseNs; //!< CLOCK_REALTIME at the time the ring was created.
+    alignas(64) std::atomic<uint64_t> writeOffset; //!< The logical offset of the end of the last reserved record, this only ever increases.
+};
+
+/**
+ * @note Records are 8-byte aligned and are followed by the tag and message, they never wrap around the end of the ring.
+ */
+struct LogRing::RecordHeader {
+    std::atomic<uint64_t> commitOffset; //!< The logical offset of this record once it's fully written, InvalidOffset while it's being written.
+    uint32_t size; //!< The size of the entire record including this header and any alignment padding.
+    uint8_t type;
+    uint8_t stream;
+    uint8_t priority;
+    uint8_t tagLength;
+    int64_t timestampNs; //!< CLOCK_MONOTONIC at the time the record's line was read.
+    uint32_t messageLength;
+    uint32_t reserved;
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "Records in shared memory require lock-free 64-bit atomics");
+
+static constexpr uint64_t AlignUp(uint64_t value, uint64_t alignment) {
+    return (value + alignment - 1) & ~(alignment - 1);
+}
+
+static int64_t GetClockNs(clockid_t clock) {
+    timespec time{};
+    clock_gettime(clock, &time);
+    return static_cast<int64_t>(time.tv_sec) * 1'000'000'000 + time.tv_nsec;
+}
+
+LogRing::LogRing(const std::filesystem::path &path, size_t pCapacity) {
+    size_t pageSize{static_cast<size_t>(sysconf(_SC_PAGESIZE))};
+    capacity = AlignUp(pCapacity, pageSize);
+    mappingSize = pageSize + capacity;
+    static_assert(sizeof(Header) <= 4096);
+
+    std::error_code error;
+    std::filesystem::rename(path, std::filesystem::path{path}.concat(".1"), error); // This fails if there's no previous ring, which is fine.
+
+    UniqueFd fd{open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644), "log_ring"};
+    if (!fd.Valid())
+        throw Exception{"open({}) failed: {}", path.string(), strerror(errno)};
+    if (ftruncate(fd.Get(), static_cast<off_t>(mappingSize)) == -1)
+        throw Exception{"ftruncate({}, {}) failed: {}", path.string(), mappingSize, strerror(errno)};
+
+    mapping = mmap(nullptr, mappingSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd.Get(), 0);
+    if (mapping == MAP_FAILED)
+        throw Exception{"mmap({}, {}) failed: {}", path.string(), mappingSize, strerror(errno)};
+
+    header = new(mapping) Header{
+        .magic = 0,
+        .version = LogRingVersion,
+        .headerSize = static_cast<uint32_t>(pageSize),
+        .capacity = capacity,
+        .monotonicBaseNs = GetClockNs(CLOCK_MONOTONIC),
+        .realtimeBaseNs = GetClockNs(CLOCK_REALTIME),
+        .writeOffset = 0,
+    };
+    data = static_cast<uint8_t *>(mapping) + pageSize;
+    header->magic.store(LogRingMagic, std::memory_order_release);
+}
+
+LogRing::~LogRing() {
+    if (mapping)
+        munmap(mapping, mappingSize);
+}
+
+void LogRing::WriteRecord(uint64_t offset, uint64_t size, uint8_t type, std::chrono::steady_clock::time_point timestamp, std::string_view tag, LogRingStream stream, int priority, std::string_view message) {
+    auto record{reinterpret_cast<RecordHeader *>(data + (offset % capacity))};
+    record->commitOffset.store(InvalidOffset, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release); // Any reader must see the record as invalid before seeing any of the new contents.
+
+    record->size = static_cast<uint32_t>(size);
+    record->type = type;
+    record->stream = static_cast<uint8_t>(stream);
+    record->priority = static_cast<uint8_t>(priority);
+    record->tagLength = static_cast<uint8_t>(tag.size());
+    record->timestampNs = std::chrono::duration_cast<std::chrono::nanoseconds>(timestamp.time_since_epoch()).count();
+    record->messageLength = static_cast<uint32_t>(message.size());
+    auto payload{reinterpret_cast<char *>(record + 1)};
+    if (!tag.empty())
+        std::memcpy(payload, tag.data(), tag.size());
+    if (!message.empty())
+        std::memcpy(payload + tag.size(), message.data(), message.size());
+
+    record->commitOffset.store(offset, std::memory_order_release);
+}
+
+void LogRing::Append(std::chrono::steady_clock::time_point timestamp, std::string_view tag, LogRingStream stream, int priority, std::string_view message) {
+    tag = tag.substr(0, std::numeric_limits<uint8_t>::max());
+    message = message.substr(0, (capacity / 4) - sizeof(RecordHeader) - tag.size()); // Any single record is limited to a fraction of the ring so it can't evict everything else.
+    uint64_t size{AlignUp(sizeof(RecordHeader) + tag.size() + message.size(), alignof(RecordHeader))};
+
+    uint64_t offset{header->writeOffset.load(std::memory_order_relaxed)}, padding;
+    do {
+        uint64_t position{offset % capacity};
+        padding = (position + size > capacity) ? capacity - position : 0;
+    } while (!header->writeOffset.compare_exchange_weak(offset, offset + padding + size, std::memory_order_relaxed));
+
+    // Readers skip to the start of the ring by themselves if the remaining space can't even hold a record header.
+    if (padding >= sizeof(RecordHeader))
+        WriteRecord(offset, padding, RecordTypePadding, {}, {}, {}, 0, {});
+    WriteRecord(offset + padding, size, RecordTypeLog, timestamp, tag, stream, priority, message);
+}
+
+std::vector<LogRingEntry> ReadLogRing(const std::filesystem::path &path) {
+    UniqueFd fd{open(path.c_str(), O_RDONLY | O_CLOEXEC), "log_ring"};
+    if (!fd.Valid()) {
+        if (errno == ENOENT)
+            return {};
+        throw Exception{"open({}) failed: {}", path.string(), strerror(errno)};
+    }
+
+    struct stat fileStat{};
+    if (fstat(fd.Get(), &fileStat) == -1)
+        throw Exception{"fstat({}) failed: {}", path.string(), strerror(errno)};
+    auto fileSize{static_cast<size_t>(fileStat.st_size)};
+    if (fileSize < sizeof(LogRing::Header))
+        return {};
+
+    void *mapping{mmap(nullptr, fileSize, PROT_READ, MAP_SHARED, fd.Get(), 0)};
+    if (mapping == MAP_FAILED)
+        throw Exception{"mmap({}, {}) failed: {}", path.string(), fileSize, strerror(errno)};
+
+    std::vector<LogRingEntry> entries;
+    try {
+        auto header{static_cast<LogRing::Header *>(mapping)};
+        if (header->magic.load(std::memory_order_acquire) != LogRingMagic || header->version != LogRingVersion || header->headerSize + header->capacity > fileSize)
+            throw Exception{"'{}' is not a valid log ring", path.string()};
+
+        using RecordHeader = LogRing::RecordHeader;
+        auto data{static_cast<const uint8_t *>(mapping) + header->headerSize};
+        uint64_t capacity{header->capacity};
+        uint64_t end{header->writeOffset.load(std::memory_order_acquire)};
+        uint64_t offset{AlignUp(end > capacity ? end - capacity : 0, alignof(RecordHeader))};
+
+        // The oldest data in the ring may start in the middle of a record, or contain records which were never committed due to a crash.
+        // In either case, we scan forward until we find a record that was committed at its own offset and resume walking records from there.
+        while (offset < end) {
+            uint64_t position{offset % capacity};
+            if (capacity - position < sizeof(RecordHeader)) {
+                offset += capacity - position;
+                continue;
+            }
+
+            auto record{reinterpret_cast<const RecordHeader *>(data + position)};
+            uint64_t size{record->size};
+            if (record->commitOffset.load(std::memory_order_acquire) != offset || size < sizeof(RecordHeader) || size % alignof(RecordHeader) != 0 || position + size > capacity || offset + size > end) {
+                offset += alignof(RecordHeader);
+                continue;
+            }
+
+            if (record->type == RecordTypeLog && sizeof(RecordHeader) + record->tagLength + record->messageLength <= size) {
+                auto payload{reinterpret_cast<const char *>(record + 1)};
+                auto timeNs{header->realtimeBaseNs + (record->timestampNs - header->monotonicBaseNs)};
+                LogRingEntry entry{
+                    .time = std::chrono::system_clock::time_point{std::chrono::duration_cast<std::chrono::system_clock::duration>(std::chrono::nanoseconds{timeNs})},
+                    .tag = std::string{payload, record->tagLength},
+                    .stream = static_cast<LogRingStream>(record->stream),
+                    .priority = record->priority,
+                    .message = std::string{payload + record->tagLength, record->messageLength},
+                };
+
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (record->commitOffset.load(std::memory_order_relaxed) == offset) // The record could've been overwritten by a live writer while we were copying it.
+                    entries.push_back(std::move(entry));
+            }
+            offset += size;
+        }
+    } catch (...) {
+        munmap(mapping, fileSize);
+        throw;
+    }
+
+    munmap(mapping, fileSize);
+    return entries;
+}
+
+std::vector<LogRingEntry> ReadLogRings(std::span<const std::filesystem::path> paths) {
+    std::vector<LogRingEntry> entries;
+    for (const auto &path: paths) {
+        auto ringEntries{ReadLogRing(path)};
+        entries.insert(entries.end(), std::make_move_iterator(ringEntries.begin()), std::make_move_iterator(ringEntries.end()));
+    }
+
+    // Records in a single ring are in write order already, a stable sort keeps that order for any records sharing a timestamp.
+    std::stable_sort(entries.begin(), entries.end(), [](const LogRingEntry &a, const LogRingEntry &b) { return a.time < b.time; });
+    return entries;
+}
+
+std::string FormatLogRingEntry(const LogRingEntry &entry) {
+    constexpr std::string_view PriorityCharacters{"??VDIWEF"}; // Indexed by Android log priority.
+    char priority{entry.priority >= 0 && static_cast<size_t>(entry.priority) < PriorityCharacters.size() ? PriorityCharacters[static_cast<size_t>(entry.priority)] : '?'};
+    auto time{std::chrono::time_point_cast<std::chrono::milliseconds>(entry.time)};
+    return fmt::format("{:%Y-%m-%d %H:%M:%S} {} {}/{}: {}", time, entry.stream == LogRingStream::Err ? "err" : "out", priority, entry.tag, entry.message);
+}
+}
@@ -0,0 +1,87 @@
+// Copyright © 2023 Cassia Developers, all rights reserved.
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace cassia {
+/**
+ * @brief The pipe a log record was read from.
+ */
+enum class LogRingStream : uint8_t {
+    Out,
+    Err,
+};
+
+/**
+ * @brief A decoded record from a LogRing file.
+ */
+struct LogRingEntry {
+    std::chrono::system_clock::time_point time; //!< The wall-clock time of the record, derived from its monotonic timestamp.
+    std::string tag;
+    LogRingStream stream;
+    int priority; //!< The Android log priority of the record.
+    std::string message;
+};
+
+/**
+ * @brief A fixed-size ring of log records inside a memory-mapped file, for post-mortem inspection of logs that are long gone from logcat.
+ * @details Records are written directly into the shared file mapping, so they reside in the page cache and survive the process crashing without ever requiring an fsync.
+ * Space is reserved with a single CAS on the write offset and every record is committed by storing its own logical offset into it, so appending is lock-free and a reader can always tell complete records from partially written or overwritten ones.
+ */
+class LogRing {
+  private:
+    struct Header;
+    struct RecordHeader;
+
+    void *mapping{};
+    size_t mappingSize{};
+    Header *header{};
+    uint8_t *data{}; //!< The start of the record area, this is capacity bytes long.
+    uint64_t capacity{};
+
+    friend std::vector<LogRingEntry> ReadLogRing(const std::filesystem::path &path);
+
+    void WriteRecord(uint64_t offset, uint64_t size, uint8_t type, std::chrono::steady_clock::time_point timestamp, std::string_view tag, LogRingStream stream, int priority, std::string_view message);
+
+  public:
+    /**
+     * @brief Creates a new ring at the supplied path, an existing ring at the path is moved to the path with a ".1" suffix to retain the previous session.
+     * @param capacity The size of the record area in bytes, this will be rounded up to the page size.
+     */
+    LogRing(const std::filesystem::path &path, size_t capacity);
+
+    LogRing(const LogRing &) = delete;
+
+    LogRing &operator=(const LogRing &) = delete;
+
+    ~LogRing();
+
+    /**
+     * @brief Appends a record to the ring, overwriting the oldest records if there isn't enough space.
+     * @note This is lock-free and can be called from any amount of threads concurrently, tags longer than 255 bytes are truncated.
+     */
+    void Append(std::chrono::steady_clock::time_point timestamp, std::string_view tag, LogRingStream stream, int priority, std::string_view message);
+};
+
+/**
+ * @return All complete records in the ring file at the supplied path in the order they were written, an empty vector is returned if the file doesn't exist.
+ * @note This can be used on the ring of a running session, any records that are overwritten while reading are skipped.
+ */
+std::vector<LogRingEntry> ReadLogRing(const std::filesystem::path &path);
+
+/**
+ * @return All records from the supplied ring files merged into a single timeline ordered by time.
+ */
+std::vector<LogRingEntry> ReadLogRings(std::span<const std::filesystem::path> paths);
+
+/**
+ * @return A logcat-style line for the supplied record, without a trailing newline.
+ */
+std::string FormatLogRingEntry(const LogRingEntry &entry);
+}
@@ -0,0 +1,37 @@
+// Copyright © 2023 Cassia Developers, all rights reserved.
+
+#include "log_sink.h"
+#include <string_view>
+#include <fmt/format.h>
+#include <unistd.h>
+#ifdef __ANDROID__
+#include <android/log.h>
+#endif
+
+namespace cassia {
+#ifdef __ANDROID__
+void LogcatSink::Write(const LogRecord &record) {
+    __android_log_write(record.priority, record.tag, record.message);
+}
+#endif
+
+FdLogSink::FdLogSink(UniqueFd fd) : fd{std::move(fd)} {}
+
+void FdLogSink::Write(const LogRecord &record) {
+    constexpr std::string_view PriorityCharacters{"??VDIWEF"}; // Indexed by log priority, this matches FormatLogRingEntry.
+    char priority{record.priority >= 0 && static_cast<size_t>(record.priority) < PriorityCharacters.size() ? PriorityCharacters[static_cast<size_t>(record.priority)] : '?'};
+    line.clear();
+    fmt::format_to(std::back_inserter(line), "{}/{}: {}\n", priority, record.tag, std::string_view{record.message, record.messageLength});
+
+    // Records are dropped on errors as there's nowhere left to report them.
+    for (size_t offset{}; offset < line.size();) {
+        ssize_t written{write(fd.Get(), line.data() + offset, line.size() - offset)};
+        if (written == -1) {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+        offset += static_cast<size_t>(written);
+    }
+}
+}
@@ -0,0 +1,56 @@
+// Copyright © 2023 Cassia Developers, all rights reserved.
+#pragma once
+
+#include "util/fd.h"
+#include <chrono>
+#include <cstddef>
+#include <string>
+
+namespace cassia {
+/**
+ * @brief A single line of log output along with the metadata of the channel it came from.
+ */
+struct LogRecord {
+    const char *tag; //!< The tag of the channel, this is null-terminated.
+    int priority; //!< The Android log priority of the stream the line came from.
+    const char *message; //!< The line without a trailing newline, this is null-terminated.
+    size_t messageLength;
+    std::chrono::steady_clock::time_point timestamp; //!< The time at which the line was read from the pipe.
+};
+
+/**
+ * @brief An interface for the final destination of all log records from the Logger.
+ * @note Records are only ever written from the Logger's sink thread, so implementations don't need to be thread-safe.
+ */
+struct LogSink {
+    virtual ~LogSink() = default;
+
+    /**
+     * @note The record (and the strings it points to) is only valid for the duration of the call.
+     */
+    virtual void Write(const LogRecord &record) = 0;
+};
+
+#ifdef __ANDROID__
+/**
+ * @brief A sink which writes all records to logcat.
+ */
+struct LogcatSink : LogSink {
+    void Write(const LogRecord &record) override;
+};
+#endif
+
+/**
+ * @brief A sink which writes all records to a file descriptor in a logcat-like format, this is used in place of logcat on hosts.
+ */
+struct FdLogSink : LogSink {
+  private:
+    UniqueFd fd;
+    std::string line; //!< The formatted line, this is retained across records so it rarely needs to allocate.
+
+  public:
+    explicit FdLogSink(UniqueFd fd);
+
+    void Write(const LogRecord &record) override;
+};
+}
@@ -1,12 +1,16 @@
 // Copyright © 2023 Cassia Developers, all rights reserved.
 
 #include "logger.h"
+#include "platform.h"
 #include "util/error.h"
+#include "util/trace.h"
+#include <utility>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
 #include <sys/wait.h>
 #include <sys/epoll.h>
 #include <sys/eventfd.h>
-#include <android/log.h>
 
 namespace cassia {
 Logger Logger::instance;
@@ -19,77 +23,295 @@ constexpr std::string_view BaseLogTag{"cassia.app."};
  */
 constexpr size_t LoggerEntryMaxPayload{4000};
 
-Logger::LogStream::LogStream(SharedFd fd, int androidLogPriority) : fd{std::move(fd)}, androidLogPriority{androidLogPriority} {}
+/**
+ * @brief The size of the ring buffer for each stream, this bounds the amount of data that can be consumed from a pipe in a single read.
+ */
+constexpr size_t LogStreamRingCapacity{64 * 1024};
+
+/**
+ * @brief The maximum amount of records waiting to be written to the sink, this must be a power of two.
+ */
+constexpr size_t LogQueueCapacity{1024};
+
+/**
+ * @brief The window within which consecutive repeats of a Wine debug message are collapsed into a single line.
+ */
+constexpr std::chrono::seconds WineDebugCollapseWindow{1};
+
+Logger::LogStream::LogStream(LogChannel &channel, SharedFd fd, int logPriority, bool parseWineDebug) : channel{channel}, fd{std::move(fd)}, framer{LogStreamRingCapacity, LoggerEntryMaxPayload}, logPriority{logPriority} {
+    if (parseWineDebug)
+        wineDebugCollapser.emplace(WineDebugCollapseWindow);
+}
 
-void Logger::LogStream::ReadAndLog(const char *tag, std::vector<char> &readBuffer) {
-    if (overflow.size() > readBuffer.size())
-        throw Exception{"Overflow buffer ({}) is larger than read buffer ({})", overflow.size(), readBuffer.size()};
+void Logger::LogStream::WriteLine(LogRing *ring, int priority, std::string_view line, std::chrono::steady_clock::time_point timestamp) {
+    if (ring)
+        ring->Append(timestamp, channel.tag, this == &channel.err ? LogRingStream::Err : LogRingStream::Out, priority, line);
+    instance.QueueLine(channel, priority, line, timestamp);
+}
 
-    std::copy(overflow.begin(), overflow.end(), readBuffer.begin());
-    overflow.clear();
+void Logger::LogStream::EmitLine(LogRing *ring, std::string_view line, std::chrono::steady_clock::time_point timestamp) {
+    if (!std::exchange(channel.receivedLine, true) && Tracer::IsEnabled())
+        TraceInstant("log.first_line", "tag", Tracer::Intern(channel.tag));
 
-    ssize_t len{read(fd.Get(), readBuffer.data() + overflow.size(), readBuffer.size() - (overflow.size() + 1))};
-    if (len == -1)
-        throw Exception{"read({} [{}]) failed: {}", fd.Get(), tag, strerror(errno)};
+    if (!wineDebugCollapser) {
+        WriteLine(ring, logPriority, line, timestamp);
+        return;
+    }
 
-    size_t lastNewline{std::string_view{readBuffer.data(), static_cast<size_t>(len)}.find_last_of('\n')};
-    if (lastNewline == std::string::npos) {
-        readBuffer[len] = '\0'; // Null-terminate the buffer to make it a valid C string.
+    auto writeLine{[&](int priority, std::string_view text) {
+        WriteLine(ring, priority, text, timestamp);
+    }};
+    auto parsed{ParseWineDebugLine(line)};
+    if (parsed) {
+        instance.wineDebugCounters.Increment(*parsed);
+        wineDebugCollapser->Process(line, *parsed, timestamp, writeLine);
+        if (wineDebugCollapser->HasPendingRepeats())
+            channel.shard.pendingRepeats = true;
     } else {
-        readBuffer[lastNewline] = '\0'; // Replace the newline with a null terminator.
-        overflow.assign(readBuffer.begin() + lastNewline + 1, readBuffer.end());
+        wineDebugCollapser->Reset(writeLine);
+        WriteLine(ring, logPriority, line, timestamp);
+    }
+}
+
+bool Logger::LogStream::FlushExpiredRepeats(std::chrono::steady_clock::time_point now) {
+    if (!wineDebugCollapser)
+        return false;
+    auto ring{channel.ring.get()};
+    return wineDebugCollapser->FlushExpired(now, [&](int priority, std::string_view text) {
+        WriteLine(ring, priority, text, now);
+    });
+}
+
+void Logger::LogStream::ReadAndLog() {
+    ssize_t len{framer.Read(fd.Get())};
+    if (len == -1) {
+        if (errno == EINTR || errno == EAGAIN)
+            return;
+        throw Exception{"read({} [{}]) failed: {}", fd.Get(), channel.tag, strerror(errno)};
+    }
+
+    auto now{std::chrono::steady_clock::now()}; // All lines from a single read share a timestamp, this avoids querying the clock for every line.
+    auto ring{channel.ring.get()};
+    framer.ForEachLine([&](const char *line, size_t length) {
+        EmitLine(ring, {line, length}, now);
+    });
+}
+
+void Logger::LogStream::DrainAndLog() {
+    auto now{std::chrono::steady_clock::now()};
+    auto ring{channel.ring.get()};
+    auto emitLine{[&](const char *line, size_t length) {
+        EmitLine(ring, {line, length}, now);
+    }};
+
+    ssize_t len;
+    while ((len = framer.Read(fd.Get())) != 0) {
+        if (len == -1) {
+            if (errno == EINTR)
+                continue;
+            throw Exception{"read({} [{}]) failed: {}", fd.Get(), channel.tag, strerror(errno)};
+        }
+        framer.ForEachLine(emitLine);
     }
+    framer.Flush(emitLine);
 
-    __android_log_write(androidLogPriority, tag, readBuffer.data());
+    if (wineDebugCollapser) // The stream is about to be closed, so any pending repeats would be lost otherwise.
+        wineDebugCollapser->Reset([&](int priority, std::string_view text) {
+            WriteLine(ring, priority, text, now);
+        });
 }
 
-Logger::LogChannel::LogChannel(std::string tag, LogPipe pipe)
+Logger::LogChannel::LogChannel(std::string tag, LogPipe pipe, LogShard &shard, LogCounters &counters, LogChannelOptions options, std::shared_ptr<LogRing> ring)
         : tag{std::move(tag)},
-          out{std::move(pipe.out), ANDROID_LOG_INFO},
-          err{std::move(pipe.err), ANDROID_LOG_ERROR} {}
+          out{*this, std::move(pipe.out), LogPriorityInfo, options.parseWineDebug},
+          err{*this, std::move(pipe.err), LogPriorityError, options.parseWineDebug},
+          shard{shard},
+          counters{counters},
+          options{options},
+          ring{std::move(ring)},
+          tokens{std::max(options.burstLines, 1.0)},
+          lastRefill{std::chrono::steady_clock::now()} {}
+
+bool Logger::LogChannel::TakeRateLimitToken(std::chrono::steady_clock::time_point now) {
+    if (options.linesPerSecond <= 0)
+        return true;
+
+    if (now > lastRefill) {
+        double elapsed{std::chrono::duration<double>(now - lastRefill).count()};
+        tokens = std::min(tokens + elapsed * options.linesPerSecond, std::max(options.burstLines, 1.0));
+        lastRefill = now;
+    }
+
+    if (tokens < 1)
+        return false;
+    tokens -= 1;
+    return true;
+}
+
+void Logger::LogShard::AdoptPendingChannels() {
+    LogChannel *channel{pendingChannels.exchange(nullptr, std::memory_order_acquire)};
+    while (channel) {
+        LogChannel *next{channel->next};
+        channel->previous = nullptr;
+        channel->next = activeChannels;
+        if (activeChannels)
+            activeChannels->previous = channel;
+        activeChannels = channel;
+        channel = next;
+    }
+}
+
+void Logger::LogShard::RetireChannel(LogChannel *channel) {
+    if (Tracer::IsEnabled())
+        TraceInstant("log.channel_closed", "tag", Tracer::Intern(channel->tag));
+    if (channel->previous)
+        channel->previous->next = channel->next;
+    else
+        activeChannels = channel->next;
+    if (channel->next)
+        channel->next->previous = channel->previous;
+    delete channel;
+    channelCount.fetch_sub(1, std::memory_order_relaxed);
+}
+
+void Logger::LogShard::FlushExpiredRepeats() {
+    auto now{std::chrono::steady_clock::now()};
+    bool anyPending{};
+    for (LogChannel *channel{activeChannels}; channel; channel = channel->next) {
+        // Both streams must be flushed, so this can't short-circuit.
+        anyPending |= channel->out.FlushExpiredRepeats(now);
+        anyPending |= channel->err.FlushExpiredRepeats(now);
+    }
+    pendingRepeats = anyPending;
+}
 
-void Logger::LogThread() {
-    std::vector<char> readBuffer(LoggerEntryMaxPayload, 0);
+void Logger::LogThread(LogShard &shard) {
+    shard.tid.store(gettid());
+    shard.ApplyAffinity();
+
+    auto lastRepeatFlush{std::chrono::steady_clock::now()};
     while (true) {
+        // A stream with collapsed repeats may not get any more events, so we need a timeout to emit the repeat count once its window expires.
+        int timeout{shard.pendingRepeats ? static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(WineDebugCollapseWindow).count()) : -1};
         std::array<epoll_event, 10> events{};
-        int numEvents{epoll_wait(epollFd.Get(), events.data(), events.size(), -1)};
+        int numEvents{epoll_wait(shard.epollFd.Get(), events.data(), events.size(), timeout)};
         if (numEvents == -1) {
             if (errno == EINTR)
                 continue;
             else
                 throw Exception{"epoll_wait() failed: {}", strerror(errno)};
-        } else if (numEvents == 0) {
-            throw Exception{"epoll_wait() returned 0 with no timeout"};
         }
 
+        // Channels are published before their pipes are added to epoll, so any channel an event could refer to is pending or active by now.
+        shard.AdoptPendingChannels();
+
         for (int i{}; i < numEvents; i++) {
             epoll_event &event{events[i]};
 
-            int fd{event.data.fd};
-            if (fd == wakeEventFd.Get())
+            auto stream{static_cast<LogStream *>(event.data.ptr)};
+            if (!stream)
                 return; // Any events on the wake event fd mean we should exit.
 
-            std::lock_guard lock{mutex};
-            auto channelIt{std::find_if(channels.begin(), channels.end(), [&](auto &channel) { return channel.GetStream(fd) != nullptr; })};
-            if (channelIt == channels.end())
-                throw Exception{"epoll_wait() returned an unknown fd: {} (Event: 0x{:X})", fd, event.events};
+            auto &channel{stream->channel};
+            if (event.events & EPOLLHUP) {
+                stream->DrainAndLog(); // The writer is gone, so anything left in the pipe can be read without blocking.
 
-            auto &channel{*channelIt};
-            auto &stream{*channel.GetStream(fd)};
+                if (epoll_ctl(shard.epollFd.Get(), EPOLL_CTL_DEL, stream->fd.Get(), nullptr) == -1)
+                    throw Exception{"epoll_ctl({}, {} [{}]) failed: {}", shard.epollFd.Get(), stream->fd.Get(), channel.tag, strerror(errno)};
 
-            if (event.events & EPOLLIN)
-                stream.ReadAndLog(channel.tag.c_str(), readBuffer);
+                stream->fd.Reset();
+                if (!channel.Valid())
+                    shard.RetireChannel(&channel); // Both streams of a channel never have events in the same batch after one of them was removed.
+            } else if (event.events & EPOLLIN) {
+                stream->ReadAndLog();
+            }
+        }
 
-            if (event.events & EPOLLHUP) {
-                epoll_event deleteEvent{.events = EPOLLIN, .data = {.fd = stream.fd.Get()}};
-                if (epoll_ctl(epollFd.Get(), EPOLL_CTL_DEL, stream.fd.Get(), &deleteEvent) == -1)
-                    throw Exception{"epoll_ctl({}, {} [{}]) failed: {}", epollFd.Get(), stream.fd.Get(), channel.tag, strerror(errno)};
+        if (shard.pendingRepeats) {
+            auto now{std::chrono::steady_clock::now()};
+            if (now - lastRepeatFlush >= WineDebugCollapseWindow) {
+                shard.FlushExpiredRepeats();
+                lastRepeatFlush = now;
+            }
+        }
+    }
+}
 
-                stream.fd.Reset();
-                if (!channel.Valid())
-                    channels.erase(channelIt);
+void Logger::QueueLine(LogChannel &channel, int priority, std::string_view line, std::chrono::steady_clock::time_point timestamp) {
+    if (!channel.TakeRateLimitToken(timestamp)) {
+        channel.pendingRateLimitDrops++;
+        channel.counters.rateLimitDrops.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    auto push{[&](std::string_view message) {
+        if (!freeSlots.try_acquire()) {
+            switch (channel.options.overflowPolicy) {
+                case LogOverflowPolicy::Block:
+                    freeSlots.acquire();
+                    break;
+
+                case LogOverflowPolicy::DropOldest:
+                    // Claiming a queued record transfers its slot to us, it's only unavailable if the sink claimed the last record in the meantime.
+                    if (queuedRecords.try_acquire()) {
+                        while (!queue.TryPop([](QueuedRecord &record) { record.counters->overflowDrops.fetch_add(1, std::memory_order_relaxed); }))
+                            std::this_thread::yield(); // The record at the front was claimed but is still being filled by another producer.
+                    } else {
+                        freeSlots.acquire();
+                    }
+                    break;
+
+                case LogOverflowPolicy::DropNewest:
+                    channel.counters.overflowDrops.fetch_add(1, std::memory_order_relaxed);
+                    return;
             }
         }
+
+        // A free slot has been claimed, so this can only fail transiently while the consumer of the slot is still finishing up.
+        while (!queue.TryPush([&](QueuedRecord &record) {
+            record.counters = &channel.counters;
+            record.priority = priority;
+            record.timestamp = timestamp;
+            record.message.assign(message);
+        }))
+            std::this_thread::yield();
+        queuedRecords.release();
+    }};
+
+    if (channel.pendingRateLimitDrops) {
+        push(fmt::format("[{} lines were dropped by the rate limit]", channel.pendingRateLimitDrops));
+        channel.pendingRateLimitDrops = 0;
+    }
+    push(line);
+}
+
+void Logger::SinkThread() {
+    while (true) {
+        queuedRecords.acquire();
+        if (sinkStopping.load(std::memory_order_acquire) && queue.Empty())
+            return; // The log thread has exited and there are no records left, so this must be the token released for stopping.
+
+        while (!queue.TryPop([&](QueuedRecord &record) {
+            std::scoped_lock lock{sinkMutex};
+            sink->Write(LogRecord{
+                .tag = record.counters->tag.c_str(),
+                .priority = record.priority,
+                .message = record.message.c_str(),
+                .messageLength = record.message.size(),
+                .timestamp = record.timestamp,
+            });
+
+            auto &recordCounters{*record.counters};
+            recordCounters.lines.fetch_add(1, std::memory_order_relaxed);
+            recordCounters.bytes.fetch_add(record.message.size(), std::memory_order_relaxed);
+
+            auto lag{static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - record.timestamp).count())};
+            recordCounters.totalQueueLagNs.fetch_add(lag, std::memory_order_relaxed);
+            uint64_t maxLag{recordCounters.maxQueueLagNs.load(std::memory_order_relaxed)};
+            while (lag > maxLag && !recordCounters.maxQueueLagNs.compare_exchange_weak(maxLag, lag, std::memory_order_relaxed));
+        }))
+            std::this_thread::yield(); // The record at the front was claimed but is still being filled by a producer.
+        freeSlots.release();
     }
 }
 
@@ -97,7 +319,7 @@ static UniqueFd CreateEpollFd() {
     int epollFd{epoll_create1(EPOLL_CLOEXEC)};
     if (epollFd == -1)
         throw Exception{"epoll_create1 failed: {}", strerror(errno)};
-    return UniqueFd{epollFd};
+    return UniqueFd{epollFd, "logger"};
 }
 
 static UniqueFd CreateEventFdWithEpoll(UniqueFd &epollFd) {
@@ -105,11 +327,11 @@ static UniqueFd CreateEventFdWithEpoll(UniqueFd &epollFd) {
     if (eventFd == -1)
         throw Exception{"eventfd failed: {}", strerror(errno)};
 
-    epoll_event event{.events = EPOLLIN, .data = {.fd = eventFd}};
+    epoll_event event{.events = EPOLLIN, .data = {.ptr = nullptr}}; // A null stream is used to identify the wake event.
     if (epoll_ctl(epollFd.Get(), EPOLL_CTL_ADD, eventFd, &event) == -1)
         throw Exception{"epoll_ctl({}, {} [EVENT]) failed: {}", epollFd.Get(), eventFd, strerror(errno)};
 
-    return UniqueFd{eventFd};
+    return UniqueFd{eventFd, "logger"};
 }
 
 static void SetProcessPipe(LogPipe &pipe) {
@@ -119,59 +341,194 @@ static void SetProcessPipe(LogPipe &pipe) {
         throw Exception{"dup2({}, STDERR) failed: {}", pipe.err.Get(), strerror(errno)};
 }
 
-Logger::Logger() : epollFd{CreateEpollFd()},
-                   wakeEventFd{CreateEventFdWithEpoll(epollFd)},
-                   logThread{&Logger::LogThread, this} {
-    auto processPipe{GetPipeImpl("main")};
+Logger::LogShard::LogShard() : epollFd{CreateEpollFd()}, wakeEventFd{CreateEventFdWithEpoll(epollFd)} {}
+
+void Logger::LogShard::ApplyAffinity() {
+    pid_t threadId{tid.load()};
+    if (!threadId)
+        return; // The thread will apply the affinity itself once it starts.
+
+    int targetCpu{cpu.load()};
+    cpu_set_t cpuSet;
+    CPU_ZERO(&cpuSet);
+    if (targetCpu == -1) {
+        for (int i{}; i < CPU_SETSIZE; i++)
+            CPU_SET(i, &cpuSet);
+    } else {
+        CPU_SET(targetCpu, &cpuSet);
+    }
+
+    if (sched_setaffinity(threadId, sizeof(cpuSet), &cpuSet) == -1)
+        fmt::println(stderr, "sched_setaffinity({}, {}) failed: {}", threadId, targetCpu, strerror(errno)); // The CPU may be offline or outside of our cpuset, the thread still works without it.
+}
+
+void Logger::StartShard(size_t index) {
+    auto &shard{shards[index]};
+    shard = std::make_unique<LogShard>();
+    shard->thread = std::thread{&Logger::LogThread, this, std::ref(*shard)};
+}
+
+Logger::Logger() : queue{LogQueueCapacity},
+                   freeSlots{LogQueueCapacity},
+                   sink{CreatePlatformLogSink()} {
+    // The threads are started after all members have been initialized as they access the channel lists and the queue.
+    sinkThread = std::thread{&Logger::SinkThread, this};
+    {
+        std::scoped_lock lock{shardsMutex};
+        StartShard(0);
+        shardCount = 1;
+    }
+    auto processPipe{GetPipeImpl("main", {}, {})};
     SetProcessPipe(processPipe);
 }
 
 Logger::~Logger() {
-    if (logThread.joinable()) {
-        int result{eventfd_write(wakeEventFd.Get(), 1)};
-        TerminateIf(result == -1 && errno != EAGAIN, "eventfd_write({}) failed: {}", wakeEventFd.Get(), strerror(errno));
+    for (auto &shard: shards) {
+        if (shard && shard->thread.joinable()) {
+            int result{eventfd_write(shard->wakeEventFd.Get(), 1)};
+            TerminateIf(result == -1 && errno != EAGAIN, "eventfd_write({}) failed: {}", shard->wakeEventFd.Get(), strerror(errno));
 
-        logThread.join();
+            shard->thread.join();
+        }
+    }
+
+    if (sinkThread.joinable()) {
+        sinkStopping.store(true, std::memory_order_release);
+        queuedRecords.release();
+        sinkThread.join();
+    }
+
+    for (auto &shard: shards) {
+        if (!shard)
+            continue;
+        shard->AdoptPendingChannels();
+        while (shard->activeChannels)
+            shard->RetireChannel(shard->activeChannels);
     }
 }
 
-static std::pair<LogPipe, LogPipe> CreateLogPipes() {
-    int stdoutPipe[2], stderrPipe[2];
-    if (pipe(stdoutPipe) == -1)
-        throw std::runtime_error("pipe() failed: " + std::string{strerror(errno)});
-    if (pipe(stderrPipe) == -1)
-        throw std::runtime_error("pipe() failed: " + std::string{strerror(errno)});
+/**
+ * @return The read and write ends of a new pipe, the read end is owned by the logger while the write end is handed to a producer.
+ */
+static std::pair<SharedFd, SharedFd> CreatePipe() {
+    int fds[2];
+    if (pipe(fds) == -1) {
+        int error{errno};
+        throw Exception{"pipe() failed: {}{}", strerror(error), error == EMFILE ? ", " + FdRegistry::DescribeUsage() : ""};
+    }
+    return {SharedFd{fds[0], "logger"}, SharedFd{fds[1], "log_pipe"}};
+}
 
-    return {LogPipe{.out = stdoutPipe[0], .err = stderrPipe[0]},
-            LogPipe{.out = stdoutPipe[1], .err = stderrPipe[1]}};
+static std::pair<LogPipe, LogPipe> CreateLogPipes() {
+    auto [stdoutRead, stdoutWrite]{CreatePipe()};
+    auto [stderrRead, stderrWrite]{CreatePipe()};
+    return {LogPipe{.out = std::move(stdoutRead), .err = std::move(stderrRead)},
+            LogPipe{.out = std::move(stdoutWrite), .err = std::move(stderrWrite)}};
 }
 
 static void SetCloseOnExec(LogPipe &pipe) {
-    if (fcntl(pipe.out.Get(), F_SETFD, FD_CLOEXEC) == -1)
+    if (!pipe.out.SetCloseOnExec(true))
         throw Exception("fcntl({}, FD_CLOEXEC) failed: {}", pipe.out.Get(), strerror(errno));
-    if (fcntl(pipe.err.Get(), F_SETFD, FD_CLOEXEC) == -1)
+    if (!pipe.err.SetCloseOnExec(true))
         throw Exception("fcntl({}, FD_CLOEXEC) failed: {}", pipe.err.Get(), strerror(errno));
 }
 
-static void AddLogPipe(UniqueFd &epollFd, LogPipe &pipe) {
-    epoll_event stdoutEvent{.events = EPOLLIN, .data = {.fd = pipe.out.Get()}};
-    if (epoll_ctl(epollFd.Get(), EPOLL_CTL_ADD, pipe.out.Get(), &stdoutEvent) == -1)
-        throw Exception("epoll_ctl({}, {} [STDOUT]) failed: {}", epollFd.Get(), pipe.out.Get(), strerror(errno));
+static void SetPipeCapacity(LogPipe &pipe, size_t capacity) {
+    // The capacity is shared by both ends of a pipe, so setting it on the consumer end applies to the producer end as well.
+    for (int fd: {pipe.out.Get(), pipe.err.Get()})
+        if (fcntl(fd, F_SETPIPE_SZ, static_cast<int>(capacity)) == -1)
+            fmt::println(stderr, "fcntl({}, F_SETPIPE_SZ, {}) failed: {}", fd, capacity, strerror(errno)); // Unprivileged processes are limited by /proc/sys/fs/pipe-max-size, this isn't fatal.
+}
 
-    epoll_event stderrEvent{.events = EPOLLIN, .data = {.fd = pipe.err.Get()}};
-    if (epoll_ctl(epollFd.Get(), EPOLL_CTL_ADD, pipe.err.Get(), &stderrEvent) == -1)
-        throw Exception("epoll_ctl({}, {} [STDERR]) failed: {}", epollFd.Get(), pipe.err.Get(), strerror(errno));
+/**
+ * @brief Adds the streams of a channel to epoll with their addresses as the event data.
+ * @note On failure, the channel stays registered with the log thread and will be cleaned up alongside the logger.
+ */
+static void AddLogStreams(UniqueFd &epollFd, SharedFd &outFd, void *outStream, SharedFd &errFd, void *errStream) {
+    epoll_event stdoutEvent{.events = EPOLLIN, .data = {.ptr = outStream}};
+    if (epoll_ctl(epollFd.Get(), EPOLL_CTL_ADD, outFd.Get(), &stdoutEvent) == -1)
+        throw Exception("epoll_ctl({}, {} [STDOUT]) failed: {}", epollFd.Get(), outFd.Get(), strerror(errno));
+
+    epoll_event stderrEvent{.events = EPOLLIN, .data = {.ptr = errStream}};
+    if (epoll_ctl(epollFd.Get(), EPOLL_CTL_ADD, errFd.Get(), &stderrEvent) == -1)
+        throw Exception("epoll_ctl({}, {} [STDERR]) failed: {}", epollFd.Get(), errFd.Get(), strerror(errno));
 }
 
-LogPipe Logger::GetPipeImpl(const std::string &name) {
+LogPipe Logger::GetPipeImpl(const std::string &name, LogChannelOptions options, std::shared_ptr<LogRing> ring) {
     auto [consumerPipes, producerPipes]{CreateLogPipes()};
+    if (options.pipeCapacity != 0)
+        SetPipeCapacity(consumerPipes, options.pipeCapacity);
     SetCloseOnExec(consumerPipes); // We don't want the consumer pipes to be inherited by child processes whatsoever, they should only be held by the logger.
     SetCloseOnExec(producerPipes); // We don't want the producer pipes to be inherited by child processes automatically, they should be dup'd manually after forking.
+
+    std::string tag{std::string{BaseLogTag} + name};
+    LogCounters *channelCounters;
+    {
+        std::scoped_lock lock{countersMutex};
+        auto &entry{counters[tag]};
+        if (!entry)
+            entry = std::make_unique<LogCounters>(tag);
+        channelCounters = entry.get();
+    }
+
+    LogShard *shard{};
     {
-        std::lock_guard lock{mutex};
-        AddLogPipe(epollFd, consumerPipes);
-        channels.emplace_back(std::string{BaseLogTag} + name, std::move(consumerPipes));
+        // Channels are assigned to the shard with the fewest live channels, the count is incremented under the lock so concurrent registrations are spread out.
+        std::scoped_lock lock{shardsMutex};
+        for (size_t i{}; i < shardCount; i++)
+            if (!shard || shards[i]->channelCount.load(std::memory_order_relaxed) < shard->channelCount.load(std::memory_order_relaxed))
+                shard = shards[i].get();
+        shard->channelCount.fetch_add(1, std::memory_order_relaxed);
     }
+
+    // The channel is handed off to the log thread through a lock-free stack, it must be published before any of its events can be delivered.
+    auto channel{new LogChannel{std::move(tag), std::move(consumerPipes), *shard, *channelCounters, options, std::move(ring)}};
+    channel->next = shard->pendingChannels.load(std::memory_order_relaxed);
+    while (!shard->pendingChannels.compare_exchange_weak(channel->next, channel, std::memory_order_release, std::memory_order_relaxed));
+
+    AddLogStreams(shard->epollFd, channel->out.fd, &channel->out, channel->err.fd, &channel->err);
     return std::move(producerPipes);
 }
+
+std::vector<LogChannelStats> Logger::GetStatsImpl() {
+    std::scoped_lock lock{countersMutex};
+    std::vector<LogChannelStats> stats;
+    stats.reserve(counters.size());
+    for (auto &[tag, entry]: counters)
+        stats.push_back(LogChannelStats{
+            .tag = tag,
+            .lines = entry->lines.load(std::memory_order_relaxed),
+            .bytes = entry->bytes.load(std::memory_order_relaxed),
+            .overflowDrops = entry->overflowDrops.load(std::memory_order_relaxed),
+            .rateLimitDrops = entry->rateLimitDrops.load(std::memory_order_relaxed),
+            .totalQueueLagNs = entry->totalQueueLagNs.load(std::memory_order_relaxed),
+            .maxQueueLagNs = entry->maxQueueLagNs.load(std::memory_order_relaxed),
+        });
+    return stats;
+}
+
+std::vector<std::pair<std::string, uint64_t>> Logger::GetWineDebugCountsImpl() {
+    return wineDebugCounters.Snapshot();
+}
+
+void Logger::SetShardCountImpl(size_t count, std::span<const int> cpus) {
+    if (count == 0 || count > MaxLogShards)
+        throw Exception{"Log shard count {} is outside of [1, {}]", count, MaxLogShards};
+
+    std::scoped_lock lock{shardsMutex};
+    for (size_t i{}; i < MaxLogShards; i++) {
+        if (i < count && !shards[i])
+            StartShard(i);
+        if (shards[i]) {
+            shards[i]->cpu.store(cpus.empty() ? -1 : cpus[i % cpus.size()]);
+            shards[i]->ApplyAffinity();
+        }
+    }
+    shardCount = count;
+}
+
+void Logger::SetSink(std::unique_ptr<LogSink> sink) {
+    std::scoped_lock lock{instance.sinkMutex};
+    instance.sink = std::move(sink);
+}
 }
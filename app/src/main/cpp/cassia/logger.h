@@ -1,8 +1,24 @@
 // Copyright © 2023 Cassia Developers, all rights reserved.
 #pragma once
 
+#include "log_ring.h"
+#include "log_sink.h"
+#include "wine_debug.h"
 #include "util/fd.h"
+#include "util/line_framer.h"
+#include "util/bounded_queue.h"
+#include <array>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <semaphore>
+#include <span>
+#include <string>
 #include <thread>
+#include <unordered_map>
+#include <vector>
+#include <sys/types.h>
 
 namespace cassia {
 /**
@@ -13,51 +29,128 @@ struct LogPipe {
     SharedFd err;
 };
 
+/**
+ * @brief The behavior of a channel when the queue between the reader and the sink is full.
+ */
+enum class LogOverflowPolicy {
+    Block, //!< Stop reading until the sink catches up, this applies backpressure to the producer but also stalls all other channels.
+    DropOldest, //!< Drop the oldest record in the queue (which may belong to any channel) to make space.
+    DropNewest, //!< Drop the record that was about to be queued.
+};
+
+/**
+ * @brief Options that control how the output of a single channel is handled.
+ */
+struct LogChannelOptions {
+    size_t pipeCapacity{}; //!< The capacity of the pipes in bytes, a larger capacity allows the producer to write more before blocking on the logger. 0 will use the system default.
+    double linesPerSecond{}; //!< The sustained rate at which lines are let through to the sink, any lines above this are dropped. 0 disables rate limiting.
+    double burstLines{}; //!< The amount of lines that can be let through at once after being idle, this is raised to at least a single line.
+    LogOverflowPolicy overflowPolicy{LogOverflowPolicy::Block};
+    bool parseWineDebug{}; //!< If lines should be parsed as Wine debug output, this maps the debug class to a log priority and collapses consecutive repeats of a message.
+};
+
+/**
+ * @brief A snapshot of the counters of all channels with a specific tag.
+ */
+struct LogChannelStats {
+    std::string tag;
+    uint64_t lines; //!< The amount of lines that were written to the sink.
+    uint64_t bytes; //!< The amount of bytes that were written to the sink, excluding newlines.
+    uint64_t overflowDrops; //!< The amount of lines that were dropped due to the queue being full.
+    uint64_t rateLimitDrops; //!< The amount of lines that were dropped by the rate limit.
+    uint64_t totalQueueLagNs; //!< The sum of the time that every written line spent between being read and being written.
+    uint64_t maxQueueLagNs;
+};
+
 /**
  * @brief A class to handle logging from stdout/stderr pipes (of the main process, along with any other pipes via GetPipe(...)) to logcat.
+ * @details Logging is split into two stages: the log threads read lines from the pipes and queue them, while the sink thread writes them to the sink.
+ * This prevents a slow sink from stalling reads from the pipes, which would otherwise block any processes writing to them.
+ * Reading is sharded over one or more log threads, each with its own epoll set, and every channel is assigned to the least loaded shard when it's created.
  * @note This class holds a global instance of itself and will be initialized automatically while running static initializers, this includes taking over the process's stdout/stderr pipes.
  */
 struct Logger {
   private:
-    UniqueFd epollFd; //!< Used to wait for events from the pipes on the log thread.
-    UniqueFd wakeEventFd; //!< Used to wake the epoll loop when the thread needs to join.
-    std::thread logThread;
+    /**
+     * @brief Counters for all channels sharing a tag, these are never destroyed so they can be referred to by queued records after their channel is gone.
+     */
+    struct LogCounters {
+        std::string tag;
+        std::atomic<uint64_t> lines, bytes, overflowDrops, rateLimitDrops, totalQueueLagNs, maxQueueLagNs;
+
+        explicit LogCounters(std::string tag) : tag{std::move(tag)} {}
+    };
+
+    std::mutex countersMutex; //!< Synchronizes access to the counters map, this is only held while registering channels and querying stats.
+    std::unordered_map<std::string, std::unique_ptr<LogCounters>> counters;
 
+    struct LogChannel;
+    struct LogShard;
+
+    /**
+     * @note The address of a stream is registered with epoll as the event data, so events are dispatched to it directly.
+     */
     struct LogStream {
+        LogChannel &channel;
         SharedFd fd;
-        std::vector<char> overflow; //!< Any data that was read from the pipe but couldn't be logged yet.
-        int androidLogPriority; //!< The Android log priority to use for this stream, this will be reflected in logcat.
+        LineFramer framer; //!< Holds any data that was read from the pipe but doesn't form a complete line yet.
+        int logPriority; //!< The log priority to use for this stream, this will be reflected in logcat.
+        std::optional<WineDebugCollapser> wineDebugCollapser; //!< Only present on channels that parse Wine debug output.
 
-        LogStream(SharedFd fd, int androidLogPriority);
+        LogStream(LogChannel &channel, SharedFd fd, int logPriority, bool parseWineDebug);
 
         /**
-         * @brief Reads data from the pipe and logs it to logcat.
+         * @brief Writes a line to the persistent ring (if any) and queues it for the sink, Wine debug output is parsed and collapsed beforehand if enabled.
+         */
+        void EmitLine(LogRing *ring, std::string_view line, std::chrono::steady_clock::time_point timestamp);
+
+        /**
+         * @brief Writes a line to the persistent ring (if any) and queues it for the sink with the supplied priority.
+         */
+        void WriteLine(LogRing *ring, int priority, std::string_view line, std::chrono::steady_clock::time_point timestamp);
+
+        /**
+         * @brief Emits the repeat count of a collapsed Wine debug message if its window has expired.
+         * @return If there are still repeats pending on this stream.
+         */
+        bool FlushExpiredRepeats(std::chrono::steady_clock::time_point now);
+
+        /**
+         * @brief Reads data from the pipe and queues every complete line in it as a separate record.
          * @note This will block until data is available.
-         * @param tag The tag to use for the logcat tag.
-         * @param readBuffer A buffer to use for reading data from the pipe, this should have a (large) non-zero size.
          */
-        void ReadAndLog(const char *tag, std::vector<char> &readBuffer);
+        void ReadAndLog();
+
+        /**
+         * @brief Reads all remaining data from the pipe until EOF and queues it, including any trailing partial line.
+         * @note This should only be used after the write end of the pipe has been closed, otherwise it'll block.
+         */
+        void DrainAndLog();
     };
 
     /**
      * @brief A channel is a collection of out/err streams of logs with an associated tag.
+     * @note Channels are heap-allocated and never move, they're linked intrusively into the pending stack and then the active list.
      */
     struct LogChannel {
         std::string tag;
         LogStream out, err;
+        LogShard &shard; //!< The shard this channel is assigned to, its streams are only ever read by the thread of this shard.
+        LogChannel *next{}; //!< The next channel in the pending stack or the active list.
+        LogChannel *previous{}; //!< The previous channel in the active list.
+        LogCounters &counters;
+        LogChannelOptions options;
+        std::shared_ptr<LogRing> ring; //!< The persistent ring that every line is written to alongside the sink, this is written to before rate limiting so it has a complete record. This is null for channels that aren't persisted.
+        double tokens; //!< The amount of lines that can currently be let through by the rate limit.
+        std::chrono::steady_clock::time_point lastRefill;
+        uint64_t pendingRateLimitDrops{}; //!< The amount of lines dropped by the rate limit since the last line that was let through.
+        bool receivedLine{}; //!< If any line has been read from the channel, the first line is traced as it marks the point a process got far enough to log.
 
-        LogChannel(std::string tag, LogPipe pipe);
+        LogChannel(std::string tag, LogPipe pipe, LogShard &shard, LogCounters &counters, LogChannelOptions options, std::shared_ptr<LogRing> ring);
 
-        /**
-         * @return The stream for the given file descriptor, or nullptr if it doesn't match any of the streams.
-         */
-        LogStream *GetStream(int fd) {
-            if (fd == out.fd.Get())
-                return &out;
-            if (fd == err.fd.Get())
-                return &err;
-            return nullptr;
-        }
+        LogChannel(const LogChannel &) = delete;
+
+        LogChannel &operator=(const LogChannel &) = delete;
 
         /**
          * @return If this channel is valid, i.e. if it has any valid streams.
@@ -65,28 +158,142 @@ struct Logger {
         bool Valid() {
             return out.fd.Valid() || err.fd.Valid();
         }
+
+        /**
+         * @brief Refills the token bucket and takes a token from it.
+         * @return If the line should be let through.
+         */
+        bool TakeRateLimitToken(std::chrono::steady_clock::time_point now);
     };
 
-    std::mutex mutex; //!< Used to synchronize access to the list of channels.
-    std::vector<LogChannel> channels;
+    WineDebugCounters wineDebugCounters;
 
-    void LogThread();
+    /**
+     * @brief A log thread along with the epoll set of all channels assigned to it.
+     * @note Shards are never destroyed before the logger, they only stop being assigned new channels when the shard count is reduced.
+     */
+    struct LogShard {
+        UniqueFd epollFd; //!< Used to wait for events from the pipes on the log thread.
+        UniqueFd wakeEventFd; //!< Used to wake the epoll loop when the thread needs to join.
+        std::thread thread;
+        std::atomic<pid_t> tid{}; //!< The kernel thread ID of the log thread, this is 0 until the thread has started.
+        std::atomic<int> cpu{-1}; //!< The CPU that the log thread should be pinned to, -1 if it can run on any CPU.
+        std::atomic<size_t> channelCount{}; //!< The amount of channels assigned to this shard that haven't been retired yet.
+
+        std::atomic<LogChannel *> pendingChannels{}; //!< A lock-free stack of channels which have been registered but not adopted by the log thread yet.
+        LogChannel *activeChannels{}; //!< A list of all channels adopted by the log thread, this must only be accessed by the log thread.
+        bool pendingRepeats{}; //!< If any stream might have collapsed repeats which haven't been emitted yet, the log thread wakes up periodically to flush them while this is set.
+
+        LogShard();
+
+        /**
+         * @brief Pins the log thread to the CPU in cpu, this is a no-op until the thread has started as it applies the affinity itself.
+         */
+        void ApplyAffinity();
+
+        /**
+         * @brief Emits the repeat counts of all streams whose collapse window has expired.
+         */
+        void FlushExpiredRepeats();
+
+        /**
+         * @brief Moves all pending channels into the active list, this must be done before handling any events as they might belong to a pending channel.
+         */
+        void AdoptPendingChannels();
+
+        /**
+         * @brief Unlinks a channel from the active list and destroys it.
+         */
+        void RetireChannel(LogChannel *channel);
+    };
+
+    static constexpr size_t MaxLogShards{8};
+    std::mutex shardsMutex; //!< Synchronizes changing the shard count with assigning channels to shards.
+    std::array<std::unique_ptr<LogShard>, MaxLogShards> shards; //!< All shards that have been started, these are never destroyed before the logger.
+    size_t shardCount{}; //!< The amount of shards that new channels are assigned to, shards past this only keep serving their existing channels.
+
+    /**
+     * @brief Creates a shard and starts its log thread, this must be called with shardsMutex held.
+     */
+    void StartShard(size_t index);
+
+    void LogThread(LogShard &shard);
+
+    /**
+     * @brief A line which has been read from a pipe and is waiting to be written to the sink.
+     */
+    struct QueuedRecord {
+        LogCounters *counters;
+        int priority;
+        std::chrono::steady_clock::time_point timestamp;
+        std::string message; //!< The capacity of this is retained across uses of the queue slot, so it rarely needs to allocate.
+    };
+
+    BoundedQueue<QueuedRecord> queue;
+    std::counting_semaphore<> queuedRecords{0}; //!< The amount of records in the queue that haven't been claimed by a consumer.
+    std::counting_semaphore<> freeSlots; //!< The amount of slots in the queue that haven't been claimed by a producer.
+    std::atomic<bool> sinkStopping{};
+    std::mutex sinkMutex; //!< Synchronizes replacing the sink with writing to it.
+    std::unique_ptr<LogSink> sink;
+    std::thread sinkThread;
+
+    /**
+     * @brief Queues a line for the sink according to the channel's rate limit and overflow policy.
+     */
+    void QueueLine(LogChannel &channel, int priority, std::string_view line, std::chrono::steady_clock::time_point timestamp);
+
+    void SinkThread();
 
     Logger();
 
     ~Logger();
 
-    LogPipe GetPipeImpl(const std::string &name);
+    LogPipe GetPipeImpl(const std::string &name, LogChannelOptions options, std::shared_ptr<LogRing> ring);
+
+    std::vector<LogChannelStats> GetStatsImpl();
+
+    std::vector<std::pair<std::string, uint64_t>> GetWineDebugCountsImpl();
+
+    void SetShardCountImpl(size_t count, std::span<const int> cpus);
 
     static Logger instance; //!< The global instance of the logger.
 
   public:
     /**
      * @return Log pipes that will be redirected into logcat with the given name as a tag.
-     * @note There can be multiple streams with the same name, they will all be logged to the same tag.
+     * @param ring The persistent ring that every line of the channel is written to in addition to the sink, the ring is kept alive until the channel is closed.
+     * @note There can be multiple streams with the same name, they will all be logged to the same tag and share counters.
+     */
+    static LogPipe GetPipe(const std::string &name, LogChannelOptions options = {}, std::shared_ptr<LogRing> ring = {}) {
+        return instance.GetPipeImpl(name, options, std::move(ring));
+    }
+
+    /**
+     * @return The counters of every tag that has been used by a channel so far.
      */
-    static LogPipe GetPipe(const std::string &name) {
-        return instance.GetPipeImpl(name);
+    static std::vector<LogChannelStats> GetStats() {
+        return instance.GetStatsImpl();
     }
+
+    /**
+     * @return The amount of Wine debug messages for every "class:channel:function" combination seen by channels that parse Wine debug output, sorted by count in descending order.
+     */
+    static std::vector<std::pair<std::string, uint64_t>> GetWineDebugCounts() {
+        return instance.GetWineDebugCountsImpl();
+    }
+
+    /**
+     * @brief Sets the amount of log threads that new channels are spread over, existing channels stay on the thread they were assigned to.
+     * @param cpus The CPUs to pin the log threads to, shard N is pinned to cpus[N % cpus.size()]. If this is empty, the threads can run on any CPU.
+     * @note The count must be between 1 and MaxLogShards, the default is a single log thread.
+     */
+    static void SetShardCount(size_t count, std::span<const int> cpus = {}) {
+        instance.SetShardCountImpl(count, cpus);
+    }
+
+    /**
+     * @brief Replaces the sink that all records are written to, this is the platform sink (logcat on Android) by default.
+     */
+    static void SetSink(std::unique_ptr<LogSink> sink);
 };
 }
@@ -0,0 +1,213 @@
+// Copyright © 2023 Cassia Developers, all rights reserved.
+
+#include "pixel_convert.h"
+#include <algorithm>
+#include <bit>
+#include <cstring>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+namespace cassia {
+static_assert(std::endian::native == std::endian::little, "Pixels are converted as little-endian 32-bit words");
+
+/**
+ * @brief The alpha channel of a pixel as a 32-bit little-endian word, this is the same for RGBA and BGRA.
+ */
+constexpr uint32_t AlphaMask{0xFF000000};
+
+PixelRect PixelRect::Union(const PixelRect &other) const {
+    if (other.Empty())
+        return *this;
+    if (Empty())
+        return other;
+    int32_t left{std::min(x, other.x)}, top{std::min(y, other.y)};
+    int32_t right{std::max(x + width, other.x + other.width)}, bottom{std::max(y + height, other.y + other.height)};
+    return {left, top, right - left, bottom - top};
+}
+
+PixelRect PixelRect::Intersect(const PixelRect &other) const {
+    int32_t left{std::max(x, other.x)}, top{std::max(y, other.y)};
+    int32_t right{std::min(x + width, other.x + other.width)}, bottom{std::min(y + height, other.y + other.height)};
+    if (right <= left || bottom <= top)
+        return {};
+    return {left, top, right - left, bottom - top};
+}
+
+void DamageRegion::Add(const PixelRect &rect) {
+    if (rect.Empty())
+        return;
+    for (auto &existing: rects) {
+        if (existing.Union(rect) == existing)
+            return; // The rectangle is already covered entirely.
+        if (rect.Union(existing) == rect) {
+            existing = rect;
+            return;
+        }
+    }
+    if (rects.size() == MaxRects) {
+        auto bounds{GetBounds().Union(rect)};
+        rects.clear();
+        rects.push_back(bounds);
+        return;
+    }
+    rects.push_back(rect);
+}
+
+void DamageRegion::Add(const DamageRegion &other) {
+    for (const auto &rect: other.rects)
+        Add(rect);
+}
+
+PixelRect DamageRegion::GetBounds() const {
+    PixelRect bounds{};
+    for (const auto &rect: rects)
+        bounds = bounds.Union(rect);
+    return bounds;
+}
+
+/**
+ * @brief Converts a row of pixels, swapping the red and blue channels if requested and then setting the bits in the alpha mask.
+ */
+using RowKernel = void (*)(const uint8_t *src, uint8_t *dst, size_t pixels, bool swapRedBlue, uint32_t alphaMask);
+
+static void ConvertRowScalar(const uint8_t *src, uint8_t *dst, size_t pixels, bool swapRedBlue, uint32_t alphaMask) {
+    for (size_t i{}; i < pixels; i++) {
+        uint32_t pixel;
+        std::memcpy(&pixel, src + i * 4, sizeof(pixel));
+        if (swapRedBlue)
+            pixel = (pixel & 0xFF00FF00) | ((pixel >> 16) & 0xFF) | ((pixel & 0xFF) << 16);
+        pixel |= alphaMask;
+        std::memcpy(dst + i * 4, &pixel, sizeof(pixel));
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("ssse3"))) static void ConvertRowSsse3(const uint8_t *src, uint8_t *dst, size_t pixels, bool swapRedBlue, uint32_t alphaMask) {
+    __m128i shuffle{swapRedBlue ? _mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15) : _mm_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15)};
+    __m128i alpha{_mm_set1_epi32(static_cast<int>(alphaMask))};
+    size_t i{};
+    for (; i + 4 <= pixels; i += 4) {
+        __m128i value{_mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i * 4))};
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i * 4), _mm_or_si128(_mm_shuffle_epi8(value, shuffle), alpha));
+    }
+    ConvertRowScalar(src + i * 4, dst + i * 4, pixels - i, swapRedBlue, alphaMask);
+}
+
+__attribute__((target("avx2"))) static void ConvertRowAvx2(const uint8_t *src, uint8_t *dst, size_t pixels, bool swapRedBlue, uint32_t alphaMask) {
+    __m256i shuffle{swapRedBlue ? _mm256_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15, 2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15)
+                                : _mm256_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15)};
+    __m256i alpha{_mm256_set1_epi32(static_cast<int>(alphaMask))};
+    size_t i{};
+    for (; i + 16 <= pixels; i += 16) {
+        __m256i first{_mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i * 4))};
+        __m256i second{_mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i * 4 + 32))};
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i * 4), _mm256_or_si256(_mm256_shuffle_epi8(first, shuffle), alpha));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i * 4 + 32), _mm256_or_si256(_mm256_shuffle_epi8(second, shuffle), alpha));
+    }
+    ConvertRowSsse3(src + i * 4, dst + i * 4, pixels - i, swapRedBlue, alphaMask);
+}
+#elif defined(__aarch64__)
+static void ConvertRowNeon(const uint8_t *src, uint8_t *dst, size_t pixels, bool swapRedBlue, uint32_t alphaMask) {
+    uint8x16_t alpha{vdupq_n_u8(static_cast<uint8_t>(alphaMask >> 24))};
+    size_t i{};
+    for (; i + 16 <= pixels; i += 16) {
+        // Loading with a stride of 4 splits the channels into separate registers, so swapping channels is free.
+        uint8x16x4_t value{vld4q_u8(src + i * 4)};
+        if (swapRedBlue)
+            std::swap(value.val[0], value.val[2]);
+        value.val[3] = vorrq_u8(value.val[3], alpha);
+        vst4q_u8(dst + i * 4, value);
+    }
+    ConvertRowScalar(src + i * 4, dst + i * 4, pixels - i, swapRedBlue, alphaMask);
+}
+#endif
+
+const char *GetPixelKernelName(PixelKernel kernel) {
+    switch (kernel) {
+        case PixelKernel::Scalar:
+            return "scalar";
+        case PixelKernel::Ssse3:
+            return "ssse3";
+        case PixelKernel::Avx2:
+            return "avx2";
+        case PixelKernel::Neon:
+            return "neon";
+    }
+    return "unknown";
+}
+
+bool IsPixelKernelSupported(PixelKernel kernel) {
+    switch (kernel) {
+        case PixelKernel::Scalar:
+            return true;
+#if defined(__x86_64__) || defined(__i386__)
+        case PixelKernel::Ssse3:
+            return __builtin_cpu_supports("ssse3");
+        case PixelKernel::Avx2:
+            return __builtin_cpu_supports("avx2");
+#elif defined(__aarch64__)
+        case PixelKernel::Neon:
+            return true; // NEON is mandatory on AArch64.
+#endif
+        default:
+            return false;
+    }
+}
+
+PixelKernel GetBestPixelKernel() {
+    static const PixelKernel best{[] {
+        for (auto kernel: {PixelKernel::Neon, PixelKernel::Avx2, PixelKernel::Ssse3})
+            if (IsPixelKernelSupported(kernel))
+                return kernel;
+        return PixelKernel::Scalar;
+    }()};
+    return best;
+}
+
+static RowKernel GetRowKernel(PixelKernel kernel) {
+    switch (kernel) {
+#if defined(__x86_64__) || defined(__i386__)
+        case PixelKernel::Ssse3:
+            return ConvertRowSsse3;
+        case PixelKernel::Avx2:
+            return ConvertRowAvx2;
+#elif defined(__aarch64__)
+        case PixelKernel::Neon:
+            return ConvertRowNeon;
+#endif
+        default:
+            return ConvertRowScalar;
+    }
+}
+
+static bool IsBgr(PixelFormat format) {
+    return format == PixelFormat::Bgra8888 || format == PixelFormat::Bgrx8888;
+}
+
+void ConvertPixels(const uint8_t *src, size_t srcStride, PixelFormat srcFormat, uint8_t *dst, size_t dstStride, PixelFormat dstFormat, uint32_t width, uint32_t height, PixelKernel kernel) {
+    bool swapRedBlue{IsBgr(srcFormat) != IsBgr(dstFormat)};
+    uint32_t alphaMask{!HasAlpha(srcFormat) && HasAlpha(dstFormat) ? AlphaMask : 0};
+    size_t rowSize{static_cast<size_t>(width) * 4};
+
+    if (!swapRedBlue && !alphaMask) {
+        if (srcStride == rowSize && dstStride == rowSize) {
+            std::memcpy(dst, src, rowSize * height);
+        } else {
+            for (uint32_t row{}; row < height; row++)
+                std::memcpy(dst + row * dstStride, src + row * srcStride, rowSize);
+        }
+        return;
+    }
+
+    auto rowKernel{GetRowKernel(kernel)};
+    if (srcStride == rowSize && dstStride == rowSize) {
+        rowKernel(src, dst, static_cast<size_t>(width) * height, swapRedBlue, alphaMask); // Contiguous rows are converted as a single row, which avoids a scalar tail on every row.
+    } else {
+        for (uint32_t row{}; row < height; row++)
+            rowKernel(src + row * srcStride, dst + row * dstStride, width, swapRedBlue, alphaMask);
+    }
+}
+}
@@ -0,0 +1,107 @@
+// Copyright © 2023 Cassia Developers, all rights reserved.
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+namespace cassia {
+/**
+ * @brief 32-bit pixel formats, named by the order of their bytes in memory.
+ */
+enum class PixelFormat : uint8_t {
+    Rgba8888,
+    Rgbx8888, //!< The X byte is undefined, it's treated as opaque.
+    Bgra8888,
+    Bgrx8888, //!< The native format of 24-bit X11 visuals on little-endian machines.
+};
+
+/**
+ * @return If the format has a meaningful alpha channel.
+ */
+constexpr bool HasAlpha(PixelFormat format) {
+    return format == PixelFormat::Rgba8888 || format == PixelFormat::Bgra8888;
+}
+
+/**
+ * @brief An axis-aligned rectangle of pixels.
+ */
+struct PixelRect {
+    int32_t x, y;
+    int32_t width, height;
+
+    constexpr bool Empty() const {
+        return width <= 0 || height <= 0;
+    }
+
+    constexpr int64_t Area() const {
+        return Empty() ? 0 : static_cast<int64_t>(width) * height;
+    }
+
+    /**
+     * @return The smallest rectangle containing both rectangles, empty rectangles are ignored.
+     */
+    PixelRect Union(const PixelRect &other) const;
+
+    PixelRect Intersect(const PixelRect &other) const;
+
+    bool operator==(const PixelRect &) const = default;
+};
+
+/**
+ * @brief A set of damaged rectangles, which may overlap.
+ * @note The rectangles are collapsed into their bounding box once there are too many of them, as every rectangle costs a separate copy.
+ */
+class DamageRegion {
+  private:
+    std::vector<PixelRect> rects;
+
+  public:
+    static constexpr size_t MaxRects{16};
+
+    void Add(const PixelRect &rect);
+
+    void Add(const DamageRegion &other);
+
+    void Clear() {
+        rects.clear();
+    }
+
+    bool Empty() const {
+        return rects.empty();
+    }
+
+    std::span<const PixelRect> GetRects() const {
+        return rects;
+    }
+
+    PixelRect GetBounds() const;
+};
+
+/**
+ * @brief The implementation used for pixel conversion, the best supported one is selected at runtime.
+ */
+enum class PixelKernel : uint8_t {
+    Scalar,
+    Ssse3,
+    Avx2,
+    Neon,
+};
+
+const char *GetPixelKernelName(PixelKernel kernel);
+
+bool IsPixelKernelSupported(PixelKernel kernel);
+
+/**
+ * @return The fastest kernel supported by the CPU, this is detected once and cached.
+ */
+PixelKernel GetBestPixelKernel();
+
+/**
+ * @brief Copies a rectangle of pixels between buffers with arbitrary strides, converting between formats by swapping the red and blue channels and filling the alpha channel as required.
+ * @param srcStride The size of a row of the source in bytes.
+ * @param dstStride The size of a row of the destination in bytes.
+ */
+void ConvertPixels(const uint8_t *src, size_t srcStride, PixelFormat srcFormat, uint8_t *dst, size_t dstStride, PixelFormat dstFormat, uint32_t width, uint32_t height, PixelKernel kernel = GetBestPixelKernel());
+}
@@ -0,0 +1,50 @@
+// Copyright © 2023 Cassia Developers, all rights reserved.
+
+#include "platform.h"
+#include "util/error.h"
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <unistd.h>
+#include <fcntl.h>
+#ifdef __ANDROID__
+#include <android/log.h>
+#include <sys/system_properties.h>
+#endif
+
+namespace cassia {
+#ifdef __ANDROID__
+static_assert(LogPriorityVerbose == ANDROID_LOG_VERBOSE && LogPriorityDebug == ANDROID_LOG_DEBUG && LogPriorityInfo == ANDROID_LOG_INFO && LogPriorityWarn == ANDROID_LOG_WARN && LogPriorityError == ANDROID_LOG_ERROR);
+
+std::string GetSystemProperty(const char *name) {
+    auto property{__system_property_find(name)};
+    if (property) {
+        char value[PROP_VALUE_MAX];
+        int len{__system_property_read(property, nullptr, value)};
+        if (len > 0)
+            return std::string{value, static_cast<size_t>(len)};
+    }
+    return "";
+}
+
+std::unique_ptr<LogSink> CreatePlatformLogSink() {
+    return std::make_unique<LogcatSink>();
+}
+#else
+std::string GetSystemProperty(const char *name) {
+    std::string variable{name};
+    std::transform(variable.begin(), variable.end(), variable.begin(), [](unsigned char c) {
+        return c == '.' ? '_' : static_cast<char>(std::toupper(c));
+    });
+    auto value{getenv(variable.c_str())};
+    return value ? value : "";
+}
+
+std::unique_ptr<LogSink> CreatePlatformLogSink() {
+    int fd{fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, 0)};
+    if (fd == -1)
+        throw Exception{"fcntl(STDERR, F_DUPFD_CLOEXEC) failed: {}", strerror(errno)};
+    return std::make_unique<FdLogSink>(UniqueFd{fd, "log_sink"});
+}
+#endif
+}
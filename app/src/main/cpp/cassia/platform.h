@@ -0,0 +1,39 @@
+// Copyright © 2023 Cassia Developers, all rights reserved.
+#pragma once
+
+#include "log_sink.h"
+#include <memory>
+#include <string>
+
+namespace cassia {
+/**
+ * @brief Log priorities, these have the same values as Android's so they can be passed to logcat as-is.
+ */
+constexpr int LogPriorityVerbose{2};
+constexpr int LogPriorityDebug{3};
+constexpr int LogPriorityInfo{4};
+constexpr int LogPriorityWarn{5};
+constexpr int LogPriorityError{6};
+
+/**
+ * @brief The dynamic linker that executables are run through, this is null on platforms where they can be executed directly.
+ * @note See Process::Process for why this is required on Android.
+ */
+#ifdef __ANDROID__
+constexpr const char *LinkerPath{"/system/bin/linker64"};
+#else
+constexpr const char *LinkerPath{nullptr};
+#endif
+
+/**
+ * @return The value of a system property, or an empty string if it isn't set.
+ * @note On hosts without system properties, this reads an environment variable named after the property instead (e.g. cassia.wine.debug is read from CASSIA_WINE_DEBUG).
+ */
+std::string GetSystemProperty(const char *name);
+
+/**
+ * @return The default sink of the Logger, this is logcat on Android and the original stderr of the process elsewhere.
+ * @note This must be called before stderr is taken over by the Logger.
+ */
+std::unique_ptr<LogSink> CreatePlatformLogSink();
+}
@@ -0,0 +1,290 @@
+// Copyright © 2023 Cassia Developers, all rights reserved.
+
+#include "prefix_cloner.h"
+#include "prefix_fingerprint.h"
+#include "util/dir.h"
+#include "util/error.h"
+#include "util/fd.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <climits>
+#include <condition_variable>
+#include <cstring>
+#include <exception>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+namespace cassia {
+/**
+ * @brief The directories of a prefix that are cloned, everything else in the template (logs, metadata) belongs to the template itself.
+ */
+constexpr std::array<std::string_view, 2> ClonedDirectories{"pfx", "home"};
+
+constexpr size_t CopyBufferSize{128 * 1024}; //!< The size of the buffer used to copy files when copy_file_range isn't supported.
+
+/**
+ * @return If the error denotes that an operation isn't supported between the supplied files, rather than the operation failing.
+ */
+static bool IsUnsupportedError(int error) {
+    return error == EOPNOTSUPP || error == ENOTTY || error == EXDEV || error == EINVAL || error == ENOSYS;
+}
+
+/**
+ * @brief The state of a single clone, which is shared between all workers.
+ * @details Workers pop a directory, create all of its entries in the destination and push any subdirectories back for other workers to pick up.
+ */
+class CloneJob {
+  private:
+    UniqueFd sourceRoot;
+    UniqueFd destinationRoot;
+    std::string sourcePrefix; //!< The absolute path of the template with a trailing slash, symlinks with targets under it are rebased.
+    std::string destinationPrefix;
+
+    std::mutex mutex;
+    std::condition_variable condition; //!< Signalled when directories are pushed, a worker becomes idle or an error occurs.
+    std::vector<std::string> pendingDirectories; //!< Paths relative to the roots of directories that exist in the destination but whose entries haven't been cloned.
+    size_t activeWorkers{};
+    std::exception_ptr error; //!< The first error encountered by any worker, all workers stop once this is set.
+
+    std::atomic<bool> reflinkSupported{true}; //!< Cleared once a reflink fails because the filesystem doesn't support it.
+    std::atomic<bool> copyFileRangeSupported{true};
+
+    void CopyContents(int source, int destination, const std::string &relativePath, uint64_t size) {
+        uint64_t copied{};
+        while (copied < size && copyFileRangeSupported.load(std::memory_order_relaxed)) {
+            // copy_file_range is only exposed by bionic from API 34 onwards, so it's called directly.
+            ssize_t result{static_cast<ssize_t>(syscall(__NR_copy_file_range, source, nullptr, destination, nullptr, size - copied, 0))};
+            if (result > 0) {
+                copied += static_cast<uint64_t>(result);
+            } else if (result == 0) {
+                break; // The file was truncated while copying it.
+            } else if (errno == EINTR) {
+                continue;
+            } else if (IsUnsupportedError(errno) && copied == 0) {
+                copyFileRangeSupported = false;
+            } else {
+                throw Exception{"copy_file_range() failed for '{}': {}", relativePath, strerror(errno)};
+            }
+        }
+
+        if (copied < size && !copyFileRangeSupported.load(std::memory_order_relaxed)) {
+            std::vector<char> buffer(std::min<uint64_t>(CopyBufferSize, size));
+            while (true) {
+                ssize_t result{read(source, buffer.data(), buffer.size())};
+                if (result == 0)
+                    break;
+                if (result == -1) {
+                    if (errno == EINTR)
+                        continue;
+                    throw Exception{"read() failed for '{}': {}", relativePath, strerror(errno)};
+                }
+                for (ssize_t written{}; written < result;) {
+                    ssize_t writeResult{write(destination, buffer.data() + written, static_cast<size_t>(result - written))};
+                    if (writeResult == -1) {
+                        if (errno == EINTR)
+                            continue;
+                        throw Exception{"write() failed for '{}': {}", relativePath, strerror(errno)};
+                    }
+                    written += writeResult;
+                }
+                copied += static_cast<uint64_t>(result);
+            }
+        }
+        copiedBytes += copied;
+    }
+
+    void CloneFile(int sourceDirectory, int destinationDirectory, const char *name, const std::string &relativePath, const struct stat &info) {
+        UniqueFd source{openat(sourceDirectory, name, O_RDONLY | O_CLOEXEC | O_NOFOLLOW), "prefix_cloner"};
+        if (source.Get() == -1)
+            throw Exception{"Failed to open '{}': {}", relativePath, strerror(errno)};
+        UniqueFd destination{openat(destinationDirectory, name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, info.st_mode & 07777), "prefix_cloner"};
+        if (destination.Get() == -1)
+            throw Exception{"Failed to create '{}': {}", relativePath, strerror(errno)};
+
+        if (reflinkSupported.load(std::memory_order_relaxed)) {
+            if (ioctl(destination.Get(), FICLONE, source.Get()) == 0) {
+                reflinkedFiles++;
+                return;
+            }
+            if (!IsUnsupportedError(errno) && errno != EPERM)
+                throw Exception{"Failed to reflink '{}': {}", relativePath, strerror(errno)};
+            reflinkSupported = false;
+        }
+
+        // Files are never hardlinked to the template, see ClonePrefix.
+        CopyContents(source.Get(), destination.Get(), relativePath, static_cast<uint64_t>(info.st_size));
+        copiedFiles++;
+    }
+
+    void CloneSymlink(int sourceDirectory, int destinationDirectory, const char *name, const std::string &relativePath) {
+        std::array<char, PATH_MAX> buffer;
+        ssize_t size{readlinkat(sourceDirectory, name, buffer.data(), buffer.size())};
+        if (size == -1 || static_cast<size_t>(size) == buffer.size())
+            throw Exception{"Failed to read the symlink '{}': {}", relativePath, strerror(errno)};
+
+        std::string target{buffer.data(), static_cast<size_t>(size)};
+        if (target.starts_with(sourcePrefix))
+            target.replace(0, sourcePrefix.size(), destinationPrefix);
+        if (symlinkat(target.c_str(), destinationDirectory, name) == -1)
+            throw Exception{"Failed to create the symlink '{}': {}", relativePath, strerror(errno)};
+        symlinks++;
+    }
+
+    void CloneDirectory(const std::string &relativePath) {
+        int sourceFd{openat(sourceRoot.Get(), relativePath.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC)};
+        if (sourceFd == -1)
+            throw Exception{"Failed to open the directory '{}': {}", relativePath, strerror(errno)};
+        UniqueDir sourceDir{fdopendir(sourceFd)};
+        if (!sourceDir) {
+            close(sourceFd);
+            throw Exception{"fdopendir() failed for '{}': {}", relativePath, strerror(errno)};
+        }
+        UniqueFd destination{openat(destinationRoot.Get(), relativePath.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC), "prefix_cloner"};
+        if (destination.Get() == -1)
+            throw Exception{"Failed to open the directory '{}' in the clone: {}", relativePath, strerror(errno)};
+
+        std::vector<std::string> subdirectories;
+        while (dirent *entry{readdir(sourceDir.get())}) {
+            if (std::strcmp(entry->d_name, ".") == 0 || std::strcmp(entry->d_name, "..") == 0)
+                continue;
+            std::string entryPath{relativePath + '/' + entry->d_name};
+
+            if (entry->d_type == DT_LNK) {
+                CloneSymlink(sourceFd, destination.Get(), entry->d_name, entryPath);
+                continue;
+            }
+
+            struct stat info{};
+            if (fstatat(sourceFd, entry->d_name, &info, AT_SYMLINK_NOFOLLOW) == -1)
+                throw Exception{"fstatat() failed for '{}': {}", entryPath, strerror(errno)};
+
+            if (S_ISDIR(info.st_mode)) {
+                if (mkdirat(destination.Get(), entry->d_name, info.st_mode & 07777) == -1)
+                    throw Exception{"Failed to create the directory '{}': {}", entryPath, strerror(errno)};
+                directories++;
+                subdirectories.push_back(std::move(entryPath));
+            } else if (S_ISREG(info.st_mode)) {
+                CloneFile(sourceFd, destination.Get(), entry->d_name, entryPath, info);
+            } else if (S_ISLNK(info.st_mode)) {
+                CloneSymlink(sourceFd, destination.Get(), entry->d_name, entryPath); // The filesystem doesn't report entry types.
+            } // Any other types of files (such as sockets) are specific to a running prefix and aren't cloned.
+        }
+
+        if (!subdirectories.empty()) {
+            {
+                std::scoped_lock lock{mutex};
+                std::move(subdirectories.begin(), subdirectories.end(), std::back_inserter(pendingDirectories));
+            }
+            condition.notify_all();
+        }
+    }
+
+  public:
+    std::atomic<size_t> directories{}, symlinks{}, reflinkedFiles{}, copiedFiles{};
+    std::atomic<uint64_t> copiedBytes{};
+
+    CloneJob(const std::filesystem::path &templatePath, const std::filesystem::path &prefixPath)
+        : sourceRoot{open(templatePath.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC), "prefix_cloner"},
+          destinationRoot{open(prefixPath.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC), "prefix_cloner"},
+          sourcePrefix{templatePath.string() + '/'},
+          destinationPrefix{prefixPath.string() + '/'} {
+        if (sourceRoot.Get() == -1)
+            throw Exception{"Failed to open the template '{}': {}", templatePath.string(), strerror(errno)};
+        if (destinationRoot.Get() == -1)
+            throw Exception{"Failed to open the prefix '{}': {}", prefixPath.string(), strerror(errno)};
+
+        for (auto directory: ClonedDirectories) {
+            struct stat info{};
+            std::string path{directory};
+            if (fstatat(sourceRoot.Get(), path.c_str(), &info, 0) == -1 || !S_ISDIR(info.st_mode))
+                continue;
+            if (mkdirat(destinationRoot.Get(), path.c_str(), info.st_mode & 07777) == -1 && errno != EEXIST)
+                throw Exception{"Failed to create the directory '{}': {}", path, strerror(errno)};
+            pendingDirectories.push_back(std::move(path));
+        }
+    }
+
+    void Worker() {
+        while (true) {
+            std::string directory;
+            {
+                std::unique_lock lock{mutex};
+                condition.wait(lock, [&] { return !pendingDirectories.empty() || activeWorkers == 0 || error; });
+                if (error || pendingDirectories.empty())
+                    break; // No other worker can push any more directories once they're all idle.
+                directory = std::move(pendingDirectories.back());
+                pendingDirectories.pop_back();
+                activeWorkers++;
+            }
+
+            try {
+                CloneDirectory(directory);
+            } catch (...) {
+                std::scoped_lock lock{mutex};
+                if (!error)
+                    error = std::current_exception();
+            }
+
+            {
+                std::scoped_lock lock{mutex};
+                activeWorkers--;
+            }
+            condition.notify_all();
+        }
+        condition.notify_all();
+    }
+
+    /**
+     * @brief Rethrows the first error encountered by any worker, this must only be called once all workers have returned.
+     */
+    void RethrowError() {
+        if (error)
+            std::rethrow_exception(error);
+    }
+
+    /**
+     * @brief Clones a single file at the root of the template.
+     */
+    void CloneRootFile(std::string_view name) {
+        std::string path{name};
+        struct stat info{};
+        if (fstatat(sourceRoot.Get(), path.c_str(), &info, AT_SYMLINK_NOFOLLOW) == -1 || !S_ISREG(info.st_mode))
+            return;
+        CloneFile(sourceRoot.Get(), destinationRoot.Get(), path.c_str(), path, info);
+    }
+};
+
+PrefixCloneStats ClonePrefix(const std::filesystem::path &templatePath, const std::filesystem::path &prefixPath, size_t threadCount) {
+    auto start{std::chrono::steady_clock::now()};
+    CloneJob job{templatePath, prefixPath};
+
+    std::vector<std::thread> workers;
+    for (size_t index{1}; index < threadCount; index++)
+        workers.emplace_back(&CloneJob::Worker, &job);
+    job.Worker();
+    for (auto &worker: workers)
+        worker.join();
+    job.RethrowError();
+
+    // The fingerprint marks the prefix as initialized, so it's only cloned once everything else has been.
+    job.CloneRootFile(PrefixFingerprintFileName);
+
+    return PrefixCloneStats{
+        .directories = job.directories,
+        .symlinks = job.symlinks,
+        .reflinkedFiles = job.reflinkedFiles,
+        .copiedFiles = job.copiedFiles,
+        .copiedBytes = job.copiedBytes,
+        .duration = std::chrono::steady_clock::now() - start,
+    };
+}
+}
@@ -0,0 +1,28 @@
+// Copyright © 2023 Cassia Developers, all rights reserved.
+#pragma once
+
+#include <chrono>
+#include <filesystem>
+
+namespace cassia {
+/**
+ * @brief Statistics about a single prefix clone.
+ */
+struct PrefixCloneStats {
+    size_t directories;
+    size_t symlinks;
+    size_t reflinkedFiles; //!< Files that share their extents with the template copy-on-write, this is only possible on some filesystems.
+    size_t copiedFiles;
+    uint64_t copiedBytes;
+    std::chrono::nanoseconds duration;
+};
+
+/**
+ * @brief Clones an initialized template prefix into a new prefix, so the new prefix doesn't need to be initialized by wineboot.
+ * @details The "pfx" and "home" directories are cloned in parallel along with the prefix fingerprint, which is cloned last so a partial clone is never considered initialized.
+ * Files are reflinked when the filesystem supports it and copied with copy_file_range otherwise, absolute symlinks into the template are rebased onto the new prefix.
+ * @param prefixPath The directory of the new prefix, any existing "pfx" and "home" directories inside it must be empty.
+ * @note Files are never hardlinked to the template even though Android's ext4 and f2fs don't support reflinks, a shared inode would have to be read-only to protect the template and Wine reports that as FILE_ATTRIBUTE_READONLY. This would break wineboot updating the builtin DLLs in system32 after a runtime change, and installers replacing them.
+ */
+PrefixCloneStats ClonePrefix(const std::filesystem::path &templatePath, const std::filesystem::path &prefixPath, size_t threadCount = 4);
+}
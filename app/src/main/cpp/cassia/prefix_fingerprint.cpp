@@ -0,0 +1,131 @@
+// Copyright © 2023 Cassia Developers, all rights reserved.
+
+#include "prefix_fingerprint.h"
+#include "util/error.h"
+#include <array>
+#include <cstring>
+#include <memory>
+#include <sys/stat.h>
+
+namespace cassia {
+/**
+ * @brief The version of the fingerprint format, this must be incremented whenever the components change so existing prefixes are re-initialized.
+ */
+constexpr int PrefixFingerprintVersion{2};
+
+/**
+ * @brief Environment variables that change the configuration wineboot writes into the prefix, any other variables (such as debug options) are ignored.
+ * @note WINEPREFIX and HOME are always inside the prefix directory, they're excluded so a prefix cloned from a template keeps the template's fingerprint.
+ */
+constexpr std::array<std::string_view, 4> FingerprintEnvVars{
+    "WINELOADER",
+    "WINEARCH",
+    "WINEDLLOVERRIDES",
+    "LD_LIBRARY_PATH",
+};
+
+/**
+ * @brief Files of the runtime that are identified by their size and modification time rather than their contents, hashing these would cost more than the initialization being skipped.
+ * @note wine.inf is what wineboot applies to the prefix, Wine itself re-initializes prefixes when its modification time changes.
+ */
+constexpr std::array<std::string_view, 3> FingerprintRuntimeFiles{
+    "bin/wine",
+    "bin/wineserver",
+    "share/wine/wine.inf",
+};
+
+/**
+ * @brief Paths inside the Wine prefix that wineboot creates, a prefix missing any of these isn't initialized regardless of its fingerprint.
+ */
+constexpr std::array<std::string_view, 5> FingerprintPrefixPaths{
+    "system.reg",
+    "user.reg",
+    "userdef.reg",
+    "drive_c/windows/system32",
+    "dosdevices",
+};
+
+/**
+ * @return The contents of a file, or std::nullopt if it can't be read.
+ */
+static std::optional<std::string> ReadFile(const std::filesystem::path &path) {
+    std::unique_ptr<FILE, decltype(&fclose)> file{fopen(path.c_str(), "re"), &fclose};
+    if (!file)
+        return std::nullopt;
+    std::string contents;
+    std::array<char, 4096> buffer;
+    size_t size;
+    while ((size = fread(buffer.data(), 1, buffer.size(), file.get())) > 0)
+        contents.append(buffer.data(), size);
+    if (ferror(file.get()))
+        return std::nullopt;
+    return contents;
+}
+
+/**
+ * @brief A 64-bit FNV-1a hash, this is stable across builds unlike std::hash.
+ */
+static uint64_t HashContents(std::string_view contents) {
+    uint64_t hash{0xCBF29CE484222325};
+    for (char c: contents) {
+        hash ^= static_cast<uint8_t>(c);
+        hash *= 0x100000001B3;
+    }
+    return hash;
+}
+
+std::string ComputePrefixFingerprint(const std::filesystem::path &runtimePath, const std::filesystem::path &prefixPath, std::span<const std::string> envVars) {
+    std::string fingerprint;
+    auto out{std::back_inserter(fingerprint)};
+    fmt::format_to(out, "version={}\n", PrefixFingerprintVersion);
+    fmt::format_to(out, "runtime={}\n", runtimePath.string());
+
+    auto metadata{ReadFile(runtimePath / "metadata.json")};
+    fmt::format_to(out, "runtime.metadata={:016x}\n", metadata ? HashContents(*metadata) : 0);
+    for (auto file: FingerprintRuntimeFiles) {
+        struct stat info{};
+        if (stat((runtimePath / file).c_str(), &info) == 0)
+            fmt::format_to(out, "runtime.{}={}:{}.{:09}\n", file, info.st_size, info.st_mtim.tv_sec, info.st_mtim.tv_nsec);
+        else
+            fmt::format_to(out, "runtime.{}=missing\n", file);
+    }
+
+    for (auto path: FingerprintPrefixPaths) {
+        std::error_code error;
+        fmt::format_to(out, "prefix.{}={}\n", path, std::filesystem::exists(prefixPath / "pfx" / path, error) ? "present" : "missing");
+    }
+
+    for (auto name: FingerprintEnvVars) {
+        std::string_view value{"unset"};
+        for (const auto &var: envVars)
+            if (var.size() > name.size() && var.starts_with(name) && var[name.size()] == '=')
+                value = std::string_view{var}.substr(name.size() + 1);
+        fmt::format_to(out, "env.{}={}\n", name, value);
+    }
+    return fingerprint;
+}
+
+std::optional<std::string> ReadPrefixFingerprint(const std::filesystem::path &prefixPath) {
+    return ReadFile(prefixPath / PrefixFingerprintFileName);
+}
+
+void WritePrefixFingerprint(const std::filesystem::path &prefixPath, std::string_view fingerprint) {
+    auto path{prefixPath / PrefixFingerprintFileName};
+    auto temporaryPath{std::filesystem::path{path}.concat(".tmp")};
+    {
+        std::unique_ptr<FILE, decltype(&fclose)> file{fopen(temporaryPath.c_str(), "we"), &fclose};
+        if (!file)
+            throw Exception{"fopen({}) failed: {}", temporaryPath.string(), strerror(errno)};
+        if (fwrite(fingerprint.data(), 1, fingerprint.size(), file.get()) != fingerprint.size() || fflush(file.get()) != 0)
+            throw Exception{"Failed to write {}: {}", temporaryPath.string(), strerror(errno)};
+    }
+    std::filesystem::rename(temporaryPath, path);
+}
+
+void ClearPrefixFingerprint(const std::filesystem::path &prefixPath) {
+    std::error_code error;
+    std::filesystem::remove(prefixPath / PrefixFingerprintFileName, error);
+    if (error)
+        fmt::println(stderr, "Failed to remove the fingerprint of {}: {}", prefixPath.string(), error.message());
+}
+}
@@ -0,0 +1,38 @@
+// Copyright © 2023 Cassia Developers, all rights reserved.
+#pragma once
+
+#include <filesystem>
+#include <optional>
+#include <span>
+#include <string>
+
+namespace cassia {
+/**
+ * @brief The name of the file inside the prefix directory that holds the fingerprint of the last successful prefix initialization.
+ */
+constexpr std::string_view PrefixFingerprintFileName{"cassia.fingerprint"};
+
+/**
+ * @brief Computes a fingerprint of everything that determines the result of initializing a prefix with wineboot, if it matches the fingerprint of an earlier successful initialization then re-initializing the prefix would be a no-op.
+ * @details This covers the identity of the runtime (its metadata and the Wine binaries and wine.inf it contains), the layout of the prefix (the registry hives and core directories that wineboot creates) and the environment variables that affect Wine's configuration.
+ * @return A human-readable fingerprint with a "key=value" line per component, so mismatches can be diagnosed from the fingerprint file.
+ */
+std::string ComputePrefixFingerprint(const std::filesystem::path &runtimePath, const std::filesystem::path &prefixPath, std::span<const std::string> envVars);
+
+/**
+ * @return The fingerprint recorded in the prefix, or std::nullopt if the prefix was never initialized successfully.
+ */
+std::optional<std::string> ReadPrefixFingerprint(const std::filesystem::path &prefixPath);
+
+/**
+ * @brief Atomically records the fingerprint of a successful initialization in the prefix.
+ * @note This throws if the fingerprint couldn't be written.
+ */
+void WritePrefixFingerprint(const std::filesystem::path &prefixPath, std::string_view fingerprint);
+
+/**
+ * @brief Removes the fingerprint of a prefix, this must be done before re-initializing it so an interrupted initialization can't leave a stale fingerprint behind.
+ * @note Failures are logged rather than thrown.
+ */
+void ClearPrefixFingerprint(const std::filesystem::path &prefixPath);
+}
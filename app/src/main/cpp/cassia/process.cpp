@@ -1,52 +1,159 @@
 // Copyright © 2023 Cassia Developers, all rights reserved.
 
 #include "process.h"
+#include "launcher.h"
+#include "platform.h"
+#include "process_monitor.h"
 #include "util/error.h"
+#include "util/trace.h"
+#include <array>
+#include <csignal>
+#include <fcntl.h>
+#include <sched.h>
 #include <unistd.h>
 #include <sys/wait.h>
 
 namespace cassia {
-Process::Process(std::filesystem::path exe, const std::vector<std::string> &args, const std::vector<std::string> &envVars, std::optional<LogPipe> logPipe) {
+/**
+ * @brief Everything the child needs between being cloned and calling execve, this is prepared entirely by the parent as the child can't allocate.
+ */
+struct SpawnContext {
+    const char *path;
+    char *const *argv;
+    char *const *envp;
+    int outFd; //!< The fd to redirect stdout into, -1 to inherit it.
+    int errFd; //!< The fd to redirect stderr into, -1 to inherit it.
+    const sigset_t *originalMask; //!< The signal mask of the parent thread prior to blocking all signals for the clone.
+    const LaunchOptions *options;
+    std::span<const InheritedFd> inheritedFds;
+    LaunchOptionsResult optionsResult; //!< Written by the child, failing options don't fail the spawn.
+    int error; //!< The errno of the first failing call in the child, this is written to memory shared with the parent.
+};
+
+/**
+ * @brief The entry point of the child, this runs on the parent's memory while the parent is suspended so it must only use async-signal-safe calls.
+ */
+static int SpawnChild(void *arg) {
+    auto &context{*static_cast<SpawnContext *>(arg)};
+
+    // Any handlers installed by the parent (ART's included) would run on the parent's memory, they're reset to the default so a signal can't run one before execve.
+    for (int signal{1}; signal < NSIG; signal++) {
+        struct sigaction action{};
+        if (sigaction(signal, nullptr, &action) == 0 && action.sa_handler != SIG_IGN && action.sa_handler != SIG_DFL) {
+            action = {};
+            action.sa_handler = SIG_DFL;
+            sigaction(signal, &action, nullptr);
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, context.originalMask, nullptr);
+    context.optionsResult = ApplyLaunchOptions(*context.options);
+
+    if ((context.outFd != -1 && dup2(context.outFd, STDOUT_FILENO) == -1) || (context.errFd != -1 && dup2(context.errFd, STDERR_FILENO) == -1)) {
+        context.error = errno;
+        _exit(127);
+    }
+    for (const auto &inherited: context.inheritedFds) {
+        // dup2 clears FD_CLOEXEC on the new fd, but it does nothing at all if both are the same fd so the flag is cleared directly then.
+        if ((inherited.fd == inherited.childFd ? fcntl(inherited.fd, F_SETFD, 0) : dup2(inherited.fd, inherited.childFd)) == -1) {
+            context.error = errno;
+            _exit(127);
+        }
+    }
+
+    execve(context.path, context.argv, context.envp);
+    context.error = errno;
+    _exit(127); // We can't use exit() here because it'll attempt to run ART atexit() callbacks
+}
+
+/**
+ * @brief The size of the stack the child runs on until it calls execve.
+ */
+constexpr size_t SpawnStackSize{32 * 1024};
+
+/**
+ * @return The name of an executable for trace events, this is only interned while tracing as interning takes a lock.
+ */
+static const char *GetTraceName(const std::filesystem::path &exe) {
+    return Tracer::IsEnabled() ? Tracer::Intern(exe.filename().string()) : nullptr;
+}
+
+Process::Process(std::filesystem::path exe, const std::vector<std::string> &args, const std::vector<std::string> &envVars, std::optional<LogPipe> logPipe, const LaunchOptions &options, std::span<const InheritedFd> inheritedFds) {
     /* Android's SELinux policy (execute_no_trans) prevents us from executing executables from the app's data directory.
      * To work around this, we execute /system/bin/linker64 instead, which can link ELF executables in userspace and execute them.
      * While this was originally designed for executing ELFs directly from ZIPs, it works just as well for our use case.
+     * Hosts don't have this restriction, so the executable is executed directly there (LinkerPath is null).
      */
-    constexpr const char *LinkerPath{"/system/bin/linker64"};
+    TraceScope trace{"process.spawn", "exe", GetTraceName(exe)};
 
     fmt::println(stderr, "Launching '{} {}'", exe.string(), fmt::join(args, " "));
 
-    pid = fork();
-    if (pid == 0) {
-        if (logPipe.has_value()) {
-            dup2(logPipe->out.Get(), STDOUT_FILENO);
-            dup2(logPipe->err.Get(), STDERR_FILENO);
-        }
+    // The linker would only fail after execve succeeded, so we check the executable beforehand to report a bad path synchronously.
+    if (access(exe.c_str(), R_OK) == -1)
+        throw Exception{"Cannot launch '{}': {}", exe.string(), strerror(errno)};
 
-        std::vector<const char *> argv;
-        argv.reserve(args.size() + 3);
+    std::vector<const char *> argv;
+    argv.reserve(args.size() + 3);
+    if (LinkerPath)
         argv.push_back(LinkerPath);
-        argv.push_back(exe.c_str());
-        for (const auto &arg: args)
-            argv.push_back(arg.c_str());
-        argv.push_back(nullptr);
+    argv.push_back(exe.c_str());
+    for (const auto &arg: args)
+        argv.push_back(arg.c_str());
+    argv.push_back(nullptr);
 
-        std::vector<const char *> envp;
-        envp.reserve(envVars.size() + 1);
-        for (const auto &var: envVars)
-            envp.push_back(var.c_str());
-        envp.push_back(nullptr);
+    std::vector<const char *> envp;
+    envp.reserve(envVars.size() + 1);
+    for (const auto &var: envVars)
+        envp.push_back(var.c_str());
+    envp.push_back(nullptr);
 
-        int status{execve(LinkerPath, const_cast<char *const *>(argv.data()), const_cast<char *const *>(envp.data()))};
-        fprintf(stderr, "execve returned %d (%d = %s)\n", status, errno, strerror(errno));
+    sigset_t allSignals, originalMask;
+    sigfillset(&allSignals);
+    SpawnContext context{
+        .path = LinkerPath ? LinkerPath : exe.c_str(),
+        .argv = const_cast<char *const *>(argv.data()),
+        .envp = const_cast<char *const *>(envp.data()),
+        .outFd = logPipe ? logPipe->out.Get() : -1,
+        .errFd = logPipe ? logPipe->err.Get() : -1,
+        .originalMask = &originalMask,
+        .options = &options,
+        .inheritedFds = inheritedFds,
+        .optionsResult = {},
+        .error = 0,
+    };
 
-        _Exit(127); // We can't use exit() here because it'll attempt to run ART atexit() callbacks
+    /* Forking the app process requires duplicating the page tables of every mapping in ART, which takes milliseconds for a large heap.
+     * Instead, the child shares our memory (CLONE_VM) and we're suspended until it calls execve or exits (CLONE_VFORK), so nothing is copied.
+     * All signals are blocked during this as a handler running in the child would be running on our memory.
+     */
+    alignas(16) std::array<uint8_t, SpawnStackSize> stack;
+    pthread_sigmask(SIG_SETMASK, &allSignals, &originalMask);
+    pid = clone(&SpawnChild, stack.data() + stack.size(), CLONE_VM | CLONE_VFORK | SIGCHLD, &context);
+    int cloneError{errno};
+    pthread_sigmask(SIG_SETMASK, &originalMask, nullptr);
+
+    if (pid == -1)
+        throw Exception{"clone() failed: {}", strerror(cloneError)};
+
+    if (context.error != 0) {
+        waitpid(pid, nullptr, 0);
+        pid = -1;
+        throw Exception{"Failed to launch '{}': {}", exe.string(), strerror(context.error)};
     }
+    if (context.optionsResult.failedOptions)
+        fmt::println(stderr, "Couldn't apply {} to '{}': {}", DescribeFailedLaunchOptions(context.optionsResult.failedOptions), exe.string(), strerror(context.optionsResult.error));
+    exitCode = ProcessMonitor::Watch(pid);
+}
+
+Process::Process(Launcher &launcher, const std::filesystem::path &exe, const std::vector<std::string> &args, const std::vector<std::string> &envVars, std::optional<LogPipe> logPipe, const LaunchOptions &options) {
+    TraceScope trace{"process.spawn_launcher", "exe", GetTraceName(args.empty() ? exe : std::filesystem::path{args.front()})}; // The executable is always Wine, its first argument is what's being launched.
+    std::tie(pid, exitCode) = launcher.Spawn(exe, args, envVars, std::move(logPipe), options);
 }
 
-Process::Process(Process &&other) noexcept: pid{other.pid} { other.pid = -1; }
+Process::Process(Process &&other) noexcept: pid{other.pid}, exitCode{std::move(other.exitCode)} { other.pid = -1; }
 
 Process &Process::operator=(Process &&other) noexcept {
     pid = other.pid;
+    exitCode = std::move(other.exitCode);
     other.pid = -1;
     return *this;
 }
@@ -56,14 +163,14 @@ Process::~Process() {
 }
 
 void Process::Detach() {
-    pid = -1;
+    pid = -1; // The process is still reaped by whoever is fulfilling the exit code, so it won't be left as a zombie.
+    exitCode = {};
 }
 
 bool Process::IsRunning() {
     if (pid == -1)
         return false;
-    int status;
-    bool running{waitpid(pid, &status, WNOHANG) == 0};
+    bool running{exitCode.wait_for(std::chrono::seconds::zero()) != std::future_status::ready};
     if (!running)
         pid = -1;
     return running;
@@ -72,11 +179,25 @@ bool Process::IsRunning() {
 int Process::WaitForExit() {
     if (pid == -1)
         return -1;
-    int status;
-    waitpid(pid, &status, 0);
-    
-    fmt::println(stderr, "Process {} exited with status {}", pid, WEXITSTATUS(status));
+    TraceScope trace{"process.wait", "pid", pid};
+    int code{exitCode.get()};
+    fmt::println(stderr, "Process {} exited with status {}", pid, code);
     pid = -1;
-    return WEXITSTATUS(status);
+    return code;
+}
+
+std::optional<int> Process::WaitForExit(std::chrono::steady_clock::duration timeout) {
+    if (pid == -1)
+        return -1;
+    if (exitCode.wait_for(timeout) != std::future_status::ready)
+        return std::nullopt;
+    return WaitForExit();
+}
+
+void Process::Terminate(std::chrono::steady_clock::duration gracePeriod) {
+    if (pid != -1) {
+        TraceInstant("process.terminate", "pid", pid);
+        ProcessMonitor::Terminate(pid, exitCode, gracePeriod);
+    }
 }
 }
@@ -1,13 +1,27 @@
 // Copyright © 2023 Cassia Developers, all rights reserved.
 #pragma once
 
+#include "launch_options.h"
 #include "logger.h"
 #include <string>
 #include <vector>
 #include <filesystem>
+#include <chrono>
+#include <future>
+#include <span>
 #include <thread>
 
 namespace cassia {
+class Launcher;
+
+/**
+ * @brief An fd that's passed to a child at a fixed number, it's only duplicated in the child so it can stay FD_CLOEXEC here and isn't leaked into any other child spawned concurrently.
+ */
+struct InheritedFd {
+    int fd;
+    int childFd; //!< The number of the fd in the child.
+};
+
 /**
  * @brief A wrapper around a child process with pipes for stdout and stderr, and ensuring the child process is killed when destroyed.
  * @note A workaround for Android's limitation of being unable to launch executables from the app's data directory is included.
@@ -15,14 +29,24 @@ namespace cassia {
  */
 struct Process {
     pid_t pid{-1};
+    std::shared_future<int> exitCode; //!< Fulfilled with the exit code of the child process by the ProcessMonitor, or the launcher for processes spawned through one.
 
     Process() = default;
 
     /**
      * @brief Launches a child process with the provided arguments and environment variables.
      * @param logPipe A pair of pipes to redirect the stdout and stderr of the child process into.
+     * @param options The scheduling and resource limits of the child process, these are applied before it executes.
+     * @param inheritedFds Fds that are duplicated into the child after stdout and stderr are redirected, the child can rely on their numbers.
+     */
+    Process(std::filesystem::path exe, const std::vector<std::string> &args = {}, const std::vector<std::string> &envVars = {}, std::optional<LogPipe> logPipe = std::nullopt, const LaunchOptions &options = {}, std::span<const InheritedFd> inheritedFds = {});
+
+    /**
+     * @brief Launches a child process through a launcher rather than spawning it from this process, the child behaves identically otherwise.
+     * @param envVars Environment variables in addition to the launcher's environment.
+     * @param options Options in addition to the launcher's own, anything that isn't set is inherited from the launcher.
      */
-    Process(std::filesystem::path exe, const std::vector<std::string> &args = {}, const std::vector<std::string> &envVars = {}, std::optional<LogPipe> logPipe = std::nullopt);
+    Process(Launcher &launcher, const std::filesystem::path &exe, const std::vector<std::string> &args = {}, const std::vector<std::string> &envVars = {}, std::optional<LogPipe> logPipe = std::nullopt, const LaunchOptions &options = {});
 
     Process(const Process &) = delete;
 
@@ -47,9 +71,22 @@ struct Process {
 
     /**
      * @brief Waits for the child process to exit.
-     * @return The exit code of the child process.
+     * @return The exit code of the child process, processes killed by a signal have an exit code of 128 + the signal number.
      * @note This will update the pid to -1.
      */
     int WaitForExit();
+
+    /**
+     * @brief Waits for the child process to exit for up to the supplied duration.
+     * @return The exit code of the child process, or std::nullopt if it's still running after the timeout.
+     * @note This will update the pid to -1 if the child process has exited.
+     */
+    std::optional<int> WaitForExit(std::chrono::steady_clock::duration timeout);
+
+    /**
+     * @brief Asks the child process to exit with SIGTERM and kills it with SIGKILL if it's still running after the grace period, this doesn't block.
+     * @note The exit can be awaited with WaitForExit or the exit code future.
+     */
+    void Terminate(std::chrono::steady_clock::duration gracePeriod);
 };
 }
@@ -0,0 +1,189 @@
+// Copyright © 2023 Cassia Developers, all rights reserved.
+
+#include "process_monitor.h"
+#include "util/error.h"
+#include "util/trace.h"
+#include <array>
+#include <csignal>
+#include <cstring>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+namespace cassia {
+ProcessMonitor ProcessMonitor::instance;
+
+/**
+ * @brief The interval at which processes are polled when pidfds aren't supported by the kernel.
+ */
+constexpr std::chrono::milliseconds PollInterval{50};
+
+int GetExitCode(int waitStatus) {
+    if (WIFSIGNALED(waitStatus))
+        return 128 + WTERMSIG(waitStatus);
+    return WEXITSTATUS(waitStatus);
+}
+
+/**
+ * @return A pidfd for the supplied process, or -1 if the kernel doesn't support pidfd_open.
+ * @note Bionic has no wrapper for this prior to API 31, so we use the syscall directly.
+ */
+static int OpenPidFd(pid_t pid) {
+    return static_cast<int>(syscall(__NR_pidfd_open, pid, 0));
+}
+
+/**
+ * @brief Sends a signal through the pidfd if there is one, this can't be delivered to a different process that reused the pid.
+ */
+static void SendSignal(pid_t pid, int pidFd, int signal) {
+    if (pidFd != -1 && syscall(__NR_pidfd_send_signal, pidFd, signal, nullptr, 0) == 0)
+        return;
+    kill(pid, signal);
+}
+
+ProcessMonitor::ProcessMonitor() : epollFd{epoll_create1(EPOLL_CLOEXEC), "process_monitor"}, wakeEventFd{eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK), "process_monitor"} {
+    if (!epollFd.Valid())
+        throw Exception{"epoll_create1 failed: {}", strerror(errno)};
+    if (!wakeEventFd.Valid())
+        throw Exception{"eventfd failed: {}", strerror(errno)};
+
+    epoll_event event{.events = EPOLLIN, .data = {.ptr = nullptr}}; // A null watch is used to identify the wake event.
+    if (epoll_ctl(epollFd.Get(), EPOLL_CTL_ADD, wakeEventFd.Get(), &event) == -1)
+        throw Exception{"epoll_ctl({}, {} [EVENT]) failed: {}", epollFd.Get(), wakeEventFd.Get(), strerror(errno)};
+
+    monitorThread = std::thread{&ProcessMonitor::MonitorThread, this};
+}
+
+ProcessMonitor::~ProcessMonitor() {
+    {
+        std::scoped_lock lock{mutex};
+        stopping = true;
+    }
+    Wake();
+    if (monitorThread.joinable())
+        monitorThread.join();
+}
+
+void ProcessMonitor::Wake() {
+    int result{eventfd_write(wakeEventFd.Get(), 1)};
+    TerminateIf(result == -1 && errno != EAGAIN, "eventfd_write({}) failed: {}", wakeEventFd.Get(), strerror(errno));
+}
+
+bool ProcessMonitor::TryReap(WatchedProcess &watch) {
+    int status;
+    pid_t result{waitpid(watch.pid, &status, WNOHANG)};
+    if (result == 0 || (result == -1 && errno == EINTR))
+        return false;
+
+    // ECHILD means the process was reaped elsewhere, its exit code is lost at that point.
+    watch.exitCode.set_value(result == -1 ? -1 : GetExitCode(status));
+    TraceInstant("process.exit", "pid", watch.pid);
+    if (watch.pidFd.Valid())
+        epoll_ctl(epollFd.Get(), EPOLL_CTL_DEL, watch.pidFd.Get(), nullptr); // Closing the pidfd isn't enough, a concurrently spawned child may hold a copy of it until it calls execve.
+    else
+        polledWatches--;
+    pid_t pid{watch.pid};
+    watches.erase(pid);
+    return true;
+}
+
+void ProcessMonitor::MonitorThread() {
+    while (true) {
+        int timeout{-1};
+        {
+            std::scoped_lock lock{mutex};
+            if (stopping)
+                return;
+
+            auto now{std::chrono::steady_clock::now()};
+            auto wakeAt{std::chrono::steady_clock::time_point::max()};
+            if (polledWatches)
+                wakeAt = now + PollInterval;
+            for (const auto &termination: terminations)
+                wakeAt = std::min(wakeAt, termination.deadline);
+            if (wakeAt != std::chrono::steady_clock::time_point::max())
+                timeout = static_cast<int>(std::chrono::ceil<std::chrono::milliseconds>(std::max(wakeAt - now, std::chrono::steady_clock::duration::zero())).count());
+        }
+
+        std::array<epoll_event, 16> events{};
+        int numEvents{epoll_wait(epollFd.Get(), events.data(), events.size(), timeout)};
+        if (numEvents == -1) {
+            if (errno == EINTR)
+                continue;
+            throw Exception{"epoll_wait() failed: {}", strerror(errno)};
+        }
+
+        std::scoped_lock lock{mutex};
+        for (int i{}; i < numEvents; i++) {
+            auto watch{static_cast<WatchedProcess *>(events[i].data.ptr)};
+            if (!watch) {
+                eventfd_t value;
+                eventfd_read(wakeEventFd.Get(), &value);
+                continue;
+            }
+            TryReap(*watch); // A readable pidfd means the process has exited, so this always succeeds.
+        }
+
+        if (polledWatches) {
+            std::vector<WatchedProcess *> polled;
+            for (auto &[pid, watch]: watches)
+                if (!watch->pidFd.Valid())
+                    polled.push_back(watch.get());
+            for (auto watch: polled)
+                TryReap(*watch);
+        }
+
+        auto now{std::chrono::steady_clock::now()};
+        std::erase_if(terminations, [&](const Termination &termination) {
+            if (termination.exitCode.wait_for(std::chrono::seconds::zero()) == std::future_status::ready)
+                return true;
+            if (termination.deadline > now)
+                return false;
+
+            // The process can't have been reaped yet if it's still being watched, so the pid can't have been reused.
+            auto it{watches.find(termination.pid)};
+            fmt::println(stderr, "Process {} didn't exit after SIGTERM, sending SIGKILL", termination.pid);
+            SendSignal(termination.pid, it != watches.end() ? it->second->pidFd.Get() : -1, SIGKILL);
+            return true;
+        });
+    }
+}
+
+std::shared_future<int> ProcessMonitor::WatchImpl(pid_t pid) {
+    auto watch{std::make_unique<WatchedProcess>(WatchedProcess{
+        .pid = pid,
+        .pidFd = UniqueFd{OpenPidFd(pid), "process_monitor"},
+    })};
+    auto exitCode{watch->exitCode.get_future().share()};
+
+    // The lock is held while registering so the monitor thread can't handle an event for this watch before it's inserted.
+    std::scoped_lock lock{mutex};
+    if (watch->pidFd.Valid()) {
+        epoll_event event{.events = EPOLLIN, .data = {.ptr = watch.get()}};
+        if (epoll_ctl(epollFd.Get(), EPOLL_CTL_ADD, watch->pidFd.Get(), &event) == -1)
+            throw Exception{"epoll_ctl({}, {} [PID {}]) failed: {}", epollFd.Get(), watch->pidFd.Get(), pid, strerror(errno)};
+    } else {
+        polledWatches++;
+        Wake();
+    }
+    watches.emplace(pid, std::move(watch));
+    return exitCode;
+}
+
+void ProcessMonitor::TerminateImpl(pid_t pid, std::shared_future<int> exitCode, std::chrono::steady_clock::duration gracePeriod) {
+    std::scoped_lock lock{mutex};
+    if (exitCode.wait_for(std::chrono::seconds::zero()) == std::future_status::ready)
+        return;
+
+    auto it{watches.find(pid)};
+    SendSignal(pid, it != watches.end() ? it->second->pidFd.Get() : -1, SIGTERM);
+    terminations.push_back(Termination{
+        .deadline = std::chrono::steady_clock::now() + gracePeriod,
+        .pid = pid,
+        .exitCode = std::move(exitCode),
+    });
+    Wake();
+}
+}
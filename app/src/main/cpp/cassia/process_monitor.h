@@ -0,0 +1,93 @@
+// Copyright © 2023 Cassia Developers, all rights reserved.
+#pragma once
+
+#include "util/fd.h"
+#include <chrono>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <sys/types.h>
+
+namespace cassia {
+/**
+ * @return The exit code corresponding to a wait status, processes killed by a signal have an exit code of 128 + the signal number like in a shell.
+ */
+int GetExitCode(int waitStatus);
+
+/**
+ * @brief A single thread that waits for the exit of every child process and reaps it, so processes never have to be polled or waited on by a thread of their own.
+ * @details Children are watched through pidfds in an epoll set, on kernels without pidfd_open (prior to 5.3) they're polled with waitpid on an interval instead.
+ * @note This class holds a global instance of itself, like Logger.
+ */
+class ProcessMonitor {
+  private:
+    UniqueFd epollFd;
+    UniqueFd wakeEventFd; //!< Used to wake the monitor thread when the timeout needs to be recalculated or the thread needs to join.
+    std::thread monitorThread;
+    bool stopping{}; //!< Set while joining the monitor thread, guarded by mutex.
+
+    /**
+     * @note The address of a watch is registered with epoll as the event data, so it must not move while it's registered.
+     */
+    struct WatchedProcess {
+        pid_t pid;
+        UniqueFd pidFd; //!< This is invalid if pidfds aren't supported, the process is polled instead.
+        std::promise<int> exitCode;
+    };
+
+    /**
+     * @brief A pending SIGKILL for a process that was sent SIGTERM, this is cancelled if the process exits before the deadline.
+     */
+    struct Termination {
+        std::chrono::steady_clock::time_point deadline;
+        pid_t pid;
+        std::shared_future<int> exitCode;
+    };
+
+    std::mutex mutex; //!< Synchronizes all state below between the monitor thread and any callers.
+    std::unordered_map<pid_t, std::unique_ptr<WatchedProcess>> watches;
+    size_t polledWatches{}; //!< The amount of watches without a pidfd, the monitor thread wakes up periodically to poll them while this is non-zero.
+    std::vector<Termination> terminations;
+
+    ProcessMonitor();
+
+    ~ProcessMonitor();
+
+    void Wake();
+
+    /**
+     * @brief Reaps the supplied process if it has exited and fulfills its exit code.
+     * @return If the process has been reaped, the watch is destroyed if so.
+     * @note This must be called with mutex held.
+     */
+    bool TryReap(WatchedProcess &watch);
+
+    void MonitorThread();
+
+    std::shared_future<int> WatchImpl(pid_t pid);
+
+    void TerminateImpl(pid_t pid, std::shared_future<int> exitCode, std::chrono::steady_clock::duration gracePeriod);
+
+    static ProcessMonitor instance;
+
+  public:
+    /**
+     * @brief Starts watching a child process of this process, it'll be reaped as soon as it exits regardless of whether the future is retained.
+     * @return A future that is fulfilled with the exit code of the process.
+     */
+    static std::shared_future<int> Watch(pid_t pid) {
+        return instance.WatchImpl(pid);
+    }
+
+    /**
+     * @brief Sends SIGTERM to a process and SIGKILL once the grace period expires, unless the supplied exit future has been fulfilled by then.
+     * @note This doesn't block, the process doesn't need to be a child of this process if its exit is tracked by other means.
+     */
+    static void Terminate(pid_t pid, std::shared_future<int> exitCode, std::chrono::steady_clock::duration gracePeriod) {
+        instance.TerminateImpl(pid, std::move(exitCode), gracePeriod);
+    }
+};
+}
@@ -0,0 +1,398 @@
+// Copyright © 2023 Cassia Developers, all rights reserved.
+
+#include "resource_sampler.h"
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <cstring>
+#include <optional>
+#include <span>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fmt/format.h>
+
+namespace cassia {
+/**
+ * @brief PSS is only sampled every Nth cycle as computing it requires the kernel to walk every page table of the process.
+ */
+constexpr uint64_t PssSampleDivider{10};
+
+/**
+ * @brief Open fds are only counted every Nth cycle as it requires listing all of them, processes using esync can have tens of thousands.
+ */
+constexpr uint64_t FdSampleDivider{5};
+
+/**
+ * @brief The percentage of the fd limit at which a warning is logged, and the percentage that usage has to drop below before another warning is logged.
+ */
+constexpr uint64_t FdWarningPercent{80};
+constexpr uint64_t FdWarningResetPercent{60};
+
+/**
+ * @brief Re-reads a procfs file from the start, procfs regenerates the contents on every read at offset 0.
+ * @return The contents of the file, this is empty if the read failed (which happens once the process has exited).
+ */
+static std::string_view ReadProcFile(int fd, std::span<char> buffer) {
+    if (fd == -1)
+        return {};
+    ssize_t size{pread(fd, buffer.data(), buffer.size(), 0)};
+    if (size <= 0)
+        return {};
+    return {buffer.data(), static_cast<size_t>(size)};
+}
+
+static UniqueFd OpenProcFile(const std::string &path) {
+    return UniqueFd{open(path.c_str(), O_RDONLY | O_CLOEXEC), "resource_sampler"};
+}
+
+/**
+ * @return The next whitespace-separated field of the supplied string, the string is advanced past it.
+ */
+static std::string_view NextField(std::string_view &string) {
+    size_t start{string.find_first_not_of(" \n")};
+    if (start == std::string_view::npos) {
+        string = {};
+        return {};
+    }
+    size_t end{string.find_first_of(" \n", start)};
+    auto field{string.substr(start, end == std::string_view::npos ? std::string_view::npos : end - start)};
+    string.remove_prefix(end == std::string_view::npos ? string.size() : end);
+    return field;
+}
+
+static uint64_t ParseNumber(std::string_view string) {
+    uint64_t value{};
+    std::from_chars(string.data(), string.data() + string.size(), value);
+    return value;
+}
+
+/**
+ * @return The value of a "key: value" line in a procfs file, or 0 if the key isn't present.
+ */
+static uint64_t FindKeyedValue(std::string_view contents, std::string_view key) {
+    size_t offset{contents.find(key)};
+    if (offset == std::string_view::npos)
+        return 0;
+    auto rest{contents.substr(offset + key.size())};
+    return ParseNumber(NextField(rest));
+}
+
+/**
+ * @brief The fields we use from /proc/<pid>/stat.
+ */
+struct StatFields {
+    std::string_view name;
+    pid_t parentPid;
+    uint64_t majorFaults, userTicks, systemTicks, threads, startTime;
+};
+
+/**
+ * @note The name of the process is in parentheses and can contain spaces or parentheses itself, so fields are parsed from the last closing parenthesis onwards.
+ */
+static std::optional<StatFields> ParseStat(std::string_view stat) {
+    size_t nameStart{stat.find('(')}, nameEnd{stat.rfind(')')};
+    if (nameStart == std::string_view::npos || nameEnd == std::string_view::npos || nameEnd < nameStart)
+        return std::nullopt;
+
+    StatFields fields{.name = stat.substr(nameStart + 1, nameEnd - nameStart - 1)};
+    auto rest{stat.substr(nameEnd + 1)};
+    // Indices are relative to the state field, which is the third field of the file.
+    for (size_t index{}; index <= 19; index++) {
+        auto field{NextField(rest)};
+        if (field.empty())
+            return std::nullopt;
+        switch (index) {
+            case 1:
+                fields.parentPid = static_cast<pid_t>(ParseNumber(field));
+                break;
+            case 9:
+                fields.majorFaults = ParseNumber(field);
+                break;
+            case 11:
+                fields.userTicks = ParseNumber(field);
+                break;
+            case 12:
+                fields.systemTicks = ParseNumber(field);
+                break;
+            case 17:
+                fields.threads = ParseNumber(field);
+                break;
+            case 19:
+                fields.startTime = ParseNumber(field);
+                break;
+            default:
+                break;
+        }
+    }
+    return fields;
+}
+
+static uint64_t Delta(uint64_t current, uint64_t previous) {
+    return current > previous ? current - previous : 0;
+}
+
+ResourceSampler::ResourceSampler(std::chrono::milliseconds interval, size_t capacity) : interval{interval}, samples(capacity) {
+    samplerThread = std::thread{&ResourceSampler::SamplerThread, this};
+}
+
+ResourceSampler::~ResourceSampler() {
+    {
+        std::scoped_lock lock{mutex};
+        stopping = true;
+    }
+    condition.notify_all();
+    if (samplerThread.joinable())
+        samplerThread.join();
+}
+
+void ResourceSampler::AddRoot(pid_t pid) {
+    std::scoped_lock lock{mutex};
+    roots.insert(pid);
+}
+
+void ResourceSampler::SetInterval(std::chrono::milliseconds pInterval) {
+    {
+        std::scoped_lock lock{mutex};
+        interval = pInterval;
+    }
+    condition.notify_all();
+}
+
+ResourceSampler::Stats ResourceSampler::GetStats() {
+    std::scoped_lock lock{mutex};
+    return Stats{
+        .droppedSamples = droppedSamples,
+        .lastCycleTime = lastCycleTime,
+        .maxCycleTime = maxCycleTime,
+    };
+}
+
+std::vector<ResourceSample> ResourceSampler::Drain() {
+    std::scoped_lock lock{mutex};
+    std::vector<ResourceSample> drained;
+    drained.reserve(writeIndex - readIndex);
+    for (; readIndex < writeIndex; readIndex++)
+        drained.push_back(samples[readIndex % samples.size()]);
+    return drained;
+}
+
+void ResourceSampler::DiscoverProcesses(const std::unordered_set<pid_t> &currentRoots) {
+    if (!procDir)
+        procDir.reset(opendir("/proc"));
+    else
+        rewinddir(procDir.get());
+    if (!procDir)
+        return;
+
+    for (auto &[pid, process]: processes)
+        process.seen = false;
+
+    struct Candidate {
+        pid_t pid, parentPid;
+        uint64_t startTime;
+    };
+    std::vector<Candidate> candidates;
+    std::unordered_set<pid_t> stillUnrelated;
+    std::array<char, 1024> buffer;
+
+    while (dirent *entry{readdir(procDir.get())}) {
+        pid_t pid{};
+        auto nameEnd{entry->d_name + std::strlen(entry->d_name)};
+        if (std::from_chars(entry->d_name, nameEnd, pid).ptr != nameEnd || pid <= 0)
+            continue;
+
+        if (auto it{processes.find(pid)}; it != processes.end()) {
+            it->second.seen = true;
+            continue;
+        }
+        if (unrelatedPids.contains(pid) && !currentRoots.contains(pid)) {
+            stillUnrelated.insert(pid);
+            continue;
+        }
+
+        auto statFd{OpenProcFile(fmt::format("/proc/{}/stat", pid))};
+        if (auto fields{ParseStat(ReadProcFile(statFd.Get(), buffer))})
+            candidates.push_back(Candidate{pid, fields->parentPid, fields->startTime});
+    }
+
+    // Children can have lower pids than their parents once pids wrap around, so candidates are resolved until no more processes are added to the trees.
+    bool added{true};
+    while (added) {
+        added = false;
+        std::erase_if(candidates, [&](const Candidate &candidate) {
+            if (!currentRoots.contains(candidate.pid) && !processes.contains(candidate.parentPid))
+                return false;
+
+            auto &process{processes[candidate.pid]};
+            process.pid = candidate.pid;
+            process.parentPid = candidate.parentPid;
+            process.startTime = candidate.startTime;
+            process.statFd = OpenProcFile(fmt::format("/proc/{}/stat", candidate.pid));
+            process.statmFd = OpenProcFile(fmt::format("/proc/{}/statm", candidate.pid));
+            process.ioFd = OpenProcFile(fmt::format("/proc/{}/io", candidate.pid)); // This requires ptrace access to the process, which may be denied.
+            process.smapsRollupFd = OpenProcFile(fmt::format("/proc/{}/smaps_rollup", candidate.pid)); // This was only added in Linux 4.14.
+            process.limitsFd = OpenProcFile(fmt::format("/proc/{}/limits", candidate.pid));
+            process.taskDir.reset(opendir(fmt::format("/proc/{}/task", candidate.pid).c_str()));
+            process.fdDir.reset(opendir(fmt::format("/proc/{}/fd", candidate.pid).c_str())); // This requires ptrace access to the process, like io.
+            process.seen = true;
+            added = true;
+            return true;
+        });
+    }
+
+    for (const auto &candidate: candidates)
+        stillUnrelated.insert(candidate.pid);
+    unrelatedPids = std::move(stillUnrelated);
+    std::erase_if(processes, [](const auto &entry) { return !entry.second.seen; });
+}
+
+void ResourceSampler::SampleFds(TrackedProcess &process, std::span<char> buffer) {
+    if (!process.fdDir)
+        return;
+    rewinddir(process.fdDir.get());
+    uint32_t openFds{};
+    while (dirent *entry{readdir(process.fdDir.get())})
+        if (entry->d_name[0] != '.')
+            openFds++;
+    process.openFds = openFds;
+    process.fdLimit = FindKeyedValue(ReadProcFile(process.limitsFd.Get(), buffer), "\nMax open files"); // "unlimited" isn't a number, so it's parsed as 0.
+
+    if (!process.fdLimit)
+        return;
+    if (!process.fdWarningLogged && process.openFds * 100 >= process.fdLimit * FdWarningPercent) {
+        fmt::println(stderr, "Process {} has {} out of {} fds open, it'll fail to open files or create objects once it runs out", process.pid, process.openFds, process.fdLimit);
+        process.fdWarningLogged = true;
+    } else if (process.fdWarningLogged && process.openFds * 100 < process.fdLimit * FdWarningResetPercent) {
+        process.fdWarningLogged = false;
+    }
+}
+
+bool ResourceSampler::SampleProcess(TrackedProcess &process, int64_t timestampNs, bool samplePss, bool sampleFds) {
+    std::array<char, 4096> buffer;
+    auto fields{ParseStat(ReadProcFile(process.statFd.Get(), buffer))};
+    if (!fields || fields->startTime != process.startTime)
+        return false; // The process has exited, or its pid has been reused by a different process.
+
+    ResourceSample sample{
+        .timestampNs = timestampNs,
+        .pid = process.pid,
+        .parentPid = fields->parentPid,
+        .threads = static_cast<uint32_t>(fields->threads),
+    };
+    std::memcpy(sample.name.data(), fields->name.data(), std::min(fields->name.size(), sample.name.size() - 1));
+
+    ProcessCounters current{
+        .userTicks = fields->userTicks,
+        .systemTicks = fields->systemTicks,
+        .majorFaults = fields->majorFaults,
+    };
+
+    static const uint64_t pageSize{static_cast<uint64_t>(sysconf(_SC_PAGESIZE))};
+    auto statm{ReadProcFile(process.statmFd.Get(), buffer)};
+    NextField(statm); // The total program size isn't relevant.
+    sample.rssBytes = ParseNumber(NextField(statm)) * pageSize;
+    sample.sharedBytes = ParseNumber(NextField(statm)) * pageSize;
+
+    auto io{ReadProcFile(process.ioFd.Get(), buffer)};
+    current.readBytes = FindKeyedValue(io, "\nread_bytes:");
+    current.writeBytes = FindKeyedValue(io, "\nwrite_bytes:");
+
+    if (samplePss) {
+        auto smapsRollup{ReadProcFile(process.smapsRollupFd.Get(), buffer)};
+        if (!smapsRollup.empty())
+            process.pssBytes = FindKeyedValue(smapsRollup, "\nPss:") * 1024;
+    }
+    sample.pssBytes = process.pssBytes;
+
+    if (sampleFds)
+        SampleFds(process, buffer);
+    sample.openFds = process.openFds;
+    sample.fdLimit = process.fdLimit;
+
+    // Scheduler statistics are only available per thread, threads that exit between samples lose their contribution since the last sample.
+    if (process.taskDir) {
+        rewinddir(process.taskDir.get());
+        std::unordered_map<pid_t, UniqueFd> liveSchedStatFds;
+        liveSchedStatFds.reserve(process.schedStatFds.size());
+        while (dirent *entry{readdir(process.taskDir.get())}) {
+            pid_t tid{};
+            auto nameEnd{entry->d_name + std::strlen(entry->d_name)};
+            if (std::from_chars(entry->d_name, nameEnd, tid).ptr != nameEnd)
+                continue;
+
+            auto it{process.schedStatFds.find(tid)};
+            UniqueFd fd{it != process.schedStatFds.end() ? std::move(it->second) : OpenProcFile(fmt::format("/proc/{}/task/{}/schedstat", process.pid, tid))};
+            auto schedStat{ReadProcFile(fd.Get(), buffer)};
+            if (schedStat.empty())
+                continue;
+
+            NextField(schedStat); // The CPU time is already covered by utime/stime.
+            current.runDelayNs += ParseNumber(NextField(schedStat));
+            current.contextSwitches += ParseNumber(NextField(schedStat));
+            liveSchedStatFds.emplace(tid, std::move(fd));
+        }
+        process.schedStatFds = std::move(liveSchedStatFds);
+    }
+
+    if (process.hasPrevious) {
+        static const uint64_t nsPerTick{1'000'000'000 / static_cast<uint64_t>(sysconf(_SC_CLK_TCK))};
+        const auto &previous{process.previous};
+        sample.userTimeNs = Delta(current.userTicks, previous.userTicks) * nsPerTick;
+        sample.systemTimeNs = Delta(current.systemTicks, previous.systemTicks) * nsPerTick;
+        sample.majorFaults = Delta(current.majorFaults, previous.majorFaults);
+        sample.contextSwitches = Delta(current.contextSwitches, previous.contextSwitches);
+        sample.runDelayNs = Delta(current.runDelayNs, previous.runDelayNs);
+        sample.readBytes = Delta(current.readBytes, previous.readBytes);
+        sample.writeBytes = Delta(current.writeBytes, previous.writeBytes);
+    }
+    process.previous = current;
+    process.hasPrevious = true;
+
+    cycleSamples.push_back(sample);
+    return true;
+}
+
+void ResourceSampler::SamplerThread() {
+    while (true) {
+        std::unordered_set<pid_t> currentRoots;
+        {
+            std::unique_lock lock{mutex};
+            condition.wait_for(lock, interval, [&] { return stopping; });
+            if (stopping)
+                return;
+            currentRoots = roots;
+        }
+
+        auto start{std::chrono::steady_clock::now()};
+        DiscoverProcesses(currentRoots);
+
+        cycleSamples.clear();
+        bool samplePss{cycleCount % PssSampleDivider == 0}, sampleFds{cycleCount % FdSampleDivider == 0};
+        cycleCount++;
+        auto timestampNs{std::chrono::duration_cast<std::chrono::nanoseconds>(start.time_since_epoch()).count()};
+        for (auto it{processes.begin()}; it != processes.end();) {
+            if (SampleProcess(it->second, timestampNs, samplePss, sampleFds))
+                ++it;
+            else
+                it = processes.erase(it);
+        }
+        auto cycleTime{std::chrono::steady_clock::now() - start};
+
+        std::scoped_lock lock{mutex};
+        for (const auto &sample: cycleSamples) {
+            samples[writeIndex % samples.size()] = sample;
+            writeIndex++;
+            if (writeIndex - readIndex > samples.size()) {
+                readIndex++;
+                droppedSamples++;
+            }
+        }
+        lastCycleTime = cycleTime;
+        maxCycleTime = std::max(maxCycleTime, lastCycleTime);
+
+        // Roots are pruned once they've exited, so their pids can't be reused by an unrelated process that would then be sampled.
+        std::erase_if(roots, [&](pid_t pid) { return !processes.contains(pid) && kill(pid, 0) == -1 && errno == ESRCH; });
+    }
+}
+}
@@ -0,0 +1,143 @@
+// Copyright © 2023 Cassia Developers, all rights reserved.
+#pragma once
+
+#include "util/dir.h"
+#include "util/fd.h"
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <span>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <sys/types.h>
+
+namespace cassia {
+/**
+ * @brief The resource usage of a single process over a single sampling interval.
+ * @note All "delta" fields are the change since the previous sample of the same process, they're 0 in the first sample of a process.
+ */
+struct ResourceSample {
+    int64_t timestampNs; //!< CLOCK_MONOTONIC at the time of sampling.
+    int32_t pid;
+    int32_t parentPid;
+    uint32_t threads;
+    uint64_t userTimeNs; //!< Delta of the CPU time spent in user mode.
+    uint64_t systemTimeNs; //!< Delta of the CPU time spent in kernel mode.
+    uint64_t rssBytes;
+    uint64_t sharedBytes; //!< The part of the RSS that is backed by files or shared memory.
+    uint64_t pssBytes; //!< This is only refreshed every few samples as it's expensive to compute, the last known value is used in between.
+    uint64_t majorFaults; //!< Delta of the amount of page faults that required I/O.
+    uint64_t contextSwitches; //!< Delta of the amount of times any thread of the process was scheduled onto a CPU.
+    uint64_t runDelayNs; //!< Delta of the time threads of the process spent runnable but waiting for a CPU.
+    uint64_t readBytes; //!< Delta of the bytes read from storage, this is 0 if /proc/<pid>/io isn't accessible.
+    uint64_t writeBytes; //!< Delta of the bytes written to storage, this is 0 if /proc/<pid>/io isn't accessible.
+    uint32_t openFds; //!< This is only refreshed every few samples as it requires listing every fd, the last known value is used in between.
+    uint64_t fdLimit; //!< The soft RLIMIT_NOFILE of the process, this is 0 if it's unlimited or unknown.
+    std::array<char, 16> name; //!< The null-terminated comm of the process.
+};
+
+/**
+ * @brief Periodically samples the resource usage of process trees from procfs into a fixed-size buffer.
+ * @details All files are kept open between samples and re-read with pread, so a sampling cycle mostly consists of a single read syscall per file.
+ * Every descendant of a root process is discovered and sampled automatically, including processes that were spawned by the launcher or by Wine itself.
+ */
+class ResourceSampler {
+  private:
+    struct ProcessCounters {
+        uint64_t userTicks, systemTicks, majorFaults, contextSwitches, runDelayNs, readBytes, writeBytes;
+    };
+
+    struct TrackedProcess {
+        pid_t pid{};
+        pid_t parentPid{};
+        uint64_t startTime{}; //!< The start time of the process in clock ticks after boot, this is used to detect pid reuse.
+        UniqueFd statFd{-1}, statmFd{-1}, ioFd{-1}, smapsRollupFd{-1}, limitsFd{-1};
+        UniqueDir taskDir;
+        UniqueDir fdDir;
+        std::unordered_map<pid_t, UniqueFd> schedStatFds; //!< The schedstat files of every thread, keyed by tid.
+        ProcessCounters previous{};
+        bool hasPrevious{};
+        uint64_t pssBytes{};
+        uint32_t openFds{};
+        uint64_t fdLimit{};
+        bool fdWarningLogged{}; //!< If a warning about the process running out of fds was logged, this is reset once usage drops again.
+        bool seen{}; //!< If the process was seen in the current discovery pass.
+    };
+
+    std::thread samplerThread;
+    std::mutex mutex; //!< Synchronizes the configuration and the sample buffer between the sampler thread and any callers.
+    std::condition_variable condition; //!< Signalled when the interval changes or the sampler is stopping.
+    bool stopping{};
+    std::chrono::milliseconds interval;
+    std::unordered_set<pid_t> roots; //!< The processes whose trees are sampled.
+
+    std::vector<ResourceSample> samples; //!< A ring of the most recent samples.
+    uint64_t writeIndex{}; //!< The total amount of samples ever written into the ring.
+    uint64_t readIndex{}; //!< The total amount of samples that have been drained from the ring or overwritten.
+    uint64_t droppedSamples{}; //!< The amount of samples that were overwritten before being drained.
+    std::chrono::nanoseconds lastCycleTime{}, maxCycleTime{};
+
+    // These are only accessed by the sampler thread.
+    std::unordered_map<pid_t, TrackedProcess> processes;
+    std::unordered_set<pid_t> unrelatedPids; //!< Processes that were found to not be part of any tree, so their parent doesn't need to be re-read every cycle.
+    UniqueDir procDir;
+    std::vector<ResourceSample> cycleSamples; //!< The samples of the current cycle, these are only copied into the ring once the cycle is complete.
+    uint64_t cycleCount{};
+
+    /**
+     * @brief Starts tracking any processes in /proc that are roots or children of tracked processes, and stops tracking any processes that have exited.
+     */
+    void DiscoverProcesses(const std::unordered_set<pid_t> &currentRoots);
+
+    /**
+     * @return If the process is still alive and a sample was added to cycleSamples.
+     */
+    bool SampleProcess(TrackedProcess &process, int64_t timestampNs, bool samplePss, bool sampleFds);
+
+    /**
+     * @brief Refreshes the fd usage of a process and warns once it's close to its limit, so running out of fds (which esync makes likely) can be diagnosed before it happens.
+     */
+    void SampleFds(TrackedProcess &process, std::span<char> buffer);
+
+    void SamplerThread();
+
+  public:
+    /**
+     * @param capacity The maximum amount of samples retained between drains, older samples are overwritten.
+     */
+    ResourceSampler(std::chrono::milliseconds interval, size_t capacity);
+
+    ResourceSampler(const ResourceSampler &) = delete;
+
+    ResourceSampler &operator=(const ResourceSampler &) = delete;
+
+    ~ResourceSampler();
+
+    /**
+     * @brief Starts sampling the supplied process and all of its descendants, this stops automatically once the process exits.
+     */
+    void AddRoot(pid_t pid);
+
+    void SetInterval(std::chrono::milliseconds interval);
+
+    /**
+     * @brief Statistics about the sampler itself.
+     */
+    struct Stats {
+        uint64_t droppedSamples; //!< The total amount of samples that were overwritten before being drained.
+        std::chrono::nanoseconds lastCycleTime; //!< The time taken by the most recent sampling cycle.
+        std::chrono::nanoseconds maxCycleTime;
+    };
+
+    Stats GetStats();
+
+    /**
+     * @return All samples since the last drain in chronological order.
+     */
+    std::vector<ResourceSample> Drain();
+};
+}
@@ -0,0 +1,463 @@
+// Copyright © 2023 Cassia Developers, all rights reserved.
+
+#include "shader_cache.h"
+#include "util/error.h"
+#include "util/parallel.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cctype>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <unordered_set>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+namespace cassia {
+constexpr std::string_view SessionsDirectory{"sessions"};
+constexpr std::string_view LockFileName{"lock"}; //!< A file in every application and session directory which is locked while it's in use.
+constexpr std::string_view TemporarySuffix{".cassia-tmp"}; //!< The suffix of merged caches that are about to replace the existing cache.
+
+constexpr std::array<char, 4> DxvkCacheMagic{'D', 'X', 'V', 'K'};
+constexpr uint32_t DxvkCacheMinimumVersion{8}; //!< The first version with variable-size entries that are prefixed by their size and hash.
+constexpr size_t DxvkCacheHashSize{20}; //!< Entries are identified by the SHA-1 of their data.
+
+/**
+ * @brief The header of a state cache, this is followed by entries until the end of the file.
+ */
+struct DxvkCacheHeader {
+    std::array<char, 4> magic;
+    uint32_t version;
+    uint32_t entrySize; //!< This is unused since entries have a variable size.
+};
+static_assert(sizeof(DxvkCacheHeader) == 12);
+
+/**
+ * @brief Every entry starts with a 32-bit word that has the stage mask in the low 8 bits and the size of the data in the upper 24 bits, followed by the hash and the data.
+ */
+constexpr size_t DxvkCacheEntryHeaderSize{sizeof(uint32_t) + DxvkCacheHashSize};
+constexpr uint32_t DxvkCacheEntrySizeShift{8};
+
+constexpr size_t MergeReadBufferSize{256 * 1024};
+constexpr size_t MergeBatchSize{1024 * 1024}; //!< Unique entries are written to the output in batches of this size, so workers rarely contend on it.
+constexpr size_t HashShardCount{64}; //!< The set of seen hashes is split into shards with their own lock, so workers rarely contend on them.
+
+using DxvkCacheHash = std::array<uint8_t, DxvkCacheHashSize>;
+
+struct DxvkCacheHashHasher {
+    size_t operator()(const DxvkCacheHash &hash) const {
+        // The hash is already uniformly distributed, so any part of it is a good hash.
+        size_t value;
+        std::memcpy(&value, hash.data(), sizeof(value));
+        return value;
+    }
+};
+
+struct HashShard {
+    std::mutex mutex;
+    std::unordered_set<DxvkCacheHash, DxvkCacheHashHasher> hashes;
+};
+
+using File = std::unique_ptr<FILE, decltype(&fclose)>;
+
+/**
+ * @return The version of the state cache, or 0 if the file isn't a state cache.
+ */
+static uint32_t ReadDxvkCacheVersion(const std::filesystem::path &path) {
+    File file{fopen(path.c_str(), "re"), &fclose};
+    DxvkCacheHeader header{};
+    if (!file || fread(&header, sizeof(header), 1, file.get()) != 1 || header.magic != DxvkCacheMagic)
+        return 0;
+    return header.version;
+}
+
+ShaderCacheMergeStats MergeDxvkCaches(std::span<const std::filesystem::path> inputs, const std::filesystem::path &output, size_t threadCount) {
+    auto start{std::chrono::steady_clock::now()};
+    ShaderCacheMergeStats stats{.inputFiles = inputs.size()};
+
+    // Entries can't be converted between versions, so only the newest version is kept as it's what the runtime's DXVK writes.
+    std::vector<uint32_t> versions(inputs.size());
+    for (size_t index{}; index < inputs.size(); index++) {
+        versions[index] = ReadDxvkCacheVersion(inputs[index]);
+        if (versions[index] >= DxvkCacheMinimumVersion)
+            stats.version = std::max(stats.version, versions[index]);
+    }
+    if (!stats.version) {
+        stats.droppedFiles = inputs.size();
+        stats.duration = std::chrono::steady_clock::now() - start;
+        return stats;
+    }
+
+    auto temporaryPath{std::filesystem::path{output}.concat(TemporarySuffix)};
+    File outputFile{fopen(temporaryPath.c_str(), "we"), &fclose};
+    if (!outputFile)
+        throw Exception{"fopen({}) failed: {}", temporaryPath.string(), strerror(errno)};
+
+    std::array<HashShard, HashShardCount> shards;
+    std::mutex outputMutex;
+    std::atomic<size_t> droppedFiles{}, truncatedFiles{}, entries{}, duplicateEntries{};
+    std::atomic<uint64_t> inputBytes{}, outputBytes{};
+    auto writeOutput{[&](std::span<const uint8_t> data) {
+        std::scoped_lock lock{outputMutex};
+        if (fwrite(data.data(), 1, data.size(), outputFile.get()) != data.size())
+            throw Exception{"Failed to write '{}': {}", temporaryPath.string(), strerror(errno)};
+        outputBytes += data.size();
+    }};
+
+    try {
+        DxvkCacheHeader header{.magic = DxvkCacheMagic, .version = stats.version};
+        writeOutput({reinterpret_cast<const uint8_t *>(&header), sizeof(header)});
+
+        ParallelFor(inputs.size(), threadCount, [&](size_t index) {
+            const auto &path{inputs[index]};
+            if (versions[index] != stats.version) {
+                droppedFiles++;
+                return;
+            }
+            File file{fopen(path.c_str(), "re"), &fclose};
+            if (!file)
+                throw Exception{"fopen({}) failed: {}", path.string(), strerror(errno)};
+            setvbuf(file.get(), nullptr, _IOFBF, MergeReadBufferSize);
+            if (fseek(file.get(), sizeof(DxvkCacheHeader), SEEK_SET) != 0)
+                throw Exception{"Failed to seek in '{}': {}", path.string(), strerror(errno)};
+
+            std::vector<uint8_t> entry, batch;
+            uint64_t bytes{sizeof(DxvkCacheHeader)};
+            while (true) {
+                uint32_t entryHeader;
+                size_t read{fread(&entryHeader, 1, sizeof(entryHeader), file.get())};
+                if (read == 0 && feof(file.get()))
+                    break;
+                size_t dataSize{entryHeader >> DxvkCacheEntrySizeShift};
+                entry.resize(DxvkCacheEntryHeaderSize + dataSize);
+                if (read != sizeof(entryHeader) || fread(entry.data() + sizeof(entryHeader), 1, entry.size() - sizeof(entryHeader), file.get()) != entry.size() - sizeof(entryHeader)) {
+                    if (ferror(file.get()))
+                        throw Exception{"Failed to read '{}': {}", path.string(), strerror(errno)};
+                    truncatedFiles++;
+                    break;
+                }
+                std::memcpy(entry.data(), &entryHeader, sizeof(entryHeader));
+                bytes += entry.size();
+
+                DxvkCacheHash hash;
+                std::memcpy(hash.data(), entry.data() + sizeof(entryHeader), hash.size());
+                auto &shard{shards[hash[DxvkCacheHashSize - 1] % HashShardCount]}; // This uses a different part of the hash than the hasher, so the buckets of every shard are still evenly used.
+                bool inserted;
+                {
+                    std::scoped_lock lock{shard.mutex};
+                    inserted = shard.hashes.insert(hash).second;
+                }
+                if (!inserted) {
+                    duplicateEntries++;
+                    continue;
+                }
+                entries++;
+                batch.insert(batch.end(), entry.begin(), entry.end());
+                if (batch.size() >= MergeBatchSize) {
+                    writeOutput(batch);
+                    batch.clear();
+                }
+            }
+            if (!batch.empty())
+                writeOutput(batch);
+            inputBytes += bytes;
+        });
+
+        if (fflush(outputFile.get()) != 0)
+            throw Exception{"Failed to write '{}': {}", temporaryPath.string(), strerror(errno)};
+    } catch (...) {
+        outputFile.reset();
+        unlink(temporaryPath.c_str());
+        throw;
+    }
+    outputFile.reset();
+    std::filesystem::rename(temporaryPath, output);
+
+    stats.droppedFiles = droppedFiles;
+    stats.truncatedFiles = truncatedFiles;
+    stats.entries = entries;
+    stats.duplicateEntries = duplicateEntries;
+    stats.inputBytes = inputBytes;
+    stats.outputBytes = outputBytes;
+    stats.duration = std::chrono::steady_clock::now() - start;
+    return stats;
+}
+
+static UniqueFd OpenLock(const std::filesystem::path &path) {
+    UniqueFd fd{open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600), "shader_cache"};
+    if (!fd.Valid())
+        throw Exception{"Failed to open '{}': {}", path.string(), strerror(errno)};
+    return fd;
+}
+
+/**
+ * @return If the lock was acquired, this can only fail without blocking when the lock is held elsewhere.
+ * @note Locks are per open file, so a lock held by another ShaderCacheManager in this process is respected as well.
+ */
+static bool Lock(const UniqueFd &fd, const std::filesystem::path &path, bool block) {
+    while (flock(fd.Get(), LOCK_EX | (block ? 0 : LOCK_NB)) == -1) {
+        if (errno == EWOULDBLOCK)
+            return false;
+        if (errno != EINTR)
+            throw Exception{"Failed to lock '{}': {}", path.string(), strerror(errno)};
+    }
+    return true;
+}
+
+/**
+ * @return The names of all state caches in the directory.
+ */
+static std::vector<std::string> ListCaches(const std::filesystem::path &directory) {
+    std::vector<std::string> names;
+    for (const auto &entry: std::filesystem::directory_iterator{directory}) {
+        auto name{entry.path().filename().string()};
+        if (name.ends_with(DxvkCacheSuffix) && entry.is_regular_file())
+            names.push_back(std::move(name));
+    }
+    return names;
+}
+
+/**
+ * @return If any session of the application is locked by its owner.
+ */
+static bool HasActiveSessions(const std::filesystem::path &applicationPath) {
+    std::error_code error;
+    for (const auto &entry: std::filesystem::directory_iterator{applicationPath / SessionsDirectory, error}) {
+        auto lockPath{entry.path() / LockFileName};
+        if (!Lock(OpenLock(lockPath), lockPath, false))
+            return true;
+    }
+    return false;
+}
+
+static uint64_t GetDirectorySize(const std::filesystem::path &directory) {
+    uint64_t size{};
+    std::error_code error;
+    for (auto it{std::filesystem::recursive_directory_iterator{directory, error}}; !error && it != std::filesystem::recursive_directory_iterator{}; it.increment(error)) {
+        std::error_code sizeError;
+        if (it->is_regular_file(sizeError))
+            size += it->file_size(sizeError);
+    }
+    return size;
+}
+
+ShaderCacheManager::ShaderCacheManager(std::filesystem::path root, uint64_t quotaBytes) : root{std::move(root)}, quotaBytes{quotaBytes} {}
+
+std::string ShaderCacheManager::GetApplicationName(std::string_view exe) {
+    auto separator{exe.find_last_of("/\\")};
+    if (separator != std::string_view::npos)
+        exe.remove_prefix(separator + 1);
+    auto extension{exe.rfind('.')};
+    if (extension != std::string_view::npos && extension != 0)
+        exe = exe.substr(0, extension);
+
+    std::string name{exe};
+    std::transform(name.begin(), name.end(), name.begin(), [](unsigned char character) { return std::tolower(character); });
+    if (name.empty() || name.starts_with('.'))
+        return "unknown"; // This can't be used as a directory name.
+    return name;
+}
+
+void ShaderCacheManager::RecoverSessions(const std::filesystem::path &applicationPath, const std::filesystem::path &legacyCachePath) {
+    std::map<std::string, std::vector<std::filesystem::path>> inputs; // The inputs of every cache of the application, keyed by the name of the cache.
+    std::vector<std::pair<std::filesystem::path, UniqueFd>> abandonedSessions; // These are kept locked until they're removed.
+    for (const auto &entry: std::filesystem::directory_iterator{applicationPath / SessionsDirectory}) {
+        auto lockPath{entry.path() / LockFileName};
+        auto lock{OpenLock(lockPath)};
+        if (!Lock(lock, lockPath, false))
+            continue;
+        for (auto &name: ListCaches(entry.path()))
+            inputs[name].push_back(entry.path() / name);
+        abandonedSessions.emplace_back(entry.path(), std::move(lock));
+    }
+
+    // A legacy cache is only imported if it changed since the caches of the application were last merged, so it isn't merged again on every launch.
+    struct stat legacyInfo{}, cacheInfo{};
+    if (!legacyCachePath.empty() && stat(legacyCachePath.c_str(), &legacyInfo) == 0 && S_ISREG(legacyInfo.st_mode)) {
+        auto name{legacyCachePath.filename().string()};
+        if (stat((applicationPath / name).c_str(), &cacheInfo) == -1 || legacyInfo.st_mtime > cacheInfo.st_mtime)
+            inputs[name].push_back(legacyCachePath);
+    }
+
+    for (auto &[name, paths]: inputs) {
+        auto cachePath{applicationPath / name};
+        size_t recovered{paths.size()};
+        if (std::filesystem::exists(cachePath))
+            paths.insert(paths.begin(), cachePath);
+        auto stats{MergeDxvkCaches(paths, cachePath)};
+        fmt::println(stderr, "Recovered {} abandoned or legacy caches into '{}' ({} entries, {} duplicates, {} dropped files, {} truncated files)",
+                     recovered, cachePath.string(), stats.entries, stats.duplicateEntries, stats.droppedFiles, stats.truncatedFiles);
+    }
+    for (const auto &[path, lock]: abandonedSessions)
+        std::filesystem::remove_all(path);
+}
+
+ShaderCacheSession ShaderCacheManager::BeginSession(std::string_view runtimeName, std::string_view exe) {
+    auto applicationPath{root / runtimeName / GetApplicationName(exe)};
+    std::filesystem::create_directories(applicationPath / SessionsDirectory);
+    auto applicationLockPath{applicationPath / LockFileName};
+    auto applicationLock{OpenLock(applicationLockPath)};
+    Lock(applicationLock, applicationLockPath, true);
+
+    // DXVK writes its cache to the working directory by default, which is usually the directory of the executable.
+    std::filesystem::path legacyCachePath;
+    if (exe.find('/') != std::string_view::npos) {
+        std::filesystem::path exePath{exe};
+        legacyCachePath = exePath.parent_path() / exePath.stem().concat(DxvkCacheSuffix);
+    }
+    RecoverSessions(applicationPath, legacyCachePath);
+
+    static std::atomic<uint64_t> counter{};
+    auto sessionPath{applicationPath / SessionsDirectory / fmt::format("{}-{}", getpid(), counter.fetch_add(1, std::memory_order_relaxed))};
+    std::filesystem::create_directories(sessionPath);
+    auto sessionLockPath{sessionPath / LockFileName};
+    auto sessionLock{OpenLock(sessionLockPath)};
+    Lock(sessionLock, sessionLockPath, true);
+
+    // The session gets a copy rather than a link, as DXVK appends to the cache in place.
+    for (const auto &name: ListCaches(applicationPath))
+        std::filesystem::copy_file(applicationPath / name, sessionPath / name, std::filesystem::copy_options::overwrite_existing);
+
+    // The modification time of the application directory is when it was last used, which is what it's evicted by.
+    if (utimensat(AT_FDCWD, applicationPath.c_str(), nullptr, 0) == -1)
+        throw Exception{"utimensat() failed for '{}': {}", applicationPath.string(), strerror(errno)};
+    return ShaderCacheSession{std::move(applicationPath), std::move(sessionPath), std::move(sessionLock)};
+}
+
+ShaderCacheSession ShaderCacheManager::BeginRuntimeSession(std::string_view runtimeName) {
+    auto runtimePath{root / runtimeName};
+    auto sharedPath{runtimePath / SharedApplicationName};
+    std::filesystem::create_directories(sharedPath / SessionsDirectory);
+    auto sharedLockPath{sharedPath / LockFileName};
+    auto sharedLock{OpenLock(sharedLockPath)};
+    Lock(sharedLock, sharedLockPath, true);
+
+    for (const auto &entry: std::filesystem::directory_iterator{sharedPath / SessionsDirectory}) {
+        auto lockPath{entry.path() / LockFileName};
+        auto lock{OpenLock(lockPath)};
+        if (!Lock(lock, lockPath, false))
+            continue;
+        auto stats{MergeSessionCaches(sharedPath, entry.path())};
+        fmt::println(stderr, "Recovered {} caches of an abandoned runtime session into the caches of their applications ({} entries)", stats.caches, stats.entries);
+        std::filesystem::remove_all(entry.path());
+    }
+
+    static std::atomic<uint64_t> counter{};
+    auto sessionPath{sharedPath / SessionsDirectory / fmt::format("{}-{}", getpid(), counter.fetch_add(1, std::memory_order_relaxed))};
+    std::filesystem::create_directories(sessionPath);
+    auto sessionLockPath{sessionPath / LockFileName};
+    auto sessionLock{OpenLock(sessionLockPath)};
+    Lock(sessionLock, sessionLockPath, true);
+
+    // Every application is locked while its caches are copied, so a concurrent merge into them can't be observed halfway.
+    for (const auto &application: std::filesystem::directory_iterator{runtimePath}) {
+        if (!application.is_directory() || application.path() == sharedPath)
+            continue;
+        auto lockPath{application.path() / LockFileName};
+        auto lock{OpenLock(lockPath)};
+        Lock(lock, lockPath, true);
+        for (const auto &name: ListCaches(application.path()))
+            std::filesystem::copy_file(application.path() / name, sessionPath / name, std::filesystem::copy_options::overwrite_existing);
+    }
+
+    if (utimensat(AT_FDCWD, sharedPath.c_str(), nullptr, 0) == -1)
+        throw Exception{"utimensat() failed for '{}': {}", sharedPath.string(), strerror(errno)};
+    return ShaderCacheSession{std::move(sharedPath), std::move(sessionPath), std::move(sessionLock)};
+}
+
+ShaderCacheSessionStats ShaderCacheManager::MergeSessionCaches(const std::filesystem::path &applicationPath, const std::filesystem::path &sessionPath) {
+    ShaderCacheSessionStats stats{};
+    bool shared{applicationPath.filename() == SharedApplicationName};
+    for (const auto &name: ListCaches(sessionPath)) {
+        // The caches of a runtime-wide session belong to the application they're named after, which might not have a directory yet.
+        auto destinationPath{shared ? applicationPath.parent_path() / GetApplicationName(name.substr(0, name.size() - DxvkCacheSuffix.size())) : applicationPath};
+        if (shared)
+            std::filesystem::create_directories(destinationPath / SessionsDirectory);
+        auto lockPath{destinationPath / LockFileName};
+        auto lock{OpenLock(lockPath)};
+        Lock(lock, lockPath, true);
+
+        auto cachePath{destinationPath / name};
+        std::vector<std::filesystem::path> inputs{sessionPath / name};
+        if (std::filesystem::exists(cachePath))
+            inputs.insert(inputs.begin(), cachePath);
+        auto mergeStats{MergeDxvkCaches(inputs, cachePath)};
+        stats.caches++;
+        stats.entries += mergeStats.entries;
+        stats.bytes += mergeStats.outputBytes;
+        if (shared && utimensat(AT_FDCWD, destinationPath.c_str(), nullptr, 0) == -1)
+            throw Exception{"utimensat() failed for '{}': {}", destinationPath.string(), strerror(errno)};
+    }
+    return stats;
+}
+
+ShaderCacheSessionStats ShaderCacheManager::MergeSession(const ShaderCacheSession &session) {
+    auto start{std::chrono::steady_clock::now()};
+    auto stats{MergeSessionCaches(session.applicationPath, session.path)};
+    stats.duration = std::chrono::steady_clock::now() - start;
+    return stats;
+}
+
+ShaderCacheSessionStats ShaderCacheManager::EndSession(ShaderCacheSession session) {
+    auto start{std::chrono::steady_clock::now()};
+    // The session stays locked until it's removed, so it isn't recovered by anyone else in the meantime.
+    auto stats{MergeSessionCaches(session.applicationPath, session.path)};
+    std::filesystem::remove_all(session.path);
+    session.lock.Reset();
+
+    stats.evictedBytes = EnforceQuota();
+    stats.duration = std::chrono::steady_clock::now() - start;
+    return stats;
+}
+
+uint64_t ShaderCacheManager::EnforceQuota() {
+    struct Application {
+        std::filesystem::path path;
+        timespec lastUsed;
+        uint64_t bytes;
+    };
+    std::vector<Application> applications;
+    uint64_t totalBytes{};
+    std::error_code error;
+    for (const auto &runtime: std::filesystem::directory_iterator{root, error}) {
+        if (!runtime.is_directory())
+            continue;
+        for (const auto &application: std::filesystem::directory_iterator{runtime.path()}) {
+            struct stat info{};
+            if (!application.is_directory() || stat(application.path().c_str(), &info) == -1)
+                continue;
+            auto bytes{GetDirectorySize(application.path())};
+            applications.push_back(Application{application.path(), info.st_mtim, bytes});
+            totalBytes += bytes;
+        }
+    }
+    if (totalBytes <= quotaBytes)
+        return 0;
+
+    std::sort(applications.begin(), applications.end(), [](const Application &a, const Application &b) {
+        return a.lastUsed.tv_sec != b.lastUsed.tv_sec ? a.lastUsed.tv_sec < b.lastUsed.tv_sec : a.lastUsed.tv_nsec < b.lastUsed.tv_nsec;
+    });
+    uint64_t evictedBytes{};
+    for (const auto &application: applications) {
+        if (totalBytes <= quotaBytes)
+            break;
+        auto lockPath{application.path / LockFileName};
+        auto lock{OpenLock(lockPath)};
+        if (!application.bytes || !Lock(lock, lockPath, false) || HasActiveSessions(application.path))
+            continue;
+
+        // The lock file is kept, so anyone waiting on it still synchronizes with anyone that opens it afterwards.
+        for (const auto &entry: std::filesystem::directory_iterator{application.path})
+            if (entry.path().filename() != LockFileName)
+                std::filesystem::remove_all(entry.path());
+        totalBytes -= application.bytes;
+        evictedBytes += application.bytes;
+        fmt::println(stderr, "Evicted the shader caches of '{}' ({} bytes) to stay within the quota of {} bytes", application.path.string(), application.bytes, quotaBytes);
+    }
+    return evictedBytes;
+}
+}
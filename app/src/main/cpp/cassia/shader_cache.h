@@ -0,0 +1,134 @@
+// Copyright © 2023 Cassia Developers, all rights reserved.
+#pragma once
+
+#include "util/fd.h"
+#include <chrono>
+#include <filesystem>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace cassia {
+/**
+ * @brief The suffix of DXVK state caches, DXVK names them after the executable (eg. "Game.dxvk-cache" for Game.exe).
+ */
+constexpr std::string_view DxvkCacheSuffix{".dxvk-cache"};
+
+/**
+ * @brief Statistics about merging state caches into a single cache.
+ */
+struct ShaderCacheMergeStats {
+    size_t inputFiles;
+    size_t droppedFiles; //!< Inputs that aren't state caches or are from a different cache version than the output, none of their entries are kept.
+    size_t truncatedFiles; //!< Inputs that end partway through an entry, which happens when DXVK is killed while writing one, the entries before it are kept.
+    size_t entries; //!< The unique entries in the output.
+    size_t duplicateEntries;
+    uint32_t version; //!< The cache version of the output, this is 0 if none of the inputs were usable in which case no output was written.
+    uint64_t inputBytes;
+    uint64_t outputBytes;
+    std::chrono::nanoseconds duration;
+};
+
+/**
+ * @brief Merges DXVK state caches into a single cache, entries are deduplicated by their hash and only caches of the newest version among the inputs are kept.
+ * @details Inputs are streamed entry by entry on a pool of threads rather than loaded, only the hashes of unique entries are kept in memory. The output is written to a temporary file and renamed over the output path, so the output can also be one of the inputs.
+ * @note Caches older than version 8 have a different entry layout and are always dropped, DXVK recreates their entries as the game runs.
+ */
+ShaderCacheMergeStats MergeDxvkCaches(std::span<const std::filesystem::path> inputs, const std::filesystem::path &output, size_t threadCount = 4);
+
+/**
+ * @brief The name of the directory of the runtime-wide sessions inside the directory of a runtime, this can't collide with an application as GetApplicationName never returns a name starting with a dot.
+ */
+constexpr std::string_view SharedApplicationName{".shared"};
+
+/**
+ * @brief The cache directory of a single launch of an application, or of every application that a context launches without a session of its own.
+ * @details DXVK appends to the cache of the executable in place, so every launch writes to its own copy of the caches of the application rather than to the shared caches, which would be corrupted by concurrent launches.
+ */
+struct ShaderCacheSession {
+    std::filesystem::path applicationPath; //!< The directory of the application, which holds the merged caches of all of its sessions. This is the SharedApplicationName directory of the runtime for runtime-wide sessions.
+    std::filesystem::path path; //!< The directory of the session, this is what DXVK_STATE_CACHE_PATH points to.
+    UniqueFd lock; //!< A lock on the session which is held for its lifetime, a session that isn't locked anymore was abandoned and is merged by the next session of the application.
+};
+
+/**
+ * @brief Statistics about ending a session, every state cache of the session is merged separately.
+ */
+struct ShaderCacheSessionStats {
+    size_t caches;
+    size_t entries; //!< The unique entries across all caches of the application after merging.
+    uint64_t bytes; //!< The size of all caches of the application after merging.
+    uint64_t evictedBytes; //!< The size of the caches of other applications that were evicted to stay within the quota.
+    std::chrono::nanoseconds duration;
+};
+
+/**
+ * @brief A manager of the DXVK and VKD3D-Proton shader caches of every application, caches are kept per runtime and application rather than wherever the working directory of the game is.
+ * @details The caches of an application are shared by every prefix, so a game that's moved to another prefix still starts with a warm cache. Every launch gets a session pre-warmed with a copy of the merged caches, which is merged back once the session ends.
+ * The total size of all caches is bounded by a quota, the caches of the least recently launched applications are evicted once it's exceeded.
+ * Applications that aren't launched by path (such as games started from the Wine desktop) write to a runtime-wide session, every cache in it is merged back into the application it's named after.
+ * @note VKD3D-Proton manages concurrent access to its own cache, so it's pointed at the application directory directly and its cache is only subject to the quota.
+ */
+class ShaderCacheManager {
+  private:
+    std::filesystem::path root;
+    uint64_t quotaBytes;
+
+    /**
+     * @brief Merges the caches of sessions that were abandoned (such as by the app being killed) and legacy caches into the caches of the application.
+     * @note The application must be locked by the caller.
+     */
+    void RecoverSessions(const std::filesystem::path &applicationPath, const std::filesystem::path &legacyCachePath);
+
+    /**
+     * @brief Merges every cache of a session into the caches of its application, or into the application each cache is named after for runtime-wide sessions.
+     * @note This locks every application it merges into, which must not be locked by the caller.
+     */
+    ShaderCacheSessionStats MergeSessionCaches(const std::filesystem::path &applicationPath, const std::filesystem::path &sessionPath);
+
+  public:
+    /**
+     * @param root The directory of all caches, this has a directory per runtime with a directory per application inside.
+     * @param quotaBytes The total size of all caches, the least recently used applications are evicted when a session ends with the caches above it.
+     */
+    ShaderCacheManager(std::filesystem::path root, uint64_t quotaBytes);
+
+    /**
+     * @return The name of the directory of an executable, this is the name of the executable without its extension in lowercase as Windows paths are case-insensitive.
+     * @param exe A Windows or Unix path to the executable.
+     */
+    static std::string GetApplicationName(std::string_view exe);
+
+    /**
+     * @brief Creates the session of a launch of an executable, which is pre-warmed with a copy of the caches of the application.
+     * @details If the executable is a host path, a cache that DXVK wrote next to it before it was managed is imported into the caches of the application.
+     * @param runtimeName The name of the runtime, caches of different runtimes are kept apart as their DXVK versions differ.
+     */
+    ShaderCacheSession BeginSession(std::string_view runtimeName, std::string_view exe);
+
+    /**
+     * @brief Creates a session shared by every application of a runtime, which is pre-warmed with a copy of the caches of all of them.
+     * @details This is for processes that are launched without a session of their own, DXVK names their caches after their executable so they can be told apart when they're merged. Runtime-wide sessions that were abandoned are merged into their applications first.
+     */
+    ShaderCacheSession BeginRuntimeSession(std::string_view runtimeName);
+
+    /**
+     * @brief Merges the caches of a session into the caches of its applications while keeping the session in use, this is for runtime-wide sessions that outlive the sessions of the prefix.
+     * @note No processes may be writing to the caches of the session.
+     */
+    ShaderCacheSessionStats MergeSession(const ShaderCacheSession &session);
+
+    /**
+     * @brief Merges the caches of a session into the caches of its application and removes the session, after which the quota is enforced.
+     * @note The session must not be used by any processes anymore.
+     */
+    ShaderCacheSessionStats EndSession(ShaderCacheSession session);
+
+    /**
+     * @brief Evicts the caches of the least recently used applications until all caches fit in the quota, applications with an active session are never evicted.
+     * @return The amount of bytes that were evicted.
+     */
+    uint64_t EnforceQuota();
+};
+}
@@ -0,0 +1,729 @@
+// Copyright © 2023 Cassia Developers, all rights reserved.
+
+#include "tar_extractor.h"
+#include "util/bounded_queue.h"
+#include "util/error.h"
+#include "util/fd.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <charconv>
+#include <cstring>
+#include <exception>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <semaphore>
+#include <span>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/fs.h>
+#include <zlib.h>
+#include <zstd.h>
+
+namespace cassia {
+constexpr size_t TarBlockSize{512};
+constexpr size_t WriteChunkSize{1024 * 1024}; //!< The maximum size of a single write job, larger files are split so they can be written by multiple workers.
+constexpr size_t MaxBufferedChunks{16}; //!< The maximum amount of decompressed chunks that are waiting to be written, this bounds the memory used for compressed archives.
+constexpr size_t WriteQueueCapacity{256}; //!< The capacity of the write queue, this must be a power of two.
+constexpr size_t DecompressionBufferSize{256 * 1024};
+
+/**
+ * @brief A read-only mapping of a range of a file.
+ */
+class MappedRange {
+  private:
+    void *base{MAP_FAILED};
+    size_t mappedSize{};
+
+  public:
+    std::span<const uint8_t> data;
+
+    MappedRange(int fd, uint64_t offset, uint64_t length) {
+        // The offset of a mapping must be page-aligned, so the range is mapped from the page it starts in.
+        static const uint64_t pageSize{static_cast<uint64_t>(sysconf(_SC_PAGESIZE))};
+        uint64_t alignedOffset{offset & ~(pageSize - 1)};
+        mappedSize = static_cast<size_t>(length + (offset - alignedOffset));
+        if (length == 0)
+            throw Exception{"The archive is empty"};
+        base = mmap(nullptr, mappedSize, PROT_READ, MAP_PRIVATE, fd, static_cast<off_t>(alignedOffset));
+        if (base == MAP_FAILED)
+            throw Exception{"mmap({}, {}, {}) failed: {}", fd, mappedSize, alignedOffset, strerror(errno)};
+        madvise(base, mappedSize, MADV_SEQUENTIAL);
+        data = {static_cast<const uint8_t *>(base) + (offset - alignedOffset), static_cast<size_t>(length)};
+    }
+
+    MappedRange(const MappedRange &) = delete;
+
+    MappedRange &operator=(const MappedRange &) = delete;
+
+    ~MappedRange() {
+        if (base != MAP_FAILED)
+            munmap(base, mappedSize);
+    }
+};
+
+/**
+ * @brief A sequential reader of the (decompressed) contents of an archive.
+ */
+class ArchiveReader {
+  public:
+    virtual ~ArchiveReader() = default;
+
+    /**
+     * @return The next bytes of the archive, this is shorter than requested only at the end of the archive.
+     * @note The returned span is only valid until the next read, unless the reader is mapped.
+     */
+    virtual std::span<const uint8_t> Read(size_t size) = 0;
+
+    /**
+     * @return If the spans returned by Read() point into the mapping, so they remain valid for as long as it does.
+     */
+    virtual bool IsMapped() const = 0;
+};
+
+class MappedReader : public ArchiveReader {
+  private:
+    std::span<const uint8_t> remaining;
+
+  public:
+    explicit MappedReader(std::span<const uint8_t> data) : remaining{data} {}
+
+    std::span<const uint8_t> Read(size_t size) override {
+        auto data{remaining.first(std::min(size, remaining.size()))};
+        remaining = remaining.subspan(data.size());
+        return data;
+    }
+
+    bool IsMapped() const override {
+        return true;
+    }
+};
+
+/**
+ * @brief A reader for compressed archives, this decompresses into a buffer that is refilled as it's read.
+ */
+class DecompressingReader : public ArchiveReader {
+  private:
+    std::vector<uint8_t> buffer;
+    size_t start{}, end{}; //!< The range of the buffer that has been decompressed but not read yet.
+    bool finished{};
+
+  protected:
+    /**
+     * @return The amount of bytes decompressed into the output, this is 0 once the end of the compressed stream has been reached.
+     */
+    virtual size_t Decompress(std::span<uint8_t> output) = 0;
+
+  public:
+    std::span<const uint8_t> Read(size_t size) override {
+        if (end - start < size && !finished) {
+            if (end != start)
+                std::memmove(buffer.data(), buffer.data() + start, end - start);
+            end -= start;
+            start = 0;
+            if (buffer.size() < std::max(size, DecompressionBufferSize))
+                buffer.resize(std::max(size, DecompressionBufferSize));
+
+            while (end < size) {
+                size_t decompressed{Decompress(std::span{buffer}.subspan(end))};
+                if (decompressed == 0) {
+                    finished = true;
+                    break;
+                }
+                end += decompressed;
+            }
+        }
+
+        std::span<const uint8_t> data{buffer.data() + start, std::min(size, end - start)};
+        start += data.size();
+        return data;
+    }
+
+    bool IsMapped() const override {
+        return false;
+    }
+};
+
+class GzipReader : public DecompressingReader {
+  private:
+    z_stream stream{};
+    std::span<const uint8_t> input;
+    bool finished{};
+
+  protected:
+    size_t Decompress(std::span<uint8_t> output) override {
+        // zlib's sizes are 32-bit, so the input and output are supplied in chunks.
+        output = output.first(std::min<size_t>(output.size(), std::numeric_limits<uInt>::max()));
+        stream.next_out = output.data();
+        stream.avail_out = static_cast<uInt>(output.size());
+        while (stream.avail_out == output.size() && !finished) {
+            if (stream.avail_in == 0) {
+                if (input.empty())
+                    throw Exception{"The compressed archive is truncated"};
+                size_t chunk{std::min<size_t>(input.size(), std::numeric_limits<uInt>::max())};
+                stream.next_in = const_cast<Bytef *>(input.data());
+                stream.avail_in = static_cast<uInt>(chunk);
+                input = input.subspan(chunk);
+            }
+            int result{inflate(&stream, Z_NO_FLUSH)};
+            if (result == Z_STREAM_END)
+                finished = true;
+            else if (result != Z_OK)
+                throw Exception{"Failed to decompress the archive: {}", stream.msg ? stream.msg : zError(result)};
+        }
+        return output.size() - stream.avail_out;
+    }
+
+  public:
+    explicit GzipReader(std::span<const uint8_t> data) : input{data} {
+        // A window size of 15 with 16 added only accepts the gzip format, rather than zlib's own.
+        if (inflateInit2(&stream, 15 + 16) != Z_OK)
+            throw Exception{"inflateInit2() failed"};
+    }
+
+    ~GzipReader() override {
+        inflateEnd(&stream);
+    }
+};
+
+class ZstdReader : public DecompressingReader {
+  private:
+    std::unique_ptr<ZSTD_DCtx, decltype(&ZSTD_freeDCtx)> context{ZSTD_createDCtx(), &ZSTD_freeDCtx};
+    ZSTD_inBuffer input;
+    bool finished{};
+
+  protected:
+    size_t Decompress(std::span<uint8_t> output) override {
+        ZSTD_outBuffer outputBuffer{output.data(), output.size(), 0};
+        while (outputBuffer.pos == 0 && !finished) {
+            size_t result{ZSTD_decompressStream(context.get(), &outputBuffer, &input)};
+            if (ZSTD_isError(result))
+                throw Exception{"Failed to decompress the archive: {}", ZSTD_getErrorName(result)};
+            if (input.pos == input.size && outputBuffer.pos < outputBuffer.size) {
+                if (result != 0)
+                    throw Exception{"The compressed archive is truncated"};
+                finished = true; // All frames have been decompressed and flushed.
+            }
+        }
+        return outputBuffer.pos;
+    }
+
+  public:
+    explicit ZstdReader(std::span<const uint8_t> data) : input{data.data(), data.size(), 0} {
+        if (!context)
+            throw Exception{"ZSTD_createDCtx() failed"};
+    }
+};
+
+/**
+ * @return A reader for the archive, depending on the compression format which is detected from its magic number.
+ */
+static std::unique_ptr<ArchiveReader> CreateArchiveReader(std::span<const uint8_t> data) {
+    constexpr std::array<uint8_t, 2> GzipMagic{0x1F, 0x8B};
+    constexpr std::array<uint8_t, 4> ZstdMagic{0x28, 0xB5, 0x2F, 0xFD};
+    auto startsWith{[&](std::span<const uint8_t> magic) { return data.size() >= magic.size() && std::equal(magic.begin(), magic.end(), data.begin()); }};
+    if (startsWith(GzipMagic))
+        return std::make_unique<GzipReader>(data);
+    if (startsWith(ZstdMagic))
+        return std::make_unique<ZstdReader>(data);
+    return std::make_unique<MappedReader>(data);
+}
+
+/**
+ * @return A NUL-terminated field of a header, it isn't required to be terminated if it fills the entire field.
+ */
+static std::string_view GetStringField(std::span<const uint8_t> header, size_t offset, size_t size) {
+    auto field{reinterpret_cast<const char *>(header.data() + offset)};
+    return {field, strnlen(field, size)};
+}
+
+/**
+ * @return The value of a numeric field of a header, these are octal or big-endian base-256 if the high bit of the first byte is set (a GNU extension for large values).
+ */
+static uint64_t GetNumericField(std::span<const uint8_t> header, size_t offset, size_t size) {
+    auto field{header.subspan(offset, size)};
+    uint64_t value{};
+    if (field[0] & 0x80) {
+        value = field[0] & 0x7F;
+        for (size_t index{1}; index < field.size(); index++)
+            value = (value << 8) | field[index];
+        return value;
+    }
+    for (uint8_t c: field) {
+        if (c == ' ' && value == 0)
+            continue;
+        if (c < '0' || c > '7')
+            break;
+        value = (value << 3) | static_cast<uint64_t>(c - '0');
+    }
+    return value;
+}
+
+static bool IsValidChecksum(std::span<const uint8_t> header) {
+    // The checksum is calculated with the checksum field itself filled with spaces.
+    constexpr size_t ChecksumOffset{148}, ChecksumSize{8};
+    uint64_t sum{ChecksumSize * ' '};
+    for (size_t index{}; index < header.size(); index++)
+        if (index < ChecksumOffset || index >= ChecksumOffset + ChecksumSize)
+            sum += header[index];
+    return sum == GetNumericField(header, ChecksumOffset, ChecksumSize);
+}
+
+/**
+ * @return A path relative to the extraction root with any leading "./" removed, this is empty for the root itself.
+ */
+static std::string SanitizePath(std::string_view fullPath) {
+    if (fullPath.starts_with('/'))
+        throw Exception{"The archive contains an absolute path: '{}'", fullPath};
+
+    std::string sanitized;
+    for (auto path{fullPath}; !path.empty();) {
+        size_t separator{path.find('/')};
+        auto component{path.substr(0, separator)};
+        path.remove_prefix(separator == std::string_view::npos ? path.size() : separator + 1);
+        if (component.empty() || component == ".")
+            continue;
+        if (component == "..")
+            throw Exception{"The archive contains a path outside of the destination: '{}'", fullPath};
+        if (!sanitized.empty())
+            sanitized += '/';
+        sanitized += component;
+    }
+    return sanitized;
+}
+
+/**
+ * @return The size of an entry from the decimal value of a pax "size" record.
+ */
+static uint64_t ParsePaxSize(std::string_view value) {
+    uint64_t size{};
+    auto [end, error]{std::from_chars(value.data(), value.data() + value.size(), size)};
+    if (error != std::errc{} || end != value.data() + value.size())
+        throw Exception{"The archive contains a malformed pax header"};
+    return size;
+}
+
+/**
+ * @return The value of a key in a pax extended header, or std::nullopt if it isn't present.
+ * @note Records are in the format "<length> <key>=<value>\n", where the length includes the entire record.
+ */
+static std::optional<std::string_view> FindPaxValue(std::string_view records, std::string_view key) {
+    std::optional<std::string_view> value;
+    while (!records.empty()) {
+        size_t length{};
+        auto [end, error]{std::from_chars(records.data(), records.data() + records.size(), length)};
+        auto digits{static_cast<size_t>(end - records.data())};
+        // The record has to fit the length, the space after it and at least the key, which also guarantees that the separator is within the records.
+        if (error != std::errc{} || length <= digits + 1 || length > records.size() || *end != ' ')
+            throw Exception{"The archive contains a malformed pax header"};
+        auto record{records.substr(0, length)};
+        records.remove_prefix(length);
+
+        record.remove_prefix(digits + 1); // The length and the space after it.
+        if (record.ends_with('\n'))
+            record.remove_suffix(1);
+        if (record.starts_with(key) && record.size() > key.size() && record[key.size()] == '=')
+            value = record.substr(key.size() + 1); // Later records override earlier ones.
+    }
+    return value;
+}
+
+/**
+ * @brief A file being written by the workers, it's closed once the last chunk of it has been written.
+ */
+struct OutputFile {
+    UniqueFd fd;
+    std::string path;
+};
+
+/**
+ * @brief A chunk of a file's contents, the data points into the mapping or into the buffer for compressed archives.
+ */
+struct WriteJob {
+    std::shared_ptr<OutputFile> file; //!< This is null for jobs that stop a worker.
+    uint64_t offset;
+    std::span<const uint8_t> data;
+    std::vector<uint8_t> buffer;
+};
+
+/**
+ * @brief The state of a single extraction, the parsing thread creates all entries and queues the contents of files for the workers.
+ */
+class TarExtraction {
+  private:
+    UniqueFd root;
+    std::string parentPath; //!< The path of the directory that parentFd refers to, consecutive entries are usually in the same directory.
+    UniqueFd parentFd{-1};
+
+    BoundedQueue<WriteJob> queue{WriteQueueCapacity};
+    std::counting_semaphore<> queuedJobs{0};
+    std::counting_semaphore<> freeSlots{WriteQueueCapacity};
+    std::counting_semaphore<> freeBuffers{MaxBufferedChunks}; //!< The amount of chunks that can be buffered, this is only used for compressed archives.
+    std::vector<std::thread> workers;
+
+    std::mutex errorMutex;
+    std::exception_ptr error;
+    std::atomic<bool> failed{};
+
+    void Push(WriteJob job) {
+        freeSlots.acquire();
+        while (!queue.TryPush([&](WriteJob &slot) { slot = std::move(job); }))
+            std::this_thread::yield(); // A slot has been claimed, so this only fails while a worker is still moving out of it.
+        queuedJobs.release();
+    }
+
+    void Worker() {
+        while (true) {
+            queuedJobs.acquire();
+            WriteJob job;
+            while (!queue.TryPop([&](WriteJob &slot) { job = std::move(slot); }))
+                std::this_thread::yield();
+            freeSlots.release();
+            if (!job.file)
+                return;
+
+            if (!failed.load(std::memory_order_relaxed)) {
+                for (size_t written{}; written < job.data.size();) {
+                    ssize_t result{pwrite(job.file->fd.Get(), job.data.data() + written, job.data.size() - written, static_cast<off_t>(job.offset + written))};
+                    if (result == -1) {
+                        if (errno == EINTR)
+                            continue;
+                        Fail(std::make_exception_ptr(Exception{"Failed to write '{}': {}", job.file->path, strerror(errno)}));
+                        break;
+                    }
+                    written += static_cast<size_t>(result);
+                }
+            }
+            if (!job.buffer.empty())
+                freeBuffers.release();
+        }
+    }
+
+    void Fail(std::exception_ptr exception) {
+        std::scoped_lock lock{errorMutex};
+        if (!error)
+            error = std::move(exception);
+        failed = true;
+    }
+
+    /**
+     * @brief Opens a directory inside another one and creates it if it doesn't exist yet, the archive isn't required to contain entries for every directory.
+     * @param path The path of the directory relative to the root, this is only used for errors.
+     * @note An existing entry has to be a directory itself rather than a symlink to one, otherwise a symlink from the archive could redirect later entries outside of the root.
+     */
+    UniqueFd OpenDirectory(int directoryFd, const std::string &name, std::string_view path, mode_t mode) {
+        if (mkdirat(directoryFd, name.c_str(), mode) == 0)
+            stats.directories++;
+        else if (errno != EEXIST)
+            throw Exception{"Failed to create the directory '{}': {}", path, strerror(errno)};
+
+        UniqueFd fd{openat(directoryFd, name.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC), "tar_extractor"};
+        if (!fd.Valid()) {
+            if (errno == ELOOP || errno == ENOTDIR)
+                throw Exception{"The archive contains a path through a non-directory: '{}'", path};
+            throw Exception{"Failed to open the directory '{}': {}", path, strerror(errno)};
+        }
+        return fd;
+    }
+
+    /**
+     * @brief Opens the directory containing an entry and creates any missing directories on the way, without following any symlinks.
+     * @return The directory and the name of the entry inside it, the directory is only valid until the next call.
+     * @note This walks the path a component at a time with O_NOFOLLOW rather than using openat2() with RESOLVE_BENEATH, as older Android releases kill apps making syscalls their seccomp filter doesn't know.
+     */
+    std::pair<int, std::string> OpenParent(const std::string &path) {
+        size_t separator{path.rfind('/')};
+        if (separator == std::string::npos)
+            return {root.Get(), path};
+
+        auto directory{std::string_view{path}.substr(0, separator)};
+        if (!parentFd.Valid() || parentPath != directory) {
+            // The cached directory can't be replaced by anything else while it's open, as directories are never unlinked during an extraction.
+            parentFd.Reset();
+            UniqueFd fd{-1};
+            for (size_t start{}; start <= directory.size();) {
+                size_t end{std::min(directory.find('/', start), directory.size())};
+                fd = OpenDirectory(fd.Valid() ? fd.Get() : root.Get(), std::string{directory.substr(start, end - start)}, directory.substr(0, end), 0755);
+                start = end + 1;
+            }
+            parentFd = std::move(fd);
+            parentPath = directory;
+        }
+        return {parentFd.Get(), path.substr(separator + 1)};
+    }
+
+    /**
+     * @brief Creates a directory entry along with any missing parents of it.
+     */
+    void CreateDirectory(const std::string &path, mode_t mode) {
+        if (path.empty())
+            return;
+        auto [directoryFd, name]{OpenParent(path)};
+        OpenDirectory(directoryFd, name, path, mode);
+    }
+
+    void ExtractFile(ArchiveReader &reader, const std::string &path, mode_t mode, uint64_t size) {
+        auto [directoryFd, name]{OpenParent(path)};
+        unlinkat(directoryFd, name.c_str(), 0); // Archives may contain multiple entries for the same path, the last one takes precedence.
+        auto file{std::make_shared<OutputFile>(OutputFile{
+            .fd = UniqueFd{openat(directoryFd, name.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, mode), "tar_extractor"},
+            .path = path,
+        })};
+        if (file->fd.Get() == -1)
+            throw Exception{"Failed to create '{}': {}", path, strerror(errno)};
+        if (size != 0)
+            fallocate(file->fd.Get(), 0, 0, static_cast<off_t>(size)); // This is only an optimization, so failures (such as the filesystem not supporting it) are ignored.
+
+        for (uint64_t offset{}; offset < size;) {
+            size_t chunkSize{static_cast<size_t>(std::min<uint64_t>(size - offset, WriteChunkSize))};
+            WriteJob job{.file = file, .offset = offset};
+            if (reader.IsMapped()) {
+                job.data = reader.Read(chunkSize);
+            } else {
+                freeBuffers.acquire();
+                auto data{reader.Read(chunkSize)};
+                job.buffer.assign(data.begin(), data.end());
+                job.data = job.buffer;
+            }
+            if (job.data.size() != chunkSize)
+                throw Exception{"The archive is truncated in '{}'", path};
+            offset += chunkSize;
+            Push(std::move(job));
+        }
+        SkipPadding(reader, size);
+
+        stats.files++;
+        stats.fileBytes += size;
+    }
+
+    static void SkipPadding(ArchiveReader &reader, uint64_t size) {
+        if (size_t padding{static_cast<size_t>((TarBlockSize - size % TarBlockSize) % TarBlockSize)})
+            reader.Read(padding);
+    }
+
+    /**
+     * @return The contents of an entry that holds metadata for the following entry, such as a long name or pax header.
+     */
+    static std::string ReadMetadataEntry(ArchiveReader &reader, uint64_t size) {
+        constexpr uint64_t MaxMetadataSize{1024 * 1024};
+        if (size > MaxMetadataSize)
+            throw Exception{"The archive contains a metadata entry of {} bytes", size};
+        auto data{reader.Read(static_cast<size_t>(size))};
+        if (data.size() != size)
+            throw Exception{"The archive is truncated"};
+        std::string contents{reinterpret_cast<const char *>(data.data()), data.size()};
+        SkipPadding(reader, size);
+        return contents;
+    }
+
+  public:
+    TarExtractStats stats{};
+
+    TarExtraction(const std::filesystem::path &stagingPath, size_t threadCount) : root{open(stagingPath.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC), "tar_extractor"} {
+        if (root.Get() == -1)
+            throw Exception{"Failed to open '{}': {}", stagingPath.string(), strerror(errno)};
+        for (size_t index{}; index < std::max<size_t>(threadCount, 1); index++)
+            workers.emplace_back(&TarExtraction::Worker, this);
+    }
+
+    TarExtraction(const TarExtraction &) = delete;
+
+    TarExtraction &operator=(const TarExtraction &) = delete;
+
+    ~TarExtraction() {
+        Join();
+    }
+
+    /**
+     * @brief Waits for all queued writes to complete and stops the workers.
+     */
+    void Join() {
+        for (size_t index{}; index < workers.size(); index++)
+            Push(WriteJob{});
+        for (auto &worker: workers)
+            worker.join();
+        workers.clear();
+    }
+
+    void Extract(ArchiveReader &reader) {
+        std::string longName, longLinkName;
+        std::optional<std::string> paxPath, paxLinkPath, paxSize;
+
+        while (!failed.load(std::memory_order_relaxed)) {
+            auto header{reader.Read(TarBlockSize)};
+            if (header.size() != TarBlockSize)
+                throw Exception{"The archive is truncated"};
+            if (std::all_of(header.begin(), header.end(), [](uint8_t byte) { return byte == 0; }))
+                break; // The end of the archive is marked by zeroed blocks.
+            if (!IsValidChecksum(header))
+                throw Exception{"The archive contains a header with an invalid checksum"};
+
+            char type{static_cast<char>(header[156])};
+            uint64_t size{paxSize ? ParsePaxSize(*paxSize) : GetNumericField(header, 124, 12)};
+            auto mode{static_cast<mode_t>(GetNumericField(header, 100, 8) & 07777)};
+
+            // GNU and pax extensions supply the metadata of the following entry in an entry of their own.
+            if (type == 'L') {
+                longName = ReadMetadataEntry(reader, size);
+                longName.resize(strnlen(longName.data(), longName.size()));
+                continue;
+            } else if (type == 'K') {
+                longLinkName = ReadMetadataEntry(reader, size);
+                longLinkName.resize(strnlen(longLinkName.data(), longLinkName.size()));
+                continue;
+            } else if (type == 'x') {
+                auto records{ReadMetadataEntry(reader, size)};
+                if (auto value{FindPaxValue(records, "path")})
+                    paxPath = std::string{*value};
+                if (auto value{FindPaxValue(records, "linkpath")})
+                    paxLinkPath = std::string{*value};
+                if (auto value{FindPaxValue(records, "size")})
+                    paxSize = std::string{*value};
+                continue;
+            } else if (type == 'g') {
+                ReadMetadataEntry(reader, size); // Global pax headers only contain metadata that we don't use.
+                continue;
+            }
+
+            std::string name;
+            if (paxPath) {
+                name = *paxPath;
+            } else if (!longName.empty()) {
+                name = longName;
+            } else {
+                auto prefix{GetStringField(header, 345, 155)};
+                if (GetStringField(header, 257, 6).starts_with("ustar") && !prefix.empty())
+                    name = fmt::format("{}/{}", prefix, GetStringField(header, 0, 100));
+                else
+                    name = GetStringField(header, 0, 100);
+            }
+            std::string linkName{paxLinkPath ? *paxLinkPath : !longLinkName.empty() ? longLinkName : std::string{GetStringField(header, 157, 100)}};
+            longName.clear();
+            longLinkName.clear();
+            paxPath.reset();
+            paxLinkPath.reset();
+            paxSize.reset();
+
+            auto path{SanitizePath(name)};
+            switch (type) {
+                case '0':
+                case '\0':
+                case '7':
+                    if (path.empty())
+                        throw Exception{"The archive contains a file without a name"};
+                    ExtractFile(reader, path, mode, size);
+                    break;
+
+                case '5':
+                    CreateDirectory(path, mode | S_IRWXU); // The directory must remain writable for its contents to be extracted.
+                    SkipPadding(reader, size);
+                    break;
+
+                case '2': {
+                    // The target is stored verbatim, it's never followed by the extraction itself.
+                    auto [directoryFd, name]{OpenParent(path)};
+                    unlinkat(directoryFd, name.c_str(), 0);
+                    if (symlinkat(linkName.c_str(), directoryFd, name.c_str()) == -1)
+                        throw Exception{"Failed to create the symlink '{}' -> '{}': {}", path, linkName, strerror(errno)};
+                    stats.symlinks++;
+                    break;
+                }
+
+                case '1': {
+                    // The target is created before any later entries, so it's guaranteed to exist even if its contents haven't been written yet.
+                    auto target{SanitizePath(linkName)};
+                    auto [targetDirectoryFd, targetName]{OpenParent(target)};
+                    UniqueFd targetDirectory{fcntl(targetDirectoryFd, F_DUPFD_CLOEXEC, 0), "tar_extractor"}; // The parent of the link may replace the cached directory.
+                    if (!targetDirectory.Valid())
+                        throw Exception{"fcntl({}, F_DUPFD_CLOEXEC) failed: {}", targetDirectoryFd, strerror(errno)};
+                    auto [directoryFd, name]{OpenParent(path)};
+                    unlinkat(directoryFd, name.c_str(), 0);
+                    if (linkat(targetDirectory.Get(), targetName.c_str(), directoryFd, name.c_str(), 0) == -1)
+                        throw Exception{"Failed to create the hardlink '{}' -> '{}': {}", path, target, strerror(errno)};
+                    stats.hardlinks++;
+                    break;
+                }
+
+                default:
+                    // Devices and FIFOs can't be created by an app, and have no use in any archive we extract.
+                    if (size)
+                        ReadMetadataEntry(reader, size);
+                    break;
+            }
+        }
+    }
+
+    void RethrowError() {
+        if (error)
+            std::rethrow_exception(error);
+    }
+};
+
+/**
+ * @brief Atomically replaces the destination with the staging directory, the staging path holds the previous destination afterwards if it existed.
+ * @return If the destination existed and was exchanged.
+ */
+static bool ReplaceDirectory(const std::filesystem::path &stagingPath, const std::filesystem::path &destination) {
+    if (!std::filesystem::exists(destination)) {
+        std::filesystem::rename(stagingPath, destination);
+        return false;
+    }
+
+    // renameat2 is only exposed by bionic from API 30 onwards, so it's called directly.
+    if (syscall(__NR_renameat2, AT_FDCWD, stagingPath.c_str(), AT_FDCWD, destination.c_str(), RENAME_EXCHANGE) == 0)
+        return true;
+    if (errno != EINVAL && errno != ENOSYS)
+        throw Exception{"Failed to replace '{}': {}", destination.string(), strerror(errno)};
+
+    // The filesystem doesn't support exchanging, so the destination is briefly missing while it's replaced.
+    auto previousPath{std::filesystem::path{stagingPath}.concat(".previous")};
+    std::filesystem::remove_all(previousPath);
+    std::filesystem::rename(destination, previousPath);
+    std::filesystem::rename(stagingPath, destination);
+    std::filesystem::rename(previousPath, stagingPath);
+    return true;
+}
+
+TarExtractStats ExtractTar(int fd, uint64_t offset, uint64_t length, const std::filesystem::path &destination, size_t threadCount) {
+    auto start{std::chrono::steady_clock::now()};
+    MappedRange archive{fd, offset, length};
+    auto reader{CreateArchiveReader(archive.data)};
+
+    auto stagingPath{destination.parent_path() / fmt::format(".{}.extracting", destination.filename().string())};
+    std::filesystem::remove_all(stagingPath); // A previous extraction may have been interrupted.
+    std::filesystem::create_directories(stagingPath);
+
+    TarExtractStats stats;
+    try {
+        TarExtraction extraction{stagingPath, threadCount};
+        try {
+            extraction.Extract(*reader);
+        } catch (...) {
+            extraction.Join(); // The workers must be stopped before the error is rethrown, as they reference the mapping.
+            throw;
+        }
+        extraction.Join();
+        extraction.RethrowError();
+        stats = extraction.stats;
+    } catch (...) {
+        std::error_code error;
+        std::filesystem::remove_all(stagingPath, error);
+        throw;
+    }
+
+    bool replaced{ReplaceDirectory(stagingPath, destination)};
+    stats.archiveBytes = length;
+    stats.duration = std::chrono::steady_clock::now() - start;
+    if (replaced)
+        std::filesystem::remove_all(stagingPath); // This holds the previous contents of the destination now, which isn't part of the extraction itself.
+    return stats;
+}
+}
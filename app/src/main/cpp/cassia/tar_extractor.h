@@ -0,0 +1,30 @@
+// Copyright © 2023 Cassia Developers, all rights reserved.
+#pragma once
+
+#include <chrono>
+#include <filesystem>
+
+namespace cassia {
+/**
+ * @brief Statistics about a single archive extraction.
+ */
+struct TarExtractStats {
+    size_t files;
+    size_t directories;
+    size_t symlinks;
+    size_t hardlinks;
+    uint64_t archiveBytes; //!< The size of the archive, this is the compressed size for compressed archives.
+    uint64_t fileBytes; //!< The total size of all extracted files.
+    std::chrono::nanoseconds duration;
+};
+
+/**
+ * @brief Extracts a tar archive into a directory, the archive may be compressed with gzip or zstd which is detected from its contents.
+ * @details The archive is mapped into memory and parsed on the calling thread, which creates all directories, links and files in a single pass.
+ * The contents of files are written by a pool of workers, directly from the mapping for uncompressed archives or from a bounded amount of decompressed chunks otherwise.
+ * Everything is extracted into a staging directory next to the destination, which then atomically replaces the destination.
+ * @param fd The archive file, only the supplied range of it is read so this can be an uncompressed asset inside an APK.
+ * @note Entries with absolute paths or ".." components are rejected, as are entries whose path goes through a symlink so that a symlink in the archive can't redirect later entries outside of the destination. Symlinks themselves are created verbatim. The staging directory is removed if extraction fails.
+ */
+TarExtractStats ExtractTar(int fd, uint64_t offset, uint64_t length, const std::filesystem::path &destination, size_t threadCount = 4);
+}
@@ -0,0 +1,96 @@
+// Copyright © 2023 Cassia Developers, all rights reserved.
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include "error.h"
+
+namespace cassia {
+/**
+ * @brief A bounded lock-free queue which can be used by multiple producers and consumers concurrently.
+ * @details This is Dmitry Vyukov's bounded MPMC queue, every slot carries a sequence number which tells producers and consumers whether it's ready for them.
+ * Values are filled and consumed in-place and are never destroyed while the queue is alive, so any capacity they hold (such as a std::string's buffer) is reused.
+ * @url https://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue
+ */
+template<typename T>
+class BoundedQueue {
+  private:
+    struct Slot {
+        std::atomic<size_t> sequence;
+        T value;
+    };
+
+    std::unique_ptr<Slot[]> slots;
+    size_t mask;
+    alignas(64) std::atomic<size_t> enqueuePosition{};
+    alignas(64) std::atomic<size_t> dequeuePosition{};
+
+  public:
+    /**
+     * @param capacity The maximum amount of values in the queue, this must be a power of two.
+     */
+    explicit BoundedQueue(size_t capacity) : slots{std::make_unique<Slot[]>(capacity)}, mask{capacity - 1} {
+        if (capacity < 2 || (capacity & mask) != 0)
+            throw Exception{"Queue capacity ({}) must be a power of two", capacity};
+        for (size_t i{}; i < capacity; i++)
+            slots[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief Claims a slot at the back of the queue and calls the supplied function to fill it.
+     * @return If a slot was claimed, this fails when the queue is full.
+     */
+    template<typename Func>
+    bool TryPush(Func &&fill) {
+        size_t position{enqueuePosition.load(std::memory_order_relaxed)};
+        while (true) {
+            Slot &slot{slots[position & mask]};
+            size_t sequence{slot.sequence.load(std::memory_order_acquire)};
+            auto difference{static_cast<ptrdiff_t>(sequence) - static_cast<ptrdiff_t>(position)};
+            if (difference == 0) {
+                if (enqueuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                    fill(slot.value);
+                    slot.sequence.store(position + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (difference < 0) {
+                return false;
+            } else {
+                position = enqueuePosition.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    /**
+     * @brief Claims the slot at the front of the queue and calls the supplied function to consume it.
+     * @return If a slot was claimed, this fails when the queue is empty or the value at the front hasn't been fully pushed yet.
+     */
+    template<typename Func>
+    bool TryPop(Func &&consume) {
+        size_t position{dequeuePosition.load(std::memory_order_relaxed)};
+        while (true) {
+            Slot &slot{slots[position & mask]};
+            size_t sequence{slot.sequence.load(std::memory_order_acquire)};
+            auto difference{static_cast<ptrdiff_t>(sequence) - static_cast<ptrdiff_t>(position + 1)};
+            if (difference == 0) {
+                if (dequeuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                    consume(slot.value);
+                    slot.sequence.store(position + mask + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (difference < 0) {
+                return false;
+            } else {
+                position = dequeuePosition.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    /**
+     * @return If there were no claimed slots in the queue at the time of the call.
+     */
+    bool Empty() {
+        return enqueuePosition.load(std::memory_order_acquire) == dequeuePosition.load(std::memory_order_acquire);
+    }
+};
+}
@@ -0,0 +1,21 @@
+// Copyright © 2023 Cassia Developers, all rights reserved.
+#pragma once
+
+#include <memory>
+#include <dirent.h>
+
+namespace cassia {
+/**
+ * @brief A stateless deleter for directory streams, unlike decltype(&closedir) this doesn't store a function pointer in every handle.
+ */
+struct DirCloser {
+    void operator()(DIR *dir) const {
+        closedir(dir);
+    }
+};
+
+/**
+ * @brief A RAII wrapper for a directory stream.
+ */
+using UniqueDir = std::unique_ptr<DIR, DirCloser>;
+}
@@ -1,38 +1,32 @@
 // Copyright © 2023 Cassia Developers, all rights reserved.
 
 #include "fd.h"
+#include <fcntl.h>
 #include <unistd.h>
 
 namespace cassia {
-UniqueFd::UniqueFd(int fd) : fd{fd} {}
-
-UniqueFd::UniqueFd(UniqueFd &&other) noexcept {
-    fd = other.fd;
-    other.fd = -1;
-}
-
-UniqueFd &UniqueFd::operator=(UniqueFd &&other) noexcept {
-    fd = other.fd;
-    other.fd = -1;
-    return *this;
+UniqueFd::UniqueFd(int fd, const char *owner) : handle{FdRegistry::Register(fd, owner)} {}
+
+/**
+ * @brief Sets or clears FD_CLOEXEC while preserving any other descriptor flags.
+ */
+static bool SetCloseOnExecFlag(int fd, bool closeOnExec) {
+    int flags{fcntl(fd, F_GETFD)};
+    return flags != -1 && fcntl(fd, F_SETFD, closeOnExec ? flags | FD_CLOEXEC : flags & ~FD_CLOEXEC) != -1;
 }
 
-void UniqueFd::Reset() {
-    if (fd != -1) {
-        close(fd);
-        fd = -1;
-    }
-}
-
-UniqueFd::~UniqueFd() {
-    Reset();
+bool UniqueFd::SetCloseOnExec(bool closeOnExec) {
+    return SetCloseOnExecFlag(handle.fd, closeOnExec);
 }
 
 UniqueFd UniqueFd::Duplicate() {
-    return UniqueFd(dup(fd));
+    auto owner{FdRegistry::GetOwner(handle)};
+    return UniqueFd{dup(handle.fd), owner ? owner : UnknownFdOwner};
 }
 
-SharedFd::SharedFd(int pFd) : fd{std::make_shared<UniqueFd>(pFd)} {}
+SharedFd::SharedFd(int fd, const char *owner) : handle{FdRegistry::Register(fd, owner)} {}
 
-SharedFd::SharedFd(UniqueFd &&other) noexcept: fd{std::make_shared<UniqueFd>(std::move(other))} {}
+bool SharedFd::SetCloseOnExec(bool closeOnExec) {
+    return SetCloseOnExecFlag(handle.fd, closeOnExec);
+}
 }
@@ -1,103 +1,163 @@
 // Copyright © 2023 Cassia Developers, all rights reserved.
 #pragma once
 
-#include <memory>
+#include "fd_registry.h"
+#include <utility>
 
 namespace cassia {
+/**
+ * @brief The owner of file descriptors that were registered without one, this should only be used by code that doesn't belong to any subsystem.
+ */
+constexpr const char *UnknownFdOwner{"unknown"};
+
 /**
  * @brief A RAII wrapper for a Unix file descriptor.
+ * @note The file descriptor is registered in the FdRegistry, this is only a handle to it and doesn't allocate.
  */
 struct UniqueFd {
   private:
-    int fd;
+    FdHandle handle;
+
+    friend struct SharedFd;
 
   public:
-    UniqueFd(int fd);
+    /**
+     * @param owner A static string naming the subsystem that owns the file descriptor, this is used for diagnostics.
+     */
+    UniqueFd(int fd, const char *owner = UnknownFdOwner);
 
     UniqueFd(const UniqueFd &) = delete;
 
     /**
      * @note The other UniqueFd will be invalid after this is called.
      */
-    UniqueFd(UniqueFd &&other) noexcept;
+    UniqueFd(UniqueFd &&other) noexcept : handle{std::exchange(other.handle, {})} {}
 
     UniqueFd &operator=(const UniqueFd &) = delete;
 
     /**
-     * @note The other UniqueFd will be invalid after this is called.
+     * @note The other UniqueFd will be invalid after this is called, any file descriptor previously held by this one is closed.
      */
-    UniqueFd &operator=(UniqueFd &&other) noexcept;
+    UniqueFd &operator=(UniqueFd &&other) noexcept {
+        if (this != &other) {
+            Reset();
+            handle = std::exchange(other.handle, {});
+        }
+        return *this;
+    }
 
-    ~UniqueFd();
+    ~UniqueFd() {
+        Reset();
+    }
 
     /**
      * @note This will be -1 if this UniqueFd is invalid.
      */
-    [[nodiscard]] constexpr int Get() {
-        return fd;
+    [[nodiscard]] constexpr int Get() const {
+        return handle.fd;
     }
 
     /**
      * @brief Closes the file descriptor.
      * @note After this is called, this UniqueFd will be invalid.
      */
-    void Reset();
+    void Reset() {
+        if (handle.fd != -1)
+            FdRegistry::Release(std::exchange(handle, {}));
+    }
 
     /**
      * @return If this UniqueFd holds a valid file descriptor.
      */
-    constexpr bool Valid() {
-        return fd != -1;
+    constexpr bool Valid() const {
+        return handle.fd != -1;
     }
 
+    /**
+     * @brief Sets or clears FD_CLOEXEC on the file descriptor.
+     * @return If the flag could be changed, errno is set otherwise.
+     */
+    bool SetCloseOnExec(bool closeOnExec);
+
     /**
      * @return A new file descriptor that refers to the same underlying file, these have independent lifetimes.
+     * @note The duplicate has the same owner but doesn't inherit FD_CLOEXEC, as with dup().
      */
     [[nodiscard]] UniqueFd Duplicate();
 };
 
 /**
  * @brief A reference-counting RAII wrapper for a Unix file descriptor.
+ * @note The reference count is held by the FdRegistry, so copies are trivially small handles that don't allocate.
  */
 struct SharedFd {
   private:
-    std::shared_ptr<UniqueFd> fd;
+    FdHandle handle;
 
   public:
-    SharedFd(int pFd);
+    /**
+     * @param owner A static string naming the subsystem that owns the file descriptor, this is used for diagnostics.
+     */
+    SharedFd(int fd, const char *owner = UnknownFdOwner);
 
-    SharedFd(UniqueFd &&other) noexcept;
+    SharedFd(UniqueFd &&other) noexcept : handle{std::exchange(other.handle, {})} {}
 
-    SharedFd(const SharedFd &) = default;
+    SharedFd(const SharedFd &other) : handle{other.handle} {
+        if (handle.fd != -1)
+            FdRegistry::Acquire(handle);
+    }
 
-    SharedFd(SharedFd &&) = default;
+    SharedFd(SharedFd &&other) noexcept : handle{std::exchange(other.handle, {})} {}
 
-    SharedFd &operator=(const SharedFd &) = default;
+    SharedFd &operator=(const SharedFd &other) {
+        if (this != &other) {
+            if (other.handle.fd != -1)
+                FdRegistry::Acquire(other.handle);
+            Reset();
+            handle = other.handle;
+        }
+        return *this;
+    }
 
-    SharedFd &operator=(SharedFd &&) = default;
+    SharedFd &operator=(SharedFd &&other) noexcept {
+        if (this != &other) {
+            Reset();
+            handle = std::exchange(other.handle, {});
+        }
+        return *this;
+    }
+
+    ~SharedFd() {
+        Reset();
+    }
 
     /**
      * @note This will be -1 if this SharedFd is invalid.
      */
-    [[nodiscard]] constexpr int Get() {
-        if (!fd)
-            return -1;
-        return fd->Get();
+    [[nodiscard]] constexpr int Get() const {
+        return handle.fd;
     }
 
     /**
      * @brief Resets this reference to the file descriptor, closing the file descriptor if this was the last reference.
      * @note After this is called, this SharedFd will be invalid.
      */
-    constexpr void Reset() {
-        fd.reset();
+    void Reset() {
+        if (handle.fd != -1)
+            FdRegistry::Release(std::exchange(handle, {}));
     }
 
     /**
      * @return If this SharedFd is referring to a valid file descriptor.
      */
-    constexpr bool Valid() {
-        return fd != nullptr;
+    constexpr bool Valid() const {
+        return handle.fd != -1;
     }
+
+    /**
+     * @brief Sets or clears FD_CLOEXEC on the file descriptor, this affects all references to it.
+     * @return If the flag could be changed, errno is set otherwise.
+     */
+    bool SetCloseOnExec(bool closeOnExec);
 };
 }
@@ -0,0 +1,209 @@
+// Copyright © 2023 Cassia Developers, all rights reserved.
+
+#include "fd_registry.h"
+#include "error.h"
+#include <algorithm>
+#include <climits>
+#include <ctime>
+#include <unordered_map>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+namespace cassia {
+constinit FdRegistry FdRegistry::instance;
+
+/**
+ * @brief The fraction of RLIMIT_NOFILE at which registering file descriptors starts emitting warnings.
+ */
+constexpr int ExhaustionWarningPercent{90};
+
+/**
+ * @brief The minimum time between exhaustion warnings, so a process hovering around the threshold doesn't flood the log.
+ */
+constexpr int64_t ExhaustionWarningIntervalNs{10'000'000'000};
+
+static int64_t GetMonotonicTime() {
+    timespec time{};
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return static_cast<int64_t>(time.tv_sec) * 1'000'000'000 + time.tv_nsec;
+}
+
+static size_t GetFdLimit() {
+    rlimit limit{};
+    if (getrlimit(RLIMIT_NOFILE, &limit) == -1 || limit.rlim_cur == RLIM_INFINITY)
+        return INT_MAX;
+    return static_cast<size_t>(limit.rlim_cur);
+}
+
+FdRegistry::Entry &FdRegistry::GetEntry(int fd) {
+    auto index{static_cast<size_t>(fd) >> ChunkShift};
+    if (index >= MaxChunks)
+        throw Exception{"fd {} is beyond the capacity of the registry", fd};
+
+    auto &chunk{chunks[index]};
+    auto entries{chunk.load(std::memory_order_acquire)};
+    if (!entries) {
+        // Chunks are never freed, so a chunk that lost the race to be published is the only one that's ever deleted.
+        auto allocated{new Entry[ChunkSize]{}};
+        if (chunk.compare_exchange_strong(entries, allocated, std::memory_order_acq_rel, std::memory_order_acquire))
+            entries = allocated;
+        else
+            delete[] allocated;
+    }
+    return entries[static_cast<size_t>(fd) & (ChunkSize - 1)];
+}
+
+FdRegistry::Entry *FdRegistry::FindEntry(FdHandle handle) {
+    auto index{static_cast<size_t>(handle.fd) >> ChunkShift};
+    if (handle.fd < 0 || index >= MaxChunks)
+        return nullptr;
+    auto entries{chunks[index].load(std::memory_order_acquire)};
+    if (!entries)
+        return nullptr;
+    auto &entry{entries[static_cast<size_t>(handle.fd) & (ChunkSize - 1)]};
+    return entry.generation.load(std::memory_order_relaxed) == handle.generation ? &entry : nullptr;
+}
+
+void FdRegistry::WarnIfNearExhaustion(int fd) {
+    int threshold{warningThreshold.load(std::memory_order_relaxed)};
+    if (threshold == 0) {
+        threshold = static_cast<int>(std::min<size_t>(GetFdLimit() * ExhaustionWarningPercent / 100, INT_MAX));
+        warningThreshold.store(threshold, std::memory_order_relaxed);
+    }
+    if (fd < threshold)
+        return;
+
+    auto now{GetMonotonicTime()};
+    auto last{lastWarning.load(std::memory_order_relaxed)};
+    if ((last != 0 && now - last < ExhaustionWarningIntervalNs) || !lastWarning.compare_exchange_strong(last, now, std::memory_order_relaxed))
+        return;
+    fmt::println(stderr, "Running out of file descriptors, fd {} was registered: {}", fd, DescribeUsage());
+}
+
+FdHandle FdRegistry::Register(int fd, const char *owner) {
+    if (fd < 0)
+        return {};
+
+    Entry *entry;
+    try {
+        entry = &instance.GetEntry(fd);
+    } catch (...) {
+        close(fd);
+        throw;
+    }
+
+    // A referenced entry means the previous file was closed without going through the registry, which could've closed a file it didn't own.
+    if (auto references{entry->references.load(std::memory_order_relaxed)}; references != 0)
+        fmt::println(stderr, "fd {} was registered by {} while still referenced {} times by {}, it was closed outside of the registry", fd, owner, references, entry->owner.load(std::memory_order_relaxed));
+    else
+        instance.registeredFds.fetch_add(1, std::memory_order_relaxed);
+
+    entry->owner.store(owner, std::memory_order_relaxed);
+    uint32_t generation{entry->generation.load(std::memory_order_relaxed) + 1};
+    if (generation == 0)
+        generation = 1; // A generation of 0 is reserved for invalid handles.
+    entry->generation.store(generation, std::memory_order_relaxed);
+    entry->references.store(1, std::memory_order_release);
+
+    auto registered{instance.registeredFds.load(std::memory_order_relaxed)};
+    auto peak{instance.peakRegisteredFds.load(std::memory_order_relaxed)};
+    while (registered > peak && !instance.peakRegisteredFds.compare_exchange_weak(peak, registered, std::memory_order_relaxed));
+
+    instance.WarnIfNearExhaustion(fd);
+    return {fd, generation};
+}
+
+void FdRegistry::Acquire(FdHandle handle) {
+    auto entry{instance.FindEntry(handle)};
+    TerminateIf(!entry, "Acquiring a stale handle to fd {} (generation {})", handle.fd, handle.generation);
+    entry->references.fetch_add(1, std::memory_order_relaxed);
+}
+
+void FdRegistry::Release(FdHandle handle) {
+    auto entry{instance.FindEntry(handle)};
+    if (!entry) {
+        fmt::println(stderr, "Releasing a stale handle to fd {} (generation {}), it isn't closed as it may belong to another file now", handle.fd, handle.generation);
+        return;
+    }
+
+    if (entry->references.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        instance.registeredFds.fetch_sub(1, std::memory_order_relaxed);
+        close(handle.fd);
+    }
+}
+
+void FdRegistry::SetOwner(FdHandle handle, const char *owner) {
+    if (auto entry{instance.FindEntry(handle)})
+        entry->owner.store(owner, std::memory_order_relaxed);
+}
+
+const char *FdRegistry::GetOwner(FdHandle handle) {
+    auto entry{instance.FindEntry(handle)};
+    return entry ? entry->owner.load(std::memory_order_relaxed) : nullptr;
+}
+
+std::vector<FdRecord> FdRegistry::GetRecords() {
+    std::vector<FdRecord> records;
+    for (size_t chunkIndex{}; chunkIndex < MaxChunks; chunkIndex++) {
+        auto entries{instance.chunks[chunkIndex].load(std::memory_order_acquire)};
+        if (!entries)
+            continue;
+        for (size_t index{}; index < ChunkSize; index++) {
+            auto &entry{entries[index]};
+            auto references{entry.references.load(std::memory_order_acquire)};
+            if (references == 0)
+                continue;
+            int fd{static_cast<int>((chunkIndex << ChunkShift) | index)};
+            int flags{fcntl(fd, F_GETFD)};
+            records.push_back(FdRecord{
+                .fd = fd,
+                .generation = entry.generation.load(std::memory_order_relaxed),
+                .references = references,
+                .owner = entry.owner.load(std::memory_order_relaxed),
+                .closeOnExec = flags != -1 && (flags & FD_CLOEXEC),
+            });
+        }
+    }
+    return records;
+}
+
+FdRegistryStats FdRegistry::GetStats() {
+    auto records{GetRecords()};
+    FdRegistryStats stats{
+        .registeredFds = records.size(),
+        .peakRegisteredFds = instance.peakRegisteredFds.load(std::memory_order_relaxed),
+        .limit = GetFdLimit(),
+    };
+
+    std::unordered_map<std::string_view, size_t> owners;
+    for (const auto &record: records) {
+        owners[record.owner]++;
+        stats.inheritableFds += !record.closeOnExec;
+    }
+    for (const auto &[owner, count]: owners)
+        stats.owners.emplace_back(owner, count);
+    std::sort(stats.owners.begin(), stats.owners.end(), [](const auto &a, const auto &b) { return a.second > b.second; });
+
+    if (auto directory{opendir("/proc/self/fd")}) {
+        while (auto entry{readdir(directory)})
+            if (entry->d_name[0] != '.')
+                stats.openFds++;
+        closedir(directory);
+        stats.openFds--; // The directory stream has an fd of its own.
+    } else {
+        stats.openFds = stats.registeredFds; // This fails when no file descriptors are left, the registered ones are a lower bound.
+    }
+    return stats;
+}
+
+std::string FdRegistry::DescribeUsage() {
+    auto stats{GetStats()};
+    std::string description{fmt::format("{} of {} file descriptors are open, {} are registered (", stats.openFds, stats.limit, stats.registeredFds)};
+    for (size_t i{}; i < stats.owners.size(); i++)
+        fmt::format_to(std::back_inserter(description), "{}{}: {}", i ? ", " : "", stats.owners[i].first, stats.owners[i].second);
+    description += ')';
+    return description;
+}
+}
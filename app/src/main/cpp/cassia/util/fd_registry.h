@@ -0,0 +1,122 @@
+// Copyright © 2023 Cassia Developers, all rights reserved.
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace cassia {
+/**
+ * @brief A trivially copyable reference to a file descriptor in the FdRegistry.
+ * @details The generation distinguishes between different files that were assigned the same fd number over time, so a stale handle can't affect a newer file.
+ */
+struct FdHandle {
+    int fd{-1};
+    uint32_t generation{};
+};
+
+/**
+ * @brief The state of a single file descriptor in the FdRegistry.
+ */
+struct FdRecord {
+    int fd;
+    uint32_t generation;
+    uint32_t references;
+    const char *owner; //!< The subsystem which registered the file descriptor.
+    bool closeOnExec; //!< This is read when the record is created rather than tracked, so it reflects any changes made with fcntl directly.
+};
+
+/**
+ * @brief A summary of the file descriptors of the process, for finding leaks and diagnosing exhaustion.
+ */
+struct FdRegistryStats {
+    size_t registeredFds;
+    size_t peakRegisteredFds;
+    size_t openFds; //!< All file descriptors that are open in the process, including any which aren't registered (such as those of ART or Wine libraries).
+    size_t inheritableFds; //!< Registered file descriptors without FD_CLOEXEC, these are inherited by every spawned process.
+    size_t limit; //!< The soft RLIMIT_NOFILE of the process.
+    std::vector<std::pair<std::string, size_t>> owners; //!< The amount of registered file descriptors for every owner, sorted by count in descending order.
+};
+
+/**
+ * @brief A registry of all file descriptors owned by UniqueFd and SharedFd, which holds their reference counts along with metadata for diagnostics.
+ * @details Entries are indexed by fd number in chunks which are allocated on first use and never freed, so registering a file descriptor never allocates once its chunk exists.
+ * As the kernel always assigns the lowest free fd number, the entries in use stay dense.
+ * @note This class holds a global instance of itself, which is constant-initialized and never destroyed so file descriptors can be released during static destruction.
+ */
+class FdRegistry {
+  private:
+    struct Entry {
+        std::atomic<uint32_t> references;
+        std::atomic<uint32_t> generation;
+        std::atomic<const char *> owner;
+    };
+
+    static constexpr size_t ChunkShift{10};
+    static constexpr size_t ChunkSize{1 << ChunkShift};
+    static constexpr size_t MaxChunks{1024}; //!< This covers fd numbers up to the default fs.nr_open of 1048576.
+
+    std::array<std::atomic<Entry *>, MaxChunks> chunks{};
+    std::atomic<size_t> registeredFds{};
+    std::atomic<size_t> peakRegisteredFds{};
+    std::atomic<int> warningThreshold{}; //!< The fd number above which exhaustion warnings are emitted, this is derived from RLIMIT_NOFILE on first use.
+    std::atomic<int64_t> lastWarning{}; //!< The CLOCK_MONOTONIC time of the last exhaustion warning in nanoseconds, this rate-limits them.
+
+    static FdRegistry instance;
+
+    Entry &GetEntry(int fd);
+
+    /**
+     * @return The entry of the supplied handle, or null if the handle is stale.
+     */
+    Entry *FindEntry(FdHandle handle);
+
+    void WarnIfNearExhaustion(int fd);
+
+  public:
+    /**
+     * @brief Registers a newly opened file descriptor with a single reference.
+     * @param owner A static string naming the subsystem that owns the file descriptor, such as "logger".
+     * @return A handle to the file descriptor, or an invalid handle if fd is -1.
+     */
+    static FdHandle Register(int fd, const char *owner);
+
+    /**
+     * @brief Adds a reference to a registered file descriptor.
+     */
+    static void Acquire(FdHandle handle);
+
+    /**
+     * @brief Removes a reference from a registered file descriptor, closing it once there are none left.
+     * @note Releasing a stale handle is reported and ignored, as the fd number may already belong to another file.
+     */
+    static void Release(FdHandle handle);
+
+    /**
+     * @brief Changes the owner of a registered file descriptor, this is used when a file descriptor is handed over between subsystems.
+     */
+    static void SetOwner(FdHandle handle, const char *owner);
+
+    /**
+     * @return The owner of a registered file descriptor, or null if the handle is stale.
+     */
+    static const char *GetOwner(FdHandle handle);
+
+    /**
+     * @return The state of every registered file descriptor, sorted by fd number.
+     */
+    static std::vector<FdRecord> GetRecords();
+
+    /**
+     * @note This reads /proc/self/fd to count unregistered file descriptors, so it shouldn't be called frequently.
+     */
+    static FdRegistryStats GetStats();
+
+    /**
+     * @return A single line summarizing the file descriptor usage of the process, this is appended to errors from running out of file descriptors.
+     */
+    static std::string DescribeUsage();
+};
+}
@@ -0,0 +1,75 @@
+// Copyright © 2023 Cassia Developers, all rights reserved.
+
+#include "line_framer.h"
+#include "error.h"
+#include "fd.h"
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/memfd.h>
+
+namespace cassia {
+LineFramer::LineFramer(size_t pCapacity, size_t pMaxLineLength) : maxLineLength{pMaxLineLength} {
+    size_t pageSize{static_cast<size_t>(sysconf(_SC_PAGESIZE))};
+    capacity = (pCapacity + pageSize - 1) & ~(pageSize - 1);
+    if (capacity <= maxLineLength + 1)
+        throw Exception{"Ring capacity ({}) must be larger than the maximum line length ({})", capacity, maxLineLength};
+
+    // memfd_create() is only exposed by Bionic from API 30 onwards, so the syscall is used directly.
+    UniqueFd memFd{static_cast<int>(syscall(__NR_memfd_create, "cassia-line-framer", MFD_CLOEXEC)), "line_framer"};
+    if (!memFd.Valid())
+        throw Exception{"memfd_create() failed: {}", strerror(errno)};
+    if (ftruncate(memFd.Get(), static_cast<off_t>(capacity)) == -1)
+        throw Exception{"ftruncate({}, {}) failed: {}", memFd.Get(), capacity, strerror(errno)};
+
+    // Reserve a contiguous region for both views first, then map the same pages over each half of it.
+    void *base{mmap(nullptr, capacity * 2, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)};
+    if (base == MAP_FAILED)
+        throw Exception{"mmap({}) failed: {}", capacity * 2, strerror(errno)};
+    buffer = static_cast<char *>(base);
+
+    for (size_t offset: {size_t{0}, capacity}) {
+        if (mmap(buffer + offset, capacity, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, memFd.Get(), 0) == MAP_FAILED) {
+            int error{errno};
+            munmap(buffer, capacity * 2);
+            buffer = nullptr;
+            throw Exception{"mmap({}, {}) failed: {}", memFd.Get(), capacity, strerror(error)};
+        }
+    }
+}
+
+LineFramer::LineFramer(LineFramer &&other) noexcept
+        : buffer{other.buffer}, capacity{other.capacity}, maxLineLength{other.maxLineLength},
+          head{other.head}, size{other.size}, scanned{other.scanned} {
+    other.buffer = nullptr;
+    other.size = 0;
+}
+
+LineFramer &LineFramer::operator=(LineFramer &&other) noexcept {
+    if (buffer)
+        munmap(buffer, capacity * 2);
+    buffer = other.buffer;
+    capacity = other.capacity;
+    maxLineLength = other.maxLineLength;
+    head = other.head;
+    size = other.size;
+    scanned = other.scanned;
+    other.buffer = nullptr;
+    other.size = 0;
+    return *this;
+}
+
+LineFramer::~LineFramer() {
+    if (buffer)
+        munmap(buffer, capacity * 2);
+}
+
+ssize_t LineFramer::Read(int fd) {
+    // A byte is always kept free so that a trailing partial line can be null-terminated in-place by Flush().
+    size_t tail{(head + size) % capacity};
+    ssize_t len{read(fd, buffer + tail, capacity - size - 1)};
+    if (len > 0)
+        size += static_cast<size_t>(len);
+    return len;
+}
+}
@@ -0,0 +1,105 @@
+// Copyright © 2023 Cassia Developers, all rights reserved.
+#pragma once
+
+#include <algorithm>
+#include <cstring>
+#include <sys/types.h>
+
+namespace cassia {
+/**
+ * @brief A ring buffer that splits a byte stream into lines, the lines are handed out in-place without being copied.
+ * @details The backing memory is mapped twice back-to-back, so any span of up to the capacity is virtually contiguous no matter where it wraps around in the ring.
+ * This lets data be read directly into the free space of the ring and every line be emitted as a single null-terminated string.
+ * @note Lines longer than the maximum line length are split into chunks of exactly that length, any remainder is treated as the start of a new line.
+ */
+class LineFramer {
+  private:
+    char *buffer{}; //!< The start of the double mapping, this is 2 * capacity bytes long.
+    size_t capacity{};
+    size_t maxLineLength{};
+    size_t head{}; //!< The offset of the first unconsumed byte in the ring.
+    size_t size{}; //!< The amount of unconsumed bytes in the ring.
+    size_t scanned{}; //!< The amount of bytes at the head that are known to not contain a newline.
+
+    void Consume(size_t length) {
+        head = (head + length) % capacity;
+        size -= length;
+        scanned = 0;
+        if (size == 0)
+            head = 0; // Restarting from the front keeps the working set of the ring small for short bursts.
+    }
+
+  public:
+    /**
+     * @param capacity The size of the ring in bytes, this will be rounded up to the page size and must be larger than the maximum line length.
+     * @param maxLineLength The maximum length of a line (excluding the null terminator), any longer lines will be split.
+     */
+    LineFramer(size_t capacity, size_t maxLineLength);
+
+    LineFramer(const LineFramer &) = delete;
+
+    LineFramer(LineFramer &&other) noexcept;
+
+    LineFramer &operator=(const LineFramer &) = delete;
+
+    LineFramer &operator=(LineFramer &&other) noexcept;
+
+    ~LineFramer();
+
+    /**
+     * @brief Reads as much data as will fit into the free space of the ring from the supplied file descriptor.
+     * @return The result of the read() call, -1 with errno set on failure and 0 on EOF.
+     */
+    ssize_t Read(int fd);
+
+    /**
+     * @brief Calls the supplied function with every complete line in the ring, the lines are consumed afterwards.
+     * @param func A function taking a null-terminated line and its length, the pointer is only valid for the duration of the call.
+     * @note The newline is not included in the line, any data after the last newline is retained until it's completed or flushed.
+     */
+    template<typename Func>
+    void ForEachLine(Func &&func) {
+        while (size != 0) {
+            char *line{buffer + head};
+            size_t limit{std::min(size, maxLineLength + 1)}; // A newline directly after a line of the maximum length still belongs to it.
+            if (scanned < limit) {
+                auto newline{static_cast<char *>(std::memchr(line + scanned, '\n', limit - scanned))};
+                if (newline) {
+                    *newline = '\0';
+                    size_t length{static_cast<size_t>(newline - line)};
+                    func(static_cast<const char *>(line), length);
+                    Consume(length + 1);
+                    continue;
+                }
+            }
+
+            if (size <= maxLineLength) {
+                scanned = size;
+                break;
+            }
+
+            // The line can't fit into a single entry, terminate it at the limit temporarily and emit it as a chunk.
+            char saved{line[maxLineLength]};
+            line[maxLineLength] = '\0';
+            func(static_cast<const char *>(line), maxLineLength);
+            line[maxLineLength] = saved;
+            Consume(maxLineLength);
+        }
+    }
+
+    /**
+     * @brief Emits any complete lines followed by any trailing partial line, leaving the ring empty.
+     * @note This should be used when the stream has ended, so no data is left behind.
+     */
+    template<typename Func>
+    void Flush(Func &&func) {
+        ForEachLine(func);
+        if (size != 0) {
+            char *line{buffer + head};
+            line[size] = '\0'; // There's always at least a single byte of free space in the ring for this.
+            func(static_cast<const char *>(line), size);
+            Consume(size);
+        }
+    }
+};
+}
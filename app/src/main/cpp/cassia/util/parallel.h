@@ -0,0 +1,42 @@
+// Copyright © 2023 Cassia Developers, all rights reserved.
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace cassia {
+/**
+ * @brief Runs the function for every index in [0, count) on a pool of threads, the first exception thrown by any invocation is rethrown once all threads have stopped.
+ */
+template<typename Function>
+void ParallelFor(size_t count, size_t threadCount, Function function) {
+    std::atomic<size_t> next{};
+    std::mutex errorMutex;
+    std::exception_ptr error;
+    auto worker{[&] {
+        for (size_t index; (index = next.fetch_add(1, std::memory_order_relaxed)) < count;) {
+            try {
+                function(index);
+            } catch (...) {
+                std::scoped_lock lock{errorMutex};
+                if (!error)
+                    error = std::current_exception();
+                next = count;
+            }
+        }
+    }};
+
+    std::vector<std::thread> workers;
+    for (size_t index{1}; index < std::min(threadCount, count); index++)
+        workers.emplace_back(worker);
+    worker();
+    for (auto &thread: workers)
+        thread.join();
+    if (error)
+        std::rethrow_exception(error);
+}
+}
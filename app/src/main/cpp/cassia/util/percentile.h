@@ -0,0 +1,24 @@
+// Copyright © 2023 Cassia Developers, all rights reserved.
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+namespace cassia {
+/**
+ * @return The value at the supplied percentile (between 0 and 1) of the valid samples in a ring of durations, 0 if there are none.
+ * @param count The amount of samples that have been written to the ring in total, only the first Size of them are valid once it has wrapped around.
+ */
+template<size_t Size>
+std::chrono::nanoseconds GetPercentile(const std::array<std::chrono::nanoseconds, Size> &ring, uint64_t count, double percentile) {
+    std::vector<std::chrono::nanoseconds> samples(ring.begin(), ring.begin() + std::min<uint64_t>(count, Size));
+    if (samples.empty())
+        return {};
+    auto nth{samples.begin() + static_cast<ptrdiff_t>(percentile * static_cast<double>(samples.size() - 1))};
+    std::nth_element(samples.begin(), nth, samples.end());
+    return *nth;
+}
+}
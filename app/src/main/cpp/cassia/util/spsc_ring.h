@@ -0,0 +1,65 @@
+// Copyright © 2023 Cassia Developers, all rights reserved.
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include "error.h"
+
+namespace cassia {
+/**
+ * @brief A bounded lock-free ring which can be used by a single producer and a single consumer concurrently.
+ * @details Each side only writes its own index and keeps a cached copy of the other side's index, which is only refreshed once the ring looks full or empty.
+ * This way an uncontended push or pop doesn't touch the cache line of the other side, unlike BoundedQueue which needs a sequence number per slot to support multiple producers.
+ */
+template<typename T>
+class SpscRing {
+  private:
+    std::unique_ptr<T[]> values;
+    size_t mask;
+    alignas(64) std::atomic<size_t> writeIndex{};
+    size_t cachedReadIndex{}; //!< The consumer's read index as last seen by the producer.
+    alignas(64) std::atomic<size_t> readIndex{};
+    size_t cachedWriteIndex{}; //!< The producer's write index as last seen by the consumer.
+
+  public:
+    /**
+     * @param capacity The maximum amount of values in the ring, this must be a power of two.
+     */
+    explicit SpscRing(size_t capacity) : values{std::make_unique<T[]>(capacity)}, mask{capacity - 1} {
+        if (capacity < 2 || (capacity & mask) != 0)
+            throw Exception{"Ring capacity ({}) must be a power of two", capacity};
+    }
+
+    /**
+     * @return If the value was pushed, this fails when the ring is full.
+     * @note This may only be called by the producer.
+     */
+    bool TryPush(const T &value) {
+        size_t write{writeIndex.load(std::memory_order_relaxed)};
+        if (write - cachedReadIndex > mask) {
+            cachedReadIndex = readIndex.load(std::memory_order_acquire);
+            if (write - cachedReadIndex > mask)
+                return false;
+        }
+        values[write & mask] = value;
+        writeIndex.store(write + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * @return If a value was popped, this fails when the ring is empty.
+     * @note This may only be called by the consumer.
+     */
+    bool TryPop(T &value) {
+        size_t read{readIndex.load(std::memory_order_relaxed)};
+        if (read == cachedWriteIndex) {
+            cachedWriteIndex = writeIndex.load(std::memory_order_acquire);
+            if (read == cachedWriteIndex)
+                return false;
+        }
+        value = values[read & mask];
+        readIndex.store(read + 1, std::memory_order_release);
+        return true;
+    }
+};
+}
@@ -0,0 +1,162 @@
+// Copyright © 2023 Cassia Developers, all rights reserved.
+
+#include "trace.h"
+#include <array>
+#include <ctime>
+#include <fmt/format.h>
+#include <unistd.h>
+#include <sys/prctl.h>
+
+namespace cassia {
+Tracer Tracer::instance;
+thread_local Tracer::ThreadBufferHolder Tracer::threadBuffer;
+
+/**
+ * @brief The amount of events in the ring of every thread, this must be a power of two.
+ */
+constexpr size_t ThreadBufferCapacity{16384};
+
+/**
+ * @brief The maximum amount of rings, threads beyond this can only record events once the ring of an exited thread can be reused.
+ */
+constexpr size_t MaxThreadBuffers{64};
+
+Tracer::ThreadBufferHolder::~ThreadBufferHolder() {
+    if (buffer)
+        buffer->retired.store(true, std::memory_order_release);
+}
+
+Tracer::ThreadBuffer *Tracer::AcquireBuffer() {
+    std::array<char, 16> name{}; // The kernel limits thread names to 16 bytes, including the terminator.
+    prctl(PR_GET_NAME, name.data());
+
+    std::scoped_lock lock{mutex};
+    ThreadBuffer *buffer{};
+    if (buffers.size() < MaxThreadBuffers) {
+        buffer = buffers.emplace_back(std::make_unique<ThreadBuffer>()).get();
+        buffer->events = std::make_unique<TraceEvent[]>(ThreadBufferCapacity);
+    } else {
+        for (auto &candidate: buffers) {
+            if (candidate->retired.load(std::memory_order_acquire)) {
+                buffer = candidate.get();
+                break;
+            }
+        }
+        if (!buffer)
+            return nullptr;
+        buffer->head.store(0, std::memory_order_relaxed);
+        buffer->retired.store(false, std::memory_order_relaxed);
+    }
+    buffer->tid = gettid();
+    buffer->threadName = name.data();
+    threadBuffer.buffer = buffer;
+    return buffer;
+}
+
+void Tracer::RecordImpl(const TraceEvent &event) {
+    auto buffer{threadBuffer.buffer};
+    if (!buffer && !(buffer = AcquireBuffer())) {
+        droppedEvents.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    auto head{buffer->head.load(std::memory_order_relaxed)};
+    buffer->events[head & (ThreadBufferCapacity - 1)] = event;
+    buffer->head.store(head + 1, std::memory_order_release);
+}
+
+const char *Tracer::InternImpl(std::string_view string) {
+    std::scoped_lock lock{mutex};
+    return internedStrings.emplace(string).first->c_str();
+}
+
+void Tracer::SetEnabled(bool enable) {
+    if (enable && !enabled.load(std::memory_order_relaxed))
+        instance.startTimestamp.store(Now(), std::memory_order_relaxed);
+    enabled.store(enable, std::memory_order_relaxed);
+}
+
+int64_t Tracer::Now() {
+    timespec time{};
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return static_cast<int64_t>(time.tv_sec) * 1'000'000'000 + time.tv_nsec;
+}
+
+static void AppendJsonString(std::string &json, std::string_view string) {
+    json += '"';
+    for (char c: string) {
+        if (c == '"' || c == '\\')
+            json += '\\';
+        if (static_cast<unsigned char>(c) < 0x20)
+            fmt::format_to(std::back_inserter(json), "\\u{:04x}", static_cast<unsigned char>(c));
+        else
+            json += c;
+    }
+    json += '"';
+}
+
+/**
+ * @brief Appends a timestamp in nanoseconds as fractional microseconds, which is the unit of the trace-event format.
+ */
+static void AppendMicroseconds(std::string &json, int64_t nanoseconds) {
+    fmt::format_to(std::back_inserter(json), "{}.{:03}", nanoseconds / 1000, nanoseconds % 1000);
+}
+
+std::string Tracer::DumpChromeJsonImpl() {
+    auto pid{getpid()};
+    auto start{startTimestamp.load(std::memory_order_relaxed)};
+    std::string json;
+    auto out{std::back_inserter(json)};
+    fmt::format_to(out, R"({{"displayTimeUnit":"ms","otherData":{{"droppedEvents":{}}},"traceEvents":[)", droppedEvents.load(std::memory_order_relaxed));
+    fmt::format_to(out, R"({{"ph":"M","name":"process_name","pid":{},"tid":{},"args":{{"name":"cassia"}}}})", pid, pid);
+
+    std::scoped_lock lock{mutex};
+    std::vector<TraceEvent> events;
+    for (const auto &buffer: buffers) {
+        json += ',';
+        fmt::format_to(out, R"({{"ph":"M","name":"thread_name","pid":{},"tid":{},"args":{{"name":)", pid, buffer->tid);
+        AppendJsonString(json, buffer->threadName);
+        json += "}}";
+
+        // The owning thread may overwrite the oldest events while they're copied, any that could have been overwritten are discarded after copying.
+        auto head{buffer->head.load(std::memory_order_acquire)};
+        auto first{head > ThreadBufferCapacity ? head - ThreadBufferCapacity : 0};
+        events.clear();
+        for (auto index{first}; index < head; index++)
+            events.push_back(buffer->events[index & (ThreadBufferCapacity - 1)]);
+        auto newHead{buffer->head.load(std::memory_order_acquire)};
+        size_t overwritten{newHead > ThreadBufferCapacity && newHead - ThreadBufferCapacity > first ? static_cast<size_t>(newHead - ThreadBufferCapacity - first) : 0};
+
+        for (size_t index{overwritten}; index < events.size(); index++) {
+            const auto &event{events[index]};
+            if (event.timestamp < start)
+                continue;
+            json += R"(,{"name":)";
+            AppendJsonString(json, event.name);
+            fmt::format_to(out, R"(,"cat":"cassia","ph":"{}","pid":{},"tid":{},"ts":)", event.phase, pid, buffer->tid);
+            AppendMicroseconds(json, event.timestamp);
+            if (event.phase == 'X') {
+                json += R"(,"dur":)";
+                AppendMicroseconds(json, event.duration);
+            } else if (event.phase == 'i') {
+                json += R"(,"s":"t")";
+            }
+
+            if (event.phase == 'C') {
+                fmt::format_to(out, R"(,"args":{{"value":{}}})", event.argValue);
+            } else if (event.argName) {
+                json += R"(,"args":{)";
+                AppendJsonString(json, event.argName);
+                json += ':';
+                if (event.argString)
+                    AppendJsonString(json, event.argString);
+                else
+                    fmt::format_to(out, "{}", event.argValue);
+                json += '}';
+            }
+            json += '}';
+        }
+    }
+    json += "]}";
+    return json;
+}
+}
@@ -0,0 +1,163 @@
+// Copyright © 2023 Cassia Developers, all rights reserved.
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+#include <vector>
+#include <sys/types.h>
+
+namespace cassia {
+/**
+ * @brief A single trace event, names and string arguments must have static storage duration or be interned with Tracer::Intern as only the pointers are recorded.
+ */
+struct TraceEvent {
+    const char *name;
+    const char *argName; //!< The name of an optional argument of the event, this is null if it has none.
+    const char *argString; //!< The value of the argument if it's a string, argValue is used otherwise.
+    int64_t argValue; //!< The value of the argument if it's an integer, or the value of a counter.
+    int64_t timestamp; //!< The CLOCK_MONOTONIC time in nanoseconds, this is the same clock as Perfetto and atrace use.
+    int64_t duration; //!< The duration of spans in nanoseconds.
+    char phase; //!< The Chrome trace-event phase: 'X' for spans, 'i' for instant events and 'C' for counters.
+};
+
+/**
+ * @brief A recorder of trace events which are written into per-thread rings without any locking, so tracing doesn't perturb what's being traced.
+ * @details Every thread that records an event is assigned a ring the first time it does so, the ring is only ever written by that thread and overwrites its oldest events once full.
+ * Rings of exited threads are kept so their events can still be dumped, they're only reused once the amount of rings has reached its limit.
+ * @note This class holds a global instance of itself, like Logger. Trace points cost a single relaxed load while tracing is disabled, so they can remain in release builds.
+ */
+class Tracer {
+  private:
+    struct ThreadBuffer {
+        pid_t tid;
+        std::string threadName;
+        std::unique_ptr<TraceEvent[]> events;
+        std::atomic<uint64_t> head{}; //!< The amount of events ever written to the ring, the oldest events have been overwritten if this exceeds the capacity.
+        std::atomic<bool> retired{}; //!< Set once the owning thread has exited, the ring can be reassigned to another thread afterwards.
+    };
+
+    /**
+     * @brief Retires the ring of a thread when it exits.
+     */
+    struct ThreadBufferHolder {
+        ThreadBuffer *buffer{};
+
+        ~ThreadBufferHolder();
+    };
+
+    static inline std::atomic<bool> enabled{};
+    static thread_local ThreadBufferHolder threadBuffer;
+
+    std::mutex mutex; //!< Guards the set of rings and interned strings, this is never held while recording events.
+    std::vector<std::unique_ptr<ThreadBuffer>> buffers;
+    std::unordered_set<std::string> internedStrings;
+    std::atomic<int64_t> startTimestamp{}; //!< Events before this are omitted from dumps, this is set whenever tracing is enabled so every capture starts empty.
+    std::atomic<uint64_t> droppedEvents{}; //!< Events that couldn't be recorded as no ring was available for their thread.
+
+    static Tracer instance;
+
+    ThreadBuffer *AcquireBuffer();
+
+    void RecordImpl(const TraceEvent &event);
+
+    const char *InternImpl(std::string_view string);
+
+    std::string DumpChromeJsonImpl();
+
+  public:
+    static bool IsEnabled() {
+        return enabled.load(std::memory_order_relaxed);
+    }
+
+    static void SetEnabled(bool enable);
+
+    /**
+     * @return The current CLOCK_MONOTONIC time in nanoseconds.
+     */
+    static int64_t Now();
+
+    /**
+     * @brief Records an event regardless of whether tracing is enabled, callers are expected to check IsEnabled beforehand.
+     */
+    static void Record(const TraceEvent &event) {
+        instance.RecordImpl(event);
+    }
+
+    /**
+     * @return A copy of the string which lives as long as the process, so it can be used as a name or argument of events. Interning the same string repeatedly returns the same copy.
+     * @note This takes a lock, so strings should be interned ahead of time rather than on every event.
+     */
+    static const char *Intern(std::string_view string) {
+        return instance.InternImpl(string);
+    }
+
+    /**
+     * @return All events recorded since tracing was enabled in the Chrome trace-event JSON format, this can be opened by Perfetto and chrome://tracing.
+     */
+    static std::string DumpChromeJson() {
+        return instance.DumpChromeJsonImpl();
+    }
+};
+
+/**
+ * @brief Records an instant event, such as a process exiting.
+ */
+inline void TraceInstant(const char *name, const char *argName = nullptr, int64_t argValue = 0) {
+    if (Tracer::IsEnabled())
+        Tracer::Record(TraceEvent{.name = name, .argName = argName, .argValue = argValue, .timestamp = Tracer::Now(), .phase = 'i'});
+}
+
+inline void TraceInstant(const char *name, const char *argName, const char *argString) {
+    if (Tracer::IsEnabled())
+        Tracer::Record(TraceEvent{.name = name, .argName = argName, .argString = argString, .timestamp = Tracer::Now(), .phase = 'i'});
+}
+
+/**
+ * @brief Records the current value of a counter, such as the amount of running processes.
+ */
+inline void TraceCounter(const char *name, int64_t value) {
+    if (Tracer::IsEnabled())
+        Tracer::Record(TraceEvent{.name = name, .argValue = value, .timestamp = Tracer::Now(), .phase = 'C'});
+}
+
+/**
+ * @brief Records a span from the construction to the destruction of this object, nothing is recorded if tracing was disabled at construction.
+ */
+class TraceScope {
+  private:
+    const char *name;
+    const char *argName;
+    const char *argString{};
+    int64_t argValue;
+    int64_t start;
+
+  public:
+    explicit TraceScope(const char *name, const char *argName = nullptr, int64_t argValue = 0) : name{name}, argName{argName}, argValue{argValue}, start{Tracer::IsEnabled() ? Tracer::Now() : -1} {}
+
+    TraceScope(const char *name, const char *argName, const char *argString) : name{name}, argName{argName}, argString{argString}, argValue{}, start{Tracer::IsEnabled() ? Tracer::Now() : -1} {}
+
+    TraceScope(const TraceScope &) = delete;
+
+    TraceScope &operator=(const TraceScope &) = delete;
+
+    /**
+     * @brief Sets the argument of the span, for values which are only known once the span has started (such as the PID of a spawned process).
+     */
+    void SetArg(const char *pArgName, int64_t value) {
+        argName = pArgName;
+        argString = nullptr;
+        argValue = value;
+    }
+
+    ~TraceScope() {
+        if (start != -1) {
+            auto end{Tracer::Now()};
+            Tracer::Record(TraceEvent{.name = name, .argName = argName, .argString = argString, .argValue = argValue, .timestamp = start, .duration = end - start, .phase = 'X'});
+        }
+    }
+};
+}
@@ -1,29 +1,263 @@
 // Copyright © 2023 Cassia Developers, all rights reserved.
 
 #include "wine_ctx.h"
-#include <sys/system_properties.h>
+#include "platform.h"
+#include "prefix_fingerprint.h"
+#include "util/dir.h"
+#include "util/trace.h"
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <charconv>
+#include <csignal>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 
 namespace cassia {
 std::string GetWineDebug() {
-    auto property{__system_property_find("cassia.wine.debug")};
-    if (property) {
-        char value[PROP_VALUE_MAX];
-        int len{__system_property_read(property, nullptr, value)};
-        if (len > 0)
-            return "WINEDEBUG=" + std::string{value, static_cast<size_t>(len)};
+    auto value{GetSystemProperty("cassia.wine.debug")};
+    return value.empty() ? "" : "WINEDEBUG=" + value;
+}
+
+/**
+ * @brief Log options for processes that are expected to log heavily, such as wineserver or anything that runs games (DXVK_HUD, WINEDEBUG channels).
+ * @note These trade completeness for not stalling any other channels or the process itself when it floods the logger.
+ */
+constexpr LogChannelOptions VerboseLogOptions{
+    .pipeCapacity = 1024 * 1024,
+    .linesPerSecond = 2000,
+    .burstLines = 10000,
+    .overflowPolicy = LogOverflowPolicy::DropOldest,
+    .parseWineDebug = true,
+};
+
+/**
+ * @brief Log options for short-lived Wine processes, these keep every line but still parse and collapse Wine debug output.
+ */
+constexpr LogChannelOptions WineLogOptions{
+    .parseWineDebug = true,
+};
+
+/**
+ * @brief The default directory of shader caches, this is in the cache directory of the app so Android can clear it when storage runs low.
+ */
+constexpr std::string_view DefaultShaderCacheRoot{"/data/data/cassia.app/cache/shader_cache"};
+constexpr uint64_t DefaultShaderCacheQuotaMb{512};
+
+/**
+ * @return The directory of shader caches, this can be overridden with the cassia.shader_cache.path system property.
+ */
+static std::filesystem::path GetShaderCacheRoot() {
+    auto value{GetSystemProperty("cassia.shader_cache.path")};
+    return value.empty() ? std::filesystem::path{DefaultShaderCacheRoot} : std::filesystem::path{value};
+}
+
+/**
+ * @return The quota of shader caches in bytes, this can be overridden in megabytes with the cassia.shader_cache.quota_mb system property.
+ */
+static uint64_t GetShaderCacheQuota() {
+    auto value{GetSystemProperty("cassia.shader_cache.quota_mb")};
+    uint64_t quotaMb{DefaultShaderCacheQuotaMb};
+    if (!value.empty() && std::from_chars(value.data(), value.data() + value.size(), quotaMb).ec != std::errc{})
+        fmt::println(stderr, "Invalid shader cache quota '{}', using {}MB", value, DefaultShaderCacheQuotaMb);
+    return quotaMb * 1024 * 1024;
+}
+
+/**
+ * @return The name of the runtime that shader caches are kept under, caches of different runtimes are kept apart as they come with different DXVK versions.
+ */
+static std::string GetRuntimeName(const std::filesystem::path &runtimePath) {
+    auto name{runtimePath.filename()};
+    return (name.empty() ? runtimePath.parent_path().filename() : name).string();
+}
+
+/**
+ * @brief The amount of log threads while a prefix is running, wineserver and the Wine processes can each flood their pipes at once which a single thread can't keep up with on a little core.
+ */
+constexpr size_t WineLogShardCount{2};
+
+/**
+ * @brief The size of the persistent log ring in the prefix, this should hold a few minutes of verbose output.
+ */
+constexpr size_t PersistentLogRingCapacity{8 * 1024 * 1024};
+
+/**
+ * @brief The time wineboot is given to initialize or shut down a prefix, creating a new prefix can take a while on slow storage.
+ */
+constexpr std::chrono::seconds WinebootTimeout{120};
+constexpr std::chrono::seconds WineserverStartTimeout{10};
+constexpr std::chrono::seconds WineserverExitTimeout{10};
+constexpr std::chrono::seconds TerminateGracePeriod{5}; //!< The time between SIGTERM and SIGKILL for any process that didn't exit in time.
+constexpr std::chrono::seconds SessionEndTimeout{5}; //!< The time applications are given to close their windows when the session ends, before all remaining processes are terminated.
+constexpr std::chrono::milliseconds ExitPollInterval{10};
+
+/**
+ * @brief The executables of Wine's system processes, these hold state that's loaded once per boot and are kept alive while a context is suspended.
+ */
+constexpr std::array<std::string_view, 5> SystemProcessNames{"services.exe", "winedevice.exe", "plugplay.exe", "svchost.exe", "rpcss.exe"};
+
+constexpr std::chrono::milliseconds ResourceSampleInterval{1000};
+constexpr size_t ResourceSampleCapacity{8192}; //!< The amount of samples retained between drains, this covers several minutes of a typical process tree.
+
+LaunchOptions GetWineserverLaunchOptions() {
+    return LaunchOptions{
+        .affinity = GetCpuTopology().bigCores,
+        .nice = -4,
+        .uclampMin = 512, // This keeps the core clocked up while wineserver is idle between bursts of requests, which is most of the time.
+        .maxOpenFiles = RLIM_INFINITY, // wineserver holds handles of every Wine process, many of which are fds.
+    };
+}
+
+LaunchOptions GetHelperLaunchOptions() {
+    return LaunchOptions{
+        .affinity = GetCpuTopology().littleCores,
+    };
+}
+
+LaunchOptions GetApplicationLaunchOptions() {
+    return LaunchOptions{
+        .affinity = GetCpuTopology().allCores, // This is set explicitly as the launcher is on the little cores.
+        .maxOpenFiles = RLIM_INFINITY,
+    };
+}
+
+/**
+ * @brief Waits for a process to exit, terminating it if it doesn't exit within the timeout.
+ */
+static int WaitOrTerminate(Process &&process, std::chrono::steady_clock::duration timeout) {
+    if (auto exitCode{process.WaitForExit(timeout)})
+        return *exitCode;
+    fmt::println(stderr, "Process {} didn't exit in time, terminating it", process.pid);
+    process.Terminate(TerminateGracePeriod);
+    return process.WaitForExit();
+}
+
+/**
+ * @return The contents of a file in procfs, these can't be sized with stat so they're read until EOF.
+ */
+static std::string ReadProcFile(const std::string &path) {
+    UniqueFd fd{open(path.c_str(), O_RDONLY | O_CLOEXEC), "wine_ctx"};
+    if (fd.Get() == -1)
+        return {};
+    std::string contents;
+    std::array<char, 4096> buffer;
+    ssize_t size;
+    while ((size = read(fd.Get(), buffer.data(), buffer.size())) > 0)
+        contents.append(buffer.data(), static_cast<size_t>(size));
+    return contents;
+}
+
+/**
+ * @return If the process exists and hasn't exited, zombies are considered to have exited as they'll be reaped by their parent.
+ */
+static bool IsProcessAlive(pid_t pid) {
+    auto stat{ReadProcFile(fmt::format("/proc/{}/stat", pid))};
+    auto commEnd{stat.rfind(')')};
+    if (commEnd == std::string::npos || commEnd + 2 >= stat.size())
+        return false;
+    char state{stat[commEnd + 2]};
+    return state != 'Z' && state != 'X';
+}
+
+/**
+ * @return If the process is one of Wine's system processes, Wine sets the command line of every process to its Windows path.
+ */
+static bool IsSystemProcess(pid_t pid) {
+    auto cmdline{ReadProcFile(fmt::format("/proc/{}/cmdline", pid))};
+    std::string_view argv0{cmdline.c_str()};
+    auto separator{argv0.find_last_of("\\/")};
+    if (separator != std::string_view::npos)
+        argv0.remove_prefix(separator + 1);
+    return std::any_of(SystemProcessNames.begin(), SystemProcessNames.end(), [&](std::string_view name) {
+        return std::equal(argv0.begin(), argv0.end(), name.begin(), name.end(), [](char a, char b) { return std::tolower(static_cast<unsigned char>(a)) == b; });
+    });
+}
+
+/**
+ * @return All processes running in the prefix, these are found by their environment as Wine processes are reparented away from the launcher when their parent exits.
+ * @param prefixEnvVar The WINEPREFIX environment variable of the prefix.
+ */
+static std::vector<pid_t> FindPrefixProcesses(std::string_view prefixEnvVar, std::initializer_list<pid_t> excludedPids, bool includeSystem) {
+    std::vector<pid_t> pids;
+    UniqueDir procDir{opendir("/proc")};
+    if (!procDir)
+        return pids;
+    while (dirent *entry{readdir(procDir.get())}) {
+        if (!std::isdigit(static_cast<unsigned char>(entry->d_name[0])))
+            continue;
+        pid_t pid{static_cast<pid_t>(std::strtol(entry->d_name, nullptr, 10))};
+        if (pid == getpid() || std::find(excludedPids.begin(), excludedPids.end(), pid) != excludedPids.end())
+            continue;
+
+        auto environment{ReadProcFile(fmt::format("/proc/{}/environ", pid))};
+        bool inPrefix{false};
+        for (size_t offset{}; offset < environment.size();) {
+            auto end{environment.find('\0', offset)};
+            if (end == std::string::npos)
+                end = environment.size();
+            if (std::string_view{environment}.substr(offset, end - offset) == prefixEnvVar) {
+                inPrefix = true;
+                break;
+            }
+            offset = end + 1;
+        }
+        if (inPrefix && (includeSystem || !IsSystemProcess(pid)) && IsProcessAlive(pid))
+            pids.push_back(pid);
+    }
+    return pids;
+}
+
+/**
+ * @brief Terminates all supplied processes at once, rather than waiting on each of them in turn.
+ * @details Every process is sent SIGTERM, any that are still alive after the grace period are sent SIGKILL.
+ * @return The amount of processes that had to be killed.
+ */
+static size_t TerminateProcesses(std::vector<pid_t> pids, std::chrono::steady_clock::duration gracePeriod) {
+    for (pid_t pid: pids)
+        kill(pid, SIGTERM);
+    auto deadline{std::chrono::steady_clock::now() + gracePeriod};
+    while (true) {
+        std::erase_if(pids, [](pid_t pid) { return !IsProcessAlive(pid); });
+        if (pids.empty() || std::chrono::steady_clock::now() >= deadline)
+            break;
+        std::this_thread::sleep_for(ExitPollInterval);
+    }
+    for (pid_t pid: pids)
+        kill(pid, SIGKILL);
+    return pids.size();
+}
+
+/**
+ * @brief Waits for wineserver to create its socket, Wine processes started before then would try to start a wineserver of their own.
+ * @details wineserver changes its working directory into its server directory before binding the socket there, so the socket is found through the working directory of the process rather than by deriving the server directory like Wine does (which depends on the temporary directory Wine was built with).
+ * @return If the socket was created before the timeout.
+ */
+static bool WaitForWineserver(Process &serverProcess, std::chrono::steady_clock::duration timeout) {
+    constexpr std::chrono::milliseconds PollInterval{5};
+    auto socketPath{fmt::format("/proc/{}/cwd/socket", serverProcess.pid)};
+    auto deadline{std::chrono::steady_clock::now() + timeout};
+    while (std::chrono::steady_clock::now() < deadline) {
+        struct stat info{};
+        if (stat(socketPath.c_str(), &info) == 0 && S_ISSOCK(info.st_mode))
+            return true;
+        if (!serverProcess.IsRunning())
+            throw Exception{"wineserver exited before creating its socket"};
+        std::this_thread::sleep_for(PollInterval);
     }
-    return "";
+    return false;
 }
 
-WineContext::WineContext(std::filesystem::path pRuntimePath, std::filesystem::path pPrefixPath, std::filesystem::path cassiaExtPath)
-        : runtimePath{std::move(pRuntimePath)}, prefixPath{std::move(pPrefixPath)},
+WineContext::WineContext(std::filesystem::path pRuntimePath, std::filesystem::path pPrefixPath, std::filesystem::path pCassiaExtPath, bool forceInit)
+        : runtimePath{std::move(pRuntimePath)}, prefixPath{std::move(pPrefixPath)}, cassiaExtPath{std::move(pCassiaExtPath)},
           envVars{
                   "WINEPREFIX=" + (prefixPath / "pfx").string(),
                   "HOME=" + (prefixPath / "home").string(),
                   "LD_LIBRARY_PATH=" + (runtimePath / "lib").string() + ":" + (cassiaExtPath / "lib").string(),
                   "PATH=" + (runtimePath / "bin").string(),
                   "WINELOADER=" + (runtimePath / "bin/wine").string(),
-                  "DISPLAY=/data/data/cassia.app/cache/tmp/.X11-unix/X0",
+                  "DISPLAY=" + std::string{X11Display},
 //                  "ALSA_CONFIG_PATH=" + (prefixPath / "home/.asoundrc").string(),
                   "ALSA_CONFIG_DIR=" + (runtimePath / "share/alsa/").string(),
                   "ALSA_PLUGIN_DIR=" + (runtimePath / "lib/alsa-lib/").string(),
@@ -36,19 +270,231 @@ WineContext::WineContext(std::filesystem::path pRuntimePath, std::filesystem::pa
                   "DXVK_HUD=full",
                   GetWineDebug()
           },
-          serverProcess{runtimePath / "bin/wineserver", {"--foreground", "--persistent"}, envVars, Logger::GetPipe("wineserver")} {
-    Launch("wineboot.exe", {"--init"}, {}, Logger::GetPipe("wineboot")).WaitForExit();
-    Launch("explorer.exe", {"/desktop=shell,1280x720", "winecfg"}, {}, Logger::GetPipe("explorer")).Detach();
+          shaderCache{GetShaderCacheRoot(), GetShaderCacheQuota()},
+          resourceSampler{ResourceSampleInterval, ResourceSampleCapacity} {
+    TraceScope trace{"wine.start"};
+    auto start{std::chrono::steady_clock::now()}, phaseStart{start};
+    auto endPhase{[&](std::chrono::nanoseconds &phase, const char *traceName) {
+        auto now{std::chrono::steady_clock::now()};
+        phase = now - phaseStart;
+        if (Tracer::IsEnabled()) // steady_clock is CLOCK_MONOTONIC, which is the clock of trace events.
+            Tracer::Record(TraceEvent{.name = traceName, .timestamp = std::chrono::nanoseconds{phaseStart.time_since_epoch()}.count(), .duration = phase.count(), .phase = 'X'});
+        phaseStart = now;
+    }};
+
+    // The sync mode is selected before anything is launched, as wineserver and every client have to agree on it.
+    syncMode = SelectWineSyncMode(GetWineSyncSupport(), GetSystemProperty("cassia.wine.sync"));
+    auto syncEnvVars{GetWineSyncEnvVars(syncMode)};
+    envVars.insert(envVars.end(), syncEnvVars.begin(), syncEnvVars.end());
+
+    // Every Wine process inherits the runtime-wide shader cache session, games are usually started from the desktop rather than launched by path.
+    try {
+        runtimeShaderCacheSession = shaderCache.BeginRuntimeSession(GetRuntimeName(runtimePath));
+        envVars.push_back("DXVK_STATE_CACHE_PATH=" + runtimeShaderCacheSession->path.string());
+        envVars.push_back("VKD3D_SHADER_CACHE_PATH=" + runtimeShaderCacheSession->applicationPath.string());
+    } catch (const std::exception &e) {
+        fmt::println(stderr, "Failed to create the runtime shader cache session, caches will be in the working directory of applications: {}", e.what());
+    }
+
+    Logger::SetShardCount(WineLogShardCount);
+    logRing = std::make_shared<LogRing>(prefixPath / LogRingFileName, PersistentLogRingCapacity);
+
+    serverProcess = Process{runtimePath / "bin/wineserver", {"--foreground", "--persistent"}, envVars, GetLogPipe("wineserver", VerboseLogOptions), GetWineserverLaunchOptions()};
+    // Members are destroyed without the destructor running if the constructor throws, wineserver has to be stopped here as ~Process aborts on a running process.
+    try {
+        resourceSampler.AddRoot(serverProcess.pid);
+        // The limit is raised when wineserver is launched, this only verifies it as wineserver holds an fd for every esync object of every process.
+        if (auto fdLimit{ReadProcessFdLimit(serverProcess.pid)}; syncMode == WineSyncMode::Esync && fdLimit < EsyncMinimumFdLimit)
+            fmt::println(stderr, "wineserver can only open {} fds, esync needs at least {} so it may run out of fds", fdLimit, EsyncMinimumFdLimit);
+        if (!WaitForWineserver(serverProcess, WineserverStartTimeout))
+            fmt::println(stderr, "wineserver didn't create its socket within {}s, continuing regardless", WineserverStartTimeout.count());
+        endPhase(startupTimings.wineserver, "wine.start.wineserver");
+
+        try {
+            launcher = std::make_unique<Launcher>(Launcher::GetBundledPath(), envVars, std::vector<std::filesystem::path>{runtimePath / "bin", runtimePath / "lib"}, GetHelperLaunchOptions());
+            resourceSampler.AddRoot(launcher->GetPid());
+        } catch (const std::exception &e) {
+            fmt::println(stderr, "Failed to start the launcher, falling back to spawning directly: {}", e.what());
+        }
+        endPhase(startupTimings.launcher, "wine.start.launcher");
+
+        auto fingerprint{ComputePrefixFingerprint(runtimePath, prefixPath, envVars)};
+        startupTimings.winebootSkipped = !forceInit && ReadPrefixFingerprint(prefixPath) == fingerprint;
+        endPhase(startupTimings.fingerprint, "wine.start.fingerprint");
+
+        if (!startupTimings.winebootSkipped) {
+            ClearPrefixFingerprint(prefixPath);
+            // This isn't launched as a helper, initializing the prefix is what a cold start spends most of its time on.
+            int exitCode{WaitOrTerminate(Launch("wineboot.exe", {"--init"}, {}, GetLogPipe("wineboot", WineLogOptions)), WinebootTimeout)};
+            if (exitCode == 0) {
+                try {
+                    WritePrefixFingerprint(prefixPath, ComputePrefixFingerprint(runtimePath, prefixPath, envVars)); // The prefix layout has changed by initializing it.
+                } catch (const std::exception &e) {
+                    fmt::println(stderr, "Failed to record the prefix fingerprint: {}", e.what());
+                }
+            } else
+                fmt::println(stderr, "wineboot --init failed with exit code {}, the prefix will be initialized again on the next start", exitCode);
+        }
+        endPhase(startupTimings.wineboot, "wine.start.wineboot");
+
+        LaunchDesktop();
+        endPhase(startupTimings.explorer, "wine.start.explorer");
+    } catch (...) {
+        KillServer();
+        launcher.reset();
+        throw;
+    }
+
+    startupTimings.total = std::chrono::steady_clock::now() - start;
+    startupTimings.coldTotal = startupTimings.total;
+    auto toMs{[](std::chrono::nanoseconds duration) { return std::chrono::duration<double, std::milli>{duration}.count(); }};
+    fmt::println(stderr, "Started prefix with {} sync in {:.1f}ms (wineserver: {:.1f}ms, launcher: {:.1f}ms, fingerprint: {:.1f}ms, wineboot: {}, explorer: {:.1f}ms)",
+                 GetWineSyncModeName(syncMode), toMs(startupTimings.total), toMs(startupTimings.wineserver), toMs(startupTimings.launcher), toMs(startupTimings.fingerprint),
+                 startupTimings.winebootSkipped ? "skipped" : fmt::format("{:.1f}ms", toMs(startupTimings.wineboot)), toMs(startupTimings.explorer));
 }
 
-Process WineContext::Launch(std::string exe, std::vector<std::string> args, std::vector<std::string> pEnvVars, std::optional<LogPipe> logPipe) {
-    pEnvVars.insert(pEnvVars.end(), envVars.begin(), envVars.end());
+void WineContext::KillServer() {
+    // wineserver kills all of its remaining clients (the system processes) before exiting.
+    TraceScope trace{"wine.shutdown.wineserver"};
+    try {
+        WaitOrTerminate(Process{runtimePath / "bin/wineserver", {"--kill"}, envVars, GetLogPipe("wineserver"), GetHelperLaunchOptions()}, WineserverExitTimeout);
+    } catch (const std::exception &e) {
+        fmt::println(stderr, "Failed to run wineserver --kill, wineserver will be terminated instead: {}", e.what());
+    }
+    WaitOrTerminate(std::move(serverProcess), WineserverExitTimeout);
+}
+
+LogPipe WineContext::GetLogPipe(const std::string &name, LogChannelOptions options) {
+    return Logger::GetPipe(name, options, logRing);
+}
+
+void WineContext::LaunchDesktop() {
+    Launch("explorer.exe", {"/desktop=shell,1280x720", "winecfg"}, {}, GetLogPipe("explorer", VerboseLogOptions)).Detach();
+}
+
+void WineContext::EndSession(bool includeSystem) {
+    TraceScope trace{"wine.end_session"};
+    auto start{std::chrono::steady_clock::now()};
+    {
+        TraceScope winebootTrace{"wine.end_session.wineboot"};
+        WaitOrTerminate(Launch("wineboot.exe", {"--end-session", "--shutdown"}, {}, GetLogPipe("wineboot", WineLogOptions), GetHelperLaunchOptions()), SessionEndTimeout);
+    }
+
+    auto prefixEnvVar{"WINEPREFIX=" + (prefixPath / "pfx").string()};
+    auto pids{FindPrefixProcesses(prefixEnvVar, {serverProcess.pid, launcher ? launcher->GetPid() : -1}, includeSystem)};
+    size_t remaining{pids.size()};
+    TraceCounter("wine.remaining_processes", static_cast<int64_t>(remaining));
+    size_t killed;
+    {
+        TraceScope terminateTrace{"wine.end_session.terminate"};
+        killed = TerminateProcesses(std::move(pids), TerminateGracePeriod);
+    }
+    fmt::println(stderr, "Ended the session in {:.1f}ms ({} processes terminated, {} killed)",
+                 std::chrono::duration<double, std::milli>{std::chrono::steady_clock::now() - start}.count(), remaining, killed);
+
+    // Every process of the session is gone by now, so nothing is writing to the caches of the sessions anymore.
+    TraceScope shaderCacheTrace{"wine.end_session.shader_cache"};
+    for (auto &session: shaderCacheSessions) {
+        auto applicationPath{session.applicationPath};
+        try {
+            auto stats{shaderCache.EndSession(std::move(session))};
+            fmt::println(stderr, "Merged {} shader caches into '{}' in {:.1f}ms ({} entries, {} bytes, {} bytes evicted)", stats.caches, applicationPath.string(),
+                         std::chrono::duration<double, std::milli>{stats.duration}.count(), stats.entries, stats.bytes, stats.evictedBytes);
+        } catch (const std::exception &e) {
+            fmt::println(stderr, "Failed to merge the shader caches of '{}', they'll be recovered by its next launch: {}", applicationPath.string(), e.what());
+        }
+    }
+    shaderCacheSessions.clear();
+}
+
+bool WineContext::CanResume(const std::filesystem::path &pRuntimePath, const std::filesystem::path &pPrefixPath, const std::filesystem::path &pCassiaExtPath) {
+    return suspended && runtimePath == pRuntimePath && prefixPath == pPrefixPath && cassiaExtPath == pCassiaExtPath && serverProcess.IsRunning();
+}
+
+void WineContext::Suspend() {
+    if (suspended)
+        return;
+    TraceScope trace{"wine.suspend"};
+    EndSession(false);
+
+    // The runtime-wide session is kept as the launcher still points at it, its caches are merged again when the context ends.
+    if (runtimeShaderCacheSession) {
+        try {
+            auto stats{shaderCache.MergeSession(*runtimeShaderCacheSession)};
+            fmt::println(stderr, "Merged {} shader caches of the runtime session in {:.1f}ms ({} entries, {} bytes)", stats.caches,
+                         std::chrono::duration<double, std::milli>{stats.duration}.count(), stats.entries, stats.bytes);
+        } catch (const std::exception &e) {
+            fmt::println(stderr, "Failed to merge the shader caches of the runtime session, they'll be recovered once it ends: {}", e.what());
+        }
+    }
+    suspended = true;
+}
+
+void WineContext::Resume() {
+    TraceScope trace{"wine.resume"};
+    auto start{std::chrono::steady_clock::now()};
+    LaunchDesktop();
+    suspended = false;
+
+    auto explorer{std::chrono::steady_clock::now() - start};
+    startupTimings = WineStartupTimings{
+        .explorer = explorer,
+        .total = explorer,
+        .coldTotal = startupTimings.coldTotal,
+        .winebootSkipped = true,
+        .warm = true,
+    };
+    auto toMs{[](std::chrono::nanoseconds duration) { return std::chrono::duration<double, std::milli>{duration}.count(); }};
+    fmt::println(stderr, "Resumed prefix in {:.1f}ms, {:.1f}ms faster than its cold start", toMs(startupTimings.total), toMs(startupTimings.coldTotal - startupTimings.total));
+}
+
+Process WineContext::Launch(std::string exe, std::vector<std::string> args, std::vector<std::string> pEnvVars, std::optional<LogPipe> logPipe, std::optional<LaunchOptions> options) {
+    if (exe.find_first_of("/\\") != std::string::npos) {
+        try {
+            auto session{shaderCache.BeginSession(GetRuntimeName(runtimePath), exe)};
+            pEnvVars.push_back("DXVK_STATE_CACHE_PATH=" + session.path.string());
+            pEnvVars.push_back("VKD3D_SHADER_CACHE_PATH=" + session.applicationPath.string());
+            shaderCacheSessions.push_back(std::move(session));
+        } catch (const std::exception &e) {
+            fmt::println(stderr, "Failed to create a shader cache session for '{}', its caches will be in its working directory: {}", exe, e.what());
+        }
+    }
+
     args.insert(args.begin(), exe);
-    return Process{runtimePath / "bin/wine", args, pEnvVars, logPipe};
+    if (!options)
+        options = GetApplicationLaunchOptions();
+    if (launcher) {
+        Process process{*launcher, runtimePath / "bin/wine", args, pEnvVars, logPipe, *options}; // The launcher already has our environment variables.
+        resourceSampler.AddRoot(process.pid); // This is redundant while the launcher is alive, but keeps the process sampled if the launcher exits first.
+        return process;
+    }
+
+    pEnvVars.insert(pEnvVars.end(), envVars.begin(), envVars.end());
+    Process process{runtimePath / "bin/wine", args, pEnvVars, logPipe, *options};
+    resourceSampler.AddRoot(process.pid);
+    return process;
 }
 
 WineContext::~WineContext() {
-    Launch("wineboot.exe", {"--end-session", "--shutdown"}, {}, Logger::GetPipe("wineboot")).WaitForExit();
-    Process{runtimePath / "bin/wineserver", {"--kill"}, envVars, Logger::GetPipe("wineserver")}.WaitForExit();
+    TraceScope trace{"wine.shutdown"};
+    if (!suspended) {
+        // Ending the session launches wineboot, which can fail if the launcher died, throwing here would terminate the process.
+        try {
+            EndSession(false);
+        } catch (const std::exception &e) {
+            fmt::println(stderr, "Failed to end the session, wineserver will be killed regardless: {}", e.what());
+        }
+    }
+    KillServer();
+
+    if (runtimeShaderCacheSession) {
+        try {
+            auto stats{shaderCache.EndSession(std::move(*runtimeShaderCacheSession))};
+            fmt::println(stderr, "Merged {} shader caches of the runtime session in {:.1f}ms ({} entries, {} bytes, {} bytes evicted)", stats.caches,
+                         std::chrono::duration<double, std::milli>{stats.duration}.count(), stats.entries, stats.bytes, stats.evictedBytes);
+        } catch (const std::exception &e) {
+            fmt::println(stderr, "Failed to end the runtime shader cache session, it'll be recovered by the next context of the runtime: {}", e.what());
+        }
+    }
 }
 }
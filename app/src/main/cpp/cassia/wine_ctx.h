@@ -1,9 +1,53 @@
 // Copyright © 2023 Cassia Developers, all rights reserved.
 #pragma once
 
+#include "launcher.h"
 #include "process.h"
+#include "resource_sampler.h"
+#include "shader_cache.h"
+#include "wine_sync.h"
 
 namespace cassia {
+/**
+ * @brief The name of the persistent log ring inside the prefix directory, the ring of the previous session has a ".1" suffix.
+ */
+constexpr std::string_view LogRingFileName{"cassia.logring"};
+
+/**
+ * @brief The X display that Wine is connected to, this is the socket of the app's X server rather than a display number as there's no /tmp on Android.
+ */
+constexpr std::string_view X11Display{"/data/data/cassia.app/cache/tmp/.X11-unix/X0"};
+
+/**
+ * @brief The time taken by each phase of starting a WineContext.
+ */
+struct WineStartupTimings {
+    std::chrono::nanoseconds wineserver; //!< Spawning wineserver and waiting for it to listen on its socket.
+    std::chrono::nanoseconds launcher;
+    std::chrono::nanoseconds fingerprint; //!< Computing and comparing the prefix fingerprint.
+    std::chrono::nanoseconds wineboot; //!< Initializing the prefix with wineboot, this is 0 if it was skipped.
+    std::chrono::nanoseconds explorer; //!< Spawning the desktop, this doesn't wait for it to be ready.
+    std::chrono::nanoseconds total;
+    std::chrono::nanoseconds coldTotal; //!< The total time of the cold start of the context, this is the same as total for cold starts.
+    bool winebootSkipped; //!< If the prefix fingerprint matched, so the prefix didn't need to be initialized.
+    bool warm; //!< If a suspended context was resumed, in which case only the desktop was launched.
+};
+
+/**
+ * @return The launch options of wineserver, which is on a big core at an elevated priority as every Wine process blocks on its requests.
+ */
+LaunchOptions GetWineserverLaunchOptions();
+
+/**
+ * @return The launch options of helpers that aren't on the critical path of anything interactive (the launcher and session shutdown), these are kept on the little cores.
+ */
+LaunchOptions GetHelperLaunchOptions();
+
+/**
+ * @return The default launch options of Wine executables, these can run on any core as they include games.
+ */
+LaunchOptions GetApplicationLaunchOptions();
+
 /**
  * @brief A class consolidating all Wine-related processes/state for a specific prefix with convenience wrappers.
  */
@@ -11,24 +55,91 @@ class WineContext {
   private:
     std::filesystem::path runtimePath;
     std::filesystem::path prefixPath;
+    std::filesystem::path cassiaExtPath;
     std::vector<std::string> envVars;
+    ShaderCacheManager shaderCache;
+    std::shared_ptr<LogRing> logRing; //!< The persistent log ring of the prefix, only the channels of this context are written to it so contexts running side by side keep their logs apart.
+    ResourceSampler resourceSampler; //!< Samples the resource usage of every Wine process, this is declared first so it outlives all of them.
     Process serverProcess;
+    std::unique_ptr<Launcher> launcher; //!< The launcher that all Wine executables are spawned through, this is null if it failed to start.
+    std::optional<ShaderCacheSession> runtimeShaderCacheSession; //!< The shader cache session of every process that doesn't have one of its own, this lives as long as the context as the launcher inherits it.
+    std::vector<ShaderCacheSession> shaderCacheSessions; //!< The shader cache sessions of every application launched by path in the current session, these are merged back once it ends.
+    WineStartupTimings startupTimings{};
+    WineSyncMode syncMode{};
+    bool suspended{}; //!< If the session has ended while wineserver is being kept alive for a warm start.
+
+    /**
+     * @return Log pipes for a process of this context, which are written to the persistent log ring of the prefix alongside logcat.
+     */
+    LogPipe GetLogPipe(const std::string &name, LogChannelOptions options = {});
+
+    void LaunchDesktop();
+
+    /**
+     * @brief Kills wineserver along with all of its remaining clients and waits for it to exit, terminating it if it doesn't exit in time.
+     * @note This doesn't throw, so it can be used to clean up after a failed start.
+     */
+    void KillServer();
+
+    /**
+     * @brief Ends the session of the prefix, windows are asked to close and any remaining processes are terminated in parallel.
+     * @param includeSystem If Wine's system processes (services, devices, etc) should be terminated alongside user processes, wineserver and the launcher are never terminated.
+     */
+    void EndSession(bool includeSystem);
 
   public:
     /**
-     * @details This will start the wineserver process and initialize the Wine prefix with wineboot.
+     * @details This will start the wineserver process and initialize the Wine prefix with wineboot, unless the prefix was already initialized in the same configuration.
+     * The synchronization mode is selected from what the kernel supports, it can be overridden with the cassia.wine.sync system property ("server", "esync", "fsync" or "auto").
+     * @param forceInit If the prefix should be initialized even if its fingerprint matches.
+     */
+    WineContext(std::filesystem::path runtimePath, std::filesystem::path prefixPath, std::filesystem::path cassiaExtPath, bool forceInit = false);
+
+    /**
+     * @return If this context can be resumed in place of creating a new context with the same arguments.
+     */
+    bool CanResume(const std::filesystem::path &runtimePath, const std::filesystem::path &prefixPath, const std::filesystem::path &cassiaExtPath);
+
+    /**
+     * @brief Ends all user processes while keeping wineserver, its loaded state (registry, system processes) and the launcher alive, so the context can be resumed without booting the prefix again.
+     */
+    void Suspend();
+
+    /**
+     * @brief Starts a new session in a suspended context, this only launches the desktop as the prefix is still running.
      */
-    WineContext(std::filesystem::path runtimePath, std::filesystem::path prefixPath, std::filesystem::path cassiaExtPath);
+    void Resume();
+
+    bool IsSuspended() const {
+        return suspended;
+    }
 
     /**
-     * @brief Launches a Windows executable in the Wine environment.
+     * @brief Launches a Windows executable in the Wine environment, this goes through the launcher when it's available.
+     * @details Executables that are launched by path (rather than from Wine's PATH) get a shader cache session of their application, which the caches of DXVK and VKD3D-Proton are redirected to. Anything else (including processes started from the desktop) uses the runtime-wide session of the context.
      * @param exe The path to the executable to launch, this doesn't need to be an absolute path for executables in Wine's PATH (eg. cmd.exe, wineboot.exe, etc).
      * @param logPipe Same as Process::Process.
+     * @param options The scheduling and resource limits of the process, this is GetApplicationLaunchOptions() if unset.
      */
-    Process Launch(std::string exe, std::vector<std::string> args = {}, std::vector<std::string> envVars = {}, std::optional<LogPipe> logPipe = std::nullopt);
+    Process Launch(std::string exe, std::vector<std::string> args = {}, std::vector<std::string> envVars = {}, std::optional<LogPipe> logPipe = std::nullopt, std::optional<LaunchOptions> options = std::nullopt);
+
+    /**
+     * @brief The sampler for wineserver, the launcher and every process launched in this context, including all of their descendants.
+     */
+    ResourceSampler &GetResourceSampler() {
+        return resourceSampler;
+    }
+
+    const WineStartupTimings &GetStartupTimings() const {
+        return startupTimings;
+    }
+
+    WineSyncMode GetSyncMode() const {
+        return syncMode;
+    }
 
     /**
-     * @details This will attempt to shutdown the Wine prefix with wineboot and use wineserver to kill all other wine processes.
+     * @details This will end the session if it's still running and use wineserver to kill all other wine processes, every step has a deadline so this is bounded.
      */
     ~WineContext();
 };
@@ -0,0 +1,150 @@
+// Copyright © 2023 Cassia Developers, all rights reserved.
+
+#include "wine_debug.h"
+#include "platform.h"
+#include <algorithm>
+#include <array>
+
+namespace cassia {
+namespace {
+enum CharacterClass : uint8_t {
+    Hex = 1 << 0, //!< Valid in pid/tid fields.
+    Timestamp = 1 << 1, //!< Valid in the timestamp field.
+    Identifier = 1 << 2, //!< Valid in channel names.
+};
+
+/**
+ * @brief A lookup table from characters to their CharacterClass flags, this keeps the prefix scan to a single load and test per character.
+ */
+constexpr std::array<uint8_t, 256> CharacterTable{[] {
+    std::array<uint8_t, 256> table{};
+    for (int c{'0'}; c <= '9'; c++)
+        table[c] |= Hex | Timestamp | Identifier;
+    for (int c{'a'}; c <= 'f'; c++)
+        table[c] |= Hex;
+    for (int c{'A'}; c <= 'F'; c++)
+        table[c] |= Hex;
+    for (int c{'a'}; c <= 'z'; c++)
+        table[c] |= Identifier;
+    for (int c{'A'}; c <= 'Z'; c++)
+        table[c] |= Identifier;
+    table['_'] |= Identifier;
+    table['.'] |= Timestamp;
+    table[' '] |= Timestamp; // Timestamps are padded to a width of 3 with spaces.
+    return table;
+}()};
+
+/**
+ * @return The length of the run of characters of the supplied class at the start of the string.
+ */
+size_t SpanOf(std::string_view string, uint8_t characterClass) {
+    size_t length{};
+    while (length < string.size() && (CharacterTable[static_cast<uint8_t>(string[length])] & characterClass))
+        length++;
+    return length;
+}
+
+/**
+ * @note These are ordered by the same index as the WineDebugClass enum.
+ */
+constexpr std::array<std::string_view, 4> ClassNames{"fixme", "err", "warn", "trace"};
+}
+
+std::optional<WineDebugLine> ParseWineDebugLine(std::string_view line) {
+    // The thread prefix has up to three colon-terminated fields: an optional timestamp, an optional pid and the tid.
+    size_t offset{};
+    size_t fields{};
+    while (fields < 3) {
+        size_t length{SpanOf(line.substr(offset), fields == 0 ? (Hex | Timestamp) : Hex)};
+        if (length == 0 || offset + length >= line.size() || line[offset + length] != ':')
+            break;
+        offset += length + 1;
+        fields++;
+    }
+    if (fields == 0)
+        return std::nullopt;
+
+    std::string_view body{line.substr(offset)};
+    if (body.empty())
+        return std::nullopt;
+
+    // The first character is enough to tell the classes apart, so the class name is only compared against a single candidate.
+    size_t classIndex;
+    switch (body[0]) {
+        case 'f':
+            classIndex = 0;
+            break;
+        case 'e':
+            classIndex = 1;
+            break;
+        case 'w':
+            classIndex = 2;
+            break;
+        case 't':
+            classIndex = 3;
+            break;
+        default:
+            return std::nullopt;
+    }
+
+    std::string_view className{ClassNames[classIndex]};
+    if (body.size() <= className.size() || !body.starts_with(className) || body[className.size()] != ':')
+        return std::nullopt;
+
+    std::string_view rest{body.substr(className.size() + 1)};
+    size_t channelLength{SpanOf(rest, Identifier)};
+    if (channelLength == 0 || channelLength >= rest.size() || rest[channelLength] != ':')
+        return std::nullopt;
+    std::string_view channel{rest.substr(0, channelLength)};
+
+    rest = rest.substr(channelLength + 1);
+    size_t functionLength{rest.find(' ')};
+    if (functionLength == std::string_view::npos)
+        functionLength = rest.size();
+    if (functionLength == 0)
+        return std::nullopt;
+
+    return WineDebugLine{
+        .threadPrefix = line.substr(0, offset),
+        .body = body,
+        .debugClass = static_cast<WineDebugClass>(classIndex),
+        .channel = channel,
+        .function = rest.substr(0, functionLength),
+        .message = rest.substr(std::min(functionLength + 1, rest.size())),
+    };
+}
+
+int GetWineDebugPriority(WineDebugClass debugClass) {
+    switch (debugClass) {
+        case WineDebugClass::Err:
+            return LogPriorityError;
+        case WineDebugClass::Warn:
+            return LogPriorityWarn;
+        case WineDebugClass::Fixme:
+            return LogPriorityDebug; // These are emitted for any unimplemented functionality and are rarely actionable.
+        case WineDebugClass::Trace:
+            return LogPriorityVerbose;
+    }
+    return LogPriorityInfo;
+}
+
+void WineDebugCounters::Increment(const WineDebugLine &line) {
+    std::string_view key{line.body.data(), static_cast<size_t>((line.function.data() + line.function.size()) - line.body.data())};
+    std::scoped_lock lock{mutex};
+    auto it{counts.find(key)};
+    if (it != counts.end())
+        it->second++;
+    else
+        counts.emplace(std::string{key}, 1);
+}
+
+std::vector<std::pair<std::string, uint64_t>> WineDebugCounters::Snapshot() {
+    std::vector<std::pair<std::string, uint64_t>> snapshot;
+    {
+        std::scoped_lock lock{mutex};
+        snapshot.assign(counts.begin(), counts.end());
+    }
+    std::sort(snapshot.begin(), snapshot.end(), [](const auto &a, const auto &b) { return a.second > b.second; });
+    return snapshot;
+}
+}
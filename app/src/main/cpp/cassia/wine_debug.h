@@ -0,0 +1,151 @@
+// Copyright © 2023 Cassia Developers, all rights reserved.
+#pragma once
+
+#include <chrono>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include <fmt/format.h>
+
+namespace cassia {
+/**
+ * @brief The class of a Wine debug message, as specified in WINEDEBUG.
+ */
+enum class WineDebugClass : uint8_t {
+    Fixme,
+    Err,
+    Warn,
+    Trace,
+};
+
+/**
+ * @brief A Wine debug line split into its components, all views point into the original line.
+ * @details Wine prefixes debug output with "[timestamp:][pid:]tid:class:channel:function ", see __wine_dbg_header in ntdll.
+ */
+struct WineDebugLine {
+    std::string_view threadPrefix; //!< The timestamp, pid and tid fields including the trailing colon, these differ between otherwise identical messages.
+    std::string_view body; //!< Everything after the thread prefix, this is what repeats are compared by.
+    WineDebugClass debugClass;
+    std::string_view channel;
+    std::string_view function;
+    std::string_view message;
+};
+
+/**
+ * @return The components of the supplied line if it has a Wine debug prefix, this doesn't allocate.
+ */
+std::optional<WineDebugLine> ParseWineDebugLine(std::string_view line);
+
+/**
+ * @return The Android log priority corresponding to a Wine debug class.
+ */
+int GetWineDebugPriority(WineDebugClass debugClass);
+
+/**
+ * @brief Collapses consecutive identical Wine debug messages of a stream into a single "repeated N times" line per time window.
+ * @note Messages are compared without their thread prefix, so the same message from different threads is considered a repeat.
+ */
+class WineDebugCollapser {
+  private:
+    std::string lastBody; //!< The body of the last message that was emitted, the capacity of this is reused.
+    int lastPriority{};
+    uint64_t repeats{}; //!< The amount of suppressed repeats of the last message in the current window.
+    std::chrono::steady_clock::time_point windowStart;
+    std::chrono::steady_clock::duration window;
+
+    template<typename Emit>
+    void EmitRepeats(Emit &&emit) {
+        if (repeats) {
+            auto summary{fmt::format("[previous message repeated {} times]", repeats)};
+            emit(lastPriority, std::string_view{summary});
+            repeats = 0;
+        }
+    }
+
+  public:
+    explicit WineDebugCollapser(std::chrono::steady_clock::duration window) : window{window} {}
+
+    /**
+     * @brief Emits the supplied line unless it's a repeat of the last one within the window.
+     * @param emit A function taking the Android log priority and the line to emit.
+     */
+    template<typename Emit>
+    void Process(std::string_view line, const WineDebugLine &parsed, std::chrono::steady_clock::time_point now, Emit &&emit) {
+        int priority{GetWineDebugPriority(parsed.debugClass)};
+        if (parsed.body == lastBody && priority == lastPriority) {
+            if (now - windowStart >= window) {
+                repeats++;
+                EmitRepeats(emit);
+                windowStart = now;
+            } else {
+                repeats++;
+            }
+            return;
+        }
+
+        EmitRepeats(emit);
+        lastBody.assign(parsed.body);
+        lastPriority = priority;
+        windowStart = now;
+        emit(priority, line);
+    }
+
+    /**
+     * @brief Breaks any run of repeats, this should be used when a line without a Wine debug prefix is emitted.
+     */
+    template<typename Emit>
+    void Reset(Emit &&emit) {
+        EmitRepeats(emit);
+        lastBody.clear();
+    }
+
+    /**
+     * @brief Emits the repeat count if the window has expired without the run of repeats being broken.
+     * @return If there are still repeats pending after this.
+     */
+    template<typename Emit>
+    bool FlushExpired(std::chrono::steady_clock::time_point now, Emit &&emit) {
+        if (repeats && now - windowStart >= window) {
+            EmitRepeats(emit);
+            windowStart = now;
+        }
+        return repeats != 0;
+    }
+
+    bool HasPendingRepeats() const {
+        return repeats != 0;
+    }
+};
+
+/**
+ * @brief Counts Wine debug messages by their class, channel and function.
+ * @note This is thread-safe, the lock is only contended while taking a snapshot.
+ */
+class WineDebugCounters {
+  private:
+    /**
+     * @brief Allows lookups by std::string_view without constructing a std::string.
+     */
+    struct KeyHash {
+        using is_transparent = void;
+
+        size_t operator()(std::string_view key) const {
+            return std::hash<std::string_view>{}(key);
+        }
+    };
+
+    std::mutex mutex;
+    std::unordered_map<std::string, uint64_t, KeyHash, std::equal_to<>> counts; //!< Keyed by "class:channel:function".
+
+  public:
+    void Increment(const WineDebugLine &line);
+
+    /**
+     * @return The counts of every class, channel and function combination sorted by count in descending order.
+     */
+    std::vector<std::pair<std::string, uint64_t>> Snapshot();
+};
+}
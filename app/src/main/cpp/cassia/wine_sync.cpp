@@ -0,0 +1,145 @@
+// Copyright © 2023 Cassia Developers, all rights reserved.
+
+#include "wine_sync.h"
+#include "util/error.h"
+#include <csignal>
+#include <fstream>
+#include <limits>
+#include <optional>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+namespace cassia {
+/**
+ * @brief The number of futex_waitv, this is the same on every architecture as it was added after syscall numbers were unified.
+ */
+constexpr long FutexWaitvSyscall{449};
+
+const char *GetWineSyncModeName(WineSyncMode mode) {
+    switch (mode) {
+        case WineSyncMode::Server:
+            return "server";
+        case WineSyncMode::Esync:
+            return "esync";
+        case WineSyncMode::Fsync:
+            return "fsync";
+    }
+    return "unknown";
+}
+
+/**
+ * @return If futex_waitv can be called, this is called in a vforked child that only makes the syscall so a seccomp violation only kills the child.
+ */
+static bool ProbeFutexWaitv() {
+    pid_t pid{vfork()};
+    if (pid == 0) {
+        // The handler table isn't shared with the parent, so this only affects the child. Any handler of the parent would run on its memory.
+        signal(SIGSYS, SIG_DFL);
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigaddset(&mask, SIGSYS);
+        sigprocmask(SIG_UNBLOCK, &mask, nullptr);
+        // No futexes are passed so this fails with EINVAL when it's implemented, without waiting on anything.
+        long result{syscall(FutexWaitvSyscall, nullptr, 0, 0, nullptr, 0)};
+        _exit(result == -1 && errno == ENOSYS ? 1 : 0);
+    } else if (pid == -1) {
+        return false;
+    }
+
+    int status{};
+    while (waitpid(pid, &status, 0) == -1)
+        if (errno != EINTR)
+            return false;
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static WineSyncSupport ProbeWineSyncSupport() {
+    WineSyncSupport support{.futexWaitv = ProbeFutexWaitv()};
+
+    int fd{eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK | EFD_SEMAPHORE)};
+    support.eventfd = fd != -1;
+    if (fd != -1)
+        close(fd);
+
+    support.sharedMemory = access("/dev/shm", W_OK | X_OK) == 0;
+
+    rlimit limit{};
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0)
+        support.fdLimit = limit.rlim_max == RLIM_INFINITY ? std::numeric_limits<uint64_t>::max() : static_cast<uint64_t>(limit.rlim_max);
+
+    fmt::println(stderr, "Wine sync support: futex_waitv: {}, eventfd: {}, /dev/shm: {}, fd limit: {}", support.futexWaitv, support.eventfd, support.sharedMemory, support.fdLimit);
+    return support;
+}
+
+const WineSyncSupport &GetWineSyncSupport() {
+    static const WineSyncSupport support{ProbeWineSyncSupport()};
+    return support;
+}
+
+/**
+ * @return If all requirements of the mode are met.
+ */
+static bool IsWineSyncModeSupported(const WineSyncSupport &support, WineSyncMode mode) {
+    switch (mode) {
+        case WineSyncMode::Server:
+            return true;
+        case WineSyncMode::Esync:
+            return support.eventfd && support.sharedMemory && support.fdLimit >= EsyncMinimumFdLimit;
+        case WineSyncMode::Fsync:
+            return support.futexWaitv && support.sharedMemory;
+    }
+    return false;
+}
+
+WineSyncMode SelectWineSyncMode(const WineSyncSupport &support, std::string_view requested) {
+    std::optional<WineSyncMode> requestedMode;
+    for (auto mode: {WineSyncMode::Server, WineSyncMode::Esync, WineSyncMode::Fsync})
+        if (requested == GetWineSyncModeName(mode))
+            requestedMode = mode;
+
+    if (requestedMode && IsWineSyncModeSupported(support, *requestedMode))
+        return *requestedMode;
+    if (requestedMode)
+        fmt::println(stderr, "Wine sync mode '{}' was requested but isn't supported, selecting one automatically", requested);
+    else if (!requested.empty() && requested != "auto")
+        fmt::println(stderr, "Unknown Wine sync mode '{}', selecting one automatically", requested);
+
+    for (auto mode: {WineSyncMode::Fsync, WineSyncMode::Esync})
+        if (IsWineSyncModeSupported(support, mode))
+            return mode;
+    return WineSyncMode::Server;
+}
+
+std::vector<std::string> GetWineSyncEnvVars(WineSyncMode mode) {
+    switch (mode) {
+        case WineSyncMode::Server:
+            return {"WINEESYNC=0", "WINEFSYNC=0"};
+        case WineSyncMode::Esync:
+            return {"WINEESYNC=1", "WINEFSYNC=0"};
+        case WineSyncMode::Fsync:
+            return {"WINEESYNC=1", "WINEFSYNC=1"}; // Wine falls back to esync if fsync fails to initialize, rather than to the server.
+    }
+    return {};
+}
+
+uint64_t ReadProcessFdLimit(pid_t pid) {
+    std::ifstream limits{fmt::format("/proc/{}/limits", pid)};
+    std::string line;
+    while (std::getline(limits, line)) {
+        constexpr std::string_view Name{"Max open files"};
+        if (!line.starts_with(Name))
+            continue;
+        std::string soft{line.substr(Name.size())};
+        auto start{soft.find_first_not_of(' ')};
+        if (start == std::string::npos)
+            return 0;
+        if (soft.compare(start, 9, "unlimited") == 0)
+            return std::numeric_limits<uint64_t>::max();
+        return std::strtoull(soft.c_str() + start, nullptr, 10);
+    }
+    return 0;
+}
+}
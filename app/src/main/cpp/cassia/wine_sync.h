@@ -0,0 +1,58 @@
+// Copyright © 2023 Cassia Developers, all rights reserved.
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <sys/types.h>
+
+namespace cassia {
+/**
+ * @brief How Wine implements Win32 synchronization objects (events, mutexes, semaphores).
+ */
+enum class WineSyncMode : uint8_t {
+    Server, //!< Every wait and signal is a wineserver request, this always works but costs a round trip to wineserver each time.
+    Esync, //!< Every object is an eventfd that is waited on in the client, this requires an fd per object.
+    Fsync, //!< Every object is a futex in shared memory that is waited on with futex_waitv, this requires Linux 5.16.
+};
+
+const char *GetWineSyncModeName(WineSyncMode mode);
+
+/**
+ * @brief The minimum RLIMIT_NOFILE that esync is used with, games commonly create thousands of objects and run out of fds below this.
+ */
+constexpr uint64_t EsyncMinimumFdLimit{32768};
+
+/**
+ * @brief The kernel features that the synchronization modes depend on.
+ */
+struct WineSyncSupport {
+    bool futexWaitv; //!< If futex_waitv is implemented and allowed by the seccomp policy of the process.
+    bool eventfd; //!< If semaphore eventfds can be created.
+    bool sharedMemory; //!< If /dev/shm is writable, esync and fsync both keep their state in shared memory.
+    uint64_t fdLimit; //!< The hard RLIMIT_NOFILE, which is as far as children can raise their limit.
+};
+
+/**
+ * @brief Probes the support of the kernel for esync and fsync, the result is cached as it can't change.
+ * @note futex_waitv is probed in a child process, as a seccomp policy that doesn't allow it would kill the process making the call.
+ */
+const WineSyncSupport &GetWineSyncSupport();
+
+/**
+ * @brief Selects the fastest supported mode, or the requested mode if it's supported.
+ * @param requested The name of a mode or "auto", any unsupported or unknown mode falls back to the fastest supported one.
+ */
+WineSyncMode SelectWineSyncMode(const WineSyncSupport &support, std::string_view requested);
+
+/**
+ * @return The environment variables that enable the mode in Wine.
+ */
+std::vector<std::string> GetWineSyncEnvVars(WineSyncMode mode);
+
+/**
+ * @return The soft RLIMIT_NOFILE of a process, or 0 if it couldn't be read.
+ */
+uint64_t ReadProcessFdLimit(pid_t pid);
+}
@@ -0,0 +1,191 @@
+// Copyright © 2023 Cassia Developers, all rights reserved.
+
+#include "x11_connection.h"
+#include "util/error.h"
+#include <array>
+#include <charconv>
+#include <cstring>
+#include <span>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace cassia {
+/**
+ * @brief The size of X11 errors and events, and the minimum size of replies.
+ */
+constexpr size_t X11PacketSize{32};
+
+/**
+ * @brief The time the server has to respond during connection setup, so a hung server can't block the caller forever.
+ */
+constexpr timeval X11SetupTimeout{.tv_sec = 2, .tv_usec = 0};
+
+constexpr uint8_t X11QueryExtensionOpcode{98};
+constexpr uint8_t XTestFakeInputMinorOpcode{2};
+
+static size_t Pad4(size_t size) {
+    return (size + 3) & ~size_t{3};
+}
+
+template<typename T>
+static void Append(std::vector<uint8_t> &buffer, T value) {
+    auto bytes{reinterpret_cast<const uint8_t *>(&value)};
+    buffer.insert(buffer.end(), bytes, bytes + sizeof(T));
+}
+
+template<typename T>
+static T Read(std::span<const uint8_t> buffer, size_t offset) {
+    if (offset + sizeof(T) > buffer.size())
+        throw Exception{"X11 packet is truncated ({} < {})", buffer.size(), offset + sizeof(T)};
+    T value;
+    std::memcpy(&value, buffer.data() + offset, sizeof(T));
+    return value;
+}
+
+static std::string GetSocketPath(std::string_view display) {
+    if (display.starts_with('/'))
+        return std::string{display};
+    if (display.starts_with(':')) {
+        unsigned number{};
+        auto result{std::from_chars(display.data() + 1, display.data() + display.size(), number)};
+        if (result.ec == std::errc{} && result.ptr != display.data() + 1)
+            return fmt::format("/tmp/.X11-unix/X{}", number);
+    }
+    throw Exception{"Unsupported DISPLAY '{}', only local displays are supported", display};
+}
+
+static void WriteAll(int fd, std::span<const uint8_t> data) {
+    while (!data.empty()) {
+        ssize_t written{send(fd, data.data(), data.size(), MSG_NOSIGNAL)};
+        if (written == -1) {
+            if (errno == EINTR)
+                continue;
+            throw Exception{"Failed to write to the X server: {}", strerror(errno)};
+        }
+        data = data.subspan(static_cast<size_t>(written));
+    }
+}
+
+static void ReadAll(int fd, std::span<uint8_t> data) {
+    while (!data.empty()) {
+        ssize_t count{read(fd, data.data(), data.size())};
+        if (count == -1 && errno == EINTR)
+            continue;
+        if (count == -1)
+            throw Exception{"Failed to read from the X server: {}", strerror(errno)};
+        if (count == 0)
+            throw Exception{"The X server closed the connection"};
+        data = data.subspan(static_cast<size_t>(count));
+    }
+}
+
+X11Connection::X11Connection(std::string_view display) : fd{socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0), "x11_connection"} {
+    if (!fd.Valid())
+        throw Exception{"socket(AF_UNIX) failed: {}", strerror(errno)};
+
+    auto path{GetSocketPath(display)};
+    sockaddr_un address{.sun_family = AF_UNIX};
+    if (path.size() >= sizeof(address.sun_path))
+        throw Exception{"X11 socket path '{}' is too long", path};
+    std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+    if (connect(fd.Get(), reinterpret_cast<sockaddr *>(&address), sizeof(address)) == -1)
+        throw Exception{"Failed to connect to X server at '{}': {}", path, strerror(errno)};
+
+    setsockopt(fd.Get(), SOL_SOCKET, SO_RCVTIMEO, &X11SetupTimeout, sizeof(X11SetupTimeout));
+    Setup();
+    xtestOpcode = QueryExtension("XTEST");
+    timeval noTimeout{};
+    setsockopt(fd.Get(), SOL_SOCKET, SO_RCVTIMEO, &noTimeout, sizeof(noTimeout));
+}
+
+void X11Connection::Setup() {
+    // Little-endian byte order, protocol 11.0 and no authorization.
+    std::array<uint8_t, 12> request{'l', 0, 11, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+    WriteAll(fd.Get(), request);
+
+    std::array<uint8_t, 8> header;
+    ReadAll(fd.Get(), header);
+    std::vector<uint8_t> data(static_cast<size_t>(Read<uint16_t>(header, 6)) * 4);
+    ReadAll(fd.Get(), data);
+
+    if (header[0] == 0)
+        throw Exception{"X server refused the connection: {}", std::string_view{reinterpret_cast<const char *>(data.data()), std::min<size_t>(header[1], data.size())}};
+    if (header[0] != 1)
+        throw Exception{"X server requires authentication, which isn't supported"};
+
+    auto vendorLength{Read<uint16_t>(data, 16)};
+    auto formatCount{Read<uint8_t>(data, 21)};
+    minKeycode = Read<uint8_t>(data, 26);
+    maxKeycode = Read<uint8_t>(data, 27);
+    root = Read<uint32_t>(data, 32 + Pad4(vendorLength) + formatCount * 8); // The root window is the first field of the first screen, which follows the vendor string and pixmap formats.
+}
+
+uint8_t X11Connection::QueryExtension(std::string_view name) {
+    std::vector<uint8_t> request;
+    Append<uint8_t>(request, X11QueryExtensionOpcode);
+    Append<uint8_t>(request, 0);
+    Append<uint16_t>(request, static_cast<uint16_t>(2 + Pad4(name.size()) / 4));
+    Append<uint16_t>(request, static_cast<uint16_t>(name.size()));
+    Append<uint16_t>(request, 0);
+    request.insert(request.end(), name.begin(), name.end());
+    request.resize(Pad4(request.size()));
+    WriteAll(fd.Get(), request);
+
+    std::array<uint8_t, X11PacketSize> reply;
+    while (true) {
+        ReadAll(fd.Get(), reply);
+        if (reply[0] == 0)
+            throw Exception{"X server returned error {} for QueryExtension({})", reply[1], name};
+        if (reply[0] == 1)
+            break; // Any events before the reply are ignored, none are selected so there shouldn't be any.
+    }
+    if (!reply[8])
+        throw Exception{"X server doesn't support the {} extension", name};
+    return reply[9];
+}
+
+void X11Connection::FakeInput(X11EventType type, uint8_t detail, int16_t x, int16_t y) {
+    Append<uint8_t>(requests, xtestOpcode);
+    Append<uint8_t>(requests, XTestFakeInputMinorOpcode);
+    Append<uint16_t>(requests, FakeInputRequestSize / 4);
+    Append<uint8_t>(requests, static_cast<uint8_t>(type));
+    Append<uint8_t>(requests, detail);
+    Append<uint16_t>(requests, 0);
+    Append<uint32_t>(requests, 0); // CurrentTime
+    Append<uint32_t>(requests, type == X11EventType::MotionNotify ? root : 0);
+    Append<uint64_t>(requests, 0);
+    Append<int16_t>(requests, x);
+    Append<int16_t>(requests, y);
+    Append<uint64_t>(requests, 0); // The device ID is in the last byte, it's only used with XInput devices.
+}
+
+void X11Connection::Flush() {
+    WriteAll(fd.Get(), requests);
+    requests.clear();
+}
+
+size_t X11Connection::ProcessIncoming() {
+    std::array<uint8_t, 4096> buffer;
+    size_t errors{};
+    while (true) {
+        ssize_t count{recv(fd.Get(), buffer.data(), buffer.size(), MSG_DONTWAIT)};
+        if (count == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return errors;
+            throw Exception{"Failed to read from the X server: {}", strerror(errno)};
+        }
+        if (count == 0)
+            throw Exception{"The X server closed the connection"};
+
+        incoming.insert(incoming.end(), buffer.begin(), buffer.begin() + count);
+        size_t offset{};
+        for (; offset + X11PacketSize <= incoming.size(); offset += X11PacketSize)
+            if (incoming[offset] == 0)
+                errors++;
+        incoming.erase(incoming.begin(), incoming.begin() + static_cast<ptrdiff_t>(offset));
+    }
+}
+}
@@ -0,0 +1,87 @@
+// Copyright © 2023 Cassia Developers, all rights reserved.
+#pragma once
+
+#include "util/fd.h"
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace cassia {
+/**
+ * @brief Core X11 event types, as used by XTestFakeInput.
+ */
+enum class X11EventType : uint8_t {
+    KeyPress = 2,
+    KeyRelease = 3,
+    ButtonPress = 4,
+    ButtonRelease = 5,
+    MotionNotify = 6,
+};
+
+/**
+ * @brief A minimal X11 client that only speaks the subset of the protocol required to inject input with the XTEST extension.
+ * @details Requests are queued in a buffer and written with a single syscall on Flush, none of them have replies so they can be pipelined indefinitely.
+ * This avoids depending on Xlib or XCB, which aren't available to the app process on Android.
+ * @note Only unauthenticated connections over Unix sockets are supported, which is how the X server of the app is configured.
+ */
+class X11Connection {
+  private:
+    UniqueFd fd;
+    uint32_t root{}; //!< The root window of the first screen.
+    uint8_t xtestOpcode{}; //!< The major opcode of the XTEST extension.
+    uint8_t minKeycode{}, maxKeycode{};
+    std::vector<uint8_t> requests; //!< Requests which have been queued but not written yet.
+    std::vector<uint8_t> incoming; //!< A partial error or event that was read from the server.
+
+    void Setup();
+
+    uint8_t QueryExtension(std::string_view name);
+
+  public:
+    static constexpr size_t FakeInputRequestSize{36};
+
+    /**
+     * @param display The value of DISPLAY, this is either the path of a socket or ":N" for the socket of display N in /tmp/.X11-unix.
+     * @note This blocks until the connection is set up, an exception is thrown if it fails.
+     */
+    explicit X11Connection(std::string_view display);
+
+    int GetFd() const {
+        return fd.Get();
+    }
+
+    /**
+     * @return If the keycode can be injected, keycodes outside of the server's range would result in an error.
+     */
+    bool IsValidKeycode(uint32_t keycode) const {
+        return keycode >= minKeycode && keycode <= maxKeycode;
+    }
+
+    /**
+     * @brief Queues an XTestFakeInput request.
+     * @param detail The keycode or button, for motion this is 1 if the motion is relative.
+     * @param x The X coordinate or delta, this is only used for motion.
+     */
+    void FakeInput(X11EventType type, uint8_t detail, int16_t x = 0, int16_t y = 0);
+
+    /**
+     * @return The amount of bytes of requests that are queued.
+     */
+    size_t GetQueuedSize() const {
+        return requests.size();
+    }
+
+    /**
+     * @brief Writes all queued requests to the server.
+     */
+    void Flush();
+
+    /**
+     * @brief Reads and discards everything the server has sent without blocking, this is only ever errors as no events are selected.
+     * @return The amount of errors that were read.
+     * @note An exception is thrown if the server closed the connection.
+     */
+    size_t ProcessIncoming();
+};
+}
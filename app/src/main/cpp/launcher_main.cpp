@@ -0,0 +1,252 @@
+// Copyright © 2023 Cassia Developers, all rights reserved.
+
+/* A small helper process that spawns Wine executables on behalf of a WineContext.
+ * It's started once per context with the prefix's environment already applied, so every spawn only has to fork this tiny process rather than the app.
+ * Usage: libcassia_launcher.so <socket fd> [directories to preload...]
+ */
+
+#include "cassia/launcher_protocol.h"
+#include "cassia/platform.h"
+#include "cassia/util/error.h"
+#include "cassia/util/fd.h"
+#include <array>
+#include <csignal>
+#include <cstring>
+#include <filesystem>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+extern char **environ;
+
+namespace cassia {
+/**
+ * @brief Reads every regular file in the supplied directories into the page cache, so the first spawns don't have to fault in the runtime from storage.
+ * @note Actually loading the libraries here wouldn't help as every spawn executes a fresh linker, sharing the page cache is all that carries over between processes.
+ */
+static void PreloadDirectories(std::vector<std::filesystem::path> directories) {
+    for (const auto &directory: directories) {
+        std::error_code error;
+        for (auto it{std::filesystem::recursive_directory_iterator{directory, error}}; !error && it != std::filesystem::recursive_directory_iterator{}; it.increment(error)) {
+            if (!it->is_regular_file(error))
+                continue;
+
+            UniqueFd fd{open(it->path().c_str(), O_RDONLY | O_CLOEXEC), "launcher"};
+            struct stat fileStat{};
+            if (!fd.Valid() || fstat(fd.Get(), &fileStat) == -1)
+                continue;
+            readahead(fd.Get(), 0, static_cast<size_t>(fileStat.st_size));
+        }
+    }
+}
+
+/**
+ * @brief A spawn request that has been decoded from a message, the views point into the message buffer.
+ */
+struct SpawnRequest {
+    uint32_t id;
+    LaunchOptions options;
+    const char *exe;
+    std::vector<const char *> args;
+    std::vector<const char *> envVars;
+};
+
+static SpawnRequest ParseSpawnRequest(const char *message, size_t size) {
+    LauncherSpawnRequest header;
+    std::memcpy(&header, message, sizeof(header));
+    SpawnRequest request{.id = header.id, .options = header.options};
+
+    size_t offset{sizeof(header)};
+    auto nextString{[&]() {
+        auto end{static_cast<const char *>(std::memchr(message + offset, '\0', size - offset))};
+        if (!end)
+            throw Exception{"Spawn request {} is truncated", header.id};
+        const char *string{message + offset};
+        offset = static_cast<size_t>(end - message) + 1;
+        return string;
+    }};
+
+    request.exe = nextString();
+    for (uint32_t i{}; i < header.argCount; i++)
+        request.args.push_back(nextString());
+    for (uint32_t i{}; i < header.envCount; i++)
+        request.envVars.push_back(nextString());
+    return request;
+}
+
+/**
+ * @return The launcher's environment with the supplied variables added, a variable replaces any existing variable with the same name.
+ */
+static std::vector<const char *> MergeEnvironment(const std::vector<const char *> &overrides) {
+    std::vector<const char *> envp;
+    for (char **var{environ}; *var; var++) {
+        std::string_view name{*var, std::strcspn(*var, "=")};
+        bool overridden{};
+        for (const char *override: overrides)
+            if (std::string_view{override}.starts_with(name) && override[name.size()] == '=')
+                overridden = true;
+        if (!overridden)
+            envp.push_back(*var);
+    }
+    envp.insert(envp.end(), overrides.begin(), overrides.end());
+    envp.push_back(nullptr);
+    return envp;
+}
+
+/**
+ * @return The pid of the spawned child, or -1 with errno set on failure.
+ */
+static pid_t Spawn(const SpawnRequest &request, int outFd, int errFd, const sigset_t &childMask) {
+    if (access(request.exe, R_OK) == -1)
+        return -1;
+
+    std::vector<const char *> argv;
+    argv.reserve(request.args.size() + 3);
+    if (LinkerPath)
+        argv.push_back(LinkerPath);
+    argv.push_back(request.exe);
+    argv.insert(argv.end(), request.args.begin(), request.args.end());
+    argv.push_back(nullptr);
+    auto envp{MergeEnvironment(request.envVars)};
+
+    // The child shares our memory until it calls execve, so it can report its errno and the options it failed to apply by writing them here.
+    volatile int childError{};
+    volatile uint32_t failedOptions{};
+    volatile int optionsError{};
+    pid_t pid{vfork()};
+    if (pid == 0) {
+        sigprocmask(SIG_SETMASK, &childMask, nullptr);
+        auto optionsResult{ApplyLaunchOptions(request.options)};
+        failedOptions = optionsResult.failedOptions;
+        optionsError = optionsResult.error;
+        if ((outFd == -1 || dup2(outFd, STDOUT_FILENO) != -1) && (errFd == -1 || dup2(errFd, STDERR_FILENO) != -1))
+            execve(LinkerPath ? LinkerPath : request.exe, const_cast<char *const *>(argv.data()), const_cast<char *const *>(envp.data()));
+        childError = errno;
+        _exit(127);
+    } else if (pid == -1) {
+        return -1;
+    }
+
+    if (childError != 0) {
+        waitpid(pid, nullptr, 0);
+        errno = childError;
+        return -1;
+    }
+    if (failedOptions)
+        fmt::println(stderr, "Couldn't apply {} to '{}': {}", DescribeFailedLaunchOptions(failedOptions), request.exe, strerror(optionsError));
+    return pid;
+}
+
+static void SendReply(int socketFd, LauncherReply reply) {
+    if (send(socketFd, &reply, sizeof(reply), MSG_NOSIGNAL) == -1)
+        throw Exception{"send({}) failed: {}", socketFd, strerror(errno)};
+}
+
+/**
+ * @return If a request was handled, false if the client has disconnected.
+ */
+static bool HandleSpawnRequest(int socketFd, const sigset_t &childMask) {
+    std::vector<char> message(LauncherMaxMessageSize);
+    iovec iov{.iov_base = message.data(), .iov_len = message.size()};
+    alignas(cmsghdr) std::array<char, CMSG_SPACE(sizeof(int) * 2)> control{};
+    msghdr header{.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.data(), .msg_controllen = control.size()};
+
+    ssize_t size{recvmsg(socketFd, &header, MSG_CMSG_CLOEXEC)};
+    if (size == -1)
+        throw Exception{"recvmsg({}) failed: {}", socketFd, strerror(errno)};
+    if (size == 0)
+        return false;
+
+    UniqueFd outFd{-1}, errFd{-1};
+    for (cmsghdr *cmsg{CMSG_FIRSTHDR(&header)}; cmsg; cmsg = CMSG_NXTHDR(&header, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS && cmsg->cmsg_len == CMSG_LEN(sizeof(int) * 2)) {
+            std::array<int, 2> fds;
+            std::memcpy(fds.data(), CMSG_DATA(cmsg), sizeof(fds));
+            outFd = UniqueFd{fds[0], "spawn_request"};
+            errFd = UniqueFd{fds[1], "spawn_request"};
+        }
+    }
+
+    if (static_cast<size_t>(size) < sizeof(LauncherSpawnRequest))
+        throw Exception{"Received a message of {} bytes which is too small for a spawn request", size};
+    auto request{ParseSpawnRequest(message.data(), static_cast<size_t>(size))};
+
+    pid_t pid{Spawn(request, outFd.Get(), errFd.Get(), childMask)};
+    SendReply(socketFd, LauncherReply{
+        .type = LauncherMessageType::Spawned,
+        .id = request.id,
+        .pid = pid,
+        .value = pid == -1 ? errno : 0,
+    });
+    return true;
+}
+
+static void ReapChildren(int socketFd, int signalFd) {
+    signalfd_siginfo info;
+    while (read(signalFd, &info, sizeof(info)) == sizeof(info)); // SIGCHLD coalesces, so all children are reaped below regardless of the amount of signals.
+
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+        SendReply(socketFd, LauncherReply{
+            .type = LauncherMessageType::Exited,
+            .pid = pid,
+            .value = status,
+        });
+}
+
+static int Run(int argc, char **argv) {
+    if (argc < 2)
+        throw Exception{"Usage: {} <socket fd> [directories to preload...]", argv[0]};
+    UniqueFd socket{std::stoi(argv[1]), "launcher"};
+    socket.SetCloseOnExec(true); // The socket was inherited without FD_CLOEXEC, it mustn't leak into our children.
+    int socketFd{socket.Get()};
+
+    sigset_t childMask, sigchldMask;
+    sigemptyset(&sigchldMask);
+    sigaddset(&sigchldMask, SIGCHLD);
+    if (sigprocmask(SIG_BLOCK, &sigchldMask, &childMask) == -1)
+        throw Exception{"sigprocmask() failed: {}", strerror(errno)};
+    // The preload thread inherits the blocked mask, otherwise SIGCHLD could be delivered to it and discarded rather than waking up the signalfd.
+    std::thread{PreloadDirectories, std::vector<std::filesystem::path>(argv + 2, argv + argc)}.detach();
+    UniqueFd signalFd{signalfd(-1, &sigchldMask, SFD_CLOEXEC | SFD_NONBLOCK), "launcher"};
+    if (!signalFd.Valid())
+        throw Exception{"signalfd() failed: {}", strerror(errno)};
+
+    while (true) {
+        std::array<pollfd, 2> fds{pollfd{.fd = socketFd, .events = POLLIN}, pollfd{.fd = signalFd.Get(), .events = POLLIN}};
+        if (poll(fds.data(), fds.size(), -1) == -1) {
+            if (errno == EINTR)
+                continue;
+            throw Exception{"poll() failed: {}", strerror(errno)};
+        }
+
+        if (fds[1].revents & POLLIN)
+            ReapChildren(socketFd, signalFd.Get());
+        // Once the client is gone, we exit and any children are reparented and keep running.
+        if (fds[0].revents & POLLIN) {
+            if (!HandleSpawnRequest(socketFd, childMask))
+                return 0;
+        } else if (fds[0].revents & (POLLHUP | POLLERR)) {
+            return 0;
+        }
+    }
+}
+}
+
+int main(int argc, char **argv) {
+    try {
+        return cassia::Run(argc, argv);
+    } catch (const std::exception &e) {
+        fmt::println(stderr, "Launcher exiting: {}", e.what());
+        return 1;
+    }
+}
@@ -1,19 +1,59 @@
 // Copyright © 2023 Cassia Developers, all rights reserved.
 
+#include "cassia/compositor.h"
+#include "cassia/content_store.h"
+#include "cassia/context_registry.h"
+#include "cassia/directory_index.h"
+#include "cassia/input_injector.h"
+#include "cassia/prefix_cloner.h"
+#include "cassia/tar_extractor.h"
 #include "cassia/wine_ctx.h"
+#include "cassia/util/fd_registry.h"
+#include "cassia/util/trace.h"
+#include <bit>
 #include <filesystem>
 #include <jni.h>
 #include <android/native_window_jni.h>
 
-std::mutex stateMutex;
-std::optional<cassia::WineContext> wineCtx;
-ANativeWindow *nativeWindow{nullptr};
+/**
+ * @return The registry of the Wine contexts of all running prefixes, this is created on first use.
+ * @note Surfaces and input don't go through the registry, so they're never blocked by a context starting or stopping.
+ */
+static cassia::ContextRegistry &GetContextRegistry() {
+    static cassia::ContextRegistry registry;
+    return registry;
+}
+
+/**
+ * @return The compositor that presents to the app's surface, this is created on first use.
+ */
+static cassia::Compositor &GetCompositor() {
+    static cassia::Compositor compositor{std::make_unique<cassia::BufferFrameSource>()};
+    return compositor;
+}
+
+/**
+ * @return The index of directories that are browsed through the DocumentsProvider, this is created on first use.
+ */
+static cassia::DirectoryIndex &GetDirectoryIndex() {
+    static cassia::DirectoryIndex index;
+    return index;
+}
+
+/**
+ * @return The injector for input into the X display of Wine, this is created on first use and connects to the display lazily.
+ */
+static cassia::InputInjector &GetInputInjector() {
+    static cassia::InputInjector injector{std::string{cassia::X11Display}};
+    return injector;
+}
 
 extern "C" JNIEXPORT void JNICALL
 Java_cassia_app_CassiaManager_startServer(
         JNIEnv *env,
         jobject /* this */,
-        jstring jRuntimePath, jstring jPrefixPath, jstring jCassiaExtPath) {
+        jstring jRuntimePath, jstring jPrefixPath, jstring jCassiaExtPath, jboolean forceInit) {
+    cassia::TraceScope trace{"jni.startServer"};
     const char *runtimePathStr{env->GetStringUTFChars(jRuntimePath, nullptr)};
     const char *prefixPathStr{env->GetStringUTFChars(jPrefixPath, nullptr)};
     const char *cassiaExtPathStr{env->GetStringUTFChars(jCassiaExtPath, nullptr)};
@@ -24,9 +64,10 @@ Java_cassia_app_CassiaManager_startServer(
     env->ReleaseStringUTFChars(jPrefixPath, prefixPathStr);
     env->ReleaseStringUTFChars(jCassiaExtPath, cassiaExtPathStr);
 
-    {
-        std::scoped_lock lock{stateMutex};
-        wineCtx.emplace(runtimePath, prefixPath, cassiaExtPath);
+    try {
+        GetContextRegistry().Start(runtimePath, prefixPath, cassiaExtPath, forceInit);
+    } catch (const std::exception &e) {
+        env->ThrowNew(env->FindClass("java/io/IOException"), e.what());
     }
 }
 
@@ -34,9 +75,18 @@ extern "C"
 JNIEXPORT void JNICALL
 Java_cassia_app_CassiaManager_stopServer(
         JNIEnv *env,
-        jobject /* this */) {
-    std::scoped_lock lock{stateMutex};
-    wineCtx.reset();
+        jobject /* this */,
+        jstring jPrefixPath, jlong idleTimeoutMs) {
+    cassia::TraceScope trace{"jni.stopServer"};
+    const char *prefixPathStr{env->GetStringUTFChars(jPrefixPath, nullptr)};
+    std::filesystem::path prefixPath{prefixPathStr};
+    env->ReleaseStringUTFChars(jPrefixPath, prefixPathStr);
+
+    try {
+        GetContextRegistry().Stop(prefixPath, std::chrono::milliseconds{idleTimeoutMs});
+    } catch (const std::exception &e) {
+        env->ThrowNew(env->FindClass("java/io/IOException"), e.what());
+    }
 }
 
 extern "C" JNIEXPORT void JNICALL
@@ -44,8 +94,398 @@ Java_cassia_app_CassiaManager_setSurface(
         JNIEnv *env,
         jobject /* this */,
         jobject surface) {
-    std::scoped_lock lock{stateMutex};
-    nativeWindow = surface == nullptr ? nullptr : ANativeWindow_fromSurface(env, surface);
+    cassia::TraceScope trace{"jni.setSurface"};
+    auto window{surface == nullptr ? nullptr : ANativeWindow_fromSurface(env, surface)};
+    // The previous window is released once the compositor is done with it, so the surface can be destroyed as soon as this returns.
+    GetCompositor().SetWindow(window == nullptr ? nullptr : std::make_unique<cassia::NativeWindow>(window));
+}
+
+extern "C" JNIEXPORT jstring JNICALL
+Java_cassia_app_CassiaManager_getStartupTimings(
+        JNIEnv *env,
+        jobject /* this */,
+        jstring jPrefixPath) {
+    const char *prefixPathStr{env->GetStringUTFChars(jPrefixPath, nullptr)};
+    std::filesystem::path prefixPath{prefixPathStr};
+    env->ReleaseStringUTFChars(jPrefixPath, prefixPathStr);
+
+    auto context{GetContextRegistry().Get(prefixPath)};
+    if (!context)
+        return nullptr;
+    const auto &timings{context->GetStartupTimings()};
+    auto json{fmt::format(R"({{"wineserverNs":{},"launcherNs":{},"fingerprintNs":{},"winebootNs":{},"explorerNs":{},"totalNs":{},"coldTotalNs":{},"winebootSkipped":{},"warm":{}}})",
+                          timings.wineserver.count(), timings.launcher.count(), timings.fingerprint.count(), timings.wineboot.count(), timings.explorer.count(),
+                          timings.total.count(), timings.coldTotal.count(), timings.winebootSkipped, timings.warm)};
+    return env->NewStringUTF(json.c_str());
+}
+
+extern "C" JNIEXPORT jstring JNICALL
+Java_cassia_app_CassiaManager_getLogStats(
+        JNIEnv *env,
+        jobject /* this */) {
+    auto stats{cassia::Logger::GetStats()};
+    std::string json{"["};
+    for (const auto &channel: stats) {
+        if (json.size() > 1)
+            json += ',';
+        fmt::format_to(std::back_inserter(json), R"({{"tag":"{}","lines":{},"bytes":{},"overflowDrops":{},"rateLimitDrops":{},"totalQueueLagNs":{},"maxQueueLagNs":{}}})",
+                       channel.tag, channel.lines, channel.bytes, channel.overflowDrops, channel.rateLimitDrops, channel.totalQueueLagNs, channel.maxQueueLagNs);
+    }
+    json += ']';
+    return env->NewStringUTF(json.c_str());
+}
+
+/**
+ * @brief Appends a string as a JSON string literal, control characters are replaced rather than escaped as they're never meaningful in our strings.
+ */
+static void AppendJsonString(std::string &json, std::string_view string) {
+    json += '"';
+    for (char c: string) {
+        if (c == '"' || c == '\\')
+            json += '\\';
+        json += static_cast<unsigned char>(c) < 0x20 ? '?' : c;
+    }
+    json += '"';
+}
+
+extern "C" JNIEXPORT jstring JNICALL
+Java_cassia_app_CassiaManager_getWineDebugCounts(
+        JNIEnv *env,
+        jobject /* this */) {
+    auto counts{cassia::Logger::GetWineDebugCounts()};
+    std::string json{"["};
+    for (const auto &[key, count]: counts) {
+        if (json.size() > 1)
+            json += ',';
+        json += R"({"key":)";
+        AppendJsonString(json, key); // Keys contain Wine function names verbatim, so they need to be escaped.
+        fmt::format_to(std::back_inserter(json), R"(,"count":{}}})", count);
+    }
+    json += ']';
+    return env->NewStringUTF(json.c_str());
+}
+
+extern "C" JNIEXPORT jstring JNICALL
+Java_cassia_app_CassiaManager_getContexts(
+        JNIEnv *env,
+        jobject /* this */) {
+    std::string json{"["};
+    for (const auto &info: GetContextRegistry().GetInfo()) {
+        if (json.size() > 1)
+            json += ',';
+        json += R"({"prefixPath":)";
+        AppendJsonString(json, info.prefixPath.string());
+        fmt::format_to(std::back_inserter(json), R"(,"state":"{}","syncMode":{}}})", cassia::GetContextStateName(info.state),
+                       info.syncMode ? fmt::format(R"("{}")", cassia::GetWineSyncModeName(*info.syncMode)) : "null");
+    }
+    json += ']';
+    return env->NewStringUTF(json.c_str());
+}
+
+extern "C" JNIEXPORT jstring JNICALL
+Java_cassia_app_CassiaManager_getFdStats(
+        JNIEnv *env,
+        jobject /* this */) {
+    auto stats{cassia::FdRegistry::GetStats()};
+    auto json{fmt::format(R"({{"registeredFds":{},"peakRegisteredFds":{},"openFds":{},"inheritableFds":{},"limit":{},"owners":[)",
+                          stats.registeredFds, stats.peakRegisteredFds, stats.openFds, stats.inheritableFds, stats.limit)};
+    for (size_t i{}; i < stats.owners.size(); i++)
+        fmt::format_to(std::back_inserter(json), R"({}{{"owner":"{}","count":{}}})", i ? "," : "", stats.owners[i].first, stats.owners[i].second);
+    json += "]}";
+    return env->NewStringUTF(json.c_str());
+}
+
+/**
+ * @brief The amount of ints that encode an input event in a batch from InputHandler: the type, the code and the raw bits of the X and Y values.
+ */
+constexpr jsize InputEventInts{4};
+
+extern "C" JNIEXPORT void JNICALL
+Java_cassia_app_CassiaManager_injectInput(
+        JNIEnv *env,
+        jobject /* this */,
+        jintArray events,
+        jint count) {
+    constexpr jint ChunkSize{64}; //!< The batch is copied out of the array in chunks, so it doesn't need to be allocated.
+    std::array<jint, ChunkSize * InputEventInts> buffer;
+    std::array<cassia::InputEvent, ChunkSize> chunk;
+    if (count < 0 || count > env->GetArrayLength(events) / InputEventInts) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"), fmt::format("{} events don't fit in an array of {} ints", count, env->GetArrayLength(events)).c_str());
+        return;
+    }
+
+    auto &injector{GetInputInjector()};
+    for (jint offset{}; offset < count; offset += ChunkSize) {
+        jint chunkSize{std::min(count - offset, ChunkSize)};
+        env->GetIntArrayRegion(events, offset * InputEventInts, chunkSize * InputEventInts, buffer.data());
+        if (env->ExceptionCheck())
+            return; // The buffer wasn't filled, the pending exception is thrown once we return to Java.
+        for (jint index{}; index < chunkSize; index++) {
+            auto encoded{buffer.data() + index * InputEventInts};
+            chunk[static_cast<size_t>(index)] = cassia::InputEvent{
+                .type = static_cast<cassia::InputEventType>(encoded[0]),
+                .code = static_cast<uint32_t>(encoded[1]),
+                .x = std::bit_cast<float>(encoded[2]),
+                .y = std::bit_cast<float>(encoded[3]),
+            };
+        }
+        injector.Push(std::span{chunk.data(), static_cast<size_t>(chunkSize)});
+    }
+}
+
+extern "C" JNIEXPORT jstring JNICALL
+Java_cassia_app_CassiaManager_getInputStats(
+        JNIEnv *env,
+        jobject /* this */) {
+    auto stats{GetInputInjector().GetStats()};
+    auto json{fmt::format(R"({{"pushedEvents":{},"droppedEvents":{},"coalescedEvents":{},"injectedRequests":{},"batches":{},"serverErrors":{},"connected":{},"latencyP50Ns":{},"latencyP99Ns":{}}})",
+                          stats.pushedEvents, stats.droppedEvents, stats.coalescedEvents, stats.injectedRequests, stats.batches, stats.serverErrors, stats.connected,
+                          stats.latencyP50.count(), stats.latencyP99.count())};
+    return env->NewStringUTF(json.c_str());
+}
+
+extern "C" JNIEXPORT jstring JNICALL
+Java_cassia_app_CassiaManager_getCompositorStats(
+        JNIEnv *env,
+        jobject /* this */) {
+    auto stats{GetCompositor().GetStats()};
+    auto json{fmt::format(R"({{"presentedFrames":{},"skippedFrames":{},"presentedPixels":{},"presentTimeP50Ns":{},"presentTimeP99Ns":{},"frameIntervalP50Ns":{},"frameIntervalP99Ns":{},"kernel":"{}"}})",
+                          stats.presentedFrames, stats.skippedFrames, stats.presentedPixels, stats.presentTimeP50.count(), stats.presentTimeP99.count(),
+                          stats.frameIntervalP50.count(), stats.frameIntervalP99.count(), stats.kernel)};
+    return env->NewStringUTF(json.c_str());
+}
+
+extern "C" JNIEXPORT jstring JNICALL
+Java_cassia_app_CassiaManager_getResourceSamples(
+        JNIEnv *env,
+        jobject /* this */) {
+    // The samples of all contexts are merged, every process belongs to a single context so they can be told apart by their PIDs.
+    std::vector<cassia::ResourceSample> samples;
+    cassia::ResourceSampler::Stats stats{};
+    for (const auto &context: GetContextRegistry().GetAll()) {
+        auto &sampler{context->GetResourceSampler()};
+        auto contextSamples{sampler.Drain()};
+        samples.insert(samples.end(), std::make_move_iterator(contextSamples.begin()), std::make_move_iterator(contextSamples.end()));
+        auto contextStats{sampler.GetStats()};
+        stats.droppedSamples += contextStats.droppedSamples;
+        stats.lastCycleTime = std::max(stats.lastCycleTime, contextStats.lastCycleTime);
+        stats.maxCycleTime = std::max(stats.maxCycleTime, contextStats.maxCycleTime);
+    }
+
+    std::string json;
+    fmt::format_to(std::back_inserter(json), R"({{"droppedSamples":{},"lastCycleTimeNs":{},"maxCycleTimeNs":{},"samples":[)",
+                   stats.droppedSamples, stats.lastCycleTime.count(), stats.maxCycleTime.count());
+    for (size_t index{}; index < samples.size(); index++) {
+        const auto &sample{samples[index]};
+        if (index)
+            json += ',';
+        json += R"({"name":)";
+        AppendJsonString(json, sample.name.data()); // The name is the comm of the process, which can be set to anything by the process.
+        fmt::format_to(std::back_inserter(json),
+                       R"(,"timestampNs":{},"pid":{},"parentPid":{},"threads":{},"userTimeNs":{},"systemTimeNs":{},"rssBytes":{},"sharedBytes":{},"pssBytes":{},"majorFaults":{},"contextSwitches":{},"runDelayNs":{},"readBytes":{},"writeBytes":{},"openFds":{},"fdLimit":{}}})",
+                       sample.timestampNs, sample.pid, sample.parentPid, sample.threads, sample.userTimeNs, sample.systemTimeNs, sample.rssBytes, sample.sharedBytes, sample.pssBytes,
+                       sample.majorFaults, sample.contextSwitches, sample.runDelayNs, sample.readBytes, sample.writeBytes, sample.openFds, sample.fdLimit);
+    }
+    json += "]}";
+    return env->NewStringUTF(json.c_str());
+}
+
+extern "C" JNIEXPORT void JNICALL
+Java_cassia_app_CassiaManager_setResourceSampleInterval(
+        JNIEnv *env,
+        jobject /* this */,
+        jlong intervalMs) {
+    for (const auto &context: GetContextRegistry().GetAll())
+        context->GetResourceSampler().SetInterval(std::chrono::milliseconds{intervalMs});
+}
+
+extern "C" JNIEXPORT void JNICALL
+Java_cassia_app_CassiaManager_exportLogs(
+        JNIEnv *env,
+        jobject /* this */,
+        jstring jPrefixPath, jstring jOutputPath) {
+    cassia::TraceScope trace{"jni.exportLogs"};
+    const char *prefixPathStr{env->GetStringUTFChars(jPrefixPath, nullptr)};
+    const char *outputPathStr{env->GetStringUTFChars(jOutputPath, nullptr)};
+    std::filesystem::path prefixPath{prefixPathStr};
+    std::filesystem::path outputPath{outputPathStr};
+    env->ReleaseStringUTFChars(jPrefixPath, prefixPathStr);
+    env->ReleaseStringUTFChars(jOutputPath, outputPathStr);
+
+    try {
+        std::filesystem::path ringPath{prefixPath / cassia::LogRingFileName};
+        std::array<std::filesystem::path, 2> ringPaths{std::filesystem::path{ringPath}.concat(".1"), ringPath};
+        auto entries{cassia::ReadLogRings(ringPaths)};
 
-    // TODO: Hook up to compositor.
+        std::unique_ptr<FILE, decltype(&fclose)> output{fopen(outputPath.c_str(), "we"), &fclose};
+        if (!output)
+            throw cassia::Exception{"fopen({}) failed: {}", outputPath.string(), strerror(errno)};
+        for (const auto &entry: entries)
+            fmt::println(output.get(), "{}", cassia::FormatLogRingEntry(entry));
+    } catch (const std::exception &e) {
+        env->ThrowNew(env->FindClass("java/io/IOException"), e.what());
+    }
+}
+
+extern "C" JNIEXPORT jstring JNICALL
+Java_cassia_app_store_PrefixStore_clonePrefix(
+        JNIEnv *env,
+        jobject /* this */,
+        jstring jTemplatePath, jstring jPrefixPath) {
+    cassia::TraceScope trace{"jni.clonePrefix"};
+    const char *templatePathStr{env->GetStringUTFChars(jTemplatePath, nullptr)};
+    const char *prefixPathStr{env->GetStringUTFChars(jPrefixPath, nullptr)};
+    std::filesystem::path templatePath{templatePathStr};
+    std::filesystem::path prefixPath{prefixPathStr};
+    env->ReleaseStringUTFChars(jTemplatePath, templatePathStr);
+    env->ReleaseStringUTFChars(jPrefixPath, prefixPathStr);
+
+    try {
+        auto stats{cassia::ClonePrefix(templatePath, prefixPath)};
+        auto json{fmt::format(R"({{"directories":{},"symlinks":{},"reflinkedFiles":{},"copiedFiles":{},"copiedBytes":{},"durationNs":{}}})",
+                              stats.directories, stats.symlinks, stats.reflinkedFiles, stats.copiedFiles, stats.copiedBytes, stats.duration.count())};
+        return env->NewStringUTF(json.c_str());
+    } catch (const std::exception &e) {
+        // A failed clone is recoverable by initializing the prefix from scratch, so this is thrown to the store rather than aborting.
+        env->ThrowNew(env->FindClass("java/io/IOException"), e.what());
+        return nullptr;
+    }
+}
+
+static std::string FormatInstallStats(const cassia::ContentInstallStats &stats) {
+    return fmt::format(R"({{"files":{},"unchangedEntries":{},"updatedEntries":{},"removedEntries":{},"addedBlobs":{},"reusedBlobs":{},"addedBytes":{},"reusedBytes":{},"durationNs":{}}})",
+                       stats.files, stats.unchangedEntries, stats.updatedEntries, stats.removedEntries, stats.addedBlobs, stats.reusedBlobs, stats.addedBytes, stats.reusedBytes, stats.duration.count());
+}
+
+extern "C" JNIEXPORT jstring JNICALL
+Java_cassia_app_store_ContentStore_installTree(
+        JNIEnv *env,
+        jobject /* this */,
+        jstring jStorePath, jstring jSource, jstring jDestination, jstring jName) {
+    cassia::TraceScope trace{"jni.installTree"};
+    const char *storePathStr{env->GetStringUTFChars(jStorePath, nullptr)};
+    const char *sourceStr{env->GetStringUTFChars(jSource, nullptr)};
+    const char *destinationStr{env->GetStringUTFChars(jDestination, nullptr)};
+    const char *nameStr{env->GetStringUTFChars(jName, nullptr)};
+    std::filesystem::path storePath{storePathStr};
+    std::filesystem::path source{sourceStr};
+    std::filesystem::path destination{destinationStr};
+    std::string name{nameStr};
+    env->ReleaseStringUTFChars(jStorePath, storePathStr);
+    env->ReleaseStringUTFChars(jSource, sourceStr);
+    env->ReleaseStringUTFChars(jDestination, destinationStr);
+    env->ReleaseStringUTFChars(jName, nameStr);
+
+    try {
+        cassia::ContentStore store{storePath};
+        auto json{FormatInstallStats(store.Install(source, destination, name))};
+        return env->NewStringUTF(json.c_str());
+    } catch (const std::exception &e) {
+        env->ThrowNew(env->FindClass("java/io/IOException"), e.what());
+        return nullptr;
+    }
+}
+
+extern "C" JNIEXPORT jstring JNICALL
+Java_cassia_app_store_ContentStore_installArchive(
+        JNIEnv *env,
+        jobject /* this */,
+        jstring jStorePath, jint fd, jlong offset, jlong length, jstring jDestination, jstring jName) {
+    cassia::TraceScope trace{"jni.installArchive"};
+    const char *storePathStr{env->GetStringUTFChars(jStorePath, nullptr)};
+    const char *destinationStr{env->GetStringUTFChars(jDestination, nullptr)};
+    const char *nameStr{env->GetStringUTFChars(jName, nullptr)};
+    std::filesystem::path storePath{storePathStr};
+    std::filesystem::path destination{destinationStr};
+    std::string name{nameStr};
+    env->ReleaseStringUTFChars(jStorePath, storePathStr);
+    env->ReleaseStringUTFChars(jDestination, destinationStr);
+    env->ReleaseStringUTFChars(jName, nameStr);
+
+    // The archive is extracted next to the store and then installed from there, so only the entries that changed since the last install touch the destination.
+    auto stagingPath{storePath / fmt::format("{}.archive", name)};
+    try {
+        cassia::ContentStore store{storePath};
+        auto extractStats{cassia::ExtractTar(fd, static_cast<uint64_t>(offset), static_cast<uint64_t>(length), stagingPath)};
+        auto installStats{store.Install(stagingPath, destination, name)};
+        std::filesystem::remove_all(stagingPath);
+
+        auto seconds{std::chrono::duration<double>{extractStats.duration}.count()};
+        auto json{fmt::format(R"({{"extract":{{"files":{},"archiveBytes":{},"fileBytes":{},"durationNs":{},"megabytesPerSecond":{:.1f}}},"install":{}}})",
+                              extractStats.files, extractStats.archiveBytes, extractStats.fileBytes, extractStats.duration.count(),
+                              static_cast<double>(extractStats.fileBytes) / (1024 * 1024) / seconds, FormatInstallStats(installStats))};
+        return env->NewStringUTF(json.c_str());
+    } catch (const std::exception &e) {
+        std::error_code error;
+        std::filesystem::remove_all(stagingPath, error);
+        env->ThrowNew(env->FindClass("java/io/IOException"), e.what());
+        return nullptr;
+    }
+}
+
+extern "C" JNIEXPORT jstring JNICALL
+Java_cassia_app_store_ContentStore_collectGarbage(
+        JNIEnv *env,
+        jobject /* this */,
+        jstring jStorePath) {
+    cassia::TraceScope trace{"jni.collectGarbage"};
+    const char *storePathStr{env->GetStringUTFChars(jStorePath, nullptr)};
+    std::filesystem::path storePath{storePathStr};
+    env->ReleaseStringUTFChars(jStorePath, storePathStr);
+
+    try {
+        cassia::ContentStore store{storePath};
+        auto stats{store.CollectGarbage()};
+        auto json{fmt::format(R"({{"removedBlobs":{},"removedBytes":{},"removedManifests":{},"remainingBlobs":{},"remainingBytes":{}}})",
+                              stats.removedBlobs, stats.removedBytes, stats.removedManifests, stats.remainingBlobs, stats.remainingBytes)};
+        return env->NewStringUTF(json.c_str());
+    } catch (const std::exception &e) {
+        env->ThrowNew(env->FindClass("java/io/IOException"), e.what());
+        return nullptr;
+    }
+}
+
+extern "C" JNIEXPORT void JNICALL
+Java_cassia_app_CassiaManager_setTracingEnabled(
+        JNIEnv *env,
+        jobject /* this */,
+        jboolean enabled) {
+    cassia::Tracer::SetEnabled(enabled);
+}
+
+extern "C" JNIEXPORT void JNICALL
+Java_cassia_app_CassiaManager_dumpTrace(
+        JNIEnv *env,
+        jobject /* this */,
+        jstring jOutputPath) {
+    const char *outputPathStr{env->GetStringUTFChars(jOutputPath, nullptr)};
+    std::filesystem::path outputPath{outputPathStr};
+    env->ReleaseStringUTFChars(jOutputPath, outputPathStr);
+
+    auto json{cassia::Tracer::DumpChromeJson()};
+    std::unique_ptr<FILE, decltype(&fclose)> output{fopen(outputPath.c_str(), "we"), &fclose};
+    if (!output || fwrite(json.data(), 1, json.size(), output.get()) != json.size())
+        env->ThrowNew(env->FindClass("java/io/IOException"), fmt::format("Failed to write the trace to '{}': {}", outputPath.string(), strerror(errno)).c_str());
+}
+
+extern "C" JNIEXPORT jbyteArray JNICALL
+Java_cassia_app_provider_DocumentsProvider_listDirectory(
+        JNIEnv *env,
+        jobject /* this */,
+        jstring jPath, jint sortOrder) {
+    cassia::TraceScope trace{"jni.listDirectory"};
+    const char *pathStr{env->GetStringUTFChars(jPath, nullptr)};
+    std::string path{pathStr};
+    env->ReleaseStringUTFChars(jPath, pathStr);
+
+    try {
+        auto listing{GetDirectoryIndex().List(path, static_cast<cassia::DirectorySortOrder>(sortOrder))};
+        auto array{env->NewByteArray(static_cast<jsize>(listing->size()))};
+        if (array)
+            env->SetByteArrayRegion(array, 0, static_cast<jsize>(listing->size()), reinterpret_cast<const jbyte *>(listing->data()));
+        return array;
+    } catch (const std::exception &e) {
+        env->ThrowNew(env->FindClass("java/io/IOException"), e.what());
+        return nullptr;
+    }
 }
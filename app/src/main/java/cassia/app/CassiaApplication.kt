@@ -2,6 +2,7 @@ package cassia.app
 
 import android.app.Application
 import cassia.app.store.CassiaExtStore
+import cassia.app.store.ContentStore
 import cassia.app.store.PrefixStore
 import cassia.app.store.RuntimeStore
 import kotlinx.coroutines.MainScope
@@ -18,6 +19,8 @@ class CassiaApplication : Application() {
         instance = this
     }
 
+    lateinit var contentStore: ContentStore
+        private set
     lateinit var cassiaExt: CassiaExtStore
         private set
     lateinit var runtimes: RuntimeStore
@@ -31,9 +34,10 @@ class CassiaApplication : Application() {
         super.onCreate()
         instance = this
 
-        cassiaExt = CassiaExtStore(Paths.get(filesDir.absolutePath, "cassiaext"))
-        runtimes = RuntimeStore(Paths.get(filesDir.absolutePath, "runtimes"))
-        prefixes = PrefixStore(Paths.get(filesDir.absolutePath, "prefixes"))
+        contentStore = ContentStore(Paths.get(filesDir.absolutePath, "store"))
+        cassiaExt = CassiaExtStore(Paths.get(filesDir.absolutePath, "cassiaext"), contentStore)
+        runtimes = RuntimeStore(Paths.get(filesDir.absolutePath, "runtimes"), contentStore)
+        prefixes = PrefixStore(Paths.get(filesDir.absolutePath, "prefixes"), Paths.get(filesDir.absolutePath, "templates"))
         MainScope().launch {
             runtimes.scan()
             prefixes.scan()
@@ -6,47 +6,336 @@ import kotlinx.coroutines.Dispatchers
 import kotlinx.coroutines.sync.Mutex
 import kotlinx.coroutines.sync.withLock
 import kotlinx.coroutines.withContext
+import kotlinx.serialization.Serializable
+import kotlinx.serialization.json.Json
+
+/**
+ * Counters for all native log channels sharing a tag, these are cumulative over the lifetime of the process.
+ */
+@Serializable
+data class LogChannelStats(
+    val tag: String,
+    val lines: Long,
+    val bytes: Long,
+    val overflowDrops: Long,
+    val rateLimitDrops: Long,
+    val totalQueueLagNs: Long,
+    val maxQueueLagNs: Long,
+)
+
+/**
+ * The amount of Wine debug messages logged by native channels for a single "class:channel:function" key.
+ */
+@Serializable
+data class WineDebugCount(
+    val key: String,
+    val count: Long,
+)
+
+/**
+ * The resource usage of a single Wine process over a single sampling interval, all "delta" fields are the change since the previous sample of the process.
+ */
+@Serializable
+data class ResourceSample(
+    val name: String,
+    val timestampNs: Long,
+    val pid: Int,
+    val parentPid: Int,
+    val threads: Int,
+    val userTimeNs: Long,
+    val systemTimeNs: Long,
+    val rssBytes: Long,
+    val sharedBytes: Long,
+    val pssBytes: Long,
+    val majorFaults: Long,
+    val contextSwitches: Long,
+    val runDelayNs: Long,
+    val readBytes: Long,
+    val writeBytes: Long,
+    val openFds: Int,
+    /**
+     * The soft RLIMIT_NOFILE of the process, a warning is logged when [openFds] gets close to it.
+     */
+    val fdLimit: Long,
+)
+
+/**
+ * All resource samples since the previous batch, along with statistics about the sampler itself.
+ */
+@Serializable
+data class ResourceSampleBatch(
+    val droppedSamples: Long,
+    val lastCycleTimeNs: Long,
+    val maxCycleTimeNs: Long,
+    val samples: List<ResourceSample>,
+)
+
+/**
+ * The amount of file descriptors registered by a single native subsystem.
+ */
+@Serializable
+data class FdOwnerCount(
+    val owner: String,
+    val count: Long,
+)
+
+/**
+ * A summary of the file descriptors of the app process, registered ones are owned by native code while the rest include those of ART.
+ */
+@Serializable
+data class FdStats(
+    val registeredFds: Long,
+    val peakRegisteredFds: Long,
+    val openFds: Long,
+    val inheritableFds: Long,
+    val limit: Long,
+    val owners: List<FdOwnerCount>,
+)
+
+/**
+ * Statistics about the frames presented to the surface by the native compositor, percentiles are over the most recent frames.
+ */
+@Serializable
+data class CompositorStats(
+    val presentedFrames: Long,
+    val skippedFrames: Long,
+    val presentedPixels: Long,
+    val presentTimeP50Ns: Long,
+    val presentTimeP99Ns: Long,
+    val frameIntervalP50Ns: Long,
+    val frameIntervalP99Ns: Long,
+    val kernel: String,
+)
+
+/**
+ * Statistics about the input injected into the X server, the latency percentiles are over the most recent batches.
+ */
+@Serializable
+data class InputStats(
+    val pushedEvents: Long,
+    val droppedEvents: Long,
+    val coalescedEvents: Long,
+    val injectedRequests: Long,
+    val batches: Long,
+    val serverErrors: Long,
+    val connected: Boolean,
+    val latencyP50Ns: Long,
+    val latencyP99Ns: Long,
+)
+
+/**
+ * The time taken by each phase of starting a running prefix.
+ */
+@Serializable
+data class StartupTimings(
+    val wineserverNs: Long,
+    val launcherNs: Long,
+    val fingerprintNs: Long,
+    val winebootNs: Long,
+    val explorerNs: Long,
+    val totalNs: Long,
+    val coldTotalNs: Long,
+    val winebootSkipped: Boolean,
+    val warm: Boolean,
+)
+
+/**
+ * The state of the native context of a prefix, a prefix without a context isn't running or being kept warm.
+ */
+@Serializable
+data class ContextInfo(
+    val prefixPath: String,
+    /**
+     * One of "starting", "running", "stopping" or "suspended".
+     */
+    val state: String,
+    /**
+     * One of "server", "esync" or "fsync", this is null until the context has been created.
+     */
+    val syncMode: String? = null,
+)
 
 class CassiaManager {
     companion object {
+        /**
+         * The default time a stopped prefix is kept warm for, this covers briefly leaving the app or restarting a game.
+         */
+        const val DEFAULT_WARM_IDLE_TIMEOUT_MS = 5 * 60 * 1000L
+
         init {
             System.loadLibrary("cassia")
         }
     }
 
-    private external fun startServer(runtimePath: String, prefixPath: String, cassiaExtPath: String)
+    /**
+     * Starts the context of a prefix, contexts of different prefixes are independent and can start, run and stop concurrently.
+     * @throws java.io.IOException If the prefix is already running or its context fails to start.
+     */
+    private external fun startServer(runtimePath: String, prefixPath: String, cassiaExtPath: String, forceInit: Boolean)
+
+    /**
+     * @param idleTimeoutMs The time wineserver is kept alive for a warm restart of the same prefix, it's shut down immediately if this is 0.
+     */
+    private external fun stopServer(prefixPath: String, idleTimeoutMs: Long)
+
+    private external fun getContexts(): String
 
-    private external fun stopServer()
+    /**
+     * @return The state of every prefix that's running or being kept warm.
+     */
+    fun contexts(): List<ContextInfo> = Json.decodeFromString(getContexts())
 
     external fun setSurface(surface: Surface?)
 
+    private external fun getCompositorStats(): String
+
+    fun compositorStats(): CompositorStats = Json.decodeFromString(getCompositorStats())
+
+    /**
+     * Queues a batch of input events for injection into the X server, these are encoded by InputHandler.
+     */
+    external fun injectInput(events: IntArray, count: Int)
+
+    private external fun getInputStats(): String
+
+    fun inputStats(): InputStats = Json.decodeFromString(getInputStats())
+
+    private external fun getStartupTimings(prefixPath: String): String?
+
+    /**
+     * @return The start-up timings of a running prefix, or null if the prefix isn't running.
+     */
+    fun startupTimings(prefixUUID: String): StartupTimings? = runningPrefixes[prefixUUID]?.let { prefix -> getStartupTimings(prefix.path.toString())?.let { Json.decodeFromString(it) } }
+
+    private external fun getLogStats(): String
+
+    fun logStats(): List<LogChannelStats> = Json.decodeFromString(getLogStats())
+
+    private external fun getWineDebugCounts(): String
+
+    fun wineDebugCounts(): List<WineDebugCount> = Json.decodeFromString(getWineDebugCounts())
+
+    private external fun getFdStats(): String
+
+    /**
+     * @note This lists the file descriptors of the process, so it shouldn't be polled frequently.
+     */
+    fun fdStats(): FdStats = Json.decodeFromString(getFdStats())
+
+    private external fun getResourceSamples(): String
+
+    /**
+     * Drains all resource samples of every running or warm prefix since the previous call, this is empty if no prefix is running.
+     */
+    fun resourceSamples(): ResourceSampleBatch = Json.decodeFromString(getResourceSamples())
+
+    external fun setResourceSampleInterval(intervalMs: Long)
+
+    /**
+     * Writes the persistent logs of the current and previous session of a prefix to a text file, this works regardless of whether the prefix is running.
+     */
+    external fun exportLogs(prefixPath: String, outputPath: String)
+
+    /**
+     * Starts or stops recording trace events of start-up, process launches and shutdown, enabling tracing discards any previously recorded events.
+     */
+    external fun setTracingEnabled(enabled: Boolean)
+
+    /**
+     * Writes all trace events since tracing was enabled to a file in the Chrome trace-event JSON format, which can be opened in Perfetto (ui.perfetto.dev) or chrome://tracing.
+     */
+    external fun dumpTrace(outputPath: String)
+
+    /**
+     * Guards runningPrefixes and templateMutexes, this is never held while a prefix is starting or stopping so prefixes can do so concurrently.
+     */
     private val mutex = Mutex()
 
-    var runningPrefix: Prefix? = null
-        private set
+    /**
+     * The time a prefix is kept warm for after it's stopped, starting it again within this time skips starting wineserver and booting the prefix.
+     */
+    var warmIdleTimeoutMs = DEFAULT_WARM_IDLE_TIMEOUT_MS
 
-    suspend fun start(prefixUUID: String) {
-        mutex.withLock {
-            if (runningPrefix != null)
-                throw IllegalStateException("A prefix is already running")
-            val prefix = CassiaApplication.instance.prefixes.updateLinks(prefixUUID)
-            runningPrefix = prefix
+    private val _runningPrefixes = mutableMapOf<String, Prefix>()
+
+    /**
+     * A lock for every runtime whose template has been prepared, this is held across checking, creating and booting the template so a concurrent caller can't delete it while it boots.
+     */
+    private val templateMutexes = mutableMapOf<String, Mutex>()
+
+    /**
+     * All prefixes that are running or starting, keyed by their UUID.
+     */
+    val runningPrefixes: Map<String, Prefix>
+        get() = _runningPrefixes.toMap()
+
+    /**
+     * Starts a prefix, this can be done while other prefixes are running (such as a launcher next to a game).
+     * @param forceInit If the prefix should be initialized with wineboot even if it was already initialized with the same runtime and configuration.
+     */
+    suspend fun start(prefixUUID: String, forceInit: Boolean = false) {
+        val prefix = mutex.withLock {
+            if (_runningPrefixes.containsKey(prefixUUID))
+                throw IllegalStateException("Prefix $prefixUUID is already running")
+            CassiaApplication.instance.prefixes.updateLinks(prefixUUID).also { _runningPrefixes[prefixUUID] = it }
+        }
 
+        try {
             withContext(Dispatchers.IO) {
-                startServer(prefix.runtimePath.toString(), prefix.path.toString(), CassiaApplication.instance.cassiaExt.path.toString())
+                startServer(prefix.runtimePath.toString(), prefix.path.toString(), CassiaApplication.instance.cassiaExt.path.toString(), forceInit)
             }
+        } catch (e: Exception) {
+            mutex.withLock { _runningPrefixes.remove(prefixUUID) }
+            throw e
         }
     }
 
-    suspend fun stop() {
-        mutex.withLock {
-            if (runningPrefix == null)
-                throw IllegalStateException("No prefix is running")
-            runningPrefix = null
+    /**
+     * Initializes the template prefix of a runtime if it isn't initialized already, new prefixes for the runtime are cloned from it rather than being initialized on their first start.
+     * @note The template has a context of its own, so this can be done while prefixes are running.
+     */
+    suspend fun prepareTemplate(runtimeId: String) {
+        val templateMutex = mutex.withLock { templateMutexes.getOrPut(runtimeId) { Mutex() } }
+        templateMutex.withLock {
+            val prefixes = CassiaApplication.instance.prefixes
+            if (prefixes.isTemplateInitialized(runtimeId))
+                return
 
+            val templatePath = prefixes.createTemplate(runtimeId)
             withContext(Dispatchers.IO) {
-                stopServer()
+                startServer(CassiaApplication.instance.runtimes.path.resolve(runtimeId).toString(), templatePath.toString(), CassiaApplication.instance.cassiaExt.path.toString(), true)
+                stopServer(templatePath.toString(), 0)
             }
+            if (!prefixes.isTemplateInitialized(runtimeId))
+                throw IllegalStateException("Failed to initialize the template prefix for $runtimeId")
+        }
+    }
+
+    /**
+     * @param keepWarm If wineserver should be kept alive for warmIdleTimeoutMs, so starting the same prefix again is nearly instant.
+     */
+    suspend fun stop(prefixUUID: String, keepWarm: Boolean = true) {
+        val prefix = mutex.withLock {
+            _runningPrefixes.remove(prefixUUID) ?: throw IllegalStateException("Prefix $prefixUUID isn't running")
+        }
+
+        withContext(Dispatchers.IO) {
+            stopServer(prefix.path.toString(), if (keepWarm) warmIdleTimeoutMs else 0)
+        }
+    }
+
+    /**
+     * Shuts down a prefix that's being kept warm, this must be done before the prefix is modified externally (such as being reset or deleted).
+     */
+    suspend fun releaseWarm(prefixUUID: String) {
+        mutex.withLock {
+            if (_runningPrefixes.containsKey(prefixUUID))
+                throw IllegalStateException("Prefix $prefixUUID is running")
+        }
+        val prefix = CassiaApplication.instance.prefixes.get(prefixUUID) ?: return
+
+        withContext(Dispatchers.IO) {
+            stopServer(prefix.path.toString(), 0)
         }
     }
 }
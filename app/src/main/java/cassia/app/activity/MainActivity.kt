@@ -1,6 +1,7 @@
 package cassia.app.activity
 
 import android.os.Bundle
+import android.util.Log
 import androidx.activity.ComponentActivity
 import androidx.activity.compose.setContent
 import androidx.compose.foundation.layout.Arrangement
@@ -29,6 +30,21 @@ import kotlinx.coroutines.MainScope
 import kotlinx.coroutines.launch
 
 class MainActivity : ComponentActivity() {
+    companion object {
+        const val TAG = "cassia.kt.MainActivity"
+    }
+
+    /**
+     * Prepares the template prefix of a runtime, prefixes are still created without a template if this fails.
+     */
+    private suspend fun prepareTemplate(runtimeId: String) {
+        runCatching {
+            CassiaApplication.instance.manager.prepareTemplate(runtimeId)
+        }.onFailure { e ->
+            Log.w(TAG, "Failed to prepare the template prefix for $runtimeId: $e")
+        }
+    }
+
     override fun onCreate(savedInstanceState: Bundle?) {
         super.onCreate(savedInstanceState)
         setContent {
@@ -54,12 +70,14 @@ class MainActivity : ComponentActivity() {
                         Row {
                             Button(onClick = {
                                 if (running) {
-                                    MainScope().launch {
-                                        stopping = true
-                                        CassiaApplication.instance.manager.stop()
-                                        stopping = false
-                                        running = false
-                                        reset = true
+                                    prefix?.let {
+                                        MainScope().launch {
+                                            stopping = true
+                                            CassiaApplication.instance.manager.stop(it.uuid)
+                                            stopping = false
+                                            running = false
+                                            reset = true
+                                        }
                                     }
                                 } else {
                                     prefix?.let {
@@ -85,7 +103,7 @@ class MainActivity : ComponentActivity() {
                                             running = true
                                             starting = false
                                             stopping = true
-                                            CassiaApplication.instance.manager.stop()
+                                            CassiaApplication.instance.manager.stop(it.uuid)
                                             stopping = false
                                             running = false
                                             reset = true
@@ -101,6 +119,7 @@ class MainActivity : ComponentActivity() {
                             Button(onClick = {
                                 defaultRuntime?.let {
                                     MainScope().launch {
+                                        prepareTemplate(it)
                                         prefix = CassiaApplication.instance.prefixes.create("Default", it)
                                     }
                                 }
@@ -110,6 +129,8 @@ class MainActivity : ComponentActivity() {
                             Button(enabled = !running && reset && prefix != null, onClick = {
                                 prefix?.let {
                                     MainScope().launch {
+                                        CassiaApplication.instance.manager.releaseWarm(it.uuid)
+                                        prepareTemplate(it.runtimeId)
                                         prefix = CassiaApplication.instance.prefixes.reset(it.uuid)
                                         reset = false
                                     }
@@ -37,7 +37,7 @@ import cassia.app.input.InputHandler
 import cassia.app.ui.theme.CassiaTheme
 
 class RunnerActivity : ComponentActivity() {
-    private var input = InputHandler()
+    private var input = InputHandler(CassiaApplication.instance.manager)
 
     /**
      * Selects the highest available refresh rate for the display
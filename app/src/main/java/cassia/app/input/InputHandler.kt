@@ -1,31 +1,72 @@
 package cassia.app.input
 
-import android.util.Log
 import android.view.InputDevice
 import android.view.KeyEvent
 import android.view.MotionEvent
 import android.view.View
+import cassia.app.CassiaManager
 
 /**
- * Handles all motion and key events from the surface and translates them into the appropriate input events for the compositor.
+ * Handles all motion and key events from the surface and translates them into input events for the X server.
+ * Events are collected into a batch for every Android event and handed to native code with a single call, which merges motion and injects them on its own thread.
  * @note This class is not thread-safe and must only be called from a single thread.
- * @todo The class simply logs the events for now. It needs to be hooked up to the compositor.
  */
-class InputHandler {
+class InputHandler(private val manager: CassiaManager) {
     companion object {
-        const val TAG = "cassia.kt.InputHandler"
+        // These must match cassia::InputEventType.
+        private const val EVENT_RELATIVE_MOTION = 0
+        private const val EVENT_ABSOLUTE_MOTION = 1
+        private const val EVENT_SCROLL = 2
+        private const val EVENT_BUTTON_DOWN = 3
+        private const val EVENT_BUTTON_UP = 4
+        private const val EVENT_KEY_DOWN = 5
+        private const val EVENT_KEY_UP = 6
+
+        /**
+         * The amount of ints that encode an event in the batch: the type, the code and the raw bits of the X and Y values.
+         */
+        private const val EVENT_INTS = 4
+
+        /**
+         * The Linux code of the left mouse button, which touches are mapped to.
+         */
+        private const val BTN_LEFT = 0x110
+    }
+
+    private var batch = IntArray(64 * EVENT_INTS)
+    private var batchSize = 0
+
+    private fun queueEvent(type: Int, code: Int = 0, x: Float = 0f, y: Float = 0f) {
+        if ((batchSize + 1) * EVENT_INTS > batch.size)
+            batch = batch.copyOf(batch.size * 2)
+        val offset = batchSize * EVENT_INTS
+        batch[offset] = type
+        batch[offset + 1] = code
+        batch[offset + 2] = x.toRawBits()
+        batch[offset + 3] = y.toRawBits()
+        batchSize++
+    }
+
+    /**
+     * Hands all queued events to native code for injection.
+     */
+    private fun flushEvents() {
+        if (batchSize == 0)
+            return
+        manager.injectInput(batch, batchSize)
+        batchSize = 0
     }
 
     private fun moveMouse(dx: Float, dy: Float) {
         if (dx == 0f && dy == 0f)
             return
-        Log.d(TAG, "Mouse Move: $dx, $dy")
+        queueEvent(EVENT_RELATIVE_MOTION, x = dx, y = dy)
     }
 
     private fun scrollMouse(dh: Float, dv: Float) {
         if (dh == 0f && dv == 0f)
             return
-        Log.d(TAG, "Mouse Scroll: $dh, $dv")
+        queueEvent(EVENT_SCROLL, x = dh, y = dv)
     }
 
     private var mouseButtonState: Int = 0
@@ -38,28 +79,38 @@ class InputHandler {
         for (i in 0..7) {
             val mask = 1 shl i
             if (buttonState and mask != this.mouseButtonState and mask) {
-                val linuxButton = InputEventMap.toLinuxButton(i)
-                if (buttonState and mask != 0) {
-                    Log.d(TAG, "Mouse Button Down: $i -> $linuxButton")
-                } else {
-                    Log.d(TAG, "Mouse Button Up: $i -> $linuxButton")
-                }
+                val linuxButton = InputEventMap.toLinuxButton(mask)
+                if (linuxButton != 0)
+                    queueEvent(if (buttonState and mask != 0) EVENT_BUTTON_DOWN else EVENT_BUTTON_UP, linuxButton)
             }
         }
 
         this.mouseButtonState = buttonState
     }
 
-    private fun pointerDown(pointerId: Int, x: Double, y: Double) {
-        Log.d(TAG, "Touch Down [$pointerId]: $x, $y")
+    /**
+     * The pointer that is mapped to the mouse, X only has a single core pointer so any other pointers are ignored.
+     */
+    private var primaryPointerId: Int? = null
+
+    private fun pointerDown(pointerId: Int, x: Float, y: Float) {
+        if (primaryPointerId != null)
+            return
+        primaryPointerId = pointerId
+        queueEvent(EVENT_ABSOLUTE_MOTION, x = x, y = y)
+        queueEvent(EVENT_BUTTON_DOWN, BTN_LEFT)
     }
 
-    private fun pointerMove(pointerId: Int, x: Double, y: Double) {
-        Log.d(TAG, "Touch Move [$pointerId]: $x, $y")
+    private fun pointerMove(pointerId: Int, x: Float, y: Float) {
+        if (pointerId == primaryPointerId)
+            queueEvent(EVENT_ABSOLUTE_MOTION, x = x, y = y)
     }
 
     private fun pointerUp(pointerId: Int) {
-        Log.d(TAG, "Touch Up [$pointerId]")
+        if (pointerId != primaryPointerId)
+            return
+        primaryPointerId = null
+        queueEvent(EVENT_BUTTON_UP, BTN_LEFT)
     }
 
     fun onMotionEvent(view: View, event: MotionEvent): Boolean {
@@ -67,29 +118,39 @@ class InputHandler {
             InputDevice.SOURCE_CLASS_POINTER -> {
                 when (event.actionMasked) {
                     MotionEvent.ACTION_DOWN, MotionEvent.ACTION_POINTER_DOWN -> {
-                        pointerDown(event.getPointerId(event.actionIndex), event.getX(event.actionIndex).toDouble(), event.getY(event.actionIndex).toDouble())
+                        pointerDown(event.getPointerId(event.actionIndex), event.getX(event.actionIndex), event.getY(event.actionIndex))
                     }
 
                     MotionEvent.ACTION_UP, MotionEvent.ACTION_POINTER_UP -> {
                         pointerUp(event.getPointerId(event.actionIndex))
                     }
 
+                    MotionEvent.ACTION_CANCEL -> {
+                        primaryPointerId?.let { pointerUp(it) }
+                    }
+
                     MotionEvent.ACTION_MOVE, MotionEvent.ACTION_HOVER_MOVE -> {
                         for (i in 0 until event.pointerCount) {
-                            pointerMove(event.getPointerId(i), event.getX(i).toDouble(), event.getY(i).toDouble())
+                            pointerMove(event.getPointerId(i), event.getX(i), event.getY(i))
                         }
                     }
                 }
 
+                flushEvents()
                 return true
             }
 
             InputDevice.SOURCE_CLASS_TRACKBALL -> {
+                // Relative motion is batched by Android, every historical sample carries its own delta so they all need to be included.
+                for (h in 0 until event.historySize)
+                    moveMouse(event.getHistoricalX(h), event.getHistoricalY(h))
+
                 // Actions can be interleaved such as changing button state during a move, so we need to check all of them.
                 moveMouse(event.x, event.y)
                 scrollMouse(event.getAxisValue(MotionEvent.AXIS_HSCROLL), event.getAxisValue(MotionEvent.AXIS_VSCROLL))
                 updateButtonsMouse(event.buttonState)
 
+                flushEvents()
                 return true
             }
         }
@@ -97,7 +158,7 @@ class InputHandler {
     }
 
     private fun keyEvent(scanCode: Int, down: Boolean) {
-        Log.d("cassia.app", "Key $scanCode = $down")
+        queueEvent(if (down) EVENT_KEY_DOWN else EVENT_KEY_UP, scanCode)
     }
 
     fun onKeyEvent(event: KeyEvent): Boolean {
@@ -108,6 +169,7 @@ class InputHandler {
                     return false // We don't recognize this key, so let the app handle it.
 
                 keyEvent(scanCode, event.action == KeyEvent.ACTION_DOWN)
+                flushEvents()
                 return true
             }
 
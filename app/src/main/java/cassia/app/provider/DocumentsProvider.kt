@@ -15,6 +15,8 @@ import android.webkit.MimeTypeMap
 import cassia.app.R
 import cassia.app.CassiaApplication
 import java.io.*
+import java.nio.ByteBuffer
+import java.nio.ByteOrder
 
 class DocumentsProvider : DocumentsProvider() {
     private val baseDirectory = File(CassiaApplication.instance.filesDir.canonicalPath)
@@ -42,8 +44,28 @@ class DocumentsProvider : DocumentsProvider() {
         )
 
         const val ROOT_ID: String = "root"
+
+        // These must match DirectorySortOrder in cassia/directory_index.h
+        private const val SORT_NONE = 0
+        private const val SORT_NAME = 1
+        private const val SORT_LAST_MODIFIED = 2
+        private const val SORT_SIZE = 3
+        private const val SORT_DESCENDING = 0b100
+
+        // These must match DirectoryEntryType in cassia/directory_index.h
+        private const val ENTRY_TYPE_DIRECTORY = 1
+
+        init {
+            System.loadLibrary("cassia")
+        }
     }
 
+    /**
+     * @return The entries of the directory in a packed listing, see DirectoryIndex::Pack
+     * @param sortOrder One of the SORT_* constants, optionally combined with [SORT_DESCENDING]
+     */
+    private external fun listDirectory(path: String, sortOrder: Int): ByteArray
+
     override fun onCreate(): Boolean {
         return true
     }
@@ -91,7 +113,10 @@ class DocumentsProvider : DocumentsProvider() {
     }
 
     override fun isChildDocument(parentDocumentId: String?, documentId: String?): Boolean {
-        return documentId?.startsWith(parentDocumentId!!) ?: false
+        // Document IDs are relative paths, so this is decided from them alone without resolving either of them on the filesystem
+        if (documentId == null || parentDocumentId == null)
+            return false
+        return documentId == parentDocumentId || documentId.startsWith("${parentDocumentId.trimEnd('/')}/")
     }
 
     /**
@@ -211,14 +236,14 @@ class DocumentsProvider : DocumentsProvider() {
         }
     }
 
-    private fun includeFile(cursor: MatrixCursor, documentId: String?, file: File?): MatrixCursor {
-        val localDocumentId = documentId ?: file?.let { getDocumentId(it) }
-        val localFile = file ?: getFile(documentId!!)
-
+    /**
+     * @return The document flags for an entry with the supplied type and permissions
+     */
+    private fun getFlags(isDirectory: Boolean, canWrite: Boolean): Int {
         var flags = 0
-        if (localFile.isDirectory && localFile.canWrite()) {
+        if (isDirectory && canWrite) {
             flags = DocumentsContract.Document.FLAG_DIR_SUPPORTS_CREATE
-        } else if (localFile.canWrite()) {
+        } else if (canWrite) {
             flags = DocumentsContract.Document.FLAG_SUPPORTS_WRITE
             flags = flags or DocumentsContract.Document.FLAG_SUPPORTS_DELETE
 
@@ -227,6 +252,12 @@ class DocumentsProvider : DocumentsProvider() {
             flags = flags or DocumentsContract.Document.FLAG_SUPPORTS_COPY
             flags = flags or DocumentsContract.Document.FLAG_SUPPORTS_RENAME
         }
+        return flags
+    }
+
+    private fun includeFile(cursor: MatrixCursor, documentId: String?, file: File?): MatrixCursor {
+        val localDocumentId = documentId ?: file?.let { getDocumentId(it) }
+        val localFile = file ?: getFile(documentId!!)
 
         cursor.newRow().apply {
             add(DocumentsContract.Document.COLUMN_DOCUMENT_ID, localDocumentId)
@@ -234,7 +265,7 @@ class DocumentsProvider : DocumentsProvider() {
             add(DocumentsContract.Document.COLUMN_SIZE, localFile.length())
             add(DocumentsContract.Document.COLUMN_MIME_TYPE, getTypeForFile(localFile))
             add(DocumentsContract.Document.COLUMN_LAST_MODIFIED, localFile.lastModified())
-            add(DocumentsContract.Document.COLUMN_FLAGS, flags)
+            add(DocumentsContract.Document.COLUMN_FLAGS, getFlags(localFile.isDirectory, localFile.canWrite()))
             if (localFile == baseDirectory)
                 add(DocumentsContract.Root.COLUMN_ICON, R.mipmap.ic_launcher)
         }
@@ -260,20 +291,63 @@ class DocumentsProvider : DocumentsProvider() {
         return "application/octect-stream"
     }
 
-    private fun isIgnoredDocument(documentId: String?): Boolean {
-        val file = getFile(documentId!!)
-        val relativePath = file.toRelativeString(baseDirectory)
+    /**
+     * @param relativePath The path of the document relative to [baseDirectory]
+     */
+    private fun isIgnoredDocument(relativePath: String): Boolean {
         // If the file isn't in the prefixes or runtimes directory, we don't want to show it.
         return !relativePath.startsWith("prefixes") && !relativePath.startsWith("runtimes") && !relativePath.startsWith("cassiaext")
     }
 
+    /**
+     * @return The native sort order that corresponds to a SQL-like sort order from the document UI, such as "_display_name ASC"
+     */
+    private fun getNativeSortOrder(sortOrder: String?): Int {
+        val parts = sortOrder?.trim()?.split(Regex("\\s+")) ?: return SORT_NONE
+        val field = when (parts[0]) {
+            DocumentsContract.Document.COLUMN_DISPLAY_NAME -> SORT_NAME
+            DocumentsContract.Document.COLUMN_LAST_MODIFIED -> SORT_LAST_MODIFIED
+            DocumentsContract.Document.COLUMN_SIZE -> SORT_SIZE
+            else -> return SORT_NONE
+        }
+        return if (parts.getOrNull(1).equals("DESC", ignoreCase = true)) field or SORT_DESCENDING else field
+    }
+
     override fun queryChildDocuments(parentDocumentId: String?, projection: Array<out String>?, sortOrder: String?): Cursor {
-        var cursor = MatrixCursor(projection ?: DEFAULT_DOCUMENT_PROJECTION)
+        val cursor = MatrixCursor(projection ?: DEFAULT_DOCUMENT_PROJECTION)
 
         val parent = getFile(parentDocumentId!!)
-        for (file in parent.listFiles()!!)
-            if (!isIgnoredDocument(getDocumentId(file)))
-                cursor = includeFile(cursor, null, file)
+        val parentPath = parent.toRelativeString(baseDirectory)
+        val listing = try {
+            listDirectory(parent.path, getNativeSortOrder(sortOrder))
+        } catch (e: IOException) {
+            throw FileNotFoundException("Couldn't list document '$parentDocumentId': ${e.message}")
+        }
+
+        // The listing is parsed in a single pass, see DirectoryIndex::Pack for the format
+        val buffer = ByteBuffer.wrap(listing).order(ByteOrder.LITTLE_ENDIAN)
+        repeat(buffer.int) {
+            val size = buffer.long
+            val lastModified = buffer.long
+            val isDirectory = buffer.get().toInt() == ENTRY_TYPE_DIRECTORY
+            val canWrite = buffer.get().toInt() != 0
+            val nameLength = buffer.short.toInt() and 0xFFFF
+            val name = String(listing, buffer.position(), nameLength, Charsets.UTF_8)
+            buffer.position(buffer.position() + nameLength)
+
+            val relativePath = if (parentPath.isEmpty()) name else "$parentPath/$name"
+            if (isIgnoredDocument(relativePath))
+                return@repeat
+
+            cursor.newRow().apply {
+                add(DocumentsContract.Document.COLUMN_DOCUMENT_ID, "$ROOT_ID/$relativePath")
+                add(DocumentsContract.Document.COLUMN_DISPLAY_NAME, name)
+                add(DocumentsContract.Document.COLUMN_SIZE, size)
+                add(DocumentsContract.Document.COLUMN_MIME_TYPE, if (isDirectory) DocumentsContract.Document.MIME_TYPE_DIR else getTypeForName(name))
+                add(DocumentsContract.Document.COLUMN_LAST_MODIFIED, lastModified)
+                add(DocumentsContract.Document.COLUMN_FLAGS, getFlags(isDirectory, canWrite))
+            }
+        }
 
         return cursor
     }
@@ -2,26 +2,20 @@ package cassia.app.store
 
 import android.util.Log
 import cassia.app.CassiaApplication
-import org.apache.commons.compress.archivers.tar.TarArchiveInputStream
-import org.apache.commons.compress.compressors.gzip.GzipCompressorInputStream
 import java.nio.file.Files
 import java.nio.file.Path
-import java.nio.file.Paths
-import kotlin.io.path.ExperimentalPathApi
-import kotlin.io.path.deleteIfExists
-import kotlin.io.path.deleteRecursively
 import kotlin.io.path.exists
 
 /**
  * Manages extracting cassiaext from the APK asset into the data directory and keeping it up to date.
  */
-@OptIn(ExperimentalPathApi::class)
-class CassiaExtStore(val path: Path) {
+class CassiaExtStore(val path: Path, store: ContentStore) {
     companion object {
         const val TAG = "cassia.kt.CassiaExtStore"
         const val ID_FILE = "cassiaext.id"
-        const val TAR_FILE = "cassiaext.tar" // Note: Android asset packing recompresses tar.gz files to tar.
+        const val TAR_FILE = "cassiaext.tar" // Note: Android asset packing recompresses tar.gz files to tar, it's stored uncompressed in the APK so it can be mapped directly.
         const val README_FILE = "README.txt"
+        const val STORE_NAME = "cassiaext"
     }
 
     init {
@@ -32,31 +26,13 @@ class CassiaExtStore(val path: Path) {
         if (path.exists())
             existingId = path.resolve(ID_FILE).toFile().takeIf { it.exists() }?.readText()?.trim()
 
-        if (id != existingId) {
+        if (id != existingId || !store.isInstalled(STORE_NAME)) {
             Log.i(TAG, "Extracting cassiaext to '$path' ($id != $existingId)")
 
-            path.deleteRecursively()
-            Files.createDirectories(path)
-
-            assets.open(TAR_FILE).use { input ->
-                TarArchiveInputStream(input).use { tarInput ->
-                    while (true) {
-                        val entry = tarInput.nextTarEntry ?: break
-                        val entryPath = path.resolve(entry.name)
-                        if (entry.isSymbolicLink) {
-                            val target = Paths.get(entry.linkName)
-                            entryPath.deleteIfExists()
-                            Files.createSymbolicLink(entryPath, target)
-                        } else if (entry.isFile) {
-                            entryPath.parent?.let { Files.createDirectories(it) }
-                            val entryFile = entryPath.toFile()
-                            entryFile.outputStream().use { output ->
-                                tarInput.copyTo(output)
-                            }
-                            entryFile.setExecutable(entry.mode and 0b111 != 0, false)
-                        }
-                    }
-                }
+            assets.openFd(TAR_FILE).use { asset ->
+                // Files that didn't change since the previous version are left untouched, the rest are shared with any runtimes that contain them.
+                val stats = store.installArchive(asset.parcelFileDescriptor.fd, asset.startOffset, asset.length, path, STORE_NAME)
+                Log.i(TAG, "Installed cassiaext: $stats")
             }
 
             Files.write(path.resolve(ID_FILE), id.toByteArray())
@@ -0,0 +1,65 @@
+package cassia.app.store
+
+import android.util.Log
+import java.nio.file.Files
+import java.nio.file.Path
+
+/**
+ * A content-addressed store of files that are shared between installed trees (such as runtimes and cassiaext) as hardlinks, so identical files are only stored once.
+ * Installing a tree again only changes the entries that differ from the previous install.
+ */
+class ContentStore(val path: Path) {
+    companion object {
+        const val TAG = "cassia.kt.ContentStore"
+        const val MANIFESTS_DIRECTORY = "manifests"
+
+        init {
+            System.loadLibrary("cassia")
+        }
+    }
+
+    private external fun installTree(storePath: String, source: String, destination: String, name: String): String
+
+    private external fun installArchive(storePath: String, fd: Int, offset: Long, length: Long, destination: String, name: String): String
+
+    private external fun collectGarbage(storePath: String): String
+
+    init {
+        if (!Files.exists(path)) {
+            Log.d(TAG, "Initializing content store at $path")
+            Files.createDirectories(path)
+        }
+    }
+
+    /**
+     * @return If a tree has been installed under the supplied name.
+     */
+    fun isInstalled(name: String): Boolean {
+        return Files.exists(path.resolve(MANIFESTS_DIRECTORY).resolve(name))
+    }
+
+    /**
+     * Installs a directory tree into the destination, the source may be the destination itself to deduplicate an existing tree in-place.
+     * @note Files in the source become read-only as they're shared with the store.
+     * @return Statistics about the install as JSON.
+     */
+    fun install(source: Path, destination: Path, name: String): String {
+        return installTree(path.toString(), source.toString(), destination.toString(), name)
+    }
+
+    /**
+     * Installs a (optionally gzip or zstd compressed) tar archive from a range of a file into the destination.
+     * @return Statistics about the extraction and install as JSON.
+     */
+    fun installArchive(fd: Int, offset: Long, length: Long, destination: Path, name: String): String {
+        return installArchive(path.toString(), fd, offset, length, destination.toString(), name)
+    }
+
+    /**
+     * Removes all files in the store that aren't part of any installed tree.
+     * @return Statistics about the collection as JSON.
+     */
+    fun collectGarbage(): String {
+        return collectGarbage(path.toString())
+    }
+}
@@ -31,12 +31,24 @@ data class Prefix(val uuid: String, val name: String, val runtimeId: String, val
     }
 }
 
-class PrefixStore(val path: Path) {
+/**
+ * @param templatesPath The directory holding an initialized template prefix for each runtime, new prefixes are cloned from these rather than being initialized from scratch.
+ */
+class PrefixStore(val path: Path, val templatesPath: Path) {
     companion object {
         const val TAG = "cassia.kt.PrefixStore"
         const val PREFIX_SUBDIR = "pfx"
         const val HOME_SUBDIR = "home"
         const val METADATA_FILE = "metadata.json"
+
+        /**
+         * @brief The fingerprint file that is written once a prefix has been initialized successfully, see prefix_fingerprint.h.
+         */
+        const val FINGERPRINT_FILE = "cassia.fingerprint"
+
+        init {
+            System.loadLibrary("cassia")
+        }
     }
 
     private var scanned = false
@@ -49,8 +61,16 @@ class PrefixStore(val path: Path) {
             Log.d(TAG, "Initializing prefix store at $path")
             Files.createDirectory(path)
         }
+        if (!Files.exists(templatesPath))
+            Files.createDirectory(templatesPath)
     }
 
+    /**
+     * Clones the "pfx" and "home" directories of an initialized template prefix into a prefix directory.
+     * @return Statistics about the clone as JSON.
+     */
+    private external fun clonePrefix(templatePath: String, prefixPath: String): String
+
     suspend fun scan(): List<Prefix> {
         mutex.withLock {
             prefixes = withContext(Dispatchers.IO) {
@@ -103,22 +123,75 @@ class PrefixStore(val path: Path) {
         }
     }
 
+    /**
+     * Links the directories of a runtime into the Wine prefix inside a prefix directory.
+     * @return The links that were created, relative to the Wine prefix.
+     */
+    private fun linkRuntime(prefixPath: Path, runtimePath: Path, runtime: Runtime): List<String> {
+        val links = mutableListOf<String>()
+        for ((target, link) in runtime.prefixLinks) {
+            val linkPath = prefixPath.resolve(PREFIX_SUBDIR).resolve(link)
+            if (linkPath.exists()) {
+                Log.d(TAG, "Link $linkPath in $prefixPath already exists")
+                linkPath.deleteExisting()
+            }
+            Files.createDirectories(linkPath.parent)
+            Files.createSymbolicLink(linkPath, runtimePath.resolve(target))
+            links.add(link)
+        }
+        return links
+    }
+
     private suspend fun linkPrefixRuntimeLocked(prefix: Prefix): Prefix {
         return withContext(Dispatchers.IO) {
-            val runtime = prefix.runtime()
-            val links = mutableListOf<String>()
-            for ((target, link) in runtime.prefixLinks) {
-                val linkPath = prefix.path.resolve(PREFIX_SUBDIR).resolve(link)
-                if (linkPath.exists()) {
-                    Log.d(TAG, "Link $linkPath for prefix ${prefix.name} (${prefix.uuid}) already exists")
-                    linkPath.deleteExisting()
-                }
-                Files.createDirectories(linkPath.parent)
-                val targetPath = prefix.runtimePath.resolve(target)
-                Files.createSymbolicLink(linkPath, targetPath)
-                links.add(link)
+            prefix.copy(runtimeLinks = linkRuntime(prefix.path, prefix.runtimePath, prefix.runtime()))
+        }
+    }
+
+    fun templatePath(runtimeId: String): Path = templatesPath.resolve(runtimeId)
+
+    /**
+     * @return If the template prefix for a runtime has been initialized successfully, so prefixes can be cloned from it.
+     */
+    fun isTemplateInitialized(runtimeId: String): Boolean = templatePath(runtimeId).resolve(FINGERPRINT_FILE).exists()
+
+    /**
+     * Creates an empty template prefix for a runtime with the runtime linked into it, replacing any existing template. This needs to be initialized by starting Wine in it.
+     * @return The path of the template prefix.
+     */
+    @OptIn(ExperimentalPathApi::class)
+    suspend fun createTemplate(runtimeId: String): Path {
+        return mutex.withLock {
+            withContext(Dispatchers.IO) {
+                val runtime = CassiaApplication.instance.runtimes.get(runtimeId) ?: throw IllegalStateException("Runtime $runtimeId not found")
+                val templatePath = templatePath(runtimeId)
+                templatePath.deleteRecursively()
+                Files.createDirectory(templatePath)
+                Files.createDirectory(templatePath.resolve(PREFIX_SUBDIR))
+                Files.createDirectory(templatePath.resolve(HOME_SUBDIR))
+                linkRuntime(templatePath, runtime.path, runtime)
+                templatePath
+            }
+        }
+    }
+
+    /**
+     * Populates a new prefix from the template of its runtime, if there is an initialized one. The prefix is left empty if cloning fails, so it's initialized from scratch on its first start instead.
+     */
+    @OptIn(ExperimentalPathApi::class)
+    private fun cloneTemplateLocked(prefixPath: Path, runtimeId: String) {
+        if (!isTemplateInitialized(runtimeId))
+            return
+        runCatching {
+            val stats = clonePrefix(templatePath(runtimeId).toString(), prefixPath.toString())
+            Log.d(TAG, "Cloned the template of $runtimeId into $prefixPath: $stats")
+        }.onFailure { e ->
+            Log.w(TAG, "Failed to clone the template of $runtimeId into $prefixPath, it'll be initialized from scratch: $e")
+            for (subdir in listOf(PREFIX_SUBDIR, HOME_SUBDIR)) {
+                prefixPath.resolve(subdir).deleteRecursively()
+                Files.createDirectory(prefixPath.resolve(subdir))
             }
-            prefix.copy(runtimeLinks = links)
+            prefixPath.resolve(FINGERPRINT_FILE).deleteIfExists()
         }
     }
 
@@ -145,6 +218,7 @@ class PrefixStore(val path: Path) {
             Files.createDirectory(prefixPath)
             Files.createDirectory(prefixPath.resolve(PREFIX_SUBDIR))
             Files.createDirectory(prefixPath.resolve(HOME_SUBDIR))
+            cloneTemplateLocked(prefixPath, runtimeId)
 
             val prefix = linkPrefixRuntimeLocked(Prefix(uuid, name, runtimeId))
             writePrefixLocked(prefix)
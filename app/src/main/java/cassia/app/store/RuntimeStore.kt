@@ -25,7 +25,7 @@ data class Runtime(val uuid: String, val name: String, val version: Int, val aut
         get() = CassiaApplication.instance.runtimes.path.resolve(id)
 }
 
-class RuntimeStore(val path: Path) {
+class RuntimeStore(val path: Path, private val store: ContentStore) {
     companion object {
         const val TAG = "cassia.kt.RuntimeStore"
 
@@ -82,11 +82,43 @@ class RuntimeStore(val path: Path) {
                     .iterator().asSequence().filterNotNull().toMutableList()
             }
 
+            withContext(Dispatchers.IO) {
+                deduplicate(runtimes)
+            }
+
             scanned = true
             return runtimes
         }
     }
 
+    /**
+     * Moves the files of any runtimes that aren't in the content store yet into it, so files that are identical between runtimes are only stored once.
+     * @note The override runtime is skipped as it's modified manually, which isn't possible once its files are shared with the store.
+     */
+    private fun deduplicate(runtimes: List<Runtime>) {
+        var installed = false
+        for (runtime in runtimes) {
+            if (runtime.uuid == OVERRIDE_UUID || store.isInstalled(runtime.id))
+                continue
+            val runtimePath = path.resolve(runtime.id)
+            runCatching {
+                val stats = store.install(runtimePath, runtimePath, runtime.id)
+                Log.i(TAG, "Deduplicated runtime ${runtime.name} v${runtime.version}: $stats")
+                installed = true
+            }.onFailure { e ->
+                Log.w(TAG, "Failed to deduplicate runtime ${runtime.name} v${runtime.version}: $e")
+            }
+        }
+
+        if (installed) {
+            runCatching {
+                Log.i(TAG, "Collected content store garbage: ${store.collectGarbage()}")
+            }.onFailure { e ->
+                Log.w(TAG, "Failed to collect content store garbage: $e")
+            }
+        }
+    }
+
     suspend fun list(): List<Runtime> {
         if (!scanned)
             return scan()